@@ -0,0 +1,264 @@
+/*
+  CopperFuse: C++ version Filesystem in Userspace
+  Copyright (C) 2023 Chen Miao <chenmiao.ku@gmail.com>
+
+  This program can be distributed under the terms of the GNU LGPLv2.
+  See the file COPYING.LIB.
+*/
+
+/**
+ * Background congestion benchmark
+ *
+ * Plays the kernel streaming readahead as it does with async reads:
+ * READ requests are kept in flight up to the background limit, the
+ * session's current one when it adapts.  The filesystem replies from a backend whose
+ * parallelism and service time change midway, in three phases:
+ *
+ *   8 slots at 2 ms, 32 slots at 1 ms, 8 slots at 8 ms
+ *
+ * Compares the kernel default limit, a generous static one, the same
+ * with admission control of the bytes in flight, and the adaptive
+ * limit.  Reports throughput, the latency the kernel sees and the
+ * peak of bytes queued in the backend.
+ *
+ * usage: background_congestion [seconds per phase] [read size]
+ */
+
+#include "bench_kernel.h"
+#include "copper_fuse_lowlevel.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <poll.h>
+#include <sys/socket.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#define BACKEND_SLOTS 32
+
+struct phase {
+	unsigned slots;
+	int64_t service_ns;
+};
+
+static const struct phase phases[] = {
+	{ 8, 2000000 }, { 32, 1000000 }, { 8, 8000000 },
+};
+
+/* A storage backend: a queue served by as many slots as the phase has */
+struct backend {
+	std::mutex lock;
+	std::condition_variable cond;
+	std::deque<std::pair<copper_fuse_req_t, size_t>> queue;
+	std::atomic<unsigned> phase;
+	bool stop;
+	size_t queued_bytes;
+	size_t peak_bytes;
+	std::vector<char> data;
+	std::vector<std::thread> slots;
+
+	backend(size_t read_size) : phase(0), stop(false), queued_bytes(0), peak_bytes(0),
+		data(read_size, 'b') {
+		for (unsigned i = 0; i < BACKEND_SLOTS; i++)
+			slots.emplace_back([this, i] { serve(i); });
+	}
+
+	~backend() {
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			stop = true;
+		}
+		cond.notify_all();
+		for (auto& t : slots)
+			t.join();
+	}
+
+	void submit(copper_fuse_req_t req, size_t size) {
+		std::lock_guard<std::mutex> guard(lock);
+		queue.emplace_back(req, size);
+		queued_bytes += size;
+		peak_bytes = std::max(peak_bytes, queued_bytes);
+		cond.notify_one();
+	}
+
+	void serve(unsigned slot) {
+		unsigned seed = slot + 1;
+		std::unique_lock<std::mutex> guard(lock);
+		while (!stop) {
+			const struct phase& p = phases[phase.load()];
+			if (slot >= p.slots || queue.empty()) {
+				cond.wait_for(guard, std::chrono::milliseconds(1));
+				continue;
+			}
+			auto job = queue.front();
+			queue.pop_front();
+			guard.unlock();
+
+			/* Service time varies by a quarter either way */
+			int64_t jitter = p.service_ns / 4;
+			int64_t ns = p.service_ns - jitter + rand_r(&seed) % (2 * jitter);
+			std::this_thread::sleep_for(std::chrono::nanoseconds(ns));
+			job.first->reply_buf(data.data(), std::min(job.second, data.size()));
+
+			guard.lock();
+			queued_bytes -= job.second;
+		}
+	}
+};
+
+struct scenario {
+	const char* name;
+	unsigned max_background;
+	unsigned max_background_max;
+	size_t max_inflight_bytes;
+};
+
+struct result {
+	double mib_s;
+	double p50_ms;
+	double p99_ms;
+	size_t peak_bytes;
+	unsigned limit_avg;
+};
+
+static int run(const struct scenario& sc, double phase_s, size_t read_size, struct result* r) {
+	int sv[2];
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv) == -1) {
+		perror("socketpair");
+		return -1;
+	}
+	int sndbuf = 8 << 20;
+	setsockopt(sv[0], SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+	setsockopt(sv[1], SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+
+	backend be(read_size);
+	struct copper_fuse_lowlevel_ops op;
+	op.init = [&sc](void*, struct copper_fuse_conn_info* conn) {
+		conn->max_background = sc.max_background;
+		conn->max_background_min = 4;
+		conn->max_background_max = sc.max_background_max;
+		conn->max_inflight_bytes = sc.max_inflight_bytes;
+	};
+	op.read = [&be](copper_fuse_req_t req, fuse_ino_t, size_t size, off_t, struct fuse_file_info*) {
+		be.submit(req, size);
+	};
+
+	copper_fuse_session se(&op, nullptr);
+	se.set_fd(sv[1]);
+	struct copper_fuse_loop_config config;
+	memset(&config, 0, sizeof(config));
+	config.max_idle_threads = 10;
+	config.max_threads = 4;
+	std::thread loop([&] { se.loop_mt(&config); });
+
+	bench_kernel k(sv[0]);
+	std::vector<char> out(read_size + 4096);
+	k.init(&out);
+
+	/* The kernel: readahead kept in flight up to the background limit */
+	const size_t table = 1 << 20;
+	std::vector<int64_t> sent(table);
+	std::vector<double> lat;
+	std::mutex klock;
+	std::condition_variable kcond;
+	unsigned inflight = 0;
+	std::atomic<bool> stop(false);
+	uint64_t bytes = 0;
+	uint64_t limit_sum = 0, limit_samples = 0;
+
+	std::thread receiver([&] {
+		struct pollfd pfd = { sv[0], POLLIN, 0 };
+		while (!stop.load() || inflight) {
+			if (poll(&pfd, 1, 10) <= 0)
+				continue;
+			const struct fuse_out_header* o = k.recv(&out);
+			int64_t t = now_ns();
+			std::lock_guard<std::mutex> guard(klock);
+			lat.push_back((t - sent[o->unique % table]) / 1e6);
+			bytes += bench_reply_size(out);
+			inflight--;
+			kcond.notify_one();
+		}
+	});
+
+	struct fuse_read_in read_in;
+	memset(&read_in, 0, sizeof(read_in));
+	read_in.size = read_size;
+
+	int64_t start = now_ns();
+	int64_t end = start + (int64_t)(phase_s * 3 * 1e9);
+	for (int64_t t = start; t < end; t = now_ns()) {
+		be.phase.store(std::min<unsigned>((t - start) / (phase_s * 1e9), 2));
+		std::unique_lock<std::mutex> guard(klock);
+		unsigned limit = se.cong.background();
+		limit_sum += limit;
+		limit_samples++;
+		if (inflight >= limit) {
+			kcond.wait_for(guard, std::chrono::milliseconds(1));
+			continue;
+		}
+		inflight++;
+		struct fuse_in_header hdr = k.header(FUSE_READ, 2);
+		read_in.offset += read_size;
+		sent[hdr.unique % table] = now_ns();
+		guard.unlock();
+		k.send(&hdr, &read_in, sizeof(read_in));
+	}
+	double elapsed = (now_ns() - start) / 1e9;
+	stop.store(true);
+	receiver.join();
+
+	se.exit();
+	loop.join();
+
+	std::sort(lat.begin(), lat.end());
+	r->mib_s = bytes / elapsed / (1 << 20);
+	r->p50_ms = lat.empty() ? 0 : lat[lat.size() / 2];
+	r->p99_ms = lat.empty() ? 0 : lat[lat.size() * 99 / 100];
+	{
+		std::lock_guard<std::mutex> guard(be.lock);
+		r->peak_bytes = be.peak_bytes;
+	}
+	r->limit_avg = limit_samples ? limit_sum / limit_samples : 0;
+	close(sv[0]);
+	return 0;
+}
+
+int main(int argc, char* argv[]) {
+	double phase_s   = argc > 1 ? atof(argv[1]) : 1.0;
+	size_t read_size = argc > 2 ? atoi(argv[2]) : 16384;
+	if (phase_s <= 0 || !read_size) {
+		fprintf(stderr, "usage: %s [seconds per phase] [read size]\n", argv[0]);
+		return 1;
+	}
+
+	const struct scenario scenarios[] = {
+		{ "static 12 (kernel default)", 12, 0, 0 },
+		{ "static 1024", 1024, 0, 0 },
+		{ "static 1024, 1 MiB/worker", 1024, 0, 1 << 20 },
+		{ "adaptive 4..1024", 12, 1024, 0 },
+	};
+
+	printf("%zu byte reads, phases of %.1f s: ", read_size, phase_s);
+	for (const struct phase& p : phases)
+		printf(" %u slots at %.0f ms", p.slots, p.service_ns / 1e6);
+	printf("\n%-28s %9s %9s %9s %12s %9s\n", "", "MiB/s", "p50 ms", "p99 ms",
+		"peak queued", "avg limit");
+	for (const struct scenario& sc : scenarios) {
+		struct result r;
+		if (run(sc, phase_s, read_size, &r) < 0)
+			return 1;
+		printf("%-28s %9.1f %9.2f %9.2f %10.1f K %9u\n", sc.name, r.mib_s, r.p50_ms,
+			r.p99_ms, r.peak_bytes / 1024.0, r.limit_avg);
+	}
+	return 0;
+}
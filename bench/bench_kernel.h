@@ -0,0 +1,161 @@
+/*
+  CopperFuse: C++ version Filesystem in Userspace
+  Copyright (C) 2023 Chen Miao <chenmiao.ku@gmail.com>
+
+  This program can be distributed under the terms of the GNU LGPLv2.
+  See the file COPYING.LIB.
+*/
+
+/**
+ * What the benchmarks share: their clock, and the kernel side of a
+ * session played over a SOCK_SEQPACKET socketpair, so that neither
+ * /dev/fuse nor privileges are needed.  The session gets the other end
+ * with set_fd(), each message on the socket is one request or reply as
+ * on /dev/fuse.
+ *
+ * The kernel gives up, exit(1), when the socket fails; a benchmark has
+ * nothing to measure after that.
+ */
+
+#ifndef __COPPER_FUSE_BENCH_KERNEL_H__
+#define __COPPER_FUSE_BENCH_KERNEL_H__
+
+#include "copper_fuse_kernel.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <vector>
+
+using bench_clock = std::chrono::steady_clock;
+
+inline double sec_since(bench_clock::time_point start) {
+	return std::chrono::duration<double>(bench_clock::now() - start).count();
+}
+
+/* Of bench_clock, to keep in tables shared between threads */
+inline int64_t now_ns() {
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(
+		bench_clock::now().time_since_epoch()).count();
+}
+
+/* The payload of the reply in `out`, and its size */
+inline const char* bench_reply_body(const std::vector<char>& out) {
+	return out.data() + sizeof(struct fuse_out_header);
+}
+
+inline size_t bench_reply_size(const std::vector<char>& out) {
+	return ((const struct fuse_out_header*)out.data())->len - sizeof(struct fuse_out_header);
+}
+
+/* The kernel side of the socketpair */
+struct bench_kernel {
+	int fd;
+	std::atomic<uint64_t> unique;
+
+public:
+	explicit bench_kernel(int _fd) : fd(_fd), unique(1) {}
+
+	bench_kernel(const bench_kernel&) = delete;
+	bench_kernel& operator= (const bench_kernel&) = delete;
+
+	/* A request of the calling process under the next unique, to adjust and send() */
+	struct fuse_in_header header(uint32_t opcode, uint64_t nodeid) {
+		struct fuse_in_header hdr;
+		memset(&hdr, 0, sizeof(hdr));
+		hdr.opcode = opcode;
+		hdr.unique = unique++;
+		hdr.nodeid = nodeid;
+		hdr.pid = getpid();
+		return hdr;
+	}
+
+	/* `hdr`, its length filled in, then `arg` and `data` */
+	void send(struct fuse_in_header* hdr, const void* arg, size_t argsize,
+		const void* data = nullptr, size_t datasize = 0) {
+		hdr->len = sizeof(*hdr) + argsize + datasize;
+
+		struct iovec iov[3] = {
+			{ hdr, sizeof(*hdr) }, { (void*)arg, argsize }, { (void*)data, datasize }
+		};
+		struct msghdr msg;
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = iov;
+		msg.msg_iovlen = 3;
+		if (sendmsg(fd, &msg, 0) != (ssize_t)hdr->len) {
+			perror("sendmsg");
+			exit(1);
+		}
+	}
+
+	/* @return the unique it went under */
+	uint64_t send(uint32_t opcode, uint64_t nodeid, const void* arg, size_t argsize,
+		const void* data = nullptr, size_t datasize = 0) {
+		struct fuse_in_header hdr = header(opcode, nodeid);
+		send(&hdr, arg, argsize, data, datasize);
+		return hdr.unique;
+	}
+
+	/* The next message into `out`, a reply or a notification */
+	const struct fuse_out_header* recv(std::vector<char>* out) {
+		if (read(fd, out->data(), out->size()) < (ssize_t)sizeof(struct fuse_out_header)) {
+			perror("read");
+			exit(1);
+		}
+		return (const struct fuse_out_header*)out->data();
+	}
+
+	/**
+	 * A request and its reply, nothing else in flight
+	 *
+	 * @return the reply's error
+	 */
+	int try_call(uint32_t opcode, uint64_t nodeid, const void* arg, size_t argsize,
+		std::vector<char>* out, const void* data = nullptr, size_t datasize = 0) {
+		send(opcode, nodeid, arg, argsize, data, datasize);
+		return recv(out)->error;
+	}
+
+	/**
+	 * As try_call(), giving up if the request fails
+	 *
+	 * @return the reply's payload
+	 */
+	const char* call(uint32_t opcode, uint64_t nodeid, const void* arg, size_t argsize,
+		std::vector<char>* out, const void* data = nullptr, size_t datasize = 0) {
+		int err = try_call(opcode, nodeid, arg, argsize, out, data, datasize);
+		if (err) {
+			fprintf(stderr, "opcode %u failed: %s\n", opcode, strerror(-err));
+			exit(1);
+		}
+		return bench_reply_body(*out);
+	}
+
+	/* INIT as a kernel of this protocol version would send it */
+	const struct fuse_init_out* init(std::vector<char>* out,
+		uint32_t flags = FUSE_ASYNC_READ | FUSE_BIG_WRITES, uint32_t max_readahead = 128 << 10) {
+		struct fuse_init_in init_in;
+		memset(&init_in, 0, sizeof(init_in));
+		init_in.major = FUSE_KERNEL_VERSION;
+		init_in.minor = FUSE_KERNEL_MINOR_VERSION;
+		init_in.max_readahead = max_readahead;
+		init_in.flags = flags;
+		return (const struct fuse_init_out*)call(FUSE_INIT, 0, &init_in, sizeof(init_in), out);
+	}
+
+	/* FORGET has no reply */
+	void forget(uint64_t nodeid, uint64_t nlookup = 1) {
+		struct fuse_forget_in forget_in;
+		memset(&forget_in, 0, sizeof(forget_in));
+		forget_in.nlookup = nlookup;
+		send(FUSE_FORGET, nodeid, &forget_in, sizeof(forget_in));
+	}
+};
+
+#endif //! __COPPER_FUSE_BENCH_KERNEL_H__
@@ -0,0 +1,244 @@
+/*
+  CopperFuse: C++ version Filesystem in Userspace
+  Copyright (C) 2023 Chen Miao <chenmiao.ku@gmail.com>
+
+  This program can be distributed under the terms of the GNU LGPLv2.
+  See the file COPYING.LIB.
+*/
+
+/**
+ * Block cache benchmark
+ *
+ * A high-level filesystem whose ->read() goes to a slow server: a round
+ * trip per call plus the transfer at 1 GiB/s.  Readers read a file in
+ * 128 KiB requests, one in flight each as the kernel's synchronous
+ * reads are, either sequentially or at random 4 KiB offsets.
+ *
+ * Runs without the cache, with it and without readahead, with it and
+ * readahead, and twice through with the file left cached.  Then with
+ * four readers of one file, and random reads with half of the file fitting.
+ * Reports the time, the backend calls and the cache statistics, and
+ * checks every byte the readers got.
+ *
+ * usage: block_cache [MiB] [round trip us]
+ */
+
+#include "bench_kernel.h"
+#include "copper_fuse.h"
+#include "copper_fuse_i.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <string>
+#include <sys/socket.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#define READ_SIZE   (128 << 10)
+#define RANDOM_SIZE 4096
+/* Transfer time of the server, 1 GiB/s */
+#define NS_PER_KIB  954
+
+/* The server: one file, a round trip and a transfer per call */
+struct bench_server {
+	unsigned rtt_us;
+	std::string file;
+	std::atomic<uint64_t> calls;
+};
+
+static struct copper_fuse_operations bench_ops(bench_server* srv) {
+	struct copper_fuse_operations op;
+
+	op.getattr = [srv](const char* path, struct stat* stbuf, struct fuse_file_info*) {
+		memset(stbuf, 0, sizeof(*stbuf));
+		if (strcmp(path, "/") == 0) {
+			stbuf->st_mode = S_IFDIR | 0755;
+			stbuf->st_nlink = 2;
+			return 0;
+		}
+		if (strcmp(path, "/file") != 0)
+			return -ENOENT;
+		stbuf->st_mode = S_IFREG | 0444;
+		stbuf->st_nlink = 1;
+		stbuf->st_size = srv->file.size();
+		return 0;
+	};
+	op.open = [](const char*, struct fuse_file_info*) {
+		return 0;
+	};
+	op.read = [srv](const char* path, char* buf, size_t size, off_t off, struct fuse_file_info*) {
+		if (strcmp(path, "/file") != 0)
+			return -ENOENT;
+		srv->calls++;
+		size_t n = off < (off_t)srv->file.size() ? std::min(size, srv->file.size() - off) : 0;
+		std::this_thread::sleep_for(std::chrono::microseconds(srv->rtt_us) +
+			std::chrono::nanoseconds(n / 1024 * NS_PER_KIB));
+		memcpy(buf, srv->file.data() + off, n);
+		return (int)n;
+	};
+	return op;
+}
+
+struct bench_case {
+	const char* name;
+	size_t cache;
+	size_t block_size;
+	unsigned readahead;
+	unsigned readers;
+	unsigned passes;
+	bool random;
+};
+
+struct run_result {
+	double seconds;
+	uint64_t calls;
+	bool intact;
+	struct copper_fuse_cache_stats st;
+};
+
+static int run(const bench_case& c, size_t bytes, unsigned rtt_us, struct run_result* r) {
+	int sv[2];
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv) == -1) {
+		perror("socketpair");
+		return -1;
+	}
+
+	bench_server srv;
+	srv.rtt_us = rtt_us;
+	srv.file.resize(bytes);
+	for (size_t i = 0; i < bytes; i++)
+		srv.file[i] = (char)(i * 7 + i / 4096);
+	srv.calls = 0;
+	struct copper_fuse_operations op = bench_ops(&srv);
+
+	std::string opt = "kernel_cache,block_cache=" + std::to_string(c.cache) + ",block_size=" +
+		std::to_string(c.block_size) + ",readahead=" + std::to_string(c.readahead);
+	char prog[] = "block_cache", o[] = "-o";
+	char* fuse_argv[] = { prog, o, &opt[0], nullptr };
+	copper_fuse_args args(3, fuse_argv);
+	copper_fuse* fuse = new copper_fuse(&op, nullptr);
+	if (fuse->init(&args) == -1)
+		return -1;
+	fuse->se->set_fd(sv[1]);
+
+	struct copper_fuse_loop_config config;
+	memset(&config, 0, sizeof(config));
+	config.max_idle_threads = 10;
+	config.max_threads = c.readers + 1;
+	std::thread loop([&] { fuse->loop_mt(&config); });
+
+	bench_kernel k(sv[0]);
+	std::vector<char> out(READ_SIZE + 4096);
+	k.init(&out, FUSE_ASYNC_READ | FUSE_BIG_WRITES, READ_SIZE);
+
+	const char name[] = "file";
+	uint64_t nodeid = ((const struct fuse_entry_out*)k.call(FUSE_LOOKUP, FUSE_ROOT_ID,
+		name, sizeof(name), &out))->nodeid;
+
+	std::mt19937_64 rng(1);
+	std::vector<uint64_t> fhs(c.readers);
+	std::vector<off_t> offs(c.readers);
+	std::vector<uint64_t> uniques(c.readers);
+	struct fuse_open_in open_in;
+	struct fuse_read_in read_in;
+	struct fuse_release_in release_in;
+	memset(&open_in, 0, sizeof(open_in));
+	memset(&read_in, 0, sizeof(read_in));
+	memset(&release_in, 0, sizeof(release_in));
+	open_in.flags = read_in.flags = O_RDONLY;
+
+	r->intact = true;
+	auto start = bench_clock::now();
+	for (unsigned pass = 0; pass < c.passes; pass++) {
+		for (unsigned i = 0; i < c.readers; i++)
+			fhs[i] = ((const struct fuse_open_out*)k.call(FUSE_OPEN, nodeid, &open_in,
+				sizeof(open_in), &out))->fh;
+
+		/* The readers in lockstep, the same offsets unless reading at random */
+		for (size_t done = 0; done < bytes; done += READ_SIZE) {
+			for (unsigned i = 0; i < c.readers; i++) {
+				read_in.fh = fhs[i];
+				if (c.random) {
+					read_in.size   = RANDOM_SIZE;
+					read_in.offset = rng() % (bytes / RANDOM_SIZE) * RANDOM_SIZE;
+				} else {
+					read_in.size   = READ_SIZE;
+					read_in.offset = done;
+				}
+				offs[i] = read_in.offset;
+				uniques[i] = k.send(FUSE_READ, nodeid, &read_in, sizeof(read_in));
+			}
+			for (unsigned i = 0; i < c.readers; i++) {
+				const struct fuse_out_header* hdr = k.recv(&out);
+				size_t n = bench_reply_size(out);
+				unsigned who = 0;
+				while (who < c.readers && uniques[who] != hdr->unique)
+					who++;
+				r->intact &= !hdr->error && who < c.readers && n == read_in.size &&
+					memcmp(bench_reply_body(out),
+						srv.file.data() + offs[who], n) == 0;
+			}
+		}
+
+		for (unsigned i = 0; i < c.readers; i++) {
+			release_in.fh = fhs[i];
+			k.call(FUSE_RELEASE, nodeid, &release_in, sizeof(release_in), &out);
+		}
+	}
+	r->seconds = sec_since(start);
+	r->calls = srv.calls.load();
+	if (copper_fuse_get_cache_stats(fuse, &r->st) < 0)
+		memset(&r->st, 0, sizeof(r->st));
+
+	close(sv[0]);
+	loop.join();
+	delete fuse;
+	return 0;
+}
+
+int main(int argc, char* argv[]) {
+	unsigned mib    = argc > 1 ? atoi(argv[1]) : 32;
+	unsigned rtt_us = argc > 2 ? atoi(argv[2]) : 200;
+	if (!mib) {
+		fprintf(stderr, "usage: %s [MiB] [round trip us]\n", argv[0]);
+		return 1;
+	}
+	size_t bytes = (size_t)mib << 20;
+
+	printf("%u MiB file, %u us per backend call plus 1 GiB/s\n", mib, rtt_us);
+	printf("%-28s %9s %8s %8s %7s %8s %7s %8s\n", "", "ms", "MiB/s", "backend", "hit%",
+		"ahead", "waits", "data");
+
+	const size_t all = bytes * 2, half = bytes / 2;
+	const struct bench_case cases[] = {
+		{ "no cache",                 0,    0,        0,  1, 1, false },
+		{ "cache",                    all,  0,        0,  1, 1, false },
+		{ "cache, readahead",         all,  0,        16, 1, 1, false },
+		{ "cache, readahead, 2 passes", all, 0,       16, 1, 2, false },
+		{ "no cache, 4 readers",      0,    0,        0,  4, 1, false },
+		{ "cache, 4 readers",         all,  0,        16, 4, 1, false },
+		{ "no cache, random 4K",      0,    0,        0,  1, 16, true },
+		{ "cache half, random 4K",    half, 16 << 10, 0,  1, 16, true },
+	};
+	for (const struct bench_case& c : cases) {
+		struct run_result r;
+		if (run(c, bytes, rtt_us, &r) == -1)
+			return 1;
+		uint64_t lookups = r.st.hits + r.st.misses + r.st.waits;
+		double read = c.random ? (double)RANDOM_SIZE * (bytes / READ_SIZE) : (double)bytes;
+		printf("%-28s %9.1f %8.0f %8llu %6.1f%% %8llu %7llu %8s\n", c.name, r.seconds * 1e3,
+			read * c.readers * c.passes / r.seconds / (1 << 20), (unsigned long long)r.calls,
+			lookups ? 100.0 * (r.st.hits + r.st.waits) / lookups : 0.0,
+			(unsigned long long)r.st.ahead_hits, (unsigned long long)r.st.waits,
+			r.intact ? "intact" : "CORRUPT");
+		if (!r.intact)
+			return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,731 @@
+/*
+  CopperFuse: C++ version Filesystem in Userspace
+  Copyright (C) 2023 Chen Miao <chenmiao.ku@gmail.com>
+
+  This program can be distributed under the terms of the GNU LGPLv2.
+  See the file COPYING.LIB.
+*/
+
+/**
+ * Benchmark suite and perf-regression check of the library
+ *
+ * Micro benchmarks, each the best of `repeat` rounds, in ns per op:
+ *
+ *   micro/opt_parse        copper_fuse_args::parse_opt() of a mount's -o
+ *   micro/log              one line through copper_log, output dropped
+ *   micro/dispatch         a GETATTR through process_buf(), replied to
+ *                          over a socketpair and read back
+ *   micro/node_lookup      copper_fuse_node_table find, get_path, forget
+ *   micro/bufpool          a 1 MiB receive buffer from a warm pool, then
+ *                          micro/bufpool_map from an empty one, mapped
+ *   micro/timer            arming and cancelling a timer
+ *
+ * Macro benchmarks run the high-level library over copper_memfs, the
+ * kernel played by bench_kernel.h, or with --mount on the files of a
+ * directory, a real CopperFuse mount or anything else:
+ *
+ *   macro/meta_*           mdtest-like, `files` files created, stat'ed
+ *                          and unlinked, in ops per second
+ *   macro/data_*           fio-like, a `mib` MiB file written and read
+ *                          in 64 KiB blocks, in MiB/s, then read at
+ *                          random in 4 KiB blocks, in ops per second
+ *
+ * Results print as a table, and with --json as JSON, one result per
+ * line.  With --baseline every result is compared with the one of the
+ * same name in a file written by --json: a result worse by more than
+ * its "threshold" there, or --threshold percent, is a regression and
+ * the exit status is 1.  bench/copper_fuse_bench.json is the baseline
+ * kept with the tree, from a one CPU machine.
+ *
+ * usage: copper_fuse_bench [--filter S] [--repeat N] [--json FILE]
+ *                          [--baseline FILE] [--threshold PCT]
+ *                          [--mount DIR] [--files N] [--mib N]
+ */
+
+#include "bench_kernel.h"
+#include "copper_fuse.h"
+#include "copper_fuse_buf.h"
+#include "copper_fuse_i.h"
+#include "copper_fuse_memfs.h"
+#include "copper_fuse_node.h"
+#include "copper_fuse_timer.h"
+#include "copper_log.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <streambuf>
+#include <string>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+struct bench_result {
+	std::string name;
+	std::string unit;
+	double value;
+	bool lower_is_better;
+};
+
+struct bench_config {
+	std::string filter;
+	unsigned repeat;
+	const char* json;
+	const char* baseline;
+	double threshold;
+	const char* mount;
+	unsigned files;
+	unsigned mib;
+};
+
+static std::vector<bench_result> results;
+
+static bool wanted(const struct bench_config& c, const char* name) {
+	return c.filter.empty() || strstr(name, c.filter.c_str());
+}
+
+static void report(const char* name, const char* unit, double value, bool lower_is_better) {
+	results.push_back({ name, unit, value, lower_is_better });
+	printf("%-24s %14.1f %s\n", name, value, unit);
+	fflush(stdout);
+}
+
+/* The best of `repeat` rounds of `ops` ops, in ns per op */
+static double best_ns(unsigned repeat, uint64_t ops, const std::function<void(uint64_t ops)>& round) {
+	double best = 0;
+	for (unsigned r = 0; r < repeat; r++) {
+		auto start = bench_clock::now();
+		round(ops);
+		double ns = sec_since(start) * 1e9 / ops;
+		best = r ? std::min(best, ns) : ns;
+	}
+	return best;
+}
+
+/* copper_log writes to std::cout, the results go to stdout with printf() */
+struct bench_null_buf : std::streambuf {
+	int overflow(int c) override {
+		return c;
+	}
+};
+
+/** ---------------------------------------------------
+ * FOR MICRO BENCHMARKS
+ * ---------------------------------------------------*/
+
+struct bench_opts {
+	int verbose;
+	unsigned max_read;
+	double timeout;
+	char* fsname;
+};
+
+#define BENCH_OPT(t, p, v) { t, offsetof(struct bench_opts, p), v }
+
+static const struct copper_fuse_opt bench_opt_table[] = {
+	BENCH_OPT("debug",         verbose, 1),
+	BENCH_OPT("max_read=%u",   max_read, 0),
+	BENCH_OPT("timeout=%lf",   timeout, 0),
+	BENCH_OPT("fsname=%s",     fsname, 0),
+	COPPER_FUSE_OPT_END
+};
+
+static void bench_opt_parse(const struct bench_config& c) {
+	double ns = best_ns(c.repeat, 20000, [](uint64_t ops) {
+		for (uint64_t i = 0; i < ops; i++) {
+			char prog[] = "bench", o[] = "-o", mnt[] = "/mnt";
+			char opts[] = "debug,max_read=131072,timeout=1.5,fsname=bench,allow_other";
+			char* argv[] = { prog, o, opts, mnt, nullptr };
+			copper_fuse_args args(4, argv);
+			struct bench_opts data;
+			memset(&data, 0, sizeof(data));
+			args.parse_opt(&data, bench_opt_table, nullptr);
+
+			free(data.fsname);
+			if (args.allocated) {
+				for (int a = 0; a < args.argc; a++)
+					free(args.argv[a]);
+				free(args.argv);
+			}
+		}
+	});
+	report("micro/opt_parse", "ns/op", ns, true);
+}
+
+static void bench_log(const struct bench_config& c) {
+	double ns = best_ns(c.repeat, 100000, [](uint64_t ops) {
+		for (uint64_t i = 0; i < ops; i++)
+			debug << "lookup of " << i << " in " << 1;
+	});
+	report("micro/log", "ns/op", ns, true);
+}
+
+static int bench_session_call(copper_fuse_session* se, int fd, uint32_t opcode, const void* arg,
+	size_t argsize, std::vector<char>* out) {
+	char buf[256];
+	struct fuse_in_header* hdr = (struct fuse_in_header*)buf;
+	memset(hdr, 0, sizeof(*hdr));
+	hdr->len = sizeof(*hdr) + argsize;
+	hdr->opcode = opcode;
+	hdr->unique = 1;
+	hdr->nodeid = FUSE_ROOT_ID;
+	memcpy(buf + sizeof(*hdr), arg, argsize);
+
+	se->process_buf(buf, hdr->len);
+	if (read(fd, out->data(), out->size()) < (ssize_t)sizeof(struct fuse_out_header))
+		return -EIO;
+	return ((const struct fuse_out_header*)out->data())->error;
+}
+
+static void bench_dispatch(const struct bench_config& c) {
+	int sv[2];
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv) == -1) {
+		perror("socketpair");
+		return;
+	}
+
+	struct copper_fuse_lowlevel_ops op;
+	op.getattr = [](copper_fuse_req_t req, fuse_ino_t ino, struct fuse_file_info*) {
+		struct stat st;
+		memset(&st, 0, sizeof(st));
+		st.st_ino = ino;
+		st.st_mode = S_IFDIR | 0755;
+		st.st_nlink = 2;
+		req->reply_attr(&st, 1.0);
+	};
+	copper_fuse_session se(&op, nullptr);
+	se.set_fd(sv[1]);
+
+	std::vector<char> out(4096);
+	struct fuse_init_in init_in;
+	memset(&init_in, 0, sizeof(init_in));
+	init_in.major = FUSE_KERNEL_VERSION;
+	init_in.minor = FUSE_KERNEL_MINOR_VERSION;
+	if (bench_session_call(&se, sv[0], FUSE_INIT, &init_in, sizeof(init_in), &out) == 0) {
+		struct fuse_getattr_in getattr_in;
+		memset(&getattr_in, 0, sizeof(getattr_in));
+		bool ok = true;
+		double ns = best_ns(c.repeat, 50000, [&](uint64_t ops) {
+			for (uint64_t i = 0; i < ops; i++)
+				ok &= bench_session_call(&se, sv[0], FUSE_GETATTR, &getattr_in,
+					sizeof(getattr_in), &out) == 0;
+		});
+		if (ok)
+			report("micro/dispatch", "ns/op", ns, true);
+		else
+			fprintf(stderr, "micro/dispatch: GETATTR failed\n");
+	}
+	close(sv[0]);
+	close(sv[1]);
+}
+
+static void bench_node_lookup(const struct bench_config& c) {
+	copper_fuse_atom_table atoms;
+	copper_fuse_node_table table(&atoms);
+	fuse_ino_t dir = table.find(FUSE_ROOT_ID, "dir")->nodeid;
+	fuse_ino_t sub = table.find(dir, "sub")->nodeid;
+	std::vector<std::string> names;
+	for (unsigned i = 0; i < 1024; i++)
+		names.push_back("file" + std::to_string(i));
+
+	std::string path;
+	double ns = best_ns(c.repeat, 500000, [&](uint64_t ops) {
+		for (uint64_t i = 0; i < ops; i++) {
+			fuse_ino_t ino = table.find(sub, names[i % names.size()].c_str())->nodeid;
+			table.get_path(ino, nullptr, &path);
+			table.forget(ino, 1);
+		}
+	});
+	report("micro/node_lookup", "ns/op", ns, true);
+}
+
+static void bench_bufpool(const struct bench_config& c) {
+	const size_t size = 1 << 20;
+	copper_fuse_bufpool pool;
+	copper_fuse_recv_buf buf;
+	if (pool.get(size, &buf) < 0)
+		return;
+	pool.put(&buf);
+
+	double ns = best_ns(c.repeat, 1000000, [&](uint64_t ops) {
+		for (uint64_t i = 0; i < ops; i++) {
+			pool.get(size, &buf);
+			pool.put(&buf);
+		}
+	});
+	report("micro/bufpool", "ns/op", ns, true);
+
+	ns = best_ns(c.repeat, 200, [&](uint64_t ops) {
+		for (uint64_t i = 0; i < ops; i++) {
+			copper_fuse_bufpool cold;
+			if (cold.get(size, &buf) == 0) {
+				/* Touched as a request read into it would */
+				memset(buf.data, 0, 4096);
+				cold.put(&buf);
+			}
+		}
+	});
+	report("micro/bufpool_map", "ns/op", ns, true);
+}
+
+static void bench_timer(const struct bench_config& c) {
+	copper_fuse_timer_wheel wheel;
+	std::vector<copper_fuse_timer> timers(1024);
+
+	double ns = best_ns(c.repeat, 1000000, [&](uint64_t ops) {
+		for (uint64_t i = 0; i < ops; i++)
+			wheel.arm(&timers[i % timers.size()], 60 + i % 3600);
+		for (copper_fuse_timer& t : timers)
+			wheel.cancel(&t);
+	});
+	report("micro/timer", "ns/op", ns, true);
+}
+
+/** ---------------------------------------------------
+ * FOR MACRO BENCHMARKS
+ * ---------------------------------------------------*/
+
+/* Block size of the sequential and random data runs */
+#define BENCH_SEQ_BLOCK		(64 << 10)
+#define BENCH_RAND_BLOCK	4096
+
+/** What the workloads run on, every call returns 0 or -errno */
+struct bench_target {
+	std::function<int(const std::string& name)> create;
+	std::function<int(const std::string& name)> stat;
+	std::function<int(const std::string& name)> unlink;
+	/* One data file open at a time */
+	std::function<int(const std::string& name)> open;
+	std::function<int(const char* buf, size_t size, off_t off)> write;
+	std::function<int(char* buf, size_t size, off_t off)> read;
+	std::function<int()> close;
+};
+
+/* The high-level library over copper_memfs, in this process */
+struct bench_inprocess {
+	int sv[2];
+	copper_memfs fs;
+	struct copper_fuse_operations op;
+	copper_fuse* fuse;
+	std::thread loop;
+	std::unique_ptr<bench_kernel> k;
+	std::vector<char> out;
+	/* The data file */
+	uint64_t nodeid;
+	uint64_t fh;
+
+public:
+	int start() {
+		if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv) == -1)
+			return -errno;
+		int sndbuf = 4 << 20;
+		setsockopt(sv[0], SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+		setsockopt(sv[1], SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+
+		op = fs.operations();
+		char prog[] = "copper_fuse_bench";
+		char* argv[] = { prog, nullptr };
+		copper_fuse_args args(1, argv);
+		fuse = new copper_fuse(&op, nullptr);
+		if (fuse->init(&args) == -1)
+			return -EINVAL;
+		fuse->se->set_fd(sv[1]);
+		loop = std::thread([this] {
+			struct copper_fuse_loop_config config;
+			memset(&config, 0, sizeof(config));
+			config.max_idle_threads = 4;
+			config.max_threads = 4;
+			fuse->loop_mt(&config);
+		});
+
+		k.reset(new bench_kernel(sv[0]));
+		out.resize(BENCH_SEQ_BLOCK + 4096);
+		k->init(&out);
+		return 0;
+	}
+
+	void stop() {
+		close(sv[0]);
+		loop.join();
+		delete fuse;
+	}
+
+	int create_open(const std::string& name, uint64_t* ino, uint64_t* handle) {
+		std::string arg(sizeof(struct fuse_create_in), 0);
+		struct fuse_create_in* create_in = (struct fuse_create_in*)&arg[0];
+		create_in->mode = S_IFREG | 0644;
+		create_in->flags = O_RDWR;
+		arg.append(name.c_str(), name.size() + 1);
+		int err = k->try_call(FUSE_CREATE, FUSE_ROOT_ID, arg.data(), arg.size(), &out);
+		if (err)
+			return err;
+		const char* body = bench_reply_body(out);
+		*ino = ((const struct fuse_entry_out*)body)->nodeid;
+		*handle = ((const struct fuse_open_out*)(body + sizeof(struct fuse_entry_out)))->fh;
+		return 0;
+	}
+
+	int release(uint64_t ino, uint64_t handle) {
+		struct fuse_release_in release_in;
+		memset(&release_in, 0, sizeof(release_in));
+		release_in.fh = handle;
+		int err = k->try_call(FUSE_RELEASE, ino, &release_in, sizeof(release_in), &out);
+		k->forget(ino);
+		return err;
+	}
+
+	struct bench_target target() {
+		struct bench_target t;
+		t.create = [this](const std::string& name) {
+			uint64_t ino, handle;
+			int err = create_open(name, &ino, &handle);
+			return err ? err : release(ino, handle);
+		};
+		t.stat = [this](const std::string& name) {
+			int err = k->try_call(FUSE_LOOKUP, FUSE_ROOT_ID, name.c_str(), name.size() + 1, &out);
+			if (!err)
+				k->forget(((const struct fuse_entry_out*)bench_reply_body(out))->nodeid);
+			return err;
+		};
+		t.unlink = [this](const std::string& name) {
+			return k->try_call(FUSE_UNLINK, FUSE_ROOT_ID, name.c_str(), name.size() + 1, &out);
+		};
+		t.open = [this](const std::string& name) {
+			return create_open(name, &nodeid, &fh);
+		};
+		t.write = [this](const char* buf, size_t size, off_t off) {
+			struct fuse_write_in write_in;
+			memset(&write_in, 0, sizeof(write_in));
+			write_in.fh = fh;
+			write_in.offset = off;
+			write_in.size = size;
+			return k->try_call(FUSE_WRITE, nodeid, &write_in, sizeof(write_in), &out, buf, size);
+		};
+		t.read = [this](char* buf, size_t size, off_t off) {
+			struct fuse_read_in read_in;
+			memset(&read_in, 0, sizeof(read_in));
+			read_in.fh = fh;
+			read_in.offset = off;
+			read_in.size = size;
+			int err = k->try_call(FUSE_READ, nodeid, &read_in, sizeof(read_in), &out);
+			if (!err)
+				memcpy(buf, bench_reply_body(out), size);
+			return err;
+		};
+		t.close = [this]() {
+			return release(nodeid, fh);
+		};
+		return t;
+	}
+};
+
+/* Plain system calls on the files of a directory */
+static struct bench_target bench_directory(const std::string& dir, int* fd) {
+	struct bench_target t;
+	t.create = [dir](const std::string& name) {
+		int res = ::open((dir + "/" + name).c_str(), O_CREAT | O_EXCL | O_WRONLY, 0644);
+		if (res == -1)
+			return -errno;
+		close(res);
+		return 0;
+	};
+	t.stat = [dir](const std::string& name) {
+		struct stat st;
+		return ::stat((dir + "/" + name).c_str(), &st) == -1 ? -errno : 0;
+	};
+	t.unlink = [dir](const std::string& name) {
+		return ::unlink((dir + "/" + name).c_str()) == -1 ? -errno : 0;
+	};
+	t.open = [dir, fd](const std::string& name) {
+		*fd = ::open((dir + "/" + name).c_str(), O_CREAT | O_TRUNC | O_RDWR, 0644);
+		return *fd == -1 ? -errno : 0;
+	};
+	t.write = [fd](const char* buf, size_t size, off_t off) {
+		return pwrite(*fd, buf, size, off) == (ssize_t)size ? 0 : -EIO;
+	};
+	t.read = [fd](char* buf, size_t size, off_t off) {
+		return pread(*fd, buf, size, off) == (ssize_t)size ? 0 : -EIO;
+	};
+	t.close = [fd]() {
+		return close(*fd) == -1 ? -errno : 0;
+	};
+	return t;
+}
+
+/* Each phase timed over all files, @return 0 or the first error */
+static int bench_meta(const struct bench_config& c, struct bench_target& t) {
+	const struct {
+		const char* name;
+		const std::function<int(const std::string& name)>& fn;
+	} phases[] = {
+		{ "macro/meta_create", t.create },
+		{ "macro/meta_stat",   t.stat },
+		{ "macro/meta_unlink", t.unlink },
+	};
+
+	for (auto& phase : phases) {
+		auto start = bench_clock::now();
+		for (unsigned i = 0; i < c.files; i++) {
+			int err = phase.fn("bench." + std::to_string(i));
+			if (err) {
+				fprintf(stderr, "%s: %s\n", phase.name, strerror(-err));
+				return err;
+			}
+		}
+		report(phase.name, "ops/s", c.files / sec_since(start), false);
+	}
+	return 0;
+}
+
+static int bench_data(const struct bench_config& c, struct bench_target& t) {
+	const size_t blocks = (size_t)c.mib * (1 << 20) / BENCH_SEQ_BLOCK;
+	std::vector<char> buf(BENCH_SEQ_BLOCK, 'c');
+	int err = t.open("bench.data");
+	if (err) {
+		fprintf(stderr, "macro/data: %s\n", strerror(-err));
+		return err;
+	}
+
+	auto start = bench_clock::now();
+	for (size_t b = 0; b < blocks && !err; b++)
+		err = t.write(buf.data(), BENCH_SEQ_BLOCK, b * BENCH_SEQ_BLOCK);
+	if (!err)
+		report("macro/data_seq_write", "MiB/s", c.mib / sec_since(start), false);
+
+	start = bench_clock::now();
+	for (size_t b = 0; b < blocks && !err; b++)
+		err = t.read(buf.data(), BENCH_SEQ_BLOCK, b * BENCH_SEQ_BLOCK);
+	if (!err)
+		report("macro/data_seq_read", "MiB/s", c.mib / sec_since(start), false);
+
+	std::mt19937_64 rng(1);
+	const size_t rand_blocks = (size_t)c.mib * (1 << 20) / BENCH_RAND_BLOCK;
+	const size_t reads = std::min<size_t>(rand_blocks, 100000);
+	start = bench_clock::now();
+	for (size_t i = 0; i < reads && !err; i++)
+		err = t.read(buf.data(), BENCH_RAND_BLOCK, (rng() % rand_blocks) * BENCH_RAND_BLOCK);
+	if (!err)
+		report("macro/data_rand_read", "ops/s", reads / sec_since(start), false);
+
+	int close_err = t.close();
+	t.unlink("bench.data");
+	if (err)
+		fprintf(stderr, "macro/data: %s\n", strerror(-err));
+	return err ? err : close_err;
+}
+
+static int bench_macro(const struct bench_config& c) {
+	bool meta = wanted(c, "macro/meta_create") || wanted(c, "macro/meta_stat") ||
+		wanted(c, "macro/meta_unlink");
+	bool data = wanted(c, "macro/data_seq_write") || wanted(c, "macro/data_seq_read") ||
+		wanted(c, "macro/data_rand_read");
+	int err = 0;
+
+	if (!meta && !data)
+		return 0;
+	if (c.mount) {
+		int fd = -1;
+		struct bench_target t = bench_directory(c.mount, &fd);
+		if (meta)
+			err = bench_meta(c, t);
+		if (data && !err)
+			err = bench_data(c, t);
+		return err;
+	}
+
+	bench_inprocess* p = new bench_inprocess;
+	err = p->start();
+	if (!err) {
+		struct bench_target t = p->target();
+		if (meta)
+			err = bench_meta(c, t);
+		if (data && !err)
+			err = bench_data(c, t);
+	} else {
+		fprintf(stderr, "macro: no session: %s\n", strerror(-err));
+	}
+	p->stop();
+	delete p;
+	return err;
+}
+
+/** ---------------------------------------------------
+ * FOR RESULTS AND BASELINE
+ * ---------------------------------------------------*/
+
+static int write_json(const char* file) {
+	FILE* f = fopen(file, "w");
+	if (!f) {
+		perror(file);
+		return -1;
+	}
+
+	fprintf(f, "{\n  \"suite\": \"copper_fuse_bench\",\n  \"results\": [\n");
+	for (size_t i = 0; i < results.size(); i++) {
+		const bench_result& r = results[i];
+		fprintf(f, "    { \"name\": \"%s\", \"unit\": \"%s\", \"value\": %.1f, \"better\": \"%s\" }%s\n",
+			r.name.c_str(), r.unit.c_str(), r.value, r.lower_is_better ? "lower" : "higher",
+			i + 1 < results.size() ? "," : "");
+	}
+	fprintf(f, "  ]\n}\n");
+	return fclose(f);
+}
+
+/* The number after `"key":` in `line`, false if there is none */
+static bool json_number(const std::string& line, const char* key, double* value) {
+	size_t pos = line.find(std::string("\"") + key + "\"");
+	if (pos == std::string::npos || (pos = line.find(':', pos)) == std::string::npos)
+		return false;
+	return sscanf(line.c_str() + pos + 1, " %lf", value) == 1;
+}
+
+static bool json_string(const std::string& line, const char* key, std::string* value) {
+	size_t pos = line.find(std::string("\"") + key + "\"");
+	if (pos == std::string::npos || (pos = line.find(':', pos)) == std::string::npos ||
+		(pos = line.find('"', pos)) == std::string::npos)
+		return false;
+	size_t end = line.find('"', pos + 1);
+	if (end == std::string::npos)
+		return false;
+	value->assign(line, pos + 1, end - pos - 1);
+	return true;
+}
+
+struct baseline_entry {
+	std::string name;
+	double value;
+	/* Percent, negative when the file has none */
+	double threshold;
+};
+
+/* Results as --json writes them, one per line */
+static int read_baseline(const char* file, std::vector<baseline_entry>* entries) {
+	FILE* f = fopen(file, "r");
+	if (!f) {
+		perror(file);
+		return -1;
+	}
+
+	char line[1024];
+	while (fgets(line, sizeof(line), f)) {
+		baseline_entry e;
+		if (!json_string(line, "name", &e.name) || !json_number(line, "value", &e.value))
+			continue;
+		if (!json_number(line, "threshold", &e.threshold))
+			e.threshold = -1;
+		entries->push_back(e);
+	}
+	fclose(f);
+	return 0;
+}
+
+/* @return the number of regressions, -1 if the baseline can't be read */
+static int compare_baseline(const struct bench_config& c) {
+	std::vector<baseline_entry> entries;
+	if (read_baseline(c.baseline, &entries) == -1)
+		return -1;
+
+	int regressions = 0;
+	printf("\n%-24s %14s %14s %8s %9s\n", "against baseline", "baseline", "now", "change",
+		"allowed");
+	for (const bench_result& r : results) {
+		auto it = std::find_if(entries.begin(), entries.end(),
+			[&r](const baseline_entry& e) { return e.name == r.name; });
+		if (it == entries.end() || it->value <= 0) {
+			printf("%-24s %14s %14.1f %8s %9s\n", r.name.c_str(), "-", r.value, "", "new");
+			continue;
+		}
+
+		double allowed = it->threshold >= 0 ? it->threshold : c.threshold;
+		double change = (r.value - it->value) / it->value * 100;
+		double worse = r.lower_is_better ? change : -change;
+		bool regressed = worse > allowed;
+		regressions += regressed;
+		printf("%-24s %14.1f %14.1f %+7.1f%% %8.1f%% %s\n", r.name.c_str(), it->value, r.value,
+			change, allowed, regressed ? "REGRESSED" : "ok");
+	}
+	return regressions;
+}
+
+static int usage(const char* prog) {
+	fprintf(stderr, "usage: %s [--filter S] [--repeat N] [--json FILE] [--baseline FILE] "
+		"[--threshold PCT] [--mount DIR] [--files N] [--mib N]\n", prog);
+	return 2;
+}
+
+int main(int argc, char* argv[]) {
+	struct bench_config c;
+	c.repeat    = 3;
+	c.json      = nullptr;
+	c.baseline  = nullptr;
+	c.threshold = 20;
+	c.mount     = nullptr;
+	c.files     = 10000;
+	c.mib       = 64;
+
+	for (int i = 1; i < argc; i++) {
+		const char* arg = argv[i];
+		const char* val = i + 1 < argc ? argv[i + 1] : nullptr;
+		if (!val)
+			return usage(argv[0]);
+		if (strcmp(arg, "--filter") == 0)
+			c.filter = val;
+		else if (strcmp(arg, "--repeat") == 0)
+			c.repeat = atoi(val);
+		else if (strcmp(arg, "--json") == 0)
+			c.json = val;
+		else if (strcmp(arg, "--baseline") == 0)
+			c.baseline = val;
+		else if (strcmp(arg, "--threshold") == 0)
+			c.threshold = atof(val);
+		else if (strcmp(arg, "--mount") == 0)
+			c.mount = val;
+		else if (strcmp(arg, "--files") == 0)
+			c.files = atoi(val);
+		else if (strcmp(arg, "--mib") == 0)
+			c.mib = atoi(val);
+		else
+			return usage(argv[0]);
+		i++;
+	}
+	if (!c.repeat || !c.files || !c.mib || c.threshold < 0)
+		return usage(argv[0]);
+
+	/* The library logs to std::cout, which would drown the results */
+	bench_null_buf null_buf;
+	std::streambuf* cout_buf = std::cout.rdbuf(&null_buf);
+
+	const struct {
+		const char* name;
+		void (*run)(const struct bench_config& c);
+	} micro[] = {
+		{ "micro/opt_parse",   bench_opt_parse },
+		{ "micro/log",         bench_log },
+		{ "micro/dispatch",    bench_dispatch },
+		{ "micro/node_lookup", bench_node_lookup },
+		{ "micro/bufpool",     bench_bufpool },
+		{ "micro/timer",       bench_timer },
+	};
+	for (auto& m : micro)
+		if (wanted(c, m.name))
+			m.run(c);
+	int err = bench_macro(c);
+	std::cout.rdbuf(cout_buf);
+
+	if (c.json && write_json(c.json) == -1)
+		return 1;
+	if (c.baseline && compare_baseline(c))
+		return 1;
+	return err ? 1 : 0;
+}
@@ -0,0 +1,231 @@
+/*
+  CopperFuse: C++ version Filesystem in Userspace
+  Copyright (C) 2023 Chen Miao <chenmiao.ku@gmail.com>
+
+  This program can be distributed under the terms of the GNU LGPLv2.
+  See the file COPYING.LIB.
+*/
+
+/**
+ * CUSE streaming benchmark
+ *
+ * Runs a telemetry style character device, a ring buffer that reads
+ * drain and writes fill, and plays the kernel side, so neither
+ * /dev/cuse nor privileges are needed.  Measures a continuous byte
+ * stream in both directions, the ioctl round trip and a poll wakeup
+ * cycle (POLL with notify, WRITE, NOTIFY_POLL).
+ *
+ * usage: cuse_stream [MiB-per-direction] [request-KiB]
+ */
+
+#include "bench_kernel.h"
+#include "copper_cuse_lowlevel.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <poll.h>
+#include <sys/socket.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#define STREAM_RING (4 << 20)
+#define STREAM_IOC_STAT 0x80085301u
+
+/* The device: reads consume the ring, writes append to it */
+struct stream_dev {
+	std::vector<char> ring;
+	size_t head;
+	size_t fill;
+	struct fuse_pollhandle* ph;
+	copper_fuse_session* se;
+};
+
+static void stream_read(stream_dev* dev, copper_fuse_req_t req, size_t size) {
+	/* A telemetry source never runs dry, pretend the producer kept up */
+	if (dev->fill < size)
+		dev->fill = STREAM_RING;
+
+	struct iovec iov[2];
+	size_t first = std::min(size, STREAM_RING - dev->head);
+	iov[0].iov_base = dev->ring.data() + dev->head;
+	iov[0].iov_len  = first;
+	iov[1].iov_base = dev->ring.data();
+	iov[1].iov_len  = size - first;
+	dev->head = (dev->head + size) % STREAM_RING;
+	dev->fill -= size;
+	req->reply_iov(iov, iov[1].iov_len ? 2 : 1);
+}
+
+static void stream_write(stream_dev* dev, copper_fuse_req_t req, const char* buf, size_t size) {
+	size_t tail = (dev->head + dev->fill) % STREAM_RING;
+	size_t first = std::min(size, STREAM_RING - tail);
+	memcpy(dev->ring.data() + tail, buf, first);
+	memcpy(dev->ring.data(), buf + first, size - first);
+	dev->fill = std::min<size_t>(dev->fill + size, STREAM_RING);
+
+	if (dev->ph) {
+		dev->se->notify_poll(dev->ph);
+		delete dev->ph;
+		dev->ph = nullptr;
+	}
+	req->reply_write(size);
+}
+
+int main(int argc, char* argv[]) {
+	size_t total = (argc > 1 ? atoll(argv[1]) : 4096) << 20;
+	size_t chunk = (argc > 2 ? atoll(argv[2]) : 128) << 10;
+
+	stream_dev dev;
+	dev.ring.assign(STREAM_RING, 't');
+	dev.head = 0;
+	dev.fill = 0;
+	dev.ph = nullptr;
+
+	struct copper_cuse_lowlevel_ops clop;
+	clop.open = [](copper_fuse_req_t req, struct fuse_file_info* fi) {
+		fi->nonseekable = 1;
+		req->reply_open(fi);
+	};
+	clop.read = [&dev](copper_fuse_req_t req, size_t size, off_t, struct fuse_file_info*) {
+		stream_read(&dev, req, size);
+	};
+	clop.write = [&dev](copper_fuse_req_t req, const char* buf, size_t size, off_t,
+		struct fuse_file_info*) {
+		stream_write(&dev, req, buf, size);
+	};
+	clop.ioctl = [&dev](copper_fuse_req_t req, unsigned int cmd, void*, struct fuse_file_info*,
+		unsigned, const void*, size_t, size_t out_bufsz) {
+		uint64_t fill = dev.fill;
+		if (cmd != STREAM_IOC_STAT || out_bufsz < sizeof(fill))
+			req->reply_err(ENOTTY);
+		else
+			req->reply_ioctl(0, &fill, sizeof(fill));
+	};
+	clop.poll = [&dev](copper_fuse_req_t req, struct fuse_file_info*, struct fuse_pollhandle* ph) {
+		if (ph) {
+			delete dev.ph;
+			dev.ph = ph;
+		}
+		req->reply_poll(dev.fill ? POLLIN | POLLOUT : POLLOUT);
+	};
+
+	const char* dev_info_argv[] = { "DEVNAME=telemetry" };
+	struct copper_cuse_info ci;
+	memset(&ci, 0, sizeof(ci));
+	ci.dev_info_argc = 1;
+	ci.dev_info_argv = dev_info_argv;
+
+	int sv[2];
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv) == -1) {
+		perror("socketpair");
+		return 1;
+	}
+	int sndbuf = 4 << 20;
+	setsockopt(sv[0], SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+	setsockopt(sv[1], SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+
+	copper_fuse_session* se = copper_cuse_lowlevel_new(nullptr, &ci, &clop, &dev);
+	if (!se)
+		return 1;
+	se->set_fd(sv[1]);
+	dev.se = se;
+	std::thread loop([se] { se->loop(); });
+
+	/* The device is the one node there is */
+	bench_kernel k(sv[0]);
+	std::vector<char> out(se->bufsize + 4096);
+	struct cuse_init_in init_in = { FUSE_KERNEL_VERSION, FUSE_KERNEL_MINOR_VERSION, 0, 0 };
+	const struct cuse_init_out* init_out =
+		(const struct cuse_init_out*)k.call(CUSE_INIT, 1, &init_in, sizeof(init_in), &out);
+	if (bench_reply_size(out) < sizeof(*init_out) || chunk > init_out->max_read ||
+		chunk > init_out->max_write) {
+		fprintf(stderr, "request size %zu KiB above max_read %u / max_write %u\n",
+			chunk >> 10, init_out->max_read, init_out->max_write);
+		return 1;
+	}
+	printf("device                %s\n", (const char*)(init_out + 1));
+	printf("max_read/max_write    %u / %u KiB\n", init_out->max_read >> 10, init_out->max_write >> 10);
+
+	struct fuse_open_in open_in;
+	memset(&open_in, 0, sizeof(open_in));
+	open_in.flags = O_RDWR;
+	uint64_t fh = ((const struct fuse_open_out*)k.call(FUSE_OPEN, 1, &open_in, sizeof(open_in),
+		&out))->fh;
+
+	/* Reader: back to back reads of `chunk` */
+	struct fuse_read_in read_in;
+	memset(&read_in, 0, sizeof(read_in));
+	read_in.fh = fh;
+	read_in.size = chunk;
+	auto start = bench_clock::now();
+	size_t moved = 0;
+	for (; moved < total; moved += chunk) {
+		k.call(FUSE_READ, 1, &read_in, sizeof(read_in), &out);
+		if (bench_reply_size(out) != chunk)
+			return 1;
+	}
+	double read_s = sec_since(start);
+
+	/* Writer: the same stream the other way */
+	std::vector<char> payload(chunk, 'w');
+	struct fuse_write_in write_in;
+	memset(&write_in, 0, sizeof(write_in));
+	write_in.fh = fh;
+	write_in.size = chunk;
+	start = bench_clock::now();
+	for (moved = 0; moved < total; moved += chunk)
+		k.call(FUSE_WRITE, 1, &write_in, sizeof(write_in), &out, payload.data(), chunk);
+	double write_s = sec_since(start);
+
+	/* Restricted ioctl, the kernel decoded an 8 byte output argument */
+	const unsigned ioctls = 200000;
+	struct fuse_ioctl_in ioctl_in;
+	memset(&ioctl_in, 0, sizeof(ioctl_in));
+	ioctl_in.fh = fh;
+	ioctl_in.cmd = STREAM_IOC_STAT;
+	ioctl_in.out_size = sizeof(uint64_t);
+	start = bench_clock::now();
+	for (unsigned i = 0; i < ioctls; i++)
+		k.call(FUSE_IOCTL, 1, &ioctl_in, sizeof(ioctl_in), &out);
+	double ioctl_s = sec_since(start);
+
+	/* Drained device: POLL schedules a notify, a small WRITE fires it */
+	const unsigned wakeups = 100000;
+	struct fuse_poll_in poll_in;
+	memset(&poll_in, 0, sizeof(poll_in));
+	poll_in.fh = fh;
+	poll_in.flags = FUSE_POLL_SCHEDULE_NOTIFY;
+	poll_in.events = POLLIN;
+	write_in.size = 64;
+	unsigned notified = 0;
+	start = bench_clock::now();
+	for (unsigned i = 0; i < wakeups; i++) {
+		dev.fill = 0;
+		poll_in.kh = i + 1;
+		k.call(FUSE_POLL, 1, &poll_in, sizeof(poll_in), &out);
+		k.send(FUSE_WRITE, 1, &write_in, sizeof(write_in), payload.data(), 64);
+
+		const struct fuse_out_header* hdr = k.recv(&out);
+		if (hdr->unique == 0 && hdr->error == FUSE_NOTIFY_POLL)
+			notified++;
+		k.recv(&out);
+	}
+	double poll_s = sec_since(start);
+
+	close(sv[0]);
+	loop.join();
+	delete dev.ph;
+	copper_cuse_lowlevel_teardown(se);
+
+	double mib = (double)total / (1 << 20);
+	printf("request size          %zu KiB\n", chunk >> 10);
+	printf("read stream           %10.1f MiB/s  (%.0f req/s)\n", mib / read_s, total / chunk / read_s);
+	printf("write stream          %10.1f MiB/s  (%.0f req/s)\n", mib / write_s, total / chunk / write_s);
+	printf("ioctl round trip      %10.2f us\n", ioctl_s * 1e6 / ioctls);
+	printf("poll wakeup cycle     %10.2f us  (%u/%u notified)\n", poll_s * 1e6 / wakeups,
+		notified, wakeups);
+	return 0;
+}
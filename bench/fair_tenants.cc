@@ -0,0 +1,272 @@
+/*
+  CopperFuse: C++ version Filesystem in Userspace
+  Copyright (C) 2023 Chen Miao <chenmiao.ku@gmail.com>
+
+  This program can be distributed under the terms of the GNU LGPLv2.
+  See the file COPYING.LIB.
+*/
+
+/**
+ * Multi-tenant fairness benchmark
+ *
+ * Plays the kernel for five users at once: one noisy user keeping 32 READs in flight and four light ones
+ * keeping one each.  The filesystem serves READs synchronously in
+ * 500 us, from 8 worker threads.  Compares no fairness, deficit
+ * round-robin over 4 dispatch slots, and the same with the noisy user
+ * limited to 1000 operations per second.  Reports the throughput of
+ * every user and the latency the light ones see.
+ *
+ * Then measures what fairness costs when nobody competes: GETATTR
+ * round trips of a single user from a single worker, fairness off and
+ * on without limits.
+ *
+ * usage: fair_tenants [seconds] [read size]
+ */
+
+#include "bench_kernel.h"
+#include "copper_fuse_lowlevel.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#define TENANTS 5
+#define NOISY_UID 1000
+#define SERVICE_US 500
+
+/* Requests carry their tenant in the upper half of `unique` */
+static const unsigned windows[TENANTS] = { 32, 1, 1, 1, 1 };
+
+struct tenant {
+	std::mutex lock;
+	std::condition_variable cond;
+	unsigned inflight = 0;
+	uint64_t done = 0;
+	std::vector<int64_t> sent;
+	std::vector<double> lat;
+};
+
+struct scenario {
+	const char* name;
+	bool fair;
+	unsigned slots;
+	double noisy_ops;
+};
+
+static int socket_pair(int sv[2]) {
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv) == -1) {
+		perror("socketpair");
+		return -1;
+	}
+	int sndbuf = 8 << 20;
+	setsockopt(sv[0], SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+	setsockopt(sv[1], SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+	return 0;
+}
+
+static int run(const struct scenario& sc, double seconds, size_t read_size, tenant* tenants) {
+	int sv[2];
+	if (socket_pair(sv) < 0)
+		return -1;
+
+	std::vector<char> data(read_size, 'f');
+	struct copper_fuse_lowlevel_ops op;
+	op.read = [&data](copper_fuse_req_t req, fuse_ino_t, size_t size, off_t, struct fuse_file_info*) {
+		std::this_thread::sleep_for(std::chrono::microseconds(SERVICE_US));
+		req->reply_buf(data.data(), std::min(size, data.size()));
+	};
+
+	copper_fuse_session se(&op, nullptr);
+	se.set_fd(sv[1]);
+	if (sc.fair) {
+		se.fair.setup(sc.slots);
+		if (sc.noisy_ops > 0) {
+			copper_fuse_tenant_limits limits;
+			limits.ops_per_sec = sc.noisy_ops;
+			limits.burst = 0.01;
+			se.fair.set_limits(NOISY_UID, limits);
+		}
+	}
+	struct copper_fuse_loop_config config;
+	memset(&config, 0, sizeof(config));
+	config.max_idle_threads = 10;
+	config.max_threads = 8;
+	std::thread loop([&] { se.loop_mt(&config); });
+
+	bench_kernel k(sv[0]);
+	std::vector<char> out(read_size + 4096);
+	k.init(&out);
+
+	const size_t table = 1 << 20;
+	std::atomic<bool> stop(false);
+	std::atomic<unsigned> pending(0);
+	for (unsigned i = 0; i < TENANTS; i++) {
+		tenants[i].sent.assign(table, 0);
+		tenants[i].lat.reserve(1 << 16);
+	}
+
+	std::thread receiver([&] {
+		struct pollfd pfd = { sv[0], POLLIN, 0 };
+		while (!stop.load() || pending.load()) {
+			if (poll(&pfd, 1, 10) <= 0)
+				continue;
+			const struct fuse_out_header* o = k.recv(&out);
+			tenant& t = tenants[o->unique >> 32];
+			int64_t now = now_ns();
+			std::lock_guard<std::mutex> guard(t.lock);
+			t.lat.push_back((now - t.sent[o->unique % table]) / 1e3);
+			t.done++;
+			t.inflight--;
+			pending.fetch_sub(1);
+			t.cond.notify_one();
+		}
+	});
+
+	/* The kernel, one thread per user keeping its window full */
+	int64_t end = now_ns() + (int64_t)(seconds * 1e9);
+	std::vector<std::thread> users;
+	for (unsigned i = 0; i < TENANTS; i++) {
+		users.emplace_back([&, i] {
+			tenant& t = tenants[i];
+			struct fuse_read_in read_in;
+			memset(&read_in, 0, sizeof(read_in));
+			read_in.size = read_size;
+			struct fuse_in_header hdr = k.header(FUSE_READ, 2 + i);
+			hdr.uid = NOISY_UID + i;
+			hdr.gid = NOISY_UID + i;
+
+			for (uint64_t seq = 1; now_ns() < end; seq++) {
+				std::unique_lock<std::mutex> guard(t.lock);
+				while (t.inflight >= windows[i] && now_ns() < end)
+					t.cond.wait_for(guard, std::chrono::milliseconds(1));
+				if (t.inflight >= windows[i])
+					break;
+				t.inflight++;
+				pending.fetch_add(1);
+				hdr.unique = ((uint64_t)i << 32) | seq;
+				read_in.offset += read_size;
+				t.sent[hdr.unique % table] = now_ns();
+				guard.unlock();
+				k.send(&hdr, &read_in, sizeof(read_in));
+			}
+		});
+	}
+	for (auto& u : users)
+		u.join();
+	stop.store(true);
+	receiver.join();
+
+	se.exit();
+	loop.join();
+	close(sv[0]);
+	return 0;
+}
+
+/* Nanoseconds per GETATTR round trip, one at a time */
+static double getattr_cost(bool fair, unsigned count) {
+	int sv[2];
+	if (socket_pair(sv) < 0)
+		return -1;
+
+	struct copper_fuse_lowlevel_ops op;
+	op.getattr = [](copper_fuse_req_t req, fuse_ino_t ino, struct fuse_file_info*) {
+		struct stat st;
+		memset(&st, 0, sizeof(st));
+		st.st_ino = ino;
+		st.st_mode = S_IFREG | 0644;
+		req->reply_attr(&st, 1.0);
+	};
+
+	copper_fuse_session se(&op, nullptr);
+	se.set_fd(sv[1]);
+	if (fair)
+		se.fair.setup(0);
+	std::thread loop([&] { se.loop(); });
+
+	bench_kernel k(sv[0]);
+	std::vector<char> out(4096);
+	k.init(&out);
+
+	struct fuse_getattr_in getattr_in;
+	memset(&getattr_in, 0, sizeof(getattr_in));
+	struct fuse_in_header hdr;
+
+	int64_t start = now_ns();
+	for (unsigned i = 0; i < count; i++) {
+		hdr = k.header(FUSE_GETATTR, 2);
+		hdr.uid = NOISY_UID;
+		k.send(&hdr, &getattr_in, sizeof(getattr_in));
+		k.recv(&out);
+	}
+	double ns = (double)(now_ns() - start) / count;
+
+	/* loop() returns after one more request */
+	se.exit();
+	hdr.unique = 0;
+	k.send(&hdr, &getattr_in, sizeof(getattr_in));
+	loop.join();
+	close(sv[0]);
+	return ns;
+}
+
+static double percentile(std::vector<double>& v, unsigned p) {
+	if (v.empty())
+		return 0;
+	std::sort(v.begin(), v.end());
+	return v[std::min(v.size() - 1, v.size() * p / 100)];
+}
+
+int main(int argc, char* argv[]) {
+	double seconds   = argc > 1 ? atof(argv[1]) : 2.0;
+	size_t read_size = argc > 2 ? atoi(argv[2]) : 32768;
+	if (seconds <= 0 || !read_size) {
+		fprintf(stderr, "usage: %s [seconds] [read size]\n", argv[0]);
+		return 1;
+	}
+
+	const struct scenario scenarios[] = {
+		{ "off", false, 0, 0 },
+		{ "DRR, 4 slots", true, 4, 0 },
+		{ "DRR, 4 slots, noisy 1000/s", true, 4, 1000 },
+	};
+
+	printf("%zu byte reads served in %u us by 8 workers, %.1f s each\n", read_size, SERVICE_US,
+		seconds);
+	printf("%-28s %11s %11s %11s %11s\n", "", "noisy op/s", "light op/s", "light p50",
+		"light p99");
+	for (const struct scenario& sc : scenarios) {
+		tenant tenants[TENANTS];
+		if (run(sc, seconds, read_size, tenants) < 0)
+			return 1;
+
+		std::vector<double> light;
+		uint64_t light_done = 0;
+		for (unsigned i = 1; i < TENANTS; i++) {
+			light.insert(light.end(), tenants[i].lat.begin(), tenants[i].lat.end());
+			light_done += tenants[i].done;
+		}
+		printf("%-28s %11.0f %11.0f %8.0f us %8.0f us\n", sc.name, tenants[0].done / seconds,
+			light_done / seconds / (TENANTS - 1), percentile(light, 50), percentile(light, 99));
+	}
+
+	const unsigned count = 50000;
+	double off = getattr_cost(false, count);
+	double on = getattr_cost(true, count);
+	if (off < 0 || on < 0)
+		return 1;
+	printf("\nuncontended GETATTR round trip: %.0f ns off, %.0f ns on (%+.1f%%)\n", off, on,
+		(on - off) / off * 100);
+	return 0;
+}
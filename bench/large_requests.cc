@@ -0,0 +1,176 @@
+/*
+  CopperFuse: C++ version Filesystem in Userspace
+  Copyright (C) 2023 Chen Miao <chenmiao.ku@gmail.com>
+
+  This program can be distributed under the terms of the GNU LGPLv2.
+  See the file COPYING.LIB.
+*/
+
+/**
+ * Request size benchmark
+ *
+ * Plays the kernel writing a file sequentially with WRITE requests as
+ * large as INIT allowed, a few in flight as writeback keeps them.  The filesystem copies each request
+ * into a device image and pays a fixed cost per request on top, the
+ * submission and completion of an NVMe command.
+ *
+ * Runs the session with max_pages from 32 (128 KiB, the default) up to
+ * the kernel's limit, and at 1 MiB once more without huge page receive
+ * buffers.  Reports throughput, time per request and what the receive
+ * buffers were mapped from.
+ *
+ * usage: large_requests [seconds] [per-request us] [in flight]
+ */
+
+#include "bench_kernel.h"
+#include "copper_fuse_lowlevel.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <poll.h>
+#include <sys/socket.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+/* Size of the device image the file is written to, round robin */
+#define IMAGE_SIZE (256 << 20)
+
+struct result {
+	unsigned max_write;
+	double mib_s;
+	double us_per_req;
+	const char* kind;
+};
+
+static const char* kind_name(copper_fuse_bufpool* pool) {
+	if (pool->mapped[COPPER_FUSE_BUF_HUGETLB].load())
+		return "hugetlb";
+	if (pool->mapped[COPPER_FUSE_BUF_THP].load())
+		return "thp";
+	return "pages";
+}
+
+static int run(unsigned pages, bool huge, double seconds, unsigned cost_us, unsigned window,
+	char* image, struct result* r) {
+	int sv[2];
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv) == -1) {
+		perror("socketpair");
+		return -1;
+	}
+	int sndbuf = 32 << 20;
+	setsockopt(sv[0], SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+	setsockopt(sv[1], SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+
+	struct copper_fuse_lowlevel_ops op;
+	op.write = [image, cost_us](copper_fuse_req_t req, fuse_ino_t, const char* buf, size_t size,
+		off_t off, struct fuse_file_info*) {
+		memcpy(image + off % IMAGE_SIZE, buf, size);
+		/* The device's share of every request, whatever its size */
+		int64_t until = now_ns() + cost_us * 1000LL;
+		while (now_ns() < until)
+			;
+		req->reply_write(size);
+	};
+
+	copper_fuse_session se(&op, nullptr);
+	se.bufs.huge = huge;
+	se.set_max_pages(pages);
+	se.set_fd(sv[1]);
+	struct copper_fuse_loop_config config;
+	memset(&config, 0, sizeof(config));
+	config.max_idle_threads = 10;
+	config.max_threads = window;
+	std::thread loop([&] { se.loop_mt(&config); });
+
+	bench_kernel k(sv[0]);
+	std::vector<char> out(4096);
+	const struct fuse_init_out* init_out =
+		k.init(&out, FUSE_ASYNC_READ | FUSE_BIG_WRITES | FUSE_MAX_PAGES);
+	/* What the kernel would send, it caps max_write at max_pages */
+	unsigned max_write = std::min<unsigned>(init_out->max_write,
+		(init_out->flags & FUSE_MAX_PAGES ? init_out->max_pages : 32) * getpagesize());
+
+	std::atomic<unsigned> inflight(0);
+	std::atomic<bool> stop(false);
+	std::atomic<uint64_t> done(0);
+	std::thread receiver([&] {
+		std::vector<char> buf(4096);
+		struct pollfd pfd = { sv[0], POLLIN, 0 };
+		while (!stop.load() || inflight.load()) {
+			if (poll(&pfd, 1, 10) <= 0)
+				continue;
+			k.recv(&buf);
+			done++;
+			inflight--;
+		}
+	});
+
+	std::vector<char> data(max_write, 'w');
+	struct fuse_write_in write_in;
+	memset(&write_in, 0, sizeof(write_in));
+	write_in.size = max_write;
+
+	int64_t start = now_ns();
+	int64_t end = start + (int64_t)(seconds * 1e9);
+	while (now_ns() < end) {
+		while (inflight.load() >= window)
+			std::this_thread::yield();
+		inflight++;
+		k.send(FUSE_WRITE, 2, &write_in, sizeof(write_in), data.data(), max_write);
+		write_in.offset += max_write;
+	}
+	stop.store(true);
+	receiver.join();
+	double elapsed = (now_ns() - start) / 1e9;
+
+	se.exit();
+	loop.join();
+	close(sv[0]);
+
+	r->max_write = max_write;
+	r->mib_s = done.load() * (double)max_write / elapsed / (1 << 20);
+	r->us_per_req = elapsed * 1e6 / done.load();
+	r->kind = kind_name(&se.bufs);
+	return 0;
+}
+
+int main(int argc, char* argv[]) {
+	double seconds   = argc > 1 ? atof(argv[1]) : 1.0;
+	unsigned cost_us = argc > 2 ? atoi(argv[2]) : 20;
+	unsigned window  = argc > 3 ? atoi(argv[3]) : 4;
+	if (seconds <= 0 || !window) {
+		fprintf(stderr, "usage: %s [seconds] [per-request us] [in flight]\n", argv[0]);
+		return 1;
+	}
+
+	std::vector<char> image(IMAGE_SIZE);
+	printf("%u us per request, %u in flight\n", cost_us, window);
+	printf("%-10s %-8s %10s %10s %10s\n", "max_pages", "buffers", "request", "MiB/s", "us/req");
+
+	struct bench_case {
+		unsigned pages;
+		bool huge;
+	};
+	const struct bench_case cases[] = {
+		{ 32, true }, { 64, true }, { 128, true }, { 256, false }, { 256, true }, { 1024, true },
+	};
+	unsigned last = 0;
+	for (const struct bench_case& c : cases) {
+		struct result r;
+		if (run(c.pages, c.huge, seconds, cost_us, window, image.data(), &r) == -1)
+			return 1;
+		/* Capped by the kernel's limit, the same as the row before */
+		if (r.max_write < c.pages * getpagesize() && r.max_write == last)
+			continue;
+		last = r.max_write;
+		printf("%-10u %-8s %9uK %10.0f %10.1f\n", r.max_write / getpagesize(), r.kind,
+			r.max_write >> 10, r.mib_s, r.us_per_req);
+	}
+	return 0;
+}
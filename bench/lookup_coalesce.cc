@@ -0,0 +1,199 @@
+/*
+  CopperFuse: C++ version Filesystem in Userspace
+  Copyright (C) 2023 Chen Miao <chenmiao.ku@gmail.com>
+
+  This program can be distributed under the terms of the GNU LGPLv2.
+  See the file COPYING.LIB.
+*/
+
+/**
+ * Lookup coalescing benchmark
+ *
+ * Plays the kernel for `jobs` compilers building at once, each
+ * searching an include path of `dirs` directories for the same
+ * `headers` headers in the same order.
+ * Header n is only in directory n % dirs, so most lookups miss, and
+ * the compilers' lookups of a name arrive together.  ->getattr() costs
+ * a round trip to a server answering one call at a time over its single
+ * connection.  Every build runs twice, the second one as the kernel
+ * would send it with its dentries gone.
+ *
+ * Runs with every lookup sent to ->getattr(), with concurrent lookups
+ * coalesced, and coalesced with negative entries remembered.  Reports
+ * the time, the ->getattr() calls and checks every answer.
+ *
+ * usage: lookup_coalesce [jobs] [dirs] [headers] [round trip us]
+ */
+
+#include "bench_kernel.h"
+#include "copper_fuse.h"
+#include "copper_fuse_i.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <sys/socket.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+/* The server: /i<d> directories, /i<d>/h<n>.h where n % dirs == d */
+struct bench_server {
+	unsigned dirs;
+	unsigned headers;
+	unsigned rtt_us;
+	/* The connection, one call on it at a time */
+	std::mutex conn;
+	std::atomic<uint64_t> calls;
+};
+
+static struct copper_fuse_operations bench_ops(bench_server* srv) {
+	struct copper_fuse_operations op;
+
+	op.getattr = [srv](const char* path, struct stat* stbuf, struct fuse_file_info*) {
+		srv->calls++;
+		{
+			std::lock_guard<std::mutex> guard(srv->conn);
+			std::this_thread::sleep_for(std::chrono::microseconds(srv->rtt_us));
+		}
+		memset(stbuf, 0, sizeof(*stbuf));
+
+		unsigned d, n;
+		char tail;
+		if (strcmp(path, "/") == 0 || (sscanf(path, "/i%u%c", &d, &tail) == 1 && d < srv->dirs)) {
+			stbuf->st_mode = S_IFDIR | 0755;
+			stbuf->st_nlink = 2;
+			return 0;
+		}
+		if (sscanf(path, "/i%u/h%u.%c", &d, &n, &tail) == 3 && tail == 'h' &&
+			d < srv->dirs && n < srv->headers && n % srv->dirs == d) {
+			stbuf->st_mode = S_IFREG | 0644;
+			stbuf->st_nlink = 1;
+			stbuf->st_size = 4096;
+			return 0;
+		}
+		return -ENOENT;
+	};
+	return op;
+}
+
+struct run_result {
+	double seconds;
+	uint64_t calls;
+	uint64_t lookups;
+	bool correct;
+};
+
+static int run(const char* opts, unsigned jobs, unsigned dirs, unsigned headers, unsigned rtt_us,
+	struct run_result* r) {
+	int sv[2];
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv) == -1) {
+		perror("socketpair");
+		return -1;
+	}
+
+	bench_server srv;
+	srv.dirs = dirs;
+	srv.headers = headers;
+	srv.rtt_us = rtt_us;
+	srv.calls = 0;
+	struct copper_fuse_operations op = bench_ops(&srv);
+
+	std::string opt = opts;
+	char prog[] = "lookup_coalesce", o[] = "-o";
+	char* fuse_argv[] = { prog, o, &opt[0], nullptr };
+	copper_fuse_args args(3, fuse_argv);
+	copper_fuse* fuse = new copper_fuse(&op, nullptr);
+	if (fuse->init(&args) == -1)
+		return -1;
+	fuse->se->set_fd(sv[1]);
+
+	struct copper_fuse_loop_config config;
+	memset(&config, 0, sizeof(config));
+	config.max_idle_threads = jobs + 1;
+	config.max_threads = jobs + 1;
+	std::thread loop([&] { fuse->loop_mt(&config); });
+
+	bench_kernel k(sv[0]);
+	std::vector<char> out(4096);
+	k.init(&out, 0, 0);
+
+	std::vector<uint64_t> dir_ids(dirs);
+	for (unsigned d = 0; d < dirs; d++) {
+		std::string name = "i" + std::to_string(d);
+		dir_ids[d] = ((const struct fuse_entry_out*)k.call(FUSE_LOOKUP, FUSE_ROOT_ID,
+			name.c_str(), name.size() + 1, &out))->nodeid;
+	}
+	srv.calls = 0;
+
+	r->correct = true;
+	r->lookups = 0;
+	auto start = bench_clock::now();
+	for (unsigned build = 0; build < 2; build++) {
+		for (unsigned n = 0; n < headers; n++) {
+			std::string name = "h" + std::to_string(n) + ".h";
+			/* Down the include path until found, all compilers at once */
+			for (unsigned d = 0; d <= n % dirs; d++) {
+				for (unsigned j = 0; j < jobs; j++)
+					k.send(FUSE_LOOKUP, dir_ids[d], name.c_str(), name.size() + 1);
+				for (unsigned j = 0; j < jobs; j++) {
+					int err = k.recv(&out)->error;
+					const struct fuse_entry_out* e =
+						(const struct fuse_entry_out*)bench_reply_body(out);
+					/* Missing is ENOENT, or an entry without a node under negative_timeout */
+					bool found = !err && e->nodeid;
+					r->correct &= found == (d == n % dirs) && (!err || err == -ENOENT);
+				}
+				r->lookups += jobs;
+			}
+		}
+	}
+	r->seconds = sec_since(start);
+	r->calls = srv.calls.load();
+
+	close(sv[0]);
+	loop.join();
+	delete fuse;
+	return 0;
+}
+
+int main(int argc, char* argv[]) {
+	unsigned jobs    = argc > 1 ? atoi(argv[1]) : 8;
+	unsigned dirs    = argc > 2 ? atoi(argv[2]) : 8;
+	unsigned headers = argc > 3 ? atoi(argv[3]) : 200;
+	unsigned rtt_us  = argc > 4 ? atoi(argv[4]) : 100;
+	if (!jobs || !dirs || !headers) {
+		fprintf(stderr, "usage: %s [jobs] [dirs] [headers] [round trip us]\n", argv[0]);
+		return 1;
+	}
+
+	printf("%u jobs, %u include dirs, %u headers, %u us per getattr, 2 builds\n", jobs, dirs,
+		headers, rtt_us);
+	printf("%-32s %9s %9s %9s %8s\n", "", "ms", "lookups", "getattr", "answers");
+
+	struct bench_case {
+		const char* name;
+		const char* opts;
+	};
+	const struct bench_case cases[] = {
+		{ "every lookup",               "nolookup_coalesce" },
+		{ "coalesced",                  "lookup_coalesce" },
+		{ "coalesced, negative entries", "lookup_coalesce,negative_timeout=60" },
+	};
+	for (const struct bench_case& c : cases) {
+		struct run_result r;
+		if (run(c.opts, jobs, dirs, headers, rtt_us, &r) == -1)
+			return 1;
+		printf("%-32s %9.1f %9llu %9llu %8s\n", c.name, r.seconds * 1e3,
+			(unsigned long long)r.lookups, (unsigned long long)r.calls,
+			r.correct ? "correct" : "WRONG");
+		if (!r.correct)
+			return 1;
+	}
+	return 0;
+}
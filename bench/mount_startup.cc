@@ -0,0 +1,241 @@
+/*
+  CopperFuse: C++ version Filesystem in Userspace
+  Copyright (C) 2023 Chen Miao <chenmiao.ku@gmail.com>
+
+  This program can be distributed under the terms of the GNU LGPLv2.
+  See the file COPYING.LIB.
+*/
+
+/**
+ * Mount startup benchmark
+ *
+ * Compares the two ways an unprivileged daemon gets its /dev/fuse
+ * descriptor: a fork and exec of a fusermount per mount, and a round
+ * trip to a copper_fuse_mount_helper over a kept connection.  Both
+ * privileged sides are local stand-ins that hand out /dev/null instead
+ * of mounting, the stand-in fusermount is this very program re-executed,
+ * a lower bound for the real one.  As root, real mounts of a temporary
+ * directory are timed too, directly and through the helper.
+ *
+ * usage: mount_startup [mounts] [threads]
+ */
+
+#include "bench_kernel.h"
+#include "copper_fuse_mnt_util.h"
+#include "copper_fuse_mount.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <string>
+#include <sys/mount.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#define FAKE_FUSERMOUNT "--fake-fusermount"
+
+static const char* self_path;
+
+/* The stand-in fusermount: pass /dev/null back over _FUSE_COMMFD */
+static int fake_fusermount() {
+	const char* env = getenv("_FUSE_COMMFD");
+	if (!env)
+		return 1;
+
+	int fd = open("/dev/null", O_RDWR);
+	int res = copper_fuse_mnt_send_fd(atoi(env), "", 1, fd);
+	return res == 0 ? 0 : 1;
+}
+
+/* What copper_fuse_kernel_mount() does without a helper */
+static int mount_fork_exec() {
+	int fds[2];
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == -1)
+		return -1;
+
+	pid_t pid = fork();
+	if (pid == 0) {
+		char env[16];
+		close(fds[1]);
+		snprintf(env, sizeof(env), "%i", fds[0]);
+		setenv("_FUSE_COMMFD", env, 1);
+		execl(self_path, self_path, FAKE_FUSERMOUNT, "-o", "rw,nosuid,nodev", "--", "/mnt", (char*)nullptr);
+		_exit(1);
+	}
+	close(fds[0]);
+
+	char c;
+	int fd = -1;
+	if (pid != -1)
+		copper_fuse_mnt_recv_fd(fds[1], &c, 1, &fd);
+	close(fds[1]);
+	if (pid != -1)
+		waitpid(pid, nullptr, 0);
+	return fd;
+}
+
+static void report(const char* name, std::vector<double>& lat, double total) {
+	std::sort(lat.begin(), lat.end());
+	printf("%-26s %8.1f us/mount  p50 %8.1f  p99 %8.1f  %9.0f mounts/s\n", name,
+		total / lat.size() * 1e6, lat[lat.size() / 2] * 1e6,
+		lat[lat.size() * 99 / 100] * 1e6, lat.size() / total);
+}
+
+template <typename F>
+static int run(const char* name, unsigned mounts, F mount_one) {
+	std::vector<double> lat;
+	lat.reserve(mounts);
+
+	auto start = bench_clock::now();
+	for (unsigned i = 0; i < mounts; i++) {
+		auto t = bench_clock::now();
+		int fd = mount_one();
+		if (fd < 0) {
+			fprintf(stderr, "%s: mount %u failed: %s\n", name, i, strerror(-fd));
+			return -1;
+		}
+		close(fd);
+		lat.push_back(sec_since(t));
+	}
+	report(name, lat, sec_since(start));
+	return 0;
+}
+
+template <typename F>
+static int run_concurrent(const char* name, unsigned mounts, unsigned threads, F mount_one) {
+	std::vector<std::vector<double>> lats(threads);
+	std::vector<std::thread> workers;
+	std::atomic<int> failed(0);
+
+	auto start = bench_clock::now();
+	for (unsigned t = 0; t < threads; t++) {
+		workers.emplace_back([&, t] {
+			for (unsigned i = t; i < mounts; i += threads) {
+				auto s = bench_clock::now();
+				int fd = mount_one();
+				if (fd < 0) {
+					failed.store(1);
+					return;
+				}
+				close(fd);
+				lats[t].push_back(sec_since(s));
+			}
+		});
+	}
+	for (auto& w : workers)
+		w.join();
+	double total = sec_since(start);
+	if (failed.load()) {
+		fprintf(stderr, "%s: a mount failed\n", name);
+		return -1;
+	}
+
+	std::vector<double> lat;
+	for (auto& l : lats)
+		lat.insert(lat.end(), l.begin(), l.end());
+	report(name, lat, total);
+	return 0;
+}
+
+int main(int argc, char* argv[]) {
+	if (argc > 1 && strcmp(argv[1], FAKE_FUSERMOUNT) == 0)
+		return fake_fusermount();
+
+	self_path = "/proc/self/exe";
+	unsigned mounts  = argc > 1 ? atoi(argv[1]) : 500;
+	unsigned threads = argc > 2 ? atoi(argv[2]) : 4;
+	if (!mounts || !threads) {
+		fprintf(stderr, "usage: %s [mounts] [threads]\n", argv[0]);
+		return 1;
+	}
+
+	char dir[] = "/tmp/mount_startup.XXXXXX";
+	if (!mkdtemp(dir)) {
+		perror("mkdtemp");
+		return 1;
+	}
+	std::string sock_path = std::string(dir) + "/helper.sock";
+	std::string mnt = std::string(dir) + "/mnt";
+	mkdir(mnt.c_str(), 0755);
+
+	/* The stand-in helper, checks are skipped along with the mount */
+	copper_fuse_mount_helper stand_in;
+	stand_in.mounter = [](const struct ucred*, const struct copper_fuse_mount_req*) {
+		int fd = open("/dev/null", O_RDWR | O_CLOEXEC);
+		return fd == -1 ? -errno : fd;
+	};
+	stand_in.unmounter = [](const struct ucred*, const char*) { return 0; };
+	int res = stand_in.listen(sock_path.c_str());
+	if (res < 0) {
+		fprintf(stderr, "listen: %s\n", strerror(-res));
+		return 1;
+	}
+	std::thread server([&] { stand_in.serve(); });
+
+	struct copper_fuse_mount_req req;
+	req.mountpoint = mnt;
+	req.kernel_opts = "allow_other,default_permissions";
+	req.fsname = "bench";
+	req.subtype = "bench";
+	req.flags = MS_NOSUID | MS_NODEV;
+
+	printf("%u mounts, %u threads for the concurrent runs\n", mounts, threads);
+	int err = 0;
+	err |= run("fork+exec fusermount", mounts, mount_fork_exec);
+	err |= run("helper round trip", mounts, [&] {
+		return copper_fuse_helper_mount(sock_path.c_str(), &req);
+	});
+	err |= run_concurrent("fork+exec, concurrent", mounts, threads, mount_fork_exec);
+	err |= run_concurrent("helper, concurrent", mounts, threads, [&] {
+		return copper_fuse_helper_mount(sock_path.c_str(), &req);
+	});
+
+	stand_in.exit();
+	server.join();
+
+	/* Real mounts, only possible with privileges and a fuse module */
+	int probe = open("/dev/fuse", O_RDWR | O_CLOEXEC);
+	if (geteuid() == 0 && probe != -1) {
+		copper_fuse_mount_helper real;
+		std::string real_sock = std::string(dir) + "/real.sock";
+		if (real.listen(real_sock.c_str()) == 0) {
+			std::thread real_server([&] { real.serve(); });
+			unsigned real_mounts = std::min(mounts, 200u);
+
+			err |= run("mount(2) + umount2", real_mounts, [&] {
+				int fd = copper_fuse_mount_sys(&req, 0, 0);
+				if (fd >= 0)
+					umount2(mnt.c_str(), MNT_DETACH);
+				return fd;
+			});
+			err |= run("helper mount + unmount", real_mounts, [&] {
+				int fd = copper_fuse_helper_mount(real_sock.c_str(), &req);
+				if (fd >= 0)
+					copper_fuse_helper_unmount(real_sock.c_str(), mnt.c_str());
+				return fd;
+			});
+
+			real.exit();
+			real_server.join();
+		}
+		unlink(real_sock.c_str());
+	} else {
+		printf("real mounts skipped, needs root and /dev/fuse\n");
+	}
+	if (probe != -1)
+		close(probe);
+
+	unlink(sock_path.c_str());
+	rmdir(mnt.c_str());
+	rmdir(dir);
+	return err ? 1 : 0;
+}
@@ -0,0 +1,218 @@
+/*
+  CopperFuse: C++ version Filesystem in Userspace
+  Copyright (C) 2023 Chen Miao <chenmiao.ku@gmail.com>
+
+  This program can be distributed under the terms of the GNU LGPLv2.
+  See the file COPYING.LIB.
+*/
+
+/**
+ * Node table benchmark
+ *
+ * Drives copper_fuse_node_table as the request threads of a busy mount
+ * would:
+ *
+ *   - lookups: every thread looks names up in a directory of its own
+ *     and forgets them, once straight on the table and once with every
+ *     call behind a single lock, as the table used to be;
+ *   - renames: one thread moves a directory between two parents while
+ *     the others build the path of a file deep under it, every path must
+ *     be one of the two the file really has;
+ *   - remember: `nodes` nodes are forgotten and remembered for long
+ *     enough to all be there, then expire on the timer wheel while
+ *     forgets keep coming; reports the slowest forgets, how long the
+ *     table took to shrink back and, for comparison, how long one pass
+ *     over it takes, which a periodic scan would pay every time.
+ *
+ * usage: node_table [threads] [nodes] [ops per thread]
+ */
+
+#include "bench_kernel.h"
+#include "copper_fuse_node.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+/* Each thread looks up and forgets names in its own directory */
+static double run_lookups(unsigned threads, unsigned ops, bool one_lock) {
+	copper_fuse_atom_table atoms;
+	copper_fuse_node_table table(&atoms);
+	std::mutex global;
+	std::vector<fuse_ino_t> dirs;
+	std::vector<std::string> names;
+
+	for (unsigned t = 0; t < threads; t++)
+		dirs.push_back(table.find(FUSE_ROOT_ID, ("d" + std::to_string(t)).c_str())->nodeid);
+	for (unsigned i = 0; i < 256; i++)
+		names.push_back("file" + std::to_string(i));
+
+	auto start = bench_clock::now();
+	std::vector<std::thread> workers;
+	for (unsigned t = 0; t < threads; t++) {
+		workers.emplace_back([&, t] {
+			std::string path;
+			for (unsigned i = 0; i < ops; i++) {
+				const char* name = names[i % names.size()].c_str();
+				std::unique_lock<std::mutex> guard(global, std::defer_lock);
+				if (one_lock)
+					guard.lock();
+				fuse_ino_t ino = table.find(dirs[t], name)->nodeid;
+				table.get_path(ino, nullptr, &path);
+				table.forget(ino, 1);
+			}
+		});
+	}
+	for (std::thread& w : workers)
+		w.join();
+	return sec_since(start);
+}
+
+/* /a/x/y/z/f moved to /b/x/y/z/f and back while its path is built */
+static bool run_renames(unsigned threads, unsigned ops, double* renames_per_sec,
+	double* paths_per_sec) {
+	copper_fuse_atom_table atoms;
+	copper_fuse_node_table table(&atoms);
+	fuse_ino_t a = table.find(FUSE_ROOT_ID, "a")->nodeid;
+	fuse_ino_t b = table.find(FUSE_ROOT_ID, "b")->nodeid;
+	fuse_ino_t x = table.find(a, "x")->nodeid;
+	fuse_ino_t y = table.find(x, "y")->nodeid;
+	fuse_ino_t z = table.find(y, "z")->nodeid;
+	fuse_ino_t file = table.find(z, "f")->nodeid;
+
+	std::atomic<bool> done(false);
+	std::atomic<uint64_t> paths(0), torn(0), renames(0);
+	auto start = bench_clock::now();
+
+	std::thread renamer([&] {
+		for (unsigned i = 0; i < ops; i++) {
+			if (i % 2 == 0)
+				table.rename(a, "x", b, "x", false);
+			else
+				table.rename(b, "x", a, "x", false);
+			renames++;
+		}
+		done = true;
+	});
+	std::vector<std::thread> readers;
+	for (unsigned t = 0; t < std::max(threads, 2u) - 1; t++) {
+		readers.emplace_back([&] {
+			std::string path;
+			while (!done) {
+				if (table.get_path(file, nullptr, &path) != 0 ||
+					(path != "/a/x/y/z/f" && path != "/b/x/y/z/f"))
+					torn++;
+				paths++;
+			}
+		});
+	}
+	renamer.join();
+	for (std::thread& r : readers)
+		r.join();
+
+	double secs = sec_since(start);
+	*renames_per_sec = renames / secs;
+	*paths_per_sec   = paths / secs;
+	return torn == 0;
+}
+
+struct remember_result {
+	double fill;
+	double worst_forget;
+	/* Forgets over 100 us */
+	uint64_t slow;
+	double drained;
+	double scan;
+	size_t scanned;
+	size_t left;
+};
+
+/* `nodes` forgotten and remembered for `remember` seconds, expired by the wheel as forgets go on */
+static void run_remember(unsigned nodes, int remember, struct remember_result* r) {
+	copper_fuse_atom_table atoms;
+	copper_fuse_node_table table(&atoms);
+	table.remember = remember;
+
+	const unsigned per_dir = 1000;
+	std::vector<fuse_ino_t> dirs;
+	for (unsigned d = 0; d * per_dir < nodes; d++)
+		dirs.push_back(table.find(FUSE_ROOT_ID, ("d" + std::to_string(d)).c_str())->nodeid);
+	size_t base = table.size();
+
+	auto start = bench_clock::now();
+	for (unsigned i = 0; i < nodes; i++) {
+		std::string name = "n" + std::to_string(i);
+		table.forget(table.find(dirs[i / per_dir], name.c_str())->nodeid, 1);
+	}
+	r->fill = sec_since(start);
+
+	/* What a periodic scan of the remembered nodes would cost, at the least */
+	start = bench_clock::now();
+	size_t seen = 0;
+	for (copper_fuse_node_table::id_shard& s : table.ids) {
+		std::lock_guard<std::mutex> guard(s.lock);
+		for (auto& it : s.nodes)
+			seen += it.second->nlookup.load() == 0;
+	}
+	r->scan = sec_since(start);
+
+	/* Requests go on, each forget expires a few */
+	fuse_ino_t churn = table.find(FUSE_ROOT_ID, "churn")->nodeid;
+	r->worst_forget = 0;
+	r->slow = 0;
+	start = bench_clock::now();
+	while (table.size() > base + 1 && sec_since(start) < 2 * remember + 30) {
+		table.find(FUSE_ROOT_ID, "churn");
+		auto t = bench_clock::now();
+		table.forget(churn, 1);
+		double took = sec_since(t);
+		r->worst_forget = std::max(r->worst_forget, took);
+		r->slow += took > 100e-6;
+	}
+	r->drained = sec_since(start);
+	r->left = table.size() - base - 1;
+	r->scanned = seen;
+}
+
+int main(int argc, char* argv[]) {
+	unsigned threads = argc > 1 ? atoi(argv[1]) : 4;
+	unsigned nodes   = argc > 2 ? atoi(argv[2]) : 1000000;
+	unsigned ops     = argc > 3 ? atoi(argv[3]) : 200000;
+	if (!threads || !nodes || !ops) {
+		fprintf(stderr, "usage: %s [threads] [nodes] [ops per thread]\n", argv[0]);
+		return 1;
+	}
+
+	printf("%u threads, %u ops per thread\n", threads, ops);
+	double one = run_lookups(threads, ops, true);
+	double sharded = run_lookups(threads, ops, false);
+	printf("%-28s %9.1f ms %9.2f Mops/s\n", "lookups, one lock", one * 1e3,
+		threads * (double)ops / one / 1e6);
+	printf("%-28s %9.1f ms %9.2f Mops/s\n", "lookups, sharded", sharded * 1e3,
+		threads * (double)ops / sharded / 1e6);
+
+	double renames, paths;
+	bool intact = run_renames(threads, ops, &renames, &paths);
+	printf("%-28s %9.0f renames/s %9.0f paths/s %s\n", "renames under get_path()", renames, paths,
+		intact ? "intact" : "TORN");
+
+	/* Long enough for all of them to be there before the first expires */
+	int remember = 1 + nodes / 250000;
+	struct remember_result r;
+	run_remember(nodes, remember, &r);
+	printf("%u nodes remembered for %d s\n", nodes, remember);
+	printf("%-28s %9.1f ms\n", "looked up and forgotten", r.fill * 1e3);
+	printf("%-28s %9.1f ms, %zu nodes\n", "one pass over the table", r.scan * 1e3, r.scanned);
+	printf("%-28s %9.1f ms\n", "until all expired", r.drained * 1e3);
+	printf("%-28s %9.3f ms, %llu over 100 us\n", "slowest forget", r.worst_forget * 1e3,
+		(unsigned long long)r.slow);
+	printf("%-28s %9zu\n", "left over", r.left);
+	return intact && !r.left ? 0 : 1;
+}
@@ -0,0 +1,352 @@
+/*
+  CopperFuse: C++ version Filesystem in Userspace
+  Copyright (C) 2023 Chen Miao <chenmiao.ku@gmail.com>
+
+  This program can be distributed under the terms of the GNU LGPLv2.
+  See the file COPYING.LIB.
+*/
+
+/**
+ * Path and name kernel benchmark
+ *
+ * Builds a synthetic tree whose names follow what real filesystems
+ * hold: short source and directory names, versioned library names,
+ * hex object ids as in git or content addressed stores, camera style
+ * names and the odd name close to NAME_MAX.  Paths are 1 to 16 levels
+ * deep, most of them 3 to 6.  On those, times each kernel set the CPU
+ * has against libc:
+ *
+ *   len     strlen() of names and of whole paths
+ *   hash    std::hash<std::string_view> of names
+ *   split   memchr() for '/' along a path, component by component
+ *   cmp     memcmp() of names against a sibling sharing a prefix
+ *   equal   name equality with std::string_view ==, against interned
+ *           atoms compared by pointer
+ *   join    a path rebuilt from its components with push_back() and
+ *           append(), against one reserve() and copper_fuse_path_join()
+ *
+ * Results of every kernel set are checked against libc first, times
+ * are the best of three rounds of `repeat` passes.  The default set is
+ * small enough to stay in cache, as the names of requests being served
+ * are; a large one with a single pass shows the cost of the misses.
+ *
+ * usage: path_simd [paths] [repeat]
+ */
+
+#include "bench_kernel.h"
+#include "copper_fuse_path.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <random>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#define ROUNDS 3
+
+static volatile uint64_t sink;
+static unsigned repeat;
+
+static const char* const words[] = {
+	"src", "include", "lib", "bin", "doc", "test", "tests", "build", "usr", "share",
+	"home", "etc", "var", "log", "cache", "tmp", "node_modules", "vendor", "target",
+	"debug", "release", "objects", "refs", "heads", ".git", "config", "Makefile",
+	"README.md", "LICENSE", "index.html", "main.cc", "copper_fuse_lowlevel.cc",
+	"copper_fuse_lowlevel.h", "package.json", "__init__.py", "CMakeLists.txt",
+};
+
+static const char* const exts[] = {
+	".c", ".h", ".cc", ".py", ".js", ".o", ".so", ".txt", ".json", ".jpg", ".log",
+};
+
+static std::string make_name(std::mt19937_64& rng) {
+	char buf[256];
+	unsigned kind = rng() % 100;
+
+	if (kind < 40)
+		return words[rng() % (sizeof(words) / sizeof(words[0]))];
+	if (kind < 65) {
+		snprintf(buf, sizeof(buf), "%s_%u%s", words[rng() % (sizeof(words) / sizeof(words[0]))],
+			(unsigned)(rng() % 1000), exts[rng() % (sizeof(exts) / sizeof(exts[0]))]);
+		return buf;
+	}
+	if (kind < 75) {
+		snprintf(buf, sizeof(buf), "libcopper-%u.%u.%u.so.%u", (unsigned)(rng() % 4),
+			(unsigned)(rng() % 20), (unsigned)(rng() % 10), (unsigned)(rng() % 3));
+		return buf;
+	}
+	if (kind < 90) {
+		/* An object id, 38 hex digits below a two digit fan-out */
+		std::string id;
+		for (int i = 0; i < 38; i++)
+			id.push_back("0123456789abcdef"[rng() % 16]);
+		return id;
+	}
+	if (kind < 99) {
+		snprintf(buf, sizeof(buf), "IMG_2023%02u%02u_%06u.jpg", (unsigned)(rng() % 12 + 1),
+			(unsigned)(rng() % 28 + 1), (unsigned)(rng() % 1000000));
+		return buf;
+	}
+	return std::string(200 + rng() % 55, 'n');
+}
+
+static unsigned make_depth(std::mt19937_64& rng) {
+	std::binomial_distribution<unsigned> d(15, 0.28);
+	return 1 + d(rng);
+}
+
+struct sample {
+	std::vector<std::string> parts;
+	std::string path;
+};
+
+template <typename F>
+static double time_ns(size_t ops, F body) {
+	double best = 1e18;
+	for (int r = 0; r < ROUNDS; r++) {
+		auto start = bench_clock::now();
+		for (unsigned i = 0; i < repeat; i++)
+			body();
+		best = std::min(best, sec_since(start) * 1e9);
+	}
+	return best / ops / repeat;
+}
+
+static int sign(int v) {
+	return (v > 0) - (v < 0);
+}
+
+static int libc_cmp(const std::string& a, const std::string& b) {
+	int res = memcmp(a.data(), b.data(), std::min(a.size(), b.size()));
+	return res ? res : a.size() < b.size() ? -1 : a.size() > b.size();
+}
+
+static bool check(const copper_fuse_path_kernels* k, const std::vector<std::string>& names,
+		const std::vector<sample>& samples) {
+	uint64_t want = copper_fuse_path_ops("scalar")->hash(names[0].data(), names[0].size());
+
+	for (size_t i = 0; i < names.size(); i++) {
+		const std::string& a = names[i];
+		const std::string& b = names[(i * 7 + 1) % names.size()];
+		if (k->len(a.c_str()) != a.size() || sign(k->cmp(a.data(), a.size(), b.data(), b.size())) !=
+				sign(libc_cmp(a, b))) {
+			fprintf(stderr, "%s: wrong result for \"%s\"\n", k->isa, a.c_str());
+			return false;
+		}
+	}
+	if (k->hash(names[0].data(), names[0].size()) != want) {
+		fprintf(stderr, "%s: hash differs from the scalar one\n", k->isa);
+		return false;
+	}
+	for (const sample& s : samples) {
+		const char* p = s.path.data();
+		const char* end = p + s.path.size();
+		while (p < end) {
+			const char* want_sep = (const char*)memchr(p, '/', end - p);
+			const char* got = k->sep(p, end - p);
+			if (got != want_sep) {
+				fprintf(stderr, "%s: wrong separator in \"%s\"\n", k->isa, s.path.c_str());
+				return false;
+			}
+			p = got ? got + 1 : end;
+		}
+	}
+	return true;
+}
+
+int main(int argc, char* argv[]) {
+	size_t count = argc > 1 ? atol(argv[1]) : 1000;
+	repeat = argc > 2 ? atoi(argv[2]) : 200;
+	if (!count || !repeat) {
+		fprintf(stderr, "usage: %s [paths] [repeat]\n", argv[0]);
+		return 1;
+	}
+
+	std::mt19937_64 rng(42);
+	std::vector<sample> samples(count);
+	std::vector<std::string> names;
+	size_t path_bytes = 0, depth_sum = 0;
+	for (sample& s : samples) {
+		unsigned depth = make_depth(rng);
+		for (unsigned i = 0; i < depth; i++) {
+			s.parts.push_back(make_name(rng));
+			s.path += "/" + s.parts.back();
+			names.push_back(s.parts.back());
+		}
+		path_bytes += s.path.size();
+		depth_sum += depth;
+	}
+	/* Siblings: a name and a variant differing in its last byte */
+	std::vector<std::string> siblings(names);
+	for (std::string& n : siblings)
+		n.back() ^= 1;
+	size_t name_bytes = 0;
+	for (const std::string& n : names)
+		name_bytes += n.size();
+
+	printf("%zu paths x %u, %.1f levels, %.1f bytes per path, %.1f bytes per name\n", count, repeat,
+		(double)depth_sum / count, (double)path_bytes / count, (double)name_bytes / names.size());
+
+	std::vector<const copper_fuse_path_kernels*> sets;
+	for (const char* isa : { "scalar", "sse4.2", "avx2" }) {
+		const copper_fuse_path_kernels* k = copper_fuse_path_ops(isa);
+		if (!k)
+			continue;
+		if (!check(k, names, samples))
+			return 1;
+		sets.push_back(k);
+	}
+	printf("%-8s %10s", "ns/op", "libc");
+	for (const copper_fuse_path_kernels* k : sets)
+		printf(" %10s", k->isa);
+	printf("\n");
+
+	/* len: names, then whole paths */
+	printf("%-8s %10.2f", "len name", time_ns(names.size(), [&] {
+		uint64_t sum = 0;
+		for (const std::string& n : names)
+			sum += strlen(n.c_str());
+		sink = sum;
+	}));
+	for (const copper_fuse_path_kernels* k : sets)
+		printf(" %10.2f", time_ns(names.size(), [&] {
+			uint64_t sum = 0;
+			for (const std::string& n : names)
+				sum += k->len(n.c_str());
+			sink = sum;
+		}));
+	printf("\n%-8s %10.2f", "len path", time_ns(count, [&] {
+		uint64_t sum = 0;
+		for (const sample& s : samples)
+			sum += strlen(s.path.c_str());
+		sink = sum;
+	}));
+	for (const copper_fuse_path_kernels* k : sets)
+		printf(" %10.2f", time_ns(count, [&] {
+			uint64_t sum = 0;
+			for (const sample& s : samples)
+				sum += k->len(s.path.c_str());
+			sink = sum;
+		}));
+
+	printf("\n%-8s %10.2f", "hash", time_ns(names.size(), [&] {
+		uint64_t sum = 0;
+		for (const std::string& n : names)
+			sum += std::hash<std::string_view>()(n);
+		sink = sum;
+	}));
+	for (const copper_fuse_path_kernels* k : sets)
+		printf(" %10.2f", time_ns(names.size(), [&] {
+			uint64_t sum = 0;
+			for (const std::string& n : names)
+				sum += k->hash(n.data(), n.size());
+			sink = sum;
+		}));
+
+	/* split: every component of every path, per path */
+	printf("\n%-8s %10.2f", "split", time_ns(count, [&] {
+		uint64_t sum = 0;
+		for (const sample& s : samples) {
+			const char* p = s.path.data() + 1;
+			const char* end = s.path.data() + s.path.size();
+			while (const char* sep = (const char*)memchr(p, '/', end - p)) {
+				sum += sep - p;
+				p = sep + 1;
+			}
+		}
+		sink = sum;
+	}));
+	for (const copper_fuse_path_kernels* k : sets)
+		printf(" %10.2f", time_ns(count, [&] {
+			uint64_t sum = 0;
+			for (const sample& s : samples) {
+				const char* p = s.path.data() + 1;
+				const char* end = s.path.data() + s.path.size();
+				while (const char* sep = k->sep(p, end - p)) {
+					sum += sep - p;
+					p = sep + 1;
+				}
+			}
+			sink = sum;
+		}));
+
+	printf("\n%-8s %10.2f", "cmp", time_ns(names.size(), [&] {
+		int64_t sum = 0;
+		for (size_t i = 0; i < names.size(); i++)
+			sum += libc_cmp(names[i], siblings[i]);
+		sink = sum;
+	}));
+	for (const copper_fuse_path_kernels* k : sets)
+		printf(" %10.2f", time_ns(names.size(), [&] {
+			int64_t sum = 0;
+			for (size_t i = 0; i < names.size(); i++)
+				sum += k->cmp(names[i].data(), names[i].size(), siblings[i].data(), siblings[i].size());
+			sink = sum;
+		}));
+
+	/* equal: the name against itself in another buffer, then as atoms */
+	std::vector<std::string> copies(names);
+	copper_fuse_atom_table atoms;
+	std::vector<copper_fuse_atom_ref> refs, refs2;
+	refs.reserve(names.size());
+	refs2.reserve(names.size());
+	auto intern_start = bench_clock::now();
+	for (const std::string& n : names)
+		refs.push_back(atoms.intern(n.data(), n.size()));
+	double intern_ns = sec_since(intern_start) * 1e9;
+	/* Every name is known by now */
+	intern_start = bench_clock::now();
+	for (const std::string& n : copies)
+		refs2.push_back(atoms.intern(n.c_str()));
+	double hit_ns = sec_since(intern_start) * 1e9;
+	printf("\n%-8s %10.2f", "equal", time_ns(names.size(), [&] {
+		uint64_t sum = 0;
+		for (size_t i = 0; i < names.size(); i++)
+			sum += std::string_view(names[i]) == std::string_view(copies[i]);
+		sink = sum;
+	}));
+	printf(" %10.2f (atoms, any kernels)", time_ns(names.size(), [&] {
+		uint64_t sum = 0;
+		for (size_t i = 0; i < refs.size(); i++)
+			sum += refs[i] == refs2[i];
+		sink = sum;
+	}));
+	printf("\n%-8s %10s %10.2f ns per name, %zu distinct of %zu, %.2f ns once known\n", "intern", "",
+		intern_ns / names.size(), atoms.size(), names.size(), hit_ns / names.size());
+
+	/* join: how get_path() rebuilds the path of a node */
+	std::string path;
+	printf("%-8s %10.2f", "join", time_ns(count, [&] {
+		uint64_t sum = 0;
+		for (const sample& s : samples) {
+			std::string p;
+			for (const std::string& part : s.parts) {
+				p.push_back('/');
+				p.append(part);
+			}
+			sum += p.size();
+		}
+		sink = sum;
+	}));
+	printf(" %10.2f (reserve + join)\n", time_ns(count, [&] {
+		uint64_t sum = 0;
+		for (const sample& s : samples) {
+			std::string p;
+			size_t len = 0;
+			for (const std::string& part : s.parts)
+				len += 1 + part.size();
+			p.reserve(len);
+			for (const std::string& part : s.parts)
+				copper_fuse_path_join(&p, part.data(), part.size());
+			sum += p.size();
+		}
+		sink = sum;
+	}));
+	printf("\nkernels in use: %s\n", copper_fuse_path_ops()->isa);
+	return 0;
+}
@@ -0,0 +1,176 @@
+/*
+  CopperFuse: C++ version Filesystem in Userspace
+  Copyright (C) 2023 Chen Miao <chenmiao.ku@gmail.com>
+
+  This program can be distributed under the terms of the GNU LGPLv2.
+  See the file COPYING.LIB.
+*/
+
+/**
+ * Permission check benchmark
+ *
+ * Measures what the library's permission engine adds to the hot paths
+ * the check_permissions option guards:
+ *
+ *   getattr: refreshing the cached owner and mode of a node
+ *   open:    the cached node plus the decision, for callers in the
+ *            owner, other and group classes, the last one against the
+ *            primary group, a supplementary group and an ACL entry
+ *
+ * and compares them with deciding from a fresh read of the caller's
+ * groups from /proc, which is what a filesystem doing its own checks
+ * would need per request.  Running as root, the benchmark gives itself
+ * a few supplementary groups first so there are some to find.
+ *
+ * usage: perm_check [iterations]
+ */
+
+#include "bench_kernel.h"
+#include "copper_fuse_perm.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <endian.h>
+#include <grp.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <vector>
+
+#define NODES 4096
+#define CALLER_UID 1000
+#define CALLER_GID 1000
+#define OWNER_UID 2000
+#define OWNER_GID 2000
+#define SUPP_GID 3003
+
+static volatile int sink;
+
+template <typename F>
+static double per_op(unsigned iters, F fn) {
+	auto start = bench_clock::now();
+	for (unsigned i = 0; i < iters; i++)
+		fn(i);
+	return sec_since(start) * 1e9 / iters;
+}
+
+/* The attribute value of an ACL giving SUPP_GID read access */
+static std::string acl_value() {
+	const uint16_t entries[][2] = {
+		{ COPPER_FUSE_ACL_USER_OBJ, 6 }, { COPPER_FUSE_ACL_GROUP_OBJ, 0 },
+		{ COPPER_FUSE_ACL_GROUP, 4 }, { COPPER_FUSE_ACL_MASK, 4 }, { COPPER_FUSE_ACL_OTHER, 0 },
+	};
+	std::string value;
+	uint32_t version = htole32(2);
+	value.append((const char*)&version, sizeof(version));
+	for (const auto& e : entries) {
+		uint16_t tag = htole16(e[0]), perm = htole16(e[1]);
+		uint32_t id = htole32(e[0] == COPPER_FUSE_ACL_GROUP ? SUPP_GID : (uint32_t)-1);
+		value.append((const char*)&tag, sizeof(tag));
+		value.append((const char*)&perm, sizeof(perm));
+		value.append((const char*)&id, sizeof(id));
+	}
+	return value;
+}
+
+int main(int argc, char* argv[]) {
+	unsigned iters = argc > 1 ? atoi(argv[1]) : 1000000;
+	if (!iters) {
+		fprintf(stderr, "usage: %s [iterations]\n", argv[0]);
+		return 1;
+	}
+
+	if (getuid() == 0) {
+		const gid_t groups[] = { 3001, 3002, SUPP_GID, 3004 };
+		if (setgroups(4, groups) == -1)
+			perror("setgroups");
+	}
+	pid_t tid = syscall(SYS_gettid);
+
+	copper_fuse_groups_cache groups;
+	copper_fuse_perm_cache perms(3600);
+	auto acl = std::make_shared<copper_fuse_acl>();
+	std::string value = acl_value();
+	if (acl->parse(value.data(), value.size()) != 0) {
+		fprintf(stderr, "ACL does not parse\n");
+		return 1;
+	}
+
+	/* Node i: 0640 owned by OWNER, group of the node depends on the case */
+	struct stat st;
+	memset(&st, 0, sizeof(st));
+	st.st_mode = S_IFREG | 0640;
+	st.st_uid = OWNER_UID;
+	st.st_gid = OWNER_GID;
+	for (fuse_ino_t ino = 1; ino <= NODES; ino++)
+		perms.update(ino, &st);
+
+	double getattr_ns = per_op(iters, [&](unsigned i) {
+		perms.update(1 + i % NODES, &st);
+	});
+
+	struct bench_case {
+		const char* name;
+		uid_t uid;
+		gid_t node_gid;
+		mode_t mode;
+		bool acl;
+		int expect;
+	};
+	const struct bench_case cases[] = {
+		{ "owner",                 OWNER_UID,  OWNER_GID,  0640, false, 0 },
+		{ "other, denied",         CALLER_UID, OWNER_GID,  0640, false, -EACCES },
+		{ "primary group",         CALLER_UID, CALLER_GID, 0640, false, 0 },
+		{ "supplementary group",   CALLER_UID, SUPP_GID,   0640, false, 0 },
+		{ "ACL group entry",       CALLER_UID, OWNER_GID,  0640, true,  0 },
+	};
+
+	printf("%u iterations, %d groups for tid %d\n", iters,
+		groups.get(tid, CALLER_UID, CALLER_GID, 0, nullptr), (int)tid);
+	printf("%-24s %12s\n", "", "ns/op");
+	printf("%-24s %12.1f\n", "getattr: refresh node", getattr_ns);
+
+	for (const struct bench_case& c : cases) {
+		st.st_mode = S_IFREG | c.mode;
+		st.st_gid = c.node_gid;
+		for (fuse_ino_t ino = 1; ino <= NODES; ino++) {
+			perms.update(ino, &st);
+			uint64_t version;
+			copper_fuse_perm_node node;
+			perms.lookup(ino, &node, &version);
+			perms.set_acl(ino, version, c.acl ? acl : nullptr);
+		}
+
+		int res = 0;
+		double ns = per_op(iters, [&](unsigned i) {
+			copper_fuse_perm_node node;
+			uint64_t version;
+			perms.lookup(1 + i % NODES, &node, &version);
+			copper_fuse_cred cred(c.uid, CALLER_GID, tid, &groups);
+			res = copper_fuse_perm_check(node.mode, node.uid, node.gid, node.acl.get(), &cred, R_OK);
+			sink = res;
+		});
+		if (res != c.expect && !(getuid() != 0 && c.node_gid == SUPP_GID)) {
+			fprintf(stderr, "%s: got %d, expected %d\n", c.name, res, c.expect);
+			return 1;
+		}
+		char label[64];
+		snprintf(label, sizeof(label), "open: %s", c.name);
+		printf("%-24s %12.1f\n", label, ns);
+	}
+
+	/* The same supplementary group decision, reading /proc every time */
+	unsigned slow = std::max(iters / 100, 1u);
+	double proc_ns = per_op(slow, [&](unsigned) {
+		std::vector<gid_t> list;
+		copper_fuse_read_groups(tid, &list);
+		bool member = false;
+		for (gid_t g : list)
+			member |= g == SUPP_GID;
+		sink = member;
+	});
+	printf("%-24s %12.1f\n", "open: /proc per request", proc_ns);
+	return 0;
+}
@@ -0,0 +1,274 @@
+/*
+  CopperFuse: C++ version Filesystem in Userspace
+  Copyright (C) 2023 Chen Miao <chenmiao.ku@gmail.com>
+
+  This program can be distributed under the terms of the GNU LGPLv2.
+  See the file COPYING.LIB.
+*/
+
+/**
+ * Directory listing benchmark
+ *
+ * A high-level filesystem whose root holds `entries` files and whose
+ * ->readdir() works in offset mode: it has to walk the listing up to
+ * the offset it is asked to resume from, as a backend paging through a
+ * remote or on-disk directory does.
+ *
+ *   per-call:  ->readdir() once per READDIR reply, from its offset, the
+ *              way a listing is served without a snapshot
+ *   snapshot:  OPENDIR, READDIR until the end, RELEASEDIR through the
+ *              library, which lists the directory once per handle
+ *   shared:    `openers` handles listing the directory side by side
+ *              while a first one is open, then again after it changed
+ *
+ * and reports the backend calls and the entries the backend walked.
+ * The per-call case walks entries^2 / (2 * entries per reply) entries,
+ * so it only runs up to 100K entries unless asked for.
+ *
+ * usage: readdir_snapshot [entries] [openers] [per-call limit]
+ */
+
+#include "bench_kernel.h"
+#include "copper_fuse.h"
+#include "copper_fuse_i.h"
+#include "copper_fuse_lowlevel.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <sys/socket.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+/* What the kernel asks for at a time */
+#define REPLY_SIZE 4096
+
+struct bench_fs {
+	unsigned entries;
+	/* Bumped to change the directory behind the library's back */
+	std::atomic<long> version;
+	std::atomic<uint64_t> calls;
+	std::atomic<uint64_t> walked;
+};
+
+static struct copper_fuse_operations bench_ops(bench_fs* fs) {
+	struct copper_fuse_operations op;
+
+	op.getattr = [fs](const char* path, struct stat* st, struct fuse_file_info*) {
+		memset(st, 0, sizeof(*st));
+		if (strcmp(path, "/") != 0)
+			return -ENOENT;
+		st->st_mode = S_IFDIR | 0755;
+		st->st_nlink = 2;
+		st->st_size = fs->entries;
+		st->st_mtim.tv_sec = st->st_ctim.tv_sec = 1700000000 + fs->version.load();
+		return 0;
+	};
+	op.readdir = [fs](const char*, void* buf, fuse_fill_dir_t filler, off_t off,
+		struct fuse_file_info*, enum fuse_readdir_flags) {
+		struct stat st;
+		char name[32];
+		memset(&st, 0, sizeof(st));
+		st.st_mode = S_IFREG;
+		fs->calls++;
+		/* Paging to `off` means walking what comes before it */
+		uint64_t walked = 0;
+		for (unsigned i = 0; i < fs->entries; i++) {
+			snprintf(name, sizeof(name), "file-%08u", i);
+			walked++;
+			if (i < (uint64_t)off)
+				continue;
+			if (filler(buf, name, &st, i + 1, (enum fuse_fill_dir_flags)0))
+				break;
+		}
+		fs->walked += walked;
+		return 0;
+	};
+	return op;
+}
+
+/* A READDIR reply: how many entries, and the offset to resume from */
+static unsigned parse_dirents(const char* buf, size_t size, uint64_t* off) {
+	unsigned count = 0;
+	for (size_t pos = 0; pos < size; count++) {
+		const struct fuse_dirent* d = (const struct fuse_dirent*)(buf + pos);
+		*off = d->off;
+		pos += FUSE_DIRENT_SIZE(d);
+	}
+	return count;
+}
+
+struct dir_cursor {
+	uint64_t fh;
+	uint64_t off;
+	uint64_t seen;
+	bool done;
+};
+
+/* List every cursor to the end, one READDIR of each in flight at a time */
+static void list_all(bench_kernel* k, std::vector<dir_cursor>* cursors, std::vector<char>* out) {
+	struct fuse_read_in read_in;
+	memset(&read_in, 0, sizeof(read_in));
+	read_in.size = REPLY_SIZE;
+
+	for (;;) {
+		std::vector<std::pair<uint64_t, dir_cursor*>> inflight;
+		for (dir_cursor& c : *cursors) {
+			if (c.done)
+				continue;
+			read_in.fh = c.fh;
+			read_in.offset = c.off;
+			inflight.push_back({ k->send(FUSE_READDIR, FUSE_ROOT_ID, &read_in, sizeof(read_in)), &c });
+		}
+		if (inflight.empty())
+			return;
+		for (size_t i = 0; i < inflight.size(); i++) {
+			const struct fuse_out_header* hdr = k->recv(out);
+			size_t size = hdr->error ? 0 : bench_reply_size(*out);
+			dir_cursor* c = nullptr;
+			for (auto& it : inflight)
+				if (it.first == hdr->unique)
+					c = it.second;
+			/* A failed one ends short, and the count of entries tells */
+			if (!size)
+				c->done = true;
+			c->seen += parse_dirents(bench_reply_body(*out), size, &c->off);
+		}
+	}
+}
+
+static uint64_t opendir(bench_kernel* k, std::vector<char>* out) {
+	struct fuse_open_in open_in;
+	memset(&open_in, 0, sizeof(open_in));
+	return ((const struct fuse_open_out*)k->call(FUSE_OPENDIR, FUSE_ROOT_ID, &open_in,
+		sizeof(open_in), out))->fh;
+}
+
+static void releasedir(bench_kernel* k, uint64_t fh, std::vector<char>* out) {
+	struct fuse_release_in release_in;
+	memset(&release_in, 0, sizeof(release_in));
+	release_in.fh = fh;
+	k->call(FUSE_RELEASEDIR, FUSE_ROOT_ID, &release_in, sizeof(release_in), out);
+}
+
+static void report(const char* name, double seconds, uint64_t listed, bench_fs* fs) {
+	printf("%-28s %10.1f %12llu %16llu %12llu\n", name, seconds * 1e3,
+		(unsigned long long)fs->calls.load(), (unsigned long long)fs->walked.load(),
+		(unsigned long long)listed);
+	fs->calls = 0;
+	fs->walked = 0;
+}
+
+int main(int argc, char* argv[]) {
+	unsigned entries = argc > 1 ? atoi(argv[1]) : 1000000;
+	unsigned openers = argc > 2 ? atoi(argv[2]) : 8;
+	unsigned limit   = argc > 3 ? atoi(argv[3]) : 100000;
+	if (!entries || !openers) {
+		fprintf(stderr, "usage: %s [entries] [openers] [per-call limit]\n", argv[0]);
+		return 1;
+	}
+
+	bench_fs fs;
+	fs.entries = entries;
+	fs.version = 0;
+	fs.calls = 0;
+	fs.walked = 0;
+	struct copper_fuse_operations op = bench_ops(&fs);
+
+	printf("%u entries, %u bytes per READDIR\n", entries, REPLY_SIZE);
+	printf("%-28s %10s %12s %16s %12s\n", "", "ms", "backend calls", "entries walked", "listed");
+
+	/* Per-call: what each READDIR costs when nothing is kept between them */
+	if (entries <= limit) {
+		std::vector<char> buf(REPLY_SIZE);
+		uint64_t off = 0, listed = 0;
+		auto start = bench_clock::now();
+		for (;;) {
+			size_t used = 0;
+			fuse_fill_dir_t filler = [&](void*, const char* name, const struct stat* st,
+				off_t next, enum fuse_fill_dir_flags) {
+				size_t res = copper_fuse_add_direntry(buf.data() + used, buf.size() - used, name,
+					strlen(name), 0xffffffff, st->st_mode, next);
+				if (res > buf.size() - used)
+					return 1;
+				used += res;
+				return 0;
+			};
+			op.readdir("/", nullptr, filler, off, nullptr, (enum fuse_readdir_flags)0);
+			if (!used)
+				break;
+			listed += parse_dirents(buf.data(), used, &off);
+		}
+		report("per-call", sec_since(start), listed, &fs);
+	} else {
+		printf("%-28s %10s\n", "per-call", "skipped");
+	}
+
+	int sv[2];
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv) == -1) {
+		perror("socketpair");
+		return 1;
+	}
+
+	char prog[] = "readdir_snapshot";
+	char* fuse_argv[] = { prog, nullptr };
+	copper_fuse_args args(1, fuse_argv);
+	copper_fuse* fuse = new copper_fuse(&op, nullptr);
+	if (fuse->init(&args) == -1)
+		return 1;
+	fuse->se->set_fd(sv[1]);
+
+	struct copper_fuse_loop_config config;
+	memset(&config, 0, sizeof(config));
+	config.max_idle_threads = 10;
+	config.max_threads = 4;
+	std::thread loop([&] { fuse->loop_mt(&config); });
+
+	bench_kernel k(sv[0]);
+	std::vector<char> out(1 << 20);
+	k.init(&out, 0);
+
+	/* One handle, listed through the library */
+	auto start = bench_clock::now();
+	std::vector<dir_cursor> first = { { opendir(&k, &out), 0, 0, false } };
+	list_all(&k, &first, &out);
+	report("snapshot", sec_since(start), first[0].seen, &fs);
+
+	/* More handles while the first is open, then after a change */
+	for (int changed = 0; changed < 2; changed++) {
+		if (changed)
+			fs.version++;
+		std::vector<dir_cursor> more(openers);
+		start = bench_clock::now();
+		for (dir_cursor& c : more)
+			c = { opendir(&k, &out), 0, 0, false };
+		list_all(&k, &more, &out);
+		uint64_t listed = 0;
+		for (dir_cursor& c : more) {
+			listed += c.seen;
+			if (c.seen != entries) {
+				fprintf(stderr, "listed %llu of %u entries\n", (unsigned long long)c.seen, entries);
+				return 1;
+			}
+			releasedir(&k, c.fh, &out);
+		}
+		char label[64];
+		snprintf(label, sizeof(label), "shared, %u openers%s", openers, changed ? ", changed" : "");
+		report(label, sec_since(start), listed, &fs);
+	}
+	releasedir(&k, first[0].fh, &out);
+
+	close(sv[0]);
+	loop.join();
+	delete fuse;
+
+	if (first[0].seen != entries) {
+		fprintf(stderr, "listed %llu of %u entries\n", (unsigned long long)first[0].seen, entries);
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,260 @@
+/*
+  CopperFuse: C++ version Filesystem in Userspace
+  Copyright (C) 2023 Chen Miao <chenmiao.ku@gmail.com>
+
+  This program can be distributed under the terms of the GNU LGPLv2.
+  See the file COPYING.LIB.
+*/
+
+/**
+ * Reply builder benchmark
+ *
+ * Sends small replies to a SOCK_SEQPACKET socketpair drained by another
+ * thread, each put together three ways:
+ *
+ *   copy + write   every piece copied into one buffer, then write()
+ *   iovec each     a segment per piece in a fresh array, then writev()
+ *   builder        copper_fuse_reply_builder, small pieces coalesced
+ *                  behind the header, then send_msg()
+ *
+ * for an attr sized reply, a run of dirent records and a mix of small
+ * pieces around a 4 KiB one.  Then poll wakeups, one send_msg() each
+ * versus a copper_fuse_notify_batch.  Syscalls are counted by
+ * interposing write(), writev() and sendmmsg(), times are the best of
+ * three rounds.
+ *
+ * usage: reply_builder [replies]
+ */
+
+#include "bench_kernel.h"
+#include "copper_fuse_kernel.h"
+#include "copper_fuse_lowlevel.h"
+#include "copper_fuse_reply.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+static std::atomic<uint64_t> syscalls(0);
+
+extern "C" ssize_t write(int fd, const void* buf, size_t count) {
+	syscalls.fetch_add(1, std::memory_order_relaxed);
+	return syscall(SYS_write, fd, buf, count);
+}
+
+extern "C" ssize_t writev(int fd, const struct iovec* iov, int iovcnt) {
+	syscalls.fetch_add(1, std::memory_order_relaxed);
+	return syscall(SYS_writev, fd, iov, iovcnt);
+}
+
+extern "C" int sendmmsg(int fd, struct mmsghdr* msgs, unsigned int vlen, int flags) {
+	syscalls.fetch_add(1, std::memory_order_relaxed);
+	return syscall(SYS_sendmmsg, fd, msgs, vlen, flags);
+}
+
+struct piece {
+	const char* data;
+	size_t size;
+};
+
+struct shape {
+	const char* name;
+	std::vector<piece> pieces;
+};
+
+static int out_fd;
+
+static void send_copy(const shape& s, uint64_t unique) {
+	static thread_local std::vector<char> buf;
+	struct fuse_out_header out;
+	size_t len = sizeof(out);
+
+	for (const piece& p : s.pieces)
+		len += p.size;
+	if (buf.size() < len)
+		buf.resize(len);
+
+	out.unique = unique;
+	out.error  = 0;
+	out.len    = len;
+	memcpy(buf.data(), &out, sizeof(out));
+	size_t off = sizeof(out);
+	for (const piece& p : s.pieces) {
+		memcpy(&buf[off], p.data, p.size);
+		off += p.size;
+	}
+	write(out_fd, buf.data(), len);
+}
+
+/* What reply_iov() did: a fresh array, the header in front */
+static void send_iovec(const shape& s, uint64_t unique) {
+	struct fuse_out_header out;
+	std::unique_ptr<struct iovec[]> iov(new struct iovec[s.pieces.size() + 1]);
+
+	out.unique = unique;
+	out.error  = 0;
+	out.len    = sizeof(out);
+	iov[0].iov_base = &out;
+	iov[0].iov_len  = sizeof(out);
+	for (size_t i = 0; i < s.pieces.size(); i++) {
+		iov[i + 1].iov_base = (void*)s.pieces[i].data;
+		iov[i + 1].iov_len  = s.pieces[i].size;
+		out.len += s.pieces[i].size;
+	}
+	writev(out_fd, iov.get(), s.pieces.size() + 1);
+}
+
+static copper_fuse_session* out_se;
+static int segments;
+
+/* As a reply goes out, through send_msg() */
+static void send_builder(const shape& s, uint64_t unique) {
+	copper_fuse_reply_builder rb;
+	int count;
+
+	for (const piece& p : s.pieces)
+		rb.add(p.data, p.size);
+	struct iovec* iov = rb.finish(unique, 0, &count);
+	segments = count;
+	out_se->send_msg(iov, count);
+}
+
+#define ROUNDS 3
+
+template <typename F>
+static double time_replies(const shape& s, unsigned replies, F send) {
+	auto start = bench_clock::now();
+	for (unsigned i = 0; i < replies; i++)
+		send(s, i + 1);
+	return sec_since(start) * 1e9 / replies;
+}
+
+/* Best of ROUNDS, the three ways taking turns */
+static void run(const shape& s, unsigned replies) {
+	const char* names[3] = { "copy + write", "iovec each", "builder" };
+	double best[3] = { 1e18, 1e18, 1e18 };
+	uint64_t calls[3] = { 0, 0, 0 };
+
+	for (int r = 0; r < ROUNDS; r++) {
+		for (int m = 0; m < 3; m++) {
+			uint64_t before = syscalls.load();
+			double ns = m == 0 ? time_replies(s, replies, send_copy) :
+				m == 1 ? time_replies(s, replies, send_iovec) :
+				time_replies(s, replies, send_builder);
+			best[m] = std::min(best[m], ns);
+			calls[m] += syscalls.load() - before;
+		}
+	}
+	for (int m = 0; m < 3; m++)
+		printf("  %-16s %8.1f ns/reply  %5.2f syscalls/reply\n", names[m], best[m],
+			(double)calls[m] / (ROUNDS * replies));
+}
+
+int main(int argc, char* argv[]) {
+	unsigned replies = argc > 1 ? atoi(argv[1]) : 200000;
+	if (!replies) {
+		fprintf(stderr, "usage: %s [replies]\n", argv[0]);
+		return 1;
+	}
+
+	int sv[2];
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv) == -1) {
+		perror("socketpair");
+		return 1;
+	}
+	int sndbuf = 8 << 20;
+	setsockopt(sv[0], SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+	out_fd = sv[0];
+
+	/* A session whose device is the socket */
+	struct copper_fuse_lowlevel_ops op;
+	copper_fuse_session se(&op, nullptr);
+	se.set_fd(dup(sv[0]));
+	se.got_init = 1;
+	out_se = &se;
+
+	std::thread drain([&] {
+		std::vector<char> buf(1 << 16);
+		while (read(sv[1], buf.data(), buf.size()) > 0)
+			;
+	});
+
+	static char attr[sizeof(struct fuse_attr_out)];
+	static char dirent[40];
+	static char small[24];
+	static char block[4096];
+	memset(attr, 'a', sizeof(attr));
+	memset(dirent, 'd', sizeof(dirent));
+	memset(small, 's', sizeof(small));
+	memset(block, 'b', sizeof(block));
+
+	std::vector<shape> shapes;
+	shapes.push_back({ "attr reply", { { attr, sizeof(attr) } } });
+	shapes.push_back({ "24 dirents", std::vector<piece>(24, { dirent, sizeof(dirent) }) });
+	shape mixed = { "small + 4K + small", {} };
+	for (int i = 0; i < 8; i++)
+		mixed.pieces.push_back({ small, sizeof(small) });
+	mixed.pieces.push_back({ block, sizeof(block) });
+	for (int i = 0; i < 8; i++)
+		mixed.pieces.push_back({ small, sizeof(small) });
+	shapes.push_back(mixed);
+
+	for (const shape& s : shapes) {
+		size_t len = sizeof(struct fuse_out_header);
+		for (const piece& p : s.pieces)
+			len += p.size;
+		send_builder(s, 0);
+		printf("%s: %zu pieces, %zu bytes, builder sends %d segments\n", s.name,
+			s.pieces.size() + 1, len, segments);
+		run(s, replies);
+	}
+
+	const unsigned wakeups = 64;
+	unsigned rounds = std::max(replies / wakeups, 1u);
+	struct fuse_notify_poll_wakeup_out wake;
+	memset(&wake, 0, sizeof(wake));
+
+	printf("%u poll wakeups at once\n", wakeups);
+	uint64_t before = syscalls.load();
+	auto start = bench_clock::now();
+	for (unsigned r = 0; r < rounds; r++) {
+		for (unsigned i = 0; i < wakeups; i++) {
+			struct fuse_out_header out = { sizeof(out) + sizeof(wake), FUSE_NOTIFY_POLL, 0 };
+			struct iovec iov[2] = { { &out, sizeof(out) }, { &wake, sizeof(wake) } };
+			wake.kh = i;
+			se.send_msg(iov, 2);
+		}
+	}
+	double ns = sec_since(start) * 1e9;
+	printf("  %-16s %8.1f ns/wakeup  %5.2f syscalls/wakeup\n", "one by one",
+		ns / (rounds * wakeups), (double)(syscalls.load() - before) / (rounds * wakeups));
+
+	copper_fuse_notify_batch batch;
+	before = syscalls.load();
+	start = bench_clock::now();
+	for (unsigned r = 0; r < rounds; r++) {
+		batch.clear();
+		for (unsigned i = 0; i < wakeups; i++) {
+			wake.kh = i;
+			batch.add(FUSE_NOTIFY_POLL, &wake, sizeof(wake));
+		}
+		se.send_notify_batch(&batch);
+	}
+	ns = sec_since(start) * 1e9;
+	printf("  %-16s %8.1f ns/wakeup  %5.2f syscalls/wakeup\n", "batch",
+		ns / (rounds * wakeups), (double)(syscalls.load() - before) / (rounds * wakeups));
+
+	shutdown(sv[0], SHUT_WR);
+	drain.join();
+	close(sv[1]);
+	return 0;
+}
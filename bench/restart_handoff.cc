@@ -0,0 +1,379 @@
+/*
+  CopperFuse: C++ version Filesystem in Userspace
+  Copyright (C) 2023 Chen Miao <chenmiao.ku@gmail.com>
+
+  This program can be distributed under the terms of the GNU LGPLv2.
+  See the file COPYING.LIB.
+*/
+
+/**
+ * Live restart benchmark
+ *
+ * While GETATTR and READ requests stream in to a high-level filesystem,
+ * hands the connection from one daemon instance to a second one over a
+ * unix stream socket.  Both instances live in this process but share
+ * nothing, the files they open are kept in tables of their own and only
+ * cross over through ->save_state().  A SETLKW parked before the
+ * handoff is granted by the successor.
+ *
+ * Checks that every request is answered exactly once and without error,
+ * and reports the handoff time and the longest gap between replies.
+ *
+ * usage: restart_handoff [files] [seconds] [window]
+ */
+
+#include "bench_kernel.h"
+#include "copper_fuse.h"
+#include "copper_fuse_handoff.h"
+#include "copper_fuse_i.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <poll.h>
+#include <sys/socket.h>
+#include <thread>
+#include <unistd.h>
+#include <unordered_set>
+#include <vector>
+
+#define FILE_SIZE 4096
+
+/* One daemon instance: its own table of open files */
+struct bench_fs {
+	unsigned files;
+	std::mutex lock;
+	std::unordered_set<uint64_t> open_fhs;
+	uint64_t next_fh;
+	std::atomic<unsigned> bad_fh;
+};
+
+static int parse_file(const char* path, unsigned files) {
+	char* end;
+	if (path[0] != '/' || path[1] != 'f')
+		return -1;
+	unsigned long n = strtoul(path + 2, &end, 10);
+	return *end || n >= files ? -1 : (int)n;
+}
+
+static struct copper_fuse_operations bench_ops(bench_fs* fs) {
+	struct copper_fuse_operations op;
+
+	op.getattr = [fs](const char* path, struct stat* st, struct fuse_file_info*) {
+		memset(st, 0, sizeof(*st));
+		if (strcmp(path, "/") == 0) {
+			st->st_mode = S_IFDIR | 0755;
+			st->st_nlink = 2;
+			return 0;
+		}
+		if (parse_file(path, fs->files) < 0)
+			return -ENOENT;
+		st->st_mode = S_IFREG | 0644;
+		st->st_nlink = 1;
+		st->st_size = FILE_SIZE;
+		return 0;
+	};
+	op.open = [fs](const char*, struct fuse_file_info* fi) {
+		std::lock_guard<std::mutex> guard(fs->lock);
+		fi->fh = fs->next_fh++;
+		fs->open_fhs.insert(fi->fh);
+		return 0;
+	};
+	op.read = [fs](const char*, char* buf, size_t size, off_t off, struct fuse_file_info* fi) {
+		{
+			std::lock_guard<std::mutex> guard(fs->lock);
+			if (!fs->open_fhs.count(fi->fh)) {
+				fs->bad_fh++;
+				return -EBADF;
+			}
+		}
+		if (off >= FILE_SIZE)
+			return 0;
+		size = std::min<size_t>(size, FILE_SIZE - off);
+		memset(buf, 'h', size);
+		return (int)size;
+	};
+	op.release = [fs](const char*, struct fuse_file_info* fi) {
+		std::lock_guard<std::mutex> guard(fs->lock);
+		if (!fs->open_fhs.erase(fi->fh))
+			fs->bad_fh++;
+		return 0;
+	};
+	op.save_state = [fs](std::string* state) {
+		copper_fuse_snapshot_writer w;
+		std::lock_guard<std::mutex> guard(fs->lock);
+		w.put<uint64_t>(fs->next_fh);
+		w.put<uint64_t>(fs->open_fhs.size());
+		for (uint64_t fh : fs->open_fhs)
+			w.put<uint64_t>(fh);
+		*state = std::move(w.buf);
+		return 0;
+	};
+	op.restore_state = [fs](const std::string& state) {
+		copper_fuse_snapshot_reader r(state);
+		uint64_t count, fh;
+		std::lock_guard<std::mutex> guard(fs->lock);
+		r.get(&fs->next_fh);
+		r.get(&count);
+		for (uint64_t i = 0; i < count && r.get(&fh); i++)
+			fs->open_fhs.insert(fh);
+		return r.done() ? 0 : -EPROTO;
+	};
+	return op;
+}
+
+/* The kernel, requests pipelined up to a window and each reply checked off */
+struct handoff_kernel {
+	bench_kernel kernel;
+	std::vector<std::atomic<int64_t>> sent_ns;
+	std::vector<std::atomic<uint8_t>> answered;
+	std::atomic<unsigned> outstanding;
+	std::atomic<unsigned> errors;
+
+	handoff_kernel(int fd, size_t max_requests)
+		: kernel(fd), sent_ns(max_requests), answered(max_requests), outstanding(0), errors(0) {}
+
+	uint64_t send(uint32_t opcode, uint64_t nodeid, const void* arg, size_t argsize,
+		const char* name = nullptr) {
+		struct fuse_in_header hdr = kernel.header(opcode, nodeid);
+		if (hdr.unique >= sent_ns.size()) {
+			fprintf(stderr, "request table full\n");
+			exit(1);
+		}
+		outstanding++;
+		sent_ns[hdr.unique].store(now_ns(), std::memory_order_relaxed);
+		kernel.send(&hdr, arg, argsize, name, name ? strlen(name) + 1 : 0);
+		return hdr.unique;
+	}
+
+	/* @return the unique of the next reply, `out` holds all of it */
+	uint64_t recv(std::vector<char>* out) {
+		const struct fuse_out_header* hdr = kernel.recv(out);
+		if (hdr->unique >= answered.size() || answered[hdr->unique]++) {
+			fprintf(stderr, "unexpected reply to %llu\n", (unsigned long long)hdr->unique);
+			exit(1);
+		}
+		if (hdr->error)
+			errors++;
+		outstanding--;
+		return hdr->unique;
+	}
+
+	/* A synchronous request, only before the receiver thread runs */
+	const char* call(uint32_t opcode, uint64_t nodeid, const void* arg, size_t argsize,
+		std::vector<char>* out, const char* name = nullptr) {
+		send(opcode, nodeid, arg, argsize, name);
+		recv(out);
+		const struct fuse_out_header* hdr = (const struct fuse_out_header*)out->data();
+		if (hdr->error) {
+			fprintf(stderr, "opcode %u failed: %s\n", opcode, strerror(-hdr->error));
+			exit(1);
+		}
+		return bench_reply_body(*out);
+	}
+};
+
+static struct fuse_lk_in lk_in(uint64_t fh, uint64_t owner, uint32_t type) {
+	struct fuse_lk_in in;
+	memset(&in, 0, sizeof(in));
+	in.fh = fh;
+	in.owner = owner;
+	in.lk.start = 0;
+	in.lk.end = INT64_MAX;
+	in.lk.type = type;
+	in.lk.pid = getpid();
+	return in;
+}
+
+int main(int argc, char* argv[]) {
+	unsigned files   = argc > 1 ? atoi(argv[1]) : 10000;
+	double seconds   = argc > 2 ? atof(argv[2]) : 2.0;
+	unsigned window  = argc > 3 ? atoi(argv[3]) : 64;
+	if (!files || seconds <= 0 || !window) {
+		fprintf(stderr, "usage: %s [files] [seconds] [window]\n", argv[0]);
+		return 1;
+	}
+
+	int sv[2], hs[2];
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv) == -1 ||
+		socketpair(AF_UNIX, SOCK_STREAM, 0, hs) == -1) {
+		perror("socketpair");
+		return 1;
+	}
+	int sndbuf = 4 << 20;
+	setsockopt(sv[0], SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+	setsockopt(sv[1], SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+
+	bench_fs old_fs, new_fs;
+	for (bench_fs* fs : { &old_fs, &new_fs }) {
+		fs->files = files;
+		fs->next_fh = 1;
+		fs->bad_fh = 0;
+	}
+	struct copper_fuse_operations old_op = bench_ops(&old_fs);
+	struct copper_fuse_operations new_op = bench_ops(&new_fs);
+
+	char prog[] = "restart_handoff";
+	char* fuse_argv[] = { prog, nullptr };
+	copper_fuse_args old_args(1, fuse_argv), new_args(1, fuse_argv);
+	copper_fuse* old_fuse = new copper_fuse(&old_op, nullptr);
+	copper_fuse new_fuse(&new_op, nullptr);
+	if (old_fuse->init(&old_args) == -1 || new_fuse.init(&new_args) == -1)
+		return 1;
+	old_fuse->se->set_fd(sv[1]);
+
+	struct copper_fuse_loop_config config;
+	memset(&config, 0, sizeof(config));
+	config.max_idle_threads = 10;
+	config.max_threads = 4;
+	std::thread old_loop([&] { old_fuse->loop_mt(&config); });
+
+	handoff_kernel k(sv[0], 8 << 20);
+	std::vector<char> out(1 << 20);
+
+	struct fuse_init_in init_in;
+	memset(&init_in, 0, sizeof(init_in));
+	init_in.major = FUSE_KERNEL_VERSION;
+	init_in.minor = FUSE_KERNEL_MINOR_VERSION;
+	init_in.max_readahead = 128 << 10;
+	init_in.flags = FUSE_ASYNC_READ | FUSE_POSIX_LOCKS | FUSE_BIG_WRITES;
+	k.call(FUSE_INIT, 0, &init_in, sizeof(init_in), &out);
+
+	/* The state worth carrying over: nodes, open files, a lock and a waiter */
+	std::vector<uint64_t> nodeids(files), fhs(files);
+	struct fuse_open_in open_in;
+	memset(&open_in, 0, sizeof(open_in));
+	auto start = bench_clock::now();
+	for (unsigned i = 0; i < files; i++) {
+		std::string name = "f" + std::to_string(i);
+		nodeids[i] = ((const struct fuse_entry_out*)k.call(FUSE_LOOKUP, FUSE_ROOT_ID,
+			nullptr, 0, &out, name.c_str()))->nodeid;
+		fhs[i] = ((const struct fuse_open_out*)k.call(FUSE_OPEN, nodeids[i],
+			&open_in, sizeof(open_in), &out))->fh;
+	}
+	double setup_s = sec_since(start);
+
+	struct fuse_lk_in lock_a = lk_in(fhs[0], 0xa, F_WRLCK);
+	struct fuse_lk_in lock_b = lk_in(fhs[0], 0xb, F_WRLCK);
+	struct fuse_lk_in unlock_a = lk_in(fhs[0], 0xa, F_UNLCK);
+	k.call(FUSE_SETLK, nodeids[0], &lock_a, sizeof(lock_a), &out);
+	uint64_t waiter = k.send(FUSE_SETLKW, nodeids[0], &lock_b, sizeof(lock_b));
+
+	/* Replies, and the longest silence between two of them */
+	std::atomic<bool> stop(false);
+	std::atomic<int64_t> max_gap_ns(0), max_lat_ns(0);
+	std::thread receiver([&] {
+		std::vector<char> buf(1 << 20);
+		int64_t last = now_ns();
+		while (!stop.load() || k.outstanding.load()) {
+			struct pollfd pfd = { k.kernel.fd, POLLIN, 0 };
+			if (poll(&pfd, 1, 10) != 1)
+				continue;
+			uint64_t u = k.recv(&buf);
+			int64_t t = now_ns();
+			if (u != waiter) {
+				max_gap_ns.store(std::max(max_gap_ns.load(), t - last));
+				max_lat_ns.store(std::max(max_lat_ns.load(), t - k.sent_ns[u].load()));
+			}
+			last = t;
+		}
+	});
+
+	/* Load: GETATTR and READ on the open files, up to `window` in flight */
+	std::atomic<uint64_t> before_handoff(0);
+	std::atomic<bool> load_done(false);
+	std::thread sender([&] {
+		struct fuse_getattr_in getattr_in;
+		struct fuse_read_in read_in;
+		memset(&getattr_in, 0, sizeof(getattr_in));
+		memset(&read_in, 0, sizeof(read_in));
+		read_in.size = FILE_SIZE;
+
+		auto deadline = bench_clock::now() + std::chrono::duration<double>(seconds);
+		for (unsigned i = 0; bench_clock::now() < deadline; i++) {
+			while (k.outstanding.load() > window)
+				std::this_thread::yield();
+			unsigned f = (i * 2654435761u) % files;
+			if (i & 1) {
+				read_in.fh = fhs[f];
+				k.send(FUSE_READ, nodeids[f], &read_in, sizeof(read_in));
+			} else {
+				k.send(FUSE_GETATTR, nodeids[f], &getattr_in, sizeof(getattr_in));
+			}
+		}
+		load_done.store(true);
+	});
+
+	/* The successor waits for the connection like a freshly started daemon */
+	std::atomic<int64_t> resumed_ns(0);
+	int takeover_res = 0;
+	std::thread new_loop([&] {
+		takeover_res = new_fuse.takeover(hs[1]);
+		resumed_ns.store(now_ns());
+		if (takeover_res == 0)
+			new_fuse.loop_mt(&config);
+	});
+
+	std::this_thread::sleep_for(std::chrono::duration<double>(seconds / 2));
+	int64_t handoff_start = now_ns();
+	before_handoff.store(k.kernel.unique.load() - 1);
+	old_fuse->exit();
+	old_loop.join();
+	int64_t drained = now_ns();
+	int res = old_fuse->handoff(hs[0]);
+	int64_t sent = now_ns();
+	delete old_fuse;
+	if (res < 0) {
+		fprintf(stderr, "handoff: %s\n", strerror(-res));
+		return 1;
+	}
+
+	while (!load_done.load() || !resumed_ns.load())
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	sender.join();
+	if (takeover_res < 0) {
+		fprintf(stderr, "takeover: %s\n", strerror(-takeover_res));
+		return 1;
+	}
+
+	/* The successor grants the parked SETLKW and knows every open file */
+	k.send(FUSE_SETLK, nodeids[0], &unlock_a, sizeof(unlock_a));
+	struct fuse_release_in release_in;
+	memset(&release_in, 0, sizeof(release_in));
+	for (unsigned i = 0; i < files; i++) {
+		while (k.outstanding.load() > window)
+			std::this_thread::yield();
+		release_in.fh = fhs[i];
+		k.send(FUSE_RELEASE, nodeids[i], &release_in, sizeof(release_in));
+	}
+	stop.store(true);
+	receiver.join();
+
+	uint64_t total = k.kernel.unique.load() - 1;
+	unsigned missing = 0;
+	for (uint64_t u = 1; u <= total; u++)
+		missing += !k.answered[u].load();
+
+	close(sv[0]);
+	new_loop.join();
+
+	printf("files opened           %u (%.1f ms with LOOKUP)\n", files, setup_s * 1e3);
+	printf("requests               %llu (%llu before the handoff)\n",
+		(unsigned long long)total, (unsigned long long)before_handoff.load());
+	printf("loop drained           %8.3f ms\n", (drained - handoff_start) / 1e6);
+	printf("snapshot sent          %8.3f ms\n", (sent - drained) / 1e6);
+	printf("successor resumed      %8.3f ms after exit()\n", (resumed_ns.load() - handoff_start) / 1e6);
+	printf("longest reply gap      %8.3f ms\n", max_gap_ns.load() / 1e6);
+	printf("worst request latency  %8.3f ms\n", max_lat_ns.load() / 1e6);
+	printf("unanswered / errors    %u / %u, parked SETLKW %s\n", missing, k.errors.load(),
+		k.answered[waiter].load() ? "granted" : "lost");
+	printf("unknown handles        %u, left open %zu\n", new_fs.bad_fh.load(), new_fs.open_fhs.size());
+
+	return missing || k.errors.load() || !k.answered[waiter].load() || new_fs.bad_fh.load() ||
+		!new_fs.open_fhs.empty();
+}
@@ -0,0 +1,98 @@
+/*
+  CopperFuse: C++ version Filesystem in Userspace
+  Copyright (C) 2023 Chen Miao <chenmiao.ku@gmail.com>
+
+  This program can be distributed under the terms of the GNU LGPLv2.
+  See the file COPYING.LIB.
+*/
+
+/**
+ * Sparse file benchmark
+ *
+ * Builds a 10 GiB file in the in-memory engine with a 1 MiB data
+ * island every 256 MiB, then compares walking it with SEEK_DATA /
+ * SEEK_HOLE (what `cp --sparse` and VM image tools do) against reading
+ * every byte, and times punching the islands back out.
+ *
+ * usage: sparse [size-in-GiB]
+ */
+
+#include "bench_kernel.h"
+#include "copper_fuse_memfs.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+int main(int argc, char* argv[]) {
+	const off_t gib = (off_t)1 << 30;
+	const off_t island = (off_t)1 << 20;
+	const off_t stride = (off_t)256 << 20;
+	const size_t bufsize = 128 << 10;
+	off_t size = (argc > 1 ? atoll(argv[1]) : 10) * gib;
+
+	copper_memfs fs;
+	struct fuse_file_info fi = {};
+	fi.flags = O_RDWR;
+	if (fs.create("/sparse", 0644, &fi) != 0 || fs.truncate("/sparse", size, &fi) != 0) {
+		fprintf(stderr, "failed to create the file\n");
+		return 1;
+	}
+
+	std::vector<char> buf(bufsize, 'x');
+	for (off_t off = 0; off < size; off += stride)
+		for (off_t pos = 0; pos < island; pos += bufsize)
+			fs.write("/sparse", buf.data(), bufsize, off + pos, &fi);
+
+	/* Map the file the way cp --sparse=always does */
+	auto start = bench_clock::now();
+	off_t data_bytes = 0;
+	unsigned segments = 0;
+	for (off_t pos = 0; pos < size; ) {
+		off_t data = fs.lseek("/sparse", pos, SEEK_DATA, &fi);
+		if (data < 0)
+			break;
+		off_t hole = fs.lseek("/sparse", data, SEEK_HOLE, &fi);
+		data_bytes += hole - data;
+		segments++;
+		pos = hole;
+	}
+	double map_ms = sec_since(start) * 1e3;
+
+	/* Copy only the data segments */
+	start = bench_clock::now();
+	for (off_t pos = 0; pos < size; ) {
+		off_t data = fs.lseek("/sparse", pos, SEEK_DATA, &fi);
+		if (data < 0)
+			break;
+		off_t hole = fs.lseek("/sparse", data, SEEK_HOLE, &fi);
+		for (off_t off = data; off < hole; off += bufsize)
+			fs.read("/sparse", buf.data(), bufsize, off, &fi);
+		pos = hole;
+	}
+	double sparse_ms = sec_since(start) * 1e3;
+
+	/* What a hole-unaware reader has to do */
+	start = bench_clock::now();
+	for (off_t off = 0; off < size; off += bufsize)
+		fs.read("/sparse", buf.data(), bufsize, off, &fi);
+	double full_ms = sec_since(start) * 1e3;
+
+	start = bench_clock::now();
+	for (off_t off = 0; off < size; off += stride)
+		fs.fallocate("/sparse", FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, off, stride, &fi);
+	double punch_ms = sec_since(start) * 1e3;
+	off_t left = fs.lseek("/sparse", 0, SEEK_DATA, &fi);
+
+	printf("file size             %lld GiB\n", (long long)(size / gib));
+	printf("data segments         %u (%lld MiB)\n", segments, (long long)(data_bytes >> 20));
+	printf("SEEK_DATA/HOLE map    %10.3f ms\n", map_ms);
+	printf("sparse-aware read     %10.3f ms\n", sparse_ms);
+	printf("full read             %10.3f ms  (%.0fx)\n", full_ms, full_ms / sparse_ms);
+	printf("punch all islands     %10.3f ms  (data left: %s)\n", punch_ms,
+		left == -ENXIO ? "none" : "yes");
+
+	fs.release("/sparse", &fi);
+	return 0;
+}
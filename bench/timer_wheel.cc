@@ -0,0 +1,129 @@
+/*
+  CopperFuse: C++ version Filesystem in Userspace
+  Copyright (C) 2023 Chen Miao <chenmiao.ku@gmail.com>
+
+  This program can be distributed under the terms of the GNU LGPLv2.
+  See the file COPYING.LIB.
+*/
+
+/**
+ * Timer wheel benchmark
+ *
+ * Arms `timers` timers on a copper_fuse_timer_wheel with delays spread
+ * over ten minutes to two days, as remembered nodes and cache entries
+ * would be, then re-arms every one of them, as a node looked up and
+ * forgotten again, and cancels them all.  Reports the cost of each, and
+ * for comparison how long one pass over that many entries takes, which
+ * a thread scanning for expired ones pays every time it wakes.
+ *
+ * Then arms `fired` timers due over one second, starting half a second
+ * later so that all are armed by then, and reports how late they ran.
+ *
+ * usage: timer_wheel [timers] [fired]
+ */
+
+#include "bench_kernel.h"
+#include "copper_fuse_timer.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <random>
+#include <thread>
+#include <vector>
+
+struct fire_result {
+	double last;
+	double worst_late;
+	double mean_late;
+	unsigned ran;
+};
+
+/* `fired` timers due at random over a second, each noting how late it ran */
+static void run_fire(unsigned fired, struct fire_result* r) {
+	copper_fuse_timer_wheel wheel;
+	std::unique_ptr<copper_fuse_timer[]> timers(new copper_fuse_timer[fired]);
+	std::vector<double> due(fired), late(fired);
+	std::atomic<unsigned> ran(0);
+	std::mt19937_64 rng(2);
+
+	auto start = bench_clock::now();
+	for (unsigned i = 0; i < fired; i++) {
+		due[i] = 0.5 + (rng() % 1000000) / 1e6;
+		timers[i].fire = [&, i] {
+			late[i] = sec_since(start) - due[i];
+			ran++;
+		};
+		wheel.arm(&timers[i], due[i] - sec_since(start));
+	}
+	while (ran < fired && sec_since(start) < 30)
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	r->last = sec_since(start);
+	r->ran  = ran;
+
+	double sum = 0;
+	r->worst_late = 0;
+	for (unsigned i = 0; i < r->ran; i++) {
+		r->worst_late = std::max(r->worst_late, late[i]);
+		sum += late[i];
+	}
+	r->mean_late = r->ran ? sum / r->ran : 0;
+}
+
+int main(int argc, char* argv[]) {
+	unsigned n     = argc > 1 ? atoi(argv[1]) : 10000000;
+	unsigned fired = argc > 2 ? atoi(argv[2]) : 1000000;
+	if (!n || !fired) {
+		fprintf(stderr, "usage: %s [timers] [fired]\n", argv[0]);
+		return 1;
+	}
+
+	copper_fuse_timer_wheel wheel;
+	std::unique_ptr<copper_fuse_timer[]> timers(new copper_fuse_timer[n]);
+	std::vector<double> delay(n);
+	std::mt19937_64 rng(1);
+	for (unsigned i = 0; i < n; i++)
+		delay[i] = 600 + (rng() % (2 * 86400 - 600));
+
+	printf("%u timers\n", n);
+	auto start = bench_clock::now();
+	for (unsigned i = 0; i < n; i++)
+		wheel.arm(&timers[i], delay[i]);
+	double arm = sec_since(start);
+	printf("%-28s %9.1f ms %9.1f ns/op, %zu armed\n", "armed", arm * 1e3, arm * 1e9 / n,
+		wheel.size());
+
+	start = bench_clock::now();
+	for (unsigned i = 0; i < n; i++)
+		wheel.arm(&timers[i], delay[n - 1 - i]);
+	double rearm = sec_since(start);
+	printf("%-28s %9.1f ms %9.1f ns/op\n", "re-armed", rearm * 1e3, rearm * 1e9 / n);
+
+	/* What a scan for expired entries would cost on every wakeup, at the least */
+	start = bench_clock::now();
+	size_t due = 0;
+	for (unsigned i = 0; i < n; i++)
+		due += timers[i].expires <= 1;
+	double scan = sec_since(start);
+	printf("%-28s %9.1f ms, %zu due\n", "one pass over them", scan * 1e3, due);
+
+	start = bench_clock::now();
+	for (unsigned i = 0; i < n; i++)
+		wheel.cancel(&timers[i]);
+	double cancel = sec_since(start);
+	printf("%-28s %9.1f ms %9.1f ns/op, %zu armed\n", "cancelled", cancel * 1e3,
+		cancel * 1e9 / n, wheel.size());
+	bool cancelled = wheel.size() == 0;
+
+	struct fire_result r;
+	run_fire(fired, &r);
+	printf("%u timers due over a second\n", fired);
+	printf("%-28s %9.1f ms, %u of %u\n", "all fired after", r.last * 1e3, r.ran, fired);
+	printf("%-28s %9.3f ms mean %9.3f ms worst\n", "late by", r.mean_late * 1e3,
+		r.worst_late * 1e3);
+	return cancelled && r.ran == fired ? 0 : 1;
+}
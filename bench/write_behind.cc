@@ -0,0 +1,258 @@
+/*
+  CopperFuse: C++ version Filesystem in Userspace
+  Copyright (C) 2023 Chen Miao <chenmiao.ku@gmail.com>
+
+  This program can be distributed under the terms of the GNU LGPLv2.
+  See the file COPYING.LIB.
+*/
+
+/**
+ * Write-behind benchmark
+ *
+ * A high-level filesystem backed by an object store that charges a
+ * round trip per ->write() call.  `files` writers each append to a file
+ * of their own in 4 KiB writes, one write in flight per writer as
+ * write(2) without the writeback cache does, then close it.
+ *
+ * Runs without write-behind and with extents of 256 KiB and 1 MiB.
+ * Reports the time, the backend calls and checks what the backend got.
+ * Then lets the backend fail a write-out and checks the error reaches
+ * the writer, at the latest when it closes the file.
+ *
+ * usage: write_behind [MiB per file] [files] [round trip us]
+ */
+
+#include "bench_kernel.h"
+#include "copper_fuse.h"
+#include "copper_fuse_i.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <sys/socket.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#define WRITE_SIZE 4096
+
+/* The object store: one object per file, a round trip per call */
+struct bench_store {
+	unsigned files;
+	unsigned rtt_us;
+	std::mutex lock;
+	std::vector<std::string> objects;
+	std::atomic<uint64_t> calls;
+	/* Fail the write-out after this many calls, none if zero */
+	std::atomic<uint64_t> fail_after;
+};
+
+static int parse_file(const char* path, unsigned files) {
+	char* end;
+	if (path[0] != '/' || path[1] != 'f')
+		return -1;
+	unsigned long n = strtoul(path + 2, &end, 10);
+	return *end || n >= files ? -1 : (int)n;
+}
+
+static struct copper_fuse_operations bench_ops(bench_store* st) {
+	struct copper_fuse_operations op;
+
+	op.getattr = [st](const char* path, struct stat* stbuf, struct fuse_file_info*) {
+		memset(stbuf, 0, sizeof(*stbuf));
+		if (strcmp(path, "/") == 0) {
+			stbuf->st_mode = S_IFDIR | 0755;
+			stbuf->st_nlink = 2;
+			return 0;
+		}
+		int n = parse_file(path, st->files);
+		if (n < 0)
+			return -ENOENT;
+		std::lock_guard<std::mutex> guard(st->lock);
+		stbuf->st_mode = S_IFREG | 0644;
+		stbuf->st_nlink = 1;
+		stbuf->st_size = st->objects[n].size();
+		return 0;
+	};
+	op.open = [](const char*, struct fuse_file_info*) {
+		return 0;
+	};
+	op.write = [st](const char* path, const char* buf, size_t size, off_t off,
+		struct fuse_file_info*) {
+		int n = parse_file(path, st->files);
+		if (n < 0)
+			return -ENOENT;
+		uint64_t call = ++st->calls;
+		std::this_thread::sleep_for(std::chrono::microseconds(st->rtt_us));
+		if (st->fail_after.load() && call > st->fail_after.load())
+			return -EIO;
+		std::lock_guard<std::mutex> guard(st->lock);
+		std::string& obj = st->objects[n];
+		if (obj.size() < off + size)
+			obj.resize(off + size);
+		memcpy(&obj[off], buf, size);
+		return (int)size;
+	};
+	return op;
+}
+
+struct run_result {
+	double seconds;
+	uint64_t calls;
+	bool intact;
+	/* First error a writer saw, and from which request */
+	int error;
+	const char* error_at;
+};
+
+/* `files` writers appending `bytes` each, then closing */
+static int run(size_t write_behind, size_t bytes, unsigned files, unsigned rtt_us,
+	uint64_t fail_after, struct run_result* r) {
+	int sv[2];
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv) == -1) {
+		perror("socketpair");
+		return -1;
+	}
+
+	bench_store st;
+	st.files = files;
+	st.rtt_us = rtt_us;
+	st.objects.resize(files);
+	st.calls = 0;
+	st.fail_after = fail_after;
+	struct copper_fuse_operations op = bench_ops(&st);
+
+	std::string opt = "write_behind=" + std::to_string(write_behind);
+	char prog[] = "write_behind", o[] = "-o";
+	char* fuse_argv[] = { prog, o, &opt[0], nullptr };
+	copper_fuse_args args(3, fuse_argv);
+	copper_fuse* fuse = new copper_fuse(&op, nullptr);
+	if (fuse->init(&args) == -1)
+		return -1;
+	fuse->se->set_fd(sv[1]);
+
+	struct copper_fuse_loop_config config;
+	memset(&config, 0, sizeof(config));
+	config.max_idle_threads = 10;
+	config.max_threads = 4;
+	std::thread loop([&] { fuse->loop_mt(&config); });
+
+	bench_kernel k(sv[0]);
+	std::vector<char> out(1 << 16);
+	k.init(&out);
+
+	std::vector<uint64_t> nodeids(files), fhs(files);
+	struct fuse_open_in open_in;
+	memset(&open_in, 0, sizeof(open_in));
+	open_in.flags = O_WRONLY;
+	for (unsigned i = 0; i < files; i++) {
+		std::string name = "f" + std::to_string(i);
+		std::vector<char> req(name.begin(), name.end());
+		req.push_back('\0');
+		nodeids[i] = ((const struct fuse_entry_out*)k.call(FUSE_LOOKUP, FUSE_ROOT_ID,
+			req.data(), req.size(), &out))->nodeid;
+		fhs[i] = ((const struct fuse_open_out*)k.call(FUSE_OPEN, nodeids[i],
+			&open_in, sizeof(open_in), &out))->fh;
+	}
+
+	/* A pattern that tells misplaced bytes apart */
+	std::string data(bytes, 0);
+	for (size_t i = 0; i < bytes; i++)
+		data[i] = (char)(i * 7 + i / WRITE_SIZE);
+
+	r->error = 0;
+	r->error_at = "";
+	auto start = bench_clock::now();
+	struct fuse_write_in write_in;
+	memset(&write_in, 0, sizeof(write_in));
+	write_in.size = WRITE_SIZE;
+	write_in.flags = O_WRONLY;
+	for (size_t off = 0; off < bytes; off += WRITE_SIZE) {
+		for (unsigned i = 0; i < files; i++) {
+			write_in.fh = fhs[i];
+			write_in.offset = off;
+			k.send(FUSE_WRITE, nodeids[i], &write_in, sizeof(write_in), data.data() + off,
+				WRITE_SIZE);
+		}
+		for (unsigned i = 0; i < files; i++) {
+			int err = k.recv(&out)->error;
+			if (err && !r->error) {
+				r->error = err;
+				r->error_at = "write";
+			}
+		}
+	}
+
+	/* close(2): FLUSH, then RELEASE */
+	struct fuse_flush_in flush_in;
+	struct fuse_release_in release_in;
+	memset(&flush_in, 0, sizeof(flush_in));
+	memset(&release_in, 0, sizeof(release_in));
+	for (unsigned i = 0; i < files; i++) {
+		flush_in.fh = release_in.fh = fhs[i];
+		int err = k.try_call(FUSE_FLUSH, nodeids[i], &flush_in, sizeof(flush_in), &out);
+		/* The kernel takes ENOSYS as success, and sends no more FLUSH */
+		if (err && err != -ENOSYS && !r->error) {
+			r->error = err;
+			r->error_at = "close";
+		}
+		k.try_call(FUSE_RELEASE, nodeids[i], &release_in, sizeof(release_in), &out);
+	}
+	r->seconds = sec_since(start);
+	r->calls = st.calls.load();
+
+	close(sv[0]);
+	loop.join();
+	delete fuse;
+
+	r->intact = true;
+	for (const std::string& obj : st.objects)
+		r->intact &= obj == data;
+	return 0;
+}
+
+int main(int argc, char* argv[]) {
+	unsigned mib    = argc > 1 ? atoi(argv[1]) : 4;
+	unsigned files  = argc > 2 ? atoi(argv[2]) : 4;
+	unsigned rtt_us = argc > 3 ? atoi(argv[3]) : 100;
+	if (!mib || !files) {
+		fprintf(stderr, "usage: %s [MiB per file] [files] [round trip us]\n", argv[0]);
+		return 1;
+	}
+	size_t bytes = (size_t)mib << 20;
+
+	printf("%u files, %u MiB each in %u byte appends, %u us per backend call\n", files, mib,
+		WRITE_SIZE, rtt_us);
+	printf("%-20s %10s %14s %10s\n", "", "ms", "backend calls", "data");
+
+	const size_t extents[] = { 0, 256 << 10, 1 << 20 };
+	for (size_t extent : extents) {
+		struct run_result r;
+		if (run(extent, bytes, files, rtt_us, 0, &r) == -1)
+			return 1;
+		char label[64];
+		if (extent)
+			snprintf(label, sizeof(label), "write_behind=%zuK", extent >> 10);
+		else
+			snprintf(label, sizeof(label), "write through");
+		printf("%-20s %10.1f %14llu %10s\n", label, r.seconds * 1e3, (unsigned long long)r.calls,
+			r.intact ? "intact" : "CORRUPT");
+		if (!r.intact || r.error) {
+			fprintf(stderr, "%s: %s\n", label, r.error ? strerror(-r.error) : "data differs");
+			return 1;
+		}
+	}
+
+	/* The backend fails the write-out of a last, partial extent: nobody but close(2) is left */
+	struct run_result r;
+	if (run(1 << 20, 3 << 19, 1, rtt_us, 1, &r) == -1)
+		return 1;
+	printf("failed write-out     %s reported at %s\n",
+		r.error ? strerror(-r.error) : "not", r.error ? r.error_at : "all");
+	return r.error ? 0 : 1;
+}
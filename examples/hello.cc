@@ -1,5 +1,6 @@
 #include "copper_fuse.h"
 #include "copper_fuse_common.h"
+#include "copper_fuse_memfs.h"
 #include "copper_fuse_opt.h"
 #include "copper_log.h"
 
@@ -27,16 +28,29 @@ static const copper_fuse_opt option_spec[] = {
     COPPER_FUSE_OPT_END
 };
 
+static copper_memfs hello_fs;
+
 static void *hello_init(copper_fuse_conn_info* conn, copper_fuse_config *cfg) {
     static_cast<void>(conn);
     cfg->kernel_cache = 1;
-    return nullptr;
+    cfg->use_ino = 1;
+    cfg->nullpath_ok = 1;
+    return &hello_fs;
 }
 
-static copper_fuse_operations hello_oper = {
-    // .init = [](copper_fuse_conn_info* conn, copper_fuse_config* cfg) -> void* {},
-    .init = hello_init,
-};
+/* Seed the in-memory filesystem with the single "hello" file */
+static int hello_populate(const std::string& name, const std::string& contents) {
+    std::string path = "/" + name;
+    fuse_file_info fi {};
+    int res;
+
+    fi.flags = O_WRONLY | O_CREAT | O_EXCL;
+    res = hello_fs.create(path.c_str(), 0444, &fi);
+    if (res != 0) return res;
+    res = hello_fs.write(nullptr, contents.data(), contents.size(), 0, &fi);
+    hello_fs.release(nullptr, &fi);
+    return res < 0 ? res : 0;
+}
 
 static void show_help(const char* progname) {
     printf("usage: %s [options] <mountpoint>\n\n", progname);
@@ -72,6 +86,14 @@ int main(int argc, char* argv[]) {
         args.argv[0][0] = '\0';
     }
 
+    if (hello_populate(op.filename, op.contents) != 0) {
+        erron << "failed to create " << op.filename;
+        return 1;
+    }
+
+    copper_fuse_operations hello_oper = hello_fs.operations();
+    hello_oper.init = hello_init;
+
     ret = copper_fuse_main(args.argc, args.argv, &hello_oper, nullptr);
 
     // TODO args.out_free_args();
@@ -0,0 +1,65 @@
+#include "copper_fuse.h"
+#include "copper_fuse_common.h"
+#include "copper_fuse_opt.h"
+#include "copper_fuse_passthrough.h"
+#include "copper_log.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+struct options {
+    int show_help;
+    char* source;
+    double timeout;
+} op;
+
+#define OPTION(t, p)    \
+    { t, offsetof(options, p), 1 }
+
+static const copper_fuse_opt option_spec[] = {
+    OPTION("--source=%s", source),
+    OPTION("--timeout=%lf", timeout),
+    OPTION("-h", show_help),
+    OPTION("--help", show_help),
+    COPPER_FUSE_OPT_END
+};
+
+static copper_passthrough passthrough_fs;
+
+static void show_help(const char* progname) {
+    printf("usage: %s [options] <mountpoint>\n\n", progname);
+    printf("File-system specific options:\n"
+           "    --source=<s>        Directory to mirror\n"
+           "                        (default: \"/\")\n"
+           "    --timeout=<d>       Seconds a cached lookup is trusted\n"
+           "                        (default: 1.0)\n"
+           "\n");
+}
+
+int main(int argc, char* argv[]) {
+    int ret;
+    copper_fuse_args args(argc, argv);
+
+    op.source = strdup("/");
+    op.timeout = 1.0;
+
+    if (args.parse_opt(&op, option_spec, nullptr) == -1) return 1;
+
+    if (op.show_help) {
+        show_help(argv[0]);
+        if (args.add_arg("--help") != 0) {
+            erron << "add_arg failed";
+            exit(-1);
+        }
+        args.argv[0][0] = '\0';
+    } else if (passthrough_fs.init(op.source, op.timeout) != 0) {
+        return 1;
+    }
+
+    copper_fuse_operations passthrough_oper = passthrough_fs.operations();
+    ret = copper_fuse_main(args.argc, args.argv, &passthrough_oper, nullptr);
+
+    free(op.source);
+    return ret;
+}
@@ -15,8 +15,82 @@
 #ifndef __COPPER_CUSE_LOWLEVEL_H__
 #define __COPPER_CUSE_LOWLEVEL_H__
 
-#ifndef COPPER_FUSE_USE_VERSION
-#define COPPER_FUSE_USE_VERSION 29
-#endif
+#include "copper_fuse_lowlevel.h"
+#include "copper_fuse_opt.h"
 
-#endif //! __COPPER_CUSE_LOWLEVEL_H__
\ No newline at end of file
+#include <cstddef>
+#include <sys/types.h>
+
+/**
+ * Description of the character device
+ *
+ * `dev_info_argv` holds "KEY=value" strings handed to the kernel, at
+ * least "DEVNAME=name" is required; the device shows up as /dev/name.
+ * A zero `dev_major` lets the kernel pick the device numbers.
+ * CUSE_UNRESTRICTED_IOCTL in `flags` passes ioctls through
+ * unrestricted, see the ioctl method of copper_fuse_lowlevel_ops.
+ */
+struct copper_cuse_info {
+	unsigned dev_major;
+	unsigned dev_minor;
+	unsigned dev_info_argc;
+	const char** dev_info_argv;
+	unsigned flags;
+};
+
+/**
+ * Most ops behave almost identically to the matching fuse_lowlevel
+ * ops, the only difference being that they don't take an inode
+ * argument, as there is only one object - the device itself.
+ *
+ * A device is a stream: reads and writes of up to `max_read` and
+ * `max_write` bytes (the session buffer, 128 KiB by default) reach it
+ * unsplit, and a read can be left pending until data arrives, the
+ * request stays valid until it is replied to.  Readers waiting in
+ * poll(2) are woken with copper_fuse_session::notify_poll().
+ */
+struct copper_cuse_lowlevel_ops {
+	operators_wrapper_type<void, void*, struct copper_fuse_conn_info*> init;
+	/** Called once the device is registered with the kernel */
+	operators_wrapper_type<void, void*> init_done;
+	operators_wrapper_type<void, void*> destroy;
+	operators_wrapper_type<void, copper_fuse_req_t, struct fuse_file_info*> open;
+	operators_wrapper_type<void, copper_fuse_req_t, size_t, off_t, struct fuse_file_info*> read;
+	operators_wrapper_type<void, copper_fuse_req_t, const char*, size_t, off_t,
+		struct fuse_file_info*> write;
+	operators_wrapper_type<void, copper_fuse_req_t, struct fuse_file_info*> flush;
+	operators_wrapper_type<void, copper_fuse_req_t, struct fuse_file_info*> release;
+	operators_wrapper_type<void, copper_fuse_req_t, int, struct fuse_file_info*> fsync;
+	operators_wrapper_type<void, copper_fuse_req_t, unsigned int, void*, struct fuse_file_info*,
+		unsigned int, const void*, size_t, size_t> ioctl;
+	operators_wrapper_type<void, copper_fuse_req_t, struct fuse_file_info*,
+		struct fuse_pollhandle*> poll;
+};
+
+/**
+ * Create a session for a character device
+ *
+ * Understands the "-d"/"debug" and "max_read=N" options in `args`.
+ * The session still needs a descriptor, an open /dev/cuse or anything
+ * set with copper_fuse_session::set_fd().
+ *
+ * @return the session, or nullptr on failure
+ */
+struct copper_fuse_session* copper_cuse_lowlevel_new(struct copper_fuse_args* args,
+	const struct copper_cuse_info* ci, const struct copper_cuse_lowlevel_ops* clop, void* userdata);
+
+/**
+ * Parse the command line, create the session and open /dev/cuse
+ *
+ * @return the session, or nullptr on failure or after printing help
+ */
+struct copper_fuse_session* copper_cuse_lowlevel_setup(int argc, char* argv[],
+	const struct copper_cuse_info* ci, const struct copper_cuse_lowlevel_ops* clop,
+	int* multithreaded, void* userdata);
+
+void copper_cuse_lowlevel_teardown(struct copper_fuse_session* se);
+
+int copper_cuse_lowlevel_main(int argc, char* argv[], const struct copper_cuse_info* ci,
+	const struct copper_cuse_lowlevel_ops* clop, void* userdata);
+
+#endif //! __COPPER_CUSE_LOWLEVEL_H__
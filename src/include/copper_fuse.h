@@ -22,6 +22,8 @@
 #include <sys/uio.h>
 
 #include <functional>
+#include <memory>
+#include <string>
 #include <variant>
 
 /** ----------------------------------------------------------- *
@@ -78,9 +80,7 @@ using fuse_fill_dir_t = std::function < int(void *buf, const char *name,
                                             const struct stat *stbuf,
                                             off_t off, enum fuse_fill_dir_flags flags)>;
 
-struct copper_fuse {
-
-};
+struct copper_fuse;
 
 /**
  * Configuration of the high-level API
@@ -127,7 +127,8 @@ struct copper_fuse_config {
 	 * returned ENOENT), the lookup will only be redone after the
 	 * timeout, and the file/directory will be assumed to not
 	 * exist until then. A value of zero means that negative
-	 * lookups are not cached.
+	 * lookups are not cached.  The library remembers them as well,
+	 * for the lookups the kernel sends anyway.
 	 */
 	double negative_timeout;
 
@@ -139,6 +140,10 @@ struct copper_fuse_config {
 
   /**
 	 * Allow requests to be interrupted
+	 *
+	 * The thread running a filesystem method is sent intr_signal when
+	 * the kernel interrupts its request, see
+	 * copper_fuse_get_cancel_token().
 	 */
 	int intr;
 
@@ -293,6 +298,89 @@ struct copper_fuse_config {
 	 */
 	int parallel_direct_writes;
 
+  /**
+	 * The timeout in seconds for which extended attributes, and the
+	 * fact that one does not exist, are cached by the library.  The
+	 * cache is dropped for an attribute set or removed through the
+	 * mount.  A value of zero disables the cache.
+	 */
+	double xattr_timeout;
+
+  /**
+	 * Size of the pieces a copy_file_range request is split into when
+	 * the library performs the copy itself, i.e. when the filesystem
+	 * has no copy_file_range handler.  The pieces are copied in
+	 * parallel by at most `copy_threads` threads.
+	 */
+	size_t copy_chunk_size;
+	unsigned int copy_threads;
+
+  /**
+	 * Rate limiting and fair dispatch among the users of the mount.
+	 * Once any is set, at most `fair_slots` requests (8 if zero) are
+	 * dispatched to the filesystem at once, shared by deficit
+	 * round-robin among the user IDs that issue them, and each user
+	 * may run at most `fair_ops` requests and `fair_bytes` bytes read
+	 * or written per second.  A rate of zero is unlimited.  See also
+	 * copper_fuse::set_path_limits().
+	 */
+	unsigned int fair_slots;
+	double fair_ops;
+	double fair_bytes;
+
+  /**
+	 * Check permissions in the library, like the kernel does with the
+	 * `default_permissions` mount option: search on the parent for a
+	 * lookup, write and search for a create, read or write for an
+	 * open, and access() itself.  Owner, group and mode come from
+	 * `getattr` and are cached for `attr_timeout`, supplementary
+	 * groups from /proc, cached per process.  With `posix_acl` the
+	 * system.posix_acl_access attribute is honoured too.
+	 */
+	int check_permissions;
+	int posix_acl;
+
+  /**
+	 * Pages of payload a READ or WRITE request may carry, 32 (128 KiB)
+	 * if zero, up to the kernel's limit, see
+	 * copper_fuse_session::set_max_pages().  Receive buffers of 1 MiB
+	 * and more come from huge pages where the system has them.
+	 */
+	unsigned int max_pages;
+
+  /**
+	 * Gather the writes of an open file into extents of up to
+	 * `write_behind` bytes before passing them to `write`, answering
+	 * each at once.  An extent is written out once full, after
+	 * `write_behind_timeout` seconds, or by a flush, fsync, release,
+	 * read, getattr or write elsewhere in the file.  A failed
+	 * write-out is reported by the next write, flush or fsync of the
+	 * handle.  Zero disables it.
+	 */
+	size_t write_behind;
+	double write_behind_timeout;
+
+  /**
+	 * Keep up to `block_cache` bytes of the files read, in blocks of
+	 * `block_size` bytes (128 KiB if zero) read from `read` whole,
+	 * and answer reads from them.  A handle reading sequentially gets
+	 * up to `readahead` blocks loaded ahead of it by
+	 * `readahead_threads` threads.  The blocks of a file are dropped
+	 * when it is written to or opened, unless `kernel_cache` is set.
+	 * Zero disables it, see copper_fuse_get_cache_stats().
+	 */
+	size_t block_cache;
+	size_t block_size;
+	unsigned int readahead;
+	unsigned int readahead_threads;
+
+  /**
+	 * Let concurrent lookups of the same name share one `getattr`
+	 * call and its result, on by default.  `nolookup_coalesce` sends
+	 * every lookup to `getattr`.
+	 */
+	int lookup_coalesce;
+
   /**
 	 * The remaining options are used by libfuse internally and
 	 * should not be touched.
@@ -302,20 +390,6 @@ struct copper_fuse_config {
 	int   debug;
 };
 
-#if defined (__cplusplus) && (__cplusplus >= 201703L)
-template <typename ret_type, typename... params_type>
-struct operators_wrapper {
-  // using type = std::variant<std::function<ret_type(params_type...)>, ret_type(*)(params_type...)>;
-	using type = std::function<ret_type(params_type...)>;
-};
-
-template <typename ret_type, typename... params_type>
-using operators_wrapper_type = typename operators_wrapper<ret_type, params_type...>::type;
-#else
-# define operators_wrapper_type(ret_type, params_type...) \
-    ret_type(*)(params_type)
-#endif
-
 /**
  * The file system operations:
  *
@@ -377,6 +451,7 @@ struct copper_fuse_operations {
   operators_wrapper_type<void, void*> destroy;
   operators_wrapper_type<int, const char*, int> access;
   operators_wrapper_type<int, const char*, mode_t, struct fuse_file_info*> create;
+  /* Without ->lock() and ->flock() the library keeps track of file locks itself */
   operators_wrapper_type<int, const char*, struct fuse_file_info*, int, struct flock*> lock;
   operators_wrapper_type<int, const char*, const struct timespec[2], struct fuse_file_info*> utimens;
   operators_wrapper_type<int, const char*, size_t, uint64_t*> bmap;
@@ -392,13 +467,39 @@ struct copper_fuse_operations {
 	operators_wrapper_type<int, const char*, int, off_t, off_t, struct fuse_file_info*> fallocate;
 	operators_wrapper_type<ssize_t, const char*, struct fuse_file_info*, off_t, const char*, struct fuse_file_info*, off_t, size_t, int> copy_file_range;
 	operators_wrapper_type<off_t, const char*, off_t, int, struct fuse_file_info*> lseek;
+
+	/**
+	 * Return the file descriptor backing an open file, or a negated
+	 * error value if the handle is not backed by one.
+	 *
+	 * Optional.  Lets the library run the default copy_file_range with
+	 * copy_file_range(2) on the underlying files instead of copying
+	 * through read() and write().
+	 */
+	operators_wrapper_type<int, const char*, struct fuse_file_info*> backing_fd;
+
+	/**
+	 * Save what a new process taking the mount over needs, see
+	 * copper_fuse::handoff()
+	 *
+	 * Optional.  Anything the kernel still refers to, open file
+	 * handles (fi->fh) first of all, must be recoverable from `state`.
+	 */
+	operators_wrapper_type<int, std::string*> save_state;
+
+	/**
+	 * Restore what ->save_state() saved, in the new process
+	 *
+	 * Called after ->init(), before any request is handled.
+	 */
+	operators_wrapper_type<int, const std::string&> restore_state;
 };
 
 /** 
  * Extra context that may be needed by some filesystems
  *
  * The uid, gid and pid fields are not filled in case of a writepage
- * operation.
+ * operation.  See copper_fuse_get_context().
  */
 struct copper_fuse_context {
   /** Pointer to the fuse object */
@@ -420,6 +521,104 @@ struct copper_fuse_context {
 	mode_t umask;
 };
 
+/**
+ * Notify IO readiness event
+ *
+ * `ph` is a handle the poll operation received, which the filesystem
+ * owns from then on.  Notifying a file that was not polled again since
+ * its last notification is cheap and sends nothing.
+ *
+ * @return 0 on success, -errno on failure
+ */
+int copper_fuse_notify_poll(struct fuse_pollhandle* ph);
+
+/**
+ * Notify many poll handles of one filesystem at once
+ *
+ * Meant for waking all the readers of a shared object, e.g. a pipe
+ * with thousands of clients: each waiting file is notified once, with
+ * a single pass over the registry.
+ *
+ * @return number of notifications sent, -errno on failure
+ */
+int copper_fuse_notify_poll_batch(struct fuse_pollhandle* const* phs, size_t count);
+
+/** Destroy a poll handle once it is no longer needed */
+void copper_fuse_pollhandle_destroy(struct fuse_pollhandle* ph);
+
+/**
+ * Check if the current request has been interrupted
+ *
+ * Only meaningful inside the methods that may block: lookup, getattr,
+ * open, create, read, write, flush, fallocate, copy_file_range, poll,
+ * lock and flock.
+ *
+ * @return 1 if the request has been interrupted, 0 otherwise
+ */
+int copper_fuse_interrupted();
+
+/**
+ * Get the cancellation token of the current request
+ *
+ * Valid in the same methods as copper_fuse_interrupted().  Backend work
+ * the method starts may keep the token and stop once it is cancelled,
+ * even after the method returned.  With the intr option the worker
+ * thread is also sent intr_signal, which breaks blocking system calls
+ * with EINTR.
+ *
+ * @return the token, or nullptr outside those methods
+ */
+std::shared_ptr<struct copper_fuse_cancel_token> copper_fuse_get_cancel_token();
+
+/**
+ * Get the context of the current request
+ *
+ * A slot of the calling thread, filled from the request header when a
+ * method is called for it: no system call, lock or allocation, cheap
+ * enough for a permission check on every operation.  In ->init() only
+ * `fuse` and `private_data` are set.  The slot keeps the last request
+ * of the thread after its method returned, and `fuse` is null in
+ * threads that never ran a method.
+ *
+ * @return the context, never null
+ */
+struct copper_fuse_context* copper_fuse_get_context();
+
+/**
+ * Get the supplementary groups of the caller of the current request
+ *
+ * They are read from /proc the first time a caller asks and cached for
+ * a second, as long as its uid and gid stay the same.  At most `size`
+ * groups are stored in `list`.
+ *
+ * @return total number of groups, -EINVAL outside a method, or -errno
+ *         if they could not be read
+ */
+int copper_fuse_getgroups(int size, gid_t list[]);
+
+/** What the block cache did so far, see `block_cache` */
+struct copper_fuse_cache_stats {
+	/** Blocks found loaded, and the blocks read from the filesystem */
+	uint64_t hits;
+	uint64_t misses;
+	/** Reads of a block already being loaded, which waited for it */
+	uint64_t waits;
+	/** Blocks loaded ahead, and those read afterwards */
+	uint64_t read_ahead;
+	uint64_t ahead_hits;
+	uint64_t evictions;
+	/** Blocks held now, of `block_size` bytes each */
+	size_t blocks;
+	size_t block_size;
+};
+
+/**
+ * Get the statistics of the block cache
+ *
+ * @return 0 on success, -ENOENT if the block cache is not enabled
+ */
+int copper_fuse_get_cache_stats(struct copper_fuse* f, struct copper_fuse_cache_stats* stats);
+
 /**
  * Main function of FUSE.
  *
@@ -0,0 +1,182 @@
+/*
+  CopperFuse: C++ version Filesystem in Userspace
+  Copyright (C) 2023 Chen Miao <chenmiao.ku@gmail.com>
+
+  This program can be distributed under the terms of the GNU LGPLv2.
+  See the file COPYING.LIB.
+*/
+
+#ifndef __COPPER_FUSE_BLOCK_CACHE_H__
+#define __COPPER_FUSE_BLOCK_CACHE_H__
+
+#include "copper_fuse.h"
+#include "copper_fuse_lowlevel.h"
+#include "copper_fuse_pool.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+/** Number of independently locked parts of the block cache */
+constexpr const unsigned COPPER_FUSE_CACHE_SHARDS = 16;
+
+/** Number of generation counters the nodes are hashed onto */
+constexpr const unsigned COPPER_FUSE_CACHE_GENS = 4096;
+
+/**
+ * Block cache of the high-level read path
+ *
+ * Files are read from ->read() in aligned blocks of `block_size`,
+ * which are kept under a budget of `capacity` bytes and evicted by
+ * CLOCK: a block read since the hand last passed it gets another round.
+ * Concurrent misses of one block wait for a single ->read() of it.
+ *
+ * A handle reading sequentially gets the blocks after the one it read
+ * loaded ahead of it by a pool of threads, in a window that doubles
+ * with every sequential read up to `readahead` blocks, as the kernel's
+ * readahead does.  Blocks loaded ahead and not read yet are the first
+ * to go.
+ *
+ * Every node has a generation, bumped by invalidate(), that is part of
+ * the key of its blocks: blocks of older generations are never found
+ * again and are evicted first.  Generations are shared by the nodes
+ * hashed onto the same counter, which only costs spurious misses.
+ */
+struct copper_fuse_block_cache {
+	/** Read `size` bytes at `off` of the file into `buf`, as ->read() does */
+	using read_fn = std::function<int(fuse_ino_t ino, char* buf, size_t size, off_t off,
+		struct fuse_file_info* fi)>;
+
+	struct key {
+		fuse_ino_t ino;
+		uint64_t gen;
+		uint64_t index;
+
+		bool operator== (const key& other) const {
+			return ino == other.ino && gen == other.gen && index == other.index;
+		}
+	};
+
+	struct key_hash {
+		size_t operator() (const key& k) const {
+			return (k.ino * 0x9e3779b97f4a7c15ULL + k.index) * 0x9e3779b97f4a7c15ULL;
+		}
+	};
+
+	/* Protected by the lock of the block's shard, but `data`, which the load fills */
+	struct block {
+		struct key key;
+		/* Until the ->read() of it returned, `data` and `len` are set then */
+		bool loading;
+		/* Read since the hand last passed */
+		bool referenced;
+		/* Loaded ahead and not read yet */
+		bool ahead;
+		int error;
+		size_t len;
+		std::unique_ptr<char[]> data;
+	};
+
+	struct shard {
+		std::mutex lock;
+		/* Wakes the readers waiting for a block to load */
+		std::condition_variable loaded;
+		std::unordered_map<key, std::shared_ptr<block>, key_hash> blocks;
+		/* The CLOCK, `hand` being the next to look at */
+		std::vector<std::shared_ptr<block>> ring;
+		size_t hand;
+	};
+
+	/* Sequential detection and readahead of an open handle */
+	struct stream {
+		struct fuse_file_info fi;
+		/* Where a sequential read starts */
+		off_t next;
+		unsigned window;
+		/* First block not read ahead yet, and the block the file ends in */
+		uint64_t ahead;
+		uint64_t end;
+		/* Loads ahead not done yet, release() waits for them */
+		unsigned inflight;
+		bool closed;
+	};
+
+	read_fn read_in;
+	size_t block_size;
+	/* In blocks, per shard */
+	size_t capacity;
+	unsigned max_window;
+
+	std::atomic<uint64_t> gens[COPPER_FUSE_CACHE_GENS];
+	shard shards[COPPER_FUSE_CACHE_SHARDS];
+
+	/* Open handles by node and fh */
+	std::mutex lock;
+	std::condition_variable idle;
+	std::map<std::pair<fuse_ino_t, uint64_t>, std::shared_ptr<stream>> streams;
+
+	std::atomic<uint64_t> hits;
+	std::atomic<uint64_t> misses;
+	std::atomic<uint64_t> waits;
+	std::atomic<uint64_t> read_ahead;
+	std::atomic<uint64_t> ahead_hits;
+	std::atomic<uint64_t> evictions;
+
+	/* Loads ahead, last so that it is joined before the rest goes */
+	copper_fuse_pool pool;
+
+public:
+	copper_fuse_block_cache(read_fn _read_in, size_t _capacity, size_t _block_size,
+		unsigned _readahead, unsigned threads);
+	/* Loads ahead must be done, stop() first */
+	~copper_fuse_block_cache() = default;
+
+	copper_fuse_block_cache(const copper_fuse_block_cache&) = delete;
+	copper_fuse_block_cache& operator= (const copper_fuse_block_cache&) = delete;
+
+	/**
+	 * Read through the cache, for READ of the handle `fi` of `ino`
+	 *
+	 * @return bytes read, fewer than `size` at the end of the file, or
+	 *         -errno if the first block could not be read
+	 */
+	int read(fuse_ino_t ino, struct fuse_file_info* fi, char* buf, size_t size, off_t off);
+
+	/** Forget the blocks of `ino`, after it was written to */
+	void invalidate(fuse_ino_t ino);
+
+	/** Wait for the loads ahead of the handle and forget it, for RELEASE */
+	void release(fuse_ino_t ino, const struct fuse_file_info* fi);
+
+	/** Wait for the loads ahead of every handle and start no more */
+	void stop();
+
+	void stats(struct copper_fuse_cache_stats* st);
+
+private:
+	shard& shard_of(const key& k);
+	/*
+	 * The block `k` loaded, by this thread or another one
+	 *
+	 * @return 0, or the error of the ->read() of it
+	 */
+	int get(const key& k, struct fuse_file_info* fi, std::shared_ptr<block>* out);
+	/* With the shard's lock held */
+	void insert(shard& s, std::shared_ptr<block> b);
+	/* Hands the memory of the evicted block over to `*spare`, if it is free */
+	bool evict_one(shard& s, std::unique_ptr<char[]>* spare);
+	void load(shard& s, block* b, struct fuse_file_info* fi);
+	void sequential(fuse_ino_t ino, struct fuse_file_info* fi, off_t off, size_t size,
+		uint64_t last, bool eof);
+	void load_ahead(std::shared_ptr<stream> st, fuse_ino_t ino, uint64_t index);
+};
+
+#endif //! __COPPER_FUSE_BLOCK_CACHE_H__
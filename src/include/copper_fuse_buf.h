@@ -0,0 +1,82 @@
+/*
+  CopperFuse: C++ version Filesystem in Userspace
+  Copyright (C) 2023 Chen Miao <chenmiao.ku@gmail.com>
+
+  This program can be distributed under the terms of the GNU LGPLv2.
+  See the file COPYING.LIB.
+*/
+
+#ifndef __COPPER_FUSE_BUF_H__
+#define __COPPER_FUSE_BUF_H__
+
+#include <atomic>
+#include <cstddef>
+#include <mutex>
+#include <vector>
+
+/** Size of the huge pages receive buffers are made of */
+constexpr const size_t COPPER_FUSE_HUGE_PAGE = 2 << 20;
+
+/** Receive buffers kept around for workers started later */
+constexpr const size_t COPPER_FUSE_BUFPOOL_MAX = 16;
+
+/** How the memory of a receive buffer was obtained */
+enum copper_fuse_buf_kind {
+	/* Explicit huge pages from the hugetlb pool */
+	COPPER_FUSE_BUF_HUGETLB,
+	/* Transparent huge pages, granted by the kernel at its discretion */
+	COPPER_FUSE_BUF_THP,
+	/* Regular pages */
+	COPPER_FUSE_BUF_PAGES,
+};
+
+/** A buffer requests are read into */
+struct copper_fuse_recv_buf {
+	char* data;
+	size_t size;
+	/* Length of the mapping, `size` rounded up to whole pages */
+	size_t mapped;
+	enum copper_fuse_buf_kind kind;
+};
+
+/**
+ * Receive buffers of the loop workers
+ *
+ * A request carrying max_pages of payload needs a buffer that large,
+ * 1 MiB and more with a raised max_pages.  Buffers of at least half a
+ * huge page are mapped from 2 MiB huge pages, so a request spans one
+ * TLB entry, or failing that with transparent huge pages advised, and
+ * regular pages as the last resort.  Huge pages must be reserved with
+ * vm.nr_hugepages for the first choice to succeed.
+ *
+ * A worker holds on to its buffer for as long as it runs, a retiring
+ * worker returns it to the pool for the next one.
+ */
+struct copper_fuse_bufpool {
+	std::mutex lock;
+	std::vector<copper_fuse_recv_buf> free;
+	/* Try huge pages at all */
+	bool huge;
+
+	/* Buffers mapped so far, by kind */
+	std::atomic<unsigned> mapped[3];
+
+public:
+	copper_fuse_bufpool();
+	~copper_fuse_bufpool();
+
+	copper_fuse_bufpool(const copper_fuse_bufpool&) = delete;
+	copper_fuse_bufpool& operator= (const copper_fuse_bufpool&) = delete;
+
+	/**
+	 * A buffer of at least `size` bytes
+	 *
+	 * @return 0 on success, -ENOMEM
+	 */
+	int get(size_t size, copper_fuse_recv_buf* buf);
+
+	/** Give back a buffer from get() */
+	void put(copper_fuse_recv_buf* buf);
+};
+
+#endif //! __COPPER_FUSE_BUF_H__
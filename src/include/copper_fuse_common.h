@@ -12,9 +12,14 @@
 #ifndef __COPPER_FUSE_COMMON_H__
 #define __COPPER_FUSE_COMMON_H__
 
-#include "copper_cuse_lowlevel.h"
+#ifndef COPPER_FUSE_USE_VERSION
+#define COPPER_FUSE_USE_VERSION 29
+#endif
 
+#include <atomic>
 #include <cstddef>
+#include <cstdint>
+#include <functional>
 
 constexpr const size_t COPPER_FUSE_MAJOR = 1;
 constexpr const size_t COPPER_FUSE_MINOR = 1;
@@ -22,6 +27,95 @@ constexpr const size_t COPPER_FUSE_MINOR = 1;
 constexpr const size_t COPPER_FUSE_VERSION = 
 	COPPER_MAKE_VERSION(COPPER_FUSE_MAJOR, COPPER_FUSE_MINOR);
 
+#if defined (__cplusplus) && (__cplusplus >= 201703L)
+template <typename ret_type, typename... params_type>
+struct operators_wrapper {
+  // using type = std::variant<std::function<ret_type(params_type...)>, ret_type(*)(params_type...)>;
+	using type = std::function<ret_type(params_type...)>;
+};
+
+template <typename ret_type, typename... params_type>
+using operators_wrapper_type = typename operators_wrapper<ret_type, params_type...>::type;
+#else
+# define operators_wrapper_type(ret_type, params_type...) \
+    ret_type(*)(params_type)
+#endif
+
+/**
+ * Information about an open file.
+ *
+ * File Handles are created by the open, opendir, and create methods and closed
+ * by the release and releasedir methods.  Multiple file handles may be
+ * concurrently open for the same file.  Generally, a client will create one
+ * file handle per file descriptor, though in some cases multiple file
+ * descriptors can share a single file handle.
+ */
+struct fuse_file_info {
+	/** Open flags.	 Available in open() and release() */
+	int flags;
+
+	/** In case of a write operation indicates if this was caused
+	    by a delayed write from the page cache. If so, then the
+	    context's pid, uid, and gid fields will not be valid, and
+	    the *fh* value may not match the *fh* value that would
+	    have been sent with the corresponding individual write
+	    requests if write caching had been disabled. */
+	unsigned int writepage : 1;
+
+	/** Can be filled in by open/create, to use direct I/O on this file. */
+	unsigned int direct_io : 1;
+
+	/** Can be filled in by open and opendir. It signals the kernel that any
+	    currently cached data (ie., data that the filesystem provided the
+	    last time the file/directory was open) need not be invalidated when
+	    the file/directory is closed. */
+	unsigned int keep_cache : 1;
+
+	/** Can be filled by open/create, to allow parallel direct writes on this
+	 *  file */
+	unsigned int parallel_direct_writes : 1;
+
+	/** Indicates a flush operation.  Set in flush operation, also
+	    maybe set in highlevel lock operation and lowlevel release
+	    operation. */
+	unsigned int flush : 1;
+
+	/** Can be filled in by open, to indicate that the file is not
+	    seekable. */
+	unsigned int nonseekable : 1;
+
+	/* Indicates that flock locks for this file should be
+	   released.  If set, lock_owner shall contain a valid value.
+	   May only be set in ->release(). */
+	unsigned int flock_release : 1;
+
+	/** Can be filled in by opendir. It signals the kernel to
+	    enable caching of entries returned by readdir().  Has no
+	    effect when set in other contexts (in particular it does
+	    nothing when set by open()). */
+	unsigned int cache_readdir : 1;
+
+	/** Can be filled in by open, to indicate that flush is not needed
+	    on close. */
+	unsigned int noflush : 1;
+
+	/** Padding.  Reserved for future use*/
+	unsigned int padding : 23;
+	unsigned int padding2 : 32;
+
+	/** File handle id.  May be filled in by filesystem in create,
+	 * open, and opendir().  Available in most other file operations on the
+	 * same file handle. */
+	uint64_t fh;
+
+	/** Lock owner id.  Available in locking operations and flush */
+	uint64_t lock_owner;
+
+	/** Requested poll events.  Available in ->poll.  Only set on kernels
+	    which support it.  If unsupported, this field is set to zero. */
+	uint32_t poll_events;
+};
+
 /**
  * Configuration parameters passed to fuse_session_loop_mt() and
  * fuse_loop_mt().
@@ -48,13 +142,172 @@ struct fuse_loop_config_v1 {
 	 * Adjusting this has performance implications; a very small number
 	 * of threads in the pool will cause a lot of thread creation and
 	 * deletion overhead and performance may suffer. When set to 0, a new
-	 * thread will be created to service every operation.
+	 * thread will be created to service every operation.  Otherwise
+	 * the ones over the limit are deleted once there were too many
+	 * for a second.
 	 */
 	unsigned int max_idle_threads;
+
+	/**
+	 * The maximum number of worker threads the loop will create.
+	 */
+	unsigned int max_threads;
 };
 
+/**
+ * Connection information, passed to the ->init() method
+ *
+ * Some of the elements are read-write, these can be changed to
+ * indicate the value requested by the filesystem.  The requested
+ * value must usually be smaller than the indicated value.
+ *
+ * `capable` and `want` hold the FUSE_* init flags of the kernel
+ * protocol (copper_fuse_kernel.h), the second flag word shifted into
+ * the upper 32 bits.
+ */
 struct copper_fuse_conn_info {
+	/**
+	 * Major version of the protocol (read-only)
+	 */
+	unsigned proto_major;
+
+	/**
+	 * Minor version of the protocol (read-only)
+	 */
+	unsigned proto_minor;
+
+	/**
+	 * Maximum size of the write buffer
+	 */
+	unsigned max_write;
+
+	/**
+	 * Maximum size of read requests. A value of zero indicates no
+	 * limit. However, even if the filesystem does not specify a
+	 * limit, the maximum size of read requests will still be
+	 * limited by the kernel.
+	 */
+	unsigned max_read;
+
+	/**
+	 * Maximum readahead
+	 */
+	unsigned max_readahead;
+
+	/**
+	 * Capability flags that the kernel supports (read-only)
+	 */
+	uint64_t capable;
+
+	/**
+	 * Capability flags that the filesystem wants to enable.
+	 *
+	 * libfuse attempts to initialize this field with
+	 * reasonable default values before calling the init() handler.
+	 */
+	uint64_t want;
+
+	/**
+	 * Maximum number of pending "background" requests. A
+	 * background request is any type of request for which the
+	 * total number is not limited by other means. As of kernel
+	 * 4.8, only two types of requests fall into this category:
+	 *
+	 *   1. Read-ahead requests
+	 *   2. Asynchronous direct I/O requests
+	 *
+	 * Read-ahead requests are generated (if max_readahead is
+	 * non-zero) by the kernel to preemptively fill its caches
+	 * when it anticipates that userspace will soon read more
+	 * data.
+	 *
+	 * Asynchronous direct I/O requests are generated if
+	 * FUSE_CAP_ASYNC_DIO is enabled and userspace submits a large
+	 * direct I/O request. In this case the kernel will internally
+	 * split it up into multiple smaller requests and submit them
+	 * to the filesystem concurrently.
+	 *
+	 * Note that the following requests are *not* background
+	 * requests: writeback requests (limited by the kernel's
+	 * flusher algorithm), regular (i.e., synchronous and
+	 * buffered) userspace read/write requests (limited to one per
+	 * thread), asynchronous read requests (Linux's io_submit(2)
+	 * call actually blocks, so these are also limited to one per
+	 * thread).
+	 */
+	unsigned max_background;
+
+	/**
+	 * Kernel congestion threshold parameter. If the number of pending
+	 * background requests exceeds this number, the FUSE kernel module will
+	 * mark the filesystem as "congested". This instructs the kernel to
+	 * expect that queued requests will take some time to complete, and to
+	 * adjust its algorithms accordingly (e.g. by putting a waiting thread
+	 * to sleep instead of using a busy-loop).
+	 */
+	unsigned congestion_threshold;
+
+	/**
+	 * When FUSE_CAP_WRITEBACK_CACHE is enabled, the kernel is responsible
+	 * for updating mtime and ctime when write requests are received. The
+	 * updated values are passed to the filesystem with setattr() requests.
+	 * However, if the filesystem does not support the full resolution of
+	 * the kernel timestamps (nanoseconds), the mtime and ctime values used
+	 * by kernel and filesystem will differ (and result in an apparent
+	 * change of times after a cache flush).
+	 *
+	 * To prevent this problem, this variable can be used to inform the
+	 * kernel about the timestamp granularity supported by the file-system.
+	 * The value should be power of 10.  The default is 1, i.e. full
+	 * nano-second resolution. Filesystems supporting only second resolution
+	 * should set this to 1000000000.
+	 */
+	unsigned time_gran;
+
+	/**
+	 * Bounds of an adaptive max_background.  When max_background_max
+	 * is non-zero, the library moves max_background between the two,
+	 * starting from the value above, to keep READ and WRITE requests
+	 * from queueing up in the filesystem.  congestion_threshold follows
+	 * at 3/4.  The kernel learns of new values through the fuse
+	 * control filesystem, see copper_fuse_congestion.h.
+	 */
+	unsigned max_background_min;
+	unsigned max_background_max;
+
+	/**
+	 * Latency in microseconds above which READ and WRITE requests
+	 * count as queueing, whatever the unloaded latency.  Zero means
+	 * none, only used with an adaptive max_background.
+	 */
+	unsigned target_latency_us;
+
+	/**
+	 * Bytes of READ and WRITE requests a loop worker may have
+	 * dispatched without their reply before it stops reading new
+	 * requests.  Only filesystems replying asynchronously get that far.
+	 * Zero means no limit.
+	 */
+	size_t max_inflight_bytes;
+};
+
+/**
+ * Cancellation state of a request
+ *
+ * Set once the kernel interrupts the request, i.e. the calling process
+ * got a signal and gave up waiting.  Work started on behalf of the
+ * request may keep a reference past the reply and check it to stop
+ * early, the reply itself no longer matters by then.
+ */
+struct copper_fuse_cancel_token {
+	std::atomic<bool> cancelled;
+
+public:
+	copper_fuse_cancel_token() : cancelled(false) {}
 
+	bool is_cancelled() const {
+		return cancelled.load(std::memory_order_acquire);
+	}
 };
 
 #endif //! __COPPER_FUSE_COMMON_H__
\ No newline at end of file
@@ -0,0 +1,142 @@
+/*
+  CopperFuse: C++ version Filesystem in Userspace
+  Copyright (C) 2023 Chen Miao <chenmiao.ku@gmail.com>
+
+  This program can be distributed under the terms of the GNU LGPLv2.
+  See the file COPYING.LIB.
+*/
+
+#ifndef __COPPER_FUSE_CONGESTION_H__
+#define __COPPER_FUSE_CONGESTION_H__
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+
+struct copper_fuse_conn_info;
+struct copper_fuse_req;
+struct copper_fuse_session;
+
+/** How often the background limit is reconsidered, in nanoseconds */
+constexpr const int64_t COPPER_FUSE_CONGESTION_PERIOD = 100 * 1000 * 1000;
+
+/** Periods over which the unloaded latency is the best average seen */
+constexpr const unsigned COPPER_FUSE_CONGESTION_WINDOW = 8;
+
+/** The kernel keeps max_background in 16 bits */
+constexpr const unsigned COPPER_FUSE_MAX_BACKGROUND = 65535;
+
+/**
+ * Bytes of READ and WRITE requests a loop worker dispatched that still
+ * wait for their reply
+ *
+ * Shared by the worker and its requests, a filesystem replying from
+ * its own threads may finish them after the worker is gone.
+ */
+struct copper_fuse_budget {
+	std::mutex lock;
+	std::condition_variable cond;
+	std::atomic<size_t> bytes;
+	std::atomic<bool> waiting;
+
+public:
+	copper_fuse_budget() : bytes(0), waiting(false) {}
+};
+
+/**
+ * Congestion control of background requests
+ *
+ * With async reads and writeback caching the kernel keeps up to
+ * max_background requests queued at the daemon.  Too few leave the
+ * backend idle, too many only queue up in it, costing memory and
+ * latency.  The controller times READ and WRITE requests from
+ * dispatch to reply and, every COPPER_FUSE_CONGESTION_PERIOD, compares
+ * their average latency to the unloaded one, the best average of the
+ * last COPPER_FUSE_CONGESTION_WINDOW periods:
+ *
+ *   - above 3/2 of it, or above the target latency if one is set,
+ *     requests are queueing: the limit drops by a quarter
+ *   - below 5/4 of it while the limit was reached, the backend keeps
+ *     up: the limit grows by an eighth
+ *
+ * within [max_background_min, max_background_max].  congestion_threshold
+ * follows at 3/4 of the limit, the kernel's own ratio.  New values reach
+ * the kernel through its control filesystem, which takes privileges,
+ * /sys/fs/fuse/connections/N/{max_background,congestion_threshold}.
+ *
+ * Independently, a loop worker stops reading requests while those it
+ * dispatched and that still wait for their reply exceed
+ * max_inflight_bytes.  The kernel keeps the rest queued, which bounds
+ * the memory a filesystem replying asynchronously can take.
+ */
+struct copper_fuse_congestion {
+	/* Set up at INIT from copper_fuse_conn_info, fixed afterwards */
+	bool adaptive;
+	unsigned min;
+	unsigned max;
+	int64_t target;
+	/* Checked by every worker before reading, even before INIT */
+	std::atomic<size_t> max_inflight_bytes;
+
+	std::atomic<unsigned> limit;
+	std::atomic<unsigned> threshold;
+
+	/* Gathered during the current period */
+	std::atomic<uint64_t> lat_sum;
+	std::atomic<uint64_t> lat_count;
+	std::atomic<unsigned> inflight;
+	std::atomic<unsigned> peak;
+	std::atomic<int64_t> next_tick;
+
+	/* Taken by the request completing the period */
+	std::mutex lock;
+	uint64_t mins[COPPER_FUSE_CONGESTION_WINDOW];
+	unsigned period;
+	uint64_t noload;
+	uint64_t last_avg;
+	/* Control files of the connection, -2 until looked up */
+	int ctl_bg;
+	int ctl_cong;
+
+public:
+	copper_fuse_congestion();
+	~copper_fuse_congestion();
+
+	copper_fuse_congestion(const copper_fuse_congestion&) = delete;
+	copper_fuse_congestion& operator= (const copper_fuse_congestion&) = delete;
+
+	/** Take the knobs and the starting limit out of `conn` */
+	void setup(const struct copper_fuse_conn_info* conn);
+
+	/** Account a READ or WRITE of `bytes` being dispatched */
+	void start(copper_fuse_req* req, size_t bytes,
+		const std::shared_ptr<copper_fuse_budget>& budget);
+
+	/** Account the reply to a request passed to start() */
+	void complete(copper_fuse_req* req);
+
+	/**
+	 * Wait until `budget` has room for another request
+	 *
+	 * @return false if the session exited meanwhile
+	 */
+	bool admit(copper_fuse_session* se, copper_fuse_budget* budget);
+
+	/** Current background limit */
+	unsigned background() const;
+
+	/** Smoothed READ and WRITE latency of the last period, in nanoseconds */
+	uint64_t latency();
+
+private:
+	/* Reconsider the limit at the end of a period */
+	void adjust(copper_fuse_session* se);
+	/* Tell the kernel about a new limit */
+	void apply(copper_fuse_session* se, unsigned bg, unsigned cong);
+};
+
+#endif //! __COPPER_FUSE_CONGESTION_H__
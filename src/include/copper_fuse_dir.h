@@ -0,0 +1,137 @@
+/*
+  CopperFuse: C++ version Filesystem in Userspace
+  Copyright (C) 2023 Chen Miao <chenmiao.ku@gmail.com>
+
+  This program can be distributed under the terms of the GNU LGPLv2.
+  See the file COPYING.LIB.
+*/
+
+#ifndef __COPPER_FUSE_DIR_H__
+#define __COPPER_FUSE_DIR_H__
+
+#include "copper_fuse_handoff.h"
+#include "copper_fuse_lowlevel.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <ctime>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/** What identifies a version of a directory, from its attributes */
+struct copper_fuse_dir_sig {
+	struct timespec mtime;
+	struct timespec ctime;
+	off_t size;
+
+public:
+	/** Known, a filesystem reporting no times gives no way to tell versions apart */
+	bool valid() const;
+	bool operator== (const copper_fuse_dir_sig& other) const;
+};
+
+/**
+ * A complete listing of a directory, immutable once built
+ *
+ * Entries keep the inode number and type a READDIR reply carries, the
+ * names are packed one after the other in `names`.  The offset of an
+ * entry is its position plus one, so a continuation costs no search
+ * and stays valid for as long as the listing lives.
+ */
+struct copper_fuse_dir_snapshot {
+	struct entry {
+		uint64_t ino;
+		uint32_t name;
+		uint16_t len;
+		uint16_t type;
+	};
+
+	std::vector<entry> entries;
+	std::string names;
+	copper_fuse_dir_sig sig;
+
+public:
+	/**
+	 * Append an entry
+	 *
+	 * @return 0 on success, -ENAMETOOLONG or -ENOMEM
+	 */
+	int add(const char* name, uint64_t ino, mode_t type);
+
+	/**
+	 * Encode the entries after offset `off` into `buf`
+	 *
+	 * @return bytes used, 0 at the end of the listing
+	 */
+	size_t fill(char* buf, size_t size, off_t off) const;
+
+	void save(copper_fuse_snapshot_writer* w) const;
+	bool restore(copper_fuse_snapshot_reader* r);
+};
+
+/** A directory opened by the kernel, its fh is the key in copper_fuse_dir_table */
+struct copper_fuse_dir_handle {
+	fuse_ino_t nodeid;
+	/* The filesystem's handle and flags from ->opendir() */
+	struct fuse_file_info fi;
+	copper_fuse_dir_sig sig;
+
+	/* Serializes the listing of one handle, the kernel does not */
+	std::mutex lock;
+	std::shared_ptr<const copper_fuse_dir_snapshot> snap;
+};
+
+/**
+ * Open directories of the high-level API and their listings
+ *
+ * A directory is listed with a single ->readdir() call, which sees a
+ * filler that never runs out of space, into a snapshot that serves
+ * every READDIR of the handle.  A listing of 1M entries then costs one
+ * pass over the backend instead of one per reply buffer.  A rewind,
+ * offset 0 again, lists the directory anew.
+ *
+ * The latest snapshot of a directory is shared with the handles
+ * opened later, as long as the directory's mtime, ctime and size did
+ * not move and nothing changed it through this mount.  A snapshot goes
+ * with the last handle using it.
+ */
+struct copper_fuse_dir_table {
+	std::mutex lock;
+	std::unordered_map<uint64_t, std::unique_ptr<copper_fuse_dir_handle>> handles;
+	uint64_t next_fh;
+	std::unordered_map<fuse_ino_t, std::weak_ptr<const copper_fuse_dir_snapshot>> shared;
+
+public:
+	copper_fuse_dir_table() : next_fh(1) {}
+
+	copper_fuse_dir_table(const copper_fuse_dir_table&) = delete;
+	copper_fuse_dir_table& operator= (const copper_fuse_dir_table&) = delete;
+
+	/** Register an open directory, returning the fh for the kernel */
+	uint64_t add(std::unique_ptr<copper_fuse_dir_handle> dh);
+
+	/** The handle of `fh`, valid until remove() */
+	copper_fuse_dir_handle* get(uint64_t fh);
+
+	/** Unregister `fh`, dropping its listing */
+	std::unique_ptr<copper_fuse_dir_handle> remove(uint64_t fh);
+
+	/** The shared listing of `nodeid` if it is still that of version `sig` */
+	std::shared_ptr<const copper_fuse_dir_snapshot> find(fuse_ino_t nodeid,
+		const copper_fuse_dir_sig& sig);
+
+	/** Offer `snap` to the handles opened later */
+	void publish(fuse_ino_t nodeid, const std::shared_ptr<const copper_fuse_dir_snapshot>& snap);
+
+	/** `nodeid` changed through the mount, stop sharing its listing */
+	void changed(fuse_ino_t nodeid);
+
+	/** Open handles with their listings, for a handoff */
+	void save(copper_fuse_snapshot_writer* w);
+	int restore(copper_fuse_snapshot_reader* r);
+};
+
+#endif //! __COPPER_FUSE_DIR_H__
@@ -0,0 +1,232 @@
+/*
+  CopperFuse: C++ version Filesystem in Userspace
+  Copyright (C) 2023 Chen Miao <chenmiao.ku@gmail.com>
+
+  This program can be distributed under the terms of the GNU LGPLv2.
+  See the file COPYING.LIB.
+*/
+
+#ifndef __COPPER_FUSE_FAIR_H__
+#define __COPPER_FUSE_FAIR_H__
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+
+struct fuse_in_header;
+struct copper_fuse_req;
+struct copper_fuse_session;
+
+/** Number of independently locked parts of the tenant table */
+constexpr const unsigned COPPER_FUSE_FAIR_SHARDS = 64;
+
+/** Requests dispatched at once when fairness is on and no slots are given */
+constexpr const unsigned COPPER_FUSE_FAIR_SLOTS = 8;
+
+/** What a request weighs in the round-robin besides its bytes */
+constexpr const size_t COPPER_FUSE_FAIR_OP_COST = 4096;
+
+/** Credit a tenant of weight 1 receives per round */
+constexpr const size_t COPPER_FUSE_FAIR_QUANTUM = 64 << 10;
+
+/** Tenant keys at or above this one are not user IDs */
+constexpr const uint64_t COPPER_FUSE_TENANT_PATH = 1ULL << 32;
+
+/** Limits of one tenant, zero rates are unlimited */
+struct copper_fuse_tenant_limits {
+	double ops_per_sec = 0;
+	/* READ and WRITE payload */
+	double bytes_per_sec = 0;
+	/* Seconds worth of tokens a bucket holds */
+	double burst = 1.0;
+	/* Share of the dispatch slots when tenants compete */
+	unsigned weight = 1;
+};
+
+struct copper_fuse_token_bucket {
+	double rate;
+	double capacity;
+	double tokens;
+	int64_t stamp;
+
+public:
+	void setup(double _rate, double burst, int64_t now);
+
+	/**
+	 * Whether `cost` may be taken
+	 *
+	 * A bucket must hold `cost`, or be full for a cost beyond its
+	 * capacity, and may then go into debt.
+	 *
+	 * @return 0 if it may, or nanoseconds until it may
+	 */
+	int64_t check(double cost, int64_t now);
+
+	void take(double cost);
+};
+
+/** A request waiting for its turn, with its own copy of the request */
+struct copper_fuse_fair_item {
+	copper_fuse_req* req;
+	std::unique_ptr<char[]> buf;
+	size_t bytes;
+};
+
+struct copper_fuse_tenant {
+	uint64_t key;
+
+	/* Guards the buckets and `limits` */
+	std::mutex lock;
+	copper_fuse_tenant_limits limits;
+	copper_fuse_token_bucket ops;
+	copper_fuse_token_bucket bytes;
+
+	/* Has limits of its own, set_default() leaves it alone */
+	std::atomic<bool> custom;
+
+	/* Requests queued, read without the scheduler lock */
+	std::atomic<size_t> waiting;
+
+	/* Under the scheduler lock */
+	std::deque<copper_fuse_fair_item> queue;
+	size_t deficit;
+	bool active;
+	/* At the front of the round and credited for it */
+	bool turn;
+	std::atomic<size_t> quantum;
+
+	/* Requests let through, and those of them that had to queue */
+	std::atomic<uint64_t> dispatched;
+	std::atomic<uint64_t> delayed;
+
+public:
+	copper_fuse_tenant(uint64_t _key, const copper_fuse_tenant_limits& _limits, int64_t now);
+
+	/** Take the tokens of a request of `bytes` if there are enough */
+	int64_t take(size_t bytes, int64_t now);
+
+	void set_limits(const copper_fuse_tenant_limits& _limits, int64_t now);
+};
+
+/**
+ * Per tenant rate limiting and fair dispatch
+ *
+ * Requests are attributed to a tenant, the user ID of the caller unless
+ * `classify` says otherwise.  Each tenant has token buckets for its
+ * operations and its READ and WRITE bytes per second, and a weight.  At
+ * most `slots` requests are dispatched to the filesystem at once, until
+ * their reply.
+ *
+ * A request whose tenant has nothing queued, while a slot is free and
+ * its buckets have enough tokens, is dispatched right away by the worker
+ * that read it: one tenant lock and a few atomics.  Otherwise it is
+ * copied into its tenant's queue and the worker goes back to reading,
+ * so a throttled or noisy tenant ties up no worker.  Queued requests are
+ * dispatched by deficit round-robin among the tenants that have tokens:
+ * a tenant whose turn comes receives COPPER_FUSE_FAIR_QUANTUM of credit
+ * times its weight and is served until it runs out, a request costing
+ * COPPER_FUSE_FAIR_OP_COST plus its bytes.
+ *
+ * Workers dispatch queued requests after their own; a pump thread,
+ * started with the first queued request, does when a reply from another
+ * thread frees a slot or when tokens come back.  FORGET, INTERRUPT,
+ * RELEASE and the like are never held back.
+ *
+ * Configure before the loop starts, limits may change at any time.
+ * When disabled, the only cost is a relaxed load per request.
+ */
+struct copper_fuse_fair {
+	struct shard {
+		std::mutex lock;
+		std::unordered_map<uint64_t, std::unique_ptr<copper_fuse_tenant>> tenants;
+	};
+
+	std::atomic<bool> enabled;
+	unsigned slots;
+	std::atomic<unsigned> inflight;
+	std::atomic<size_t> queued;
+
+	/**
+	 * Tenant of a request, the caller's user ID when unset
+	 *
+	 * Runs for every request in the worker that read it.
+	 */
+	std::function<uint64_t(const struct fuse_in_header* in, const void* inarg)> classify;
+
+	shard shards[COPPER_FUSE_FAIR_SHARDS];
+	std::mutex defaults_lock;
+	copper_fuse_tenant_limits defaults;
+
+	/* The scheduler */
+	std::mutex lock;
+	std::condition_variable cond;
+	std::deque<copper_fuse_tenant*> active;
+	bool kick;
+	int64_t wake_at;
+	bool stopping;
+	std::thread pump;
+
+public:
+	copper_fuse_fair();
+	~copper_fuse_fair();
+
+	copper_fuse_fair(const copper_fuse_fair&) = delete;
+	copper_fuse_fair& operator= (const copper_fuse_fair&) = delete;
+
+	/** Turn fairness on with `slots` requests dispatched at once */
+	void setup(unsigned _slots = COPPER_FUSE_FAIR_SLOTS);
+
+	/** Limits of tenants without limits of their own */
+	void set_default(const copper_fuse_tenant_limits& limits);
+
+	/** Limits of tenant `key`, a user ID or a key `classify` returns */
+	void set_limits(uint64_t key, const copper_fuse_tenant_limits& limits);
+
+	/**
+	 * Dispatch counts of tenant `key`
+	 *
+	 * @return false if the tenant is unknown
+	 */
+	bool stats(uint64_t key, uint64_t* dispatched, uint64_t* delayed);
+
+	/**
+	 * Admit a decoded request
+	 *
+	 * @return true if it was queued, false if the caller dispatches it
+	 */
+	bool submit(copper_fuse_session* se, copper_fuse_req* req, const char* buf, size_t len);
+
+	/** Account the reply to a request submit() let through */
+	void complete(copper_fuse_req* req);
+
+	/** Dispatch queued requests while there are slots and tokens */
+	void run(copper_fuse_session* se);
+
+	/** Dispatch everything queued regardless of limits, stop the pump */
+	void flush(copper_fuse_session* se);
+
+	/** Requests are queued */
+	bool backlog() const {
+		return queued.load(std::memory_order_relaxed) != 0;
+	}
+
+private:
+	copper_fuse_tenant* tenant_of(uint64_t key, int64_t now);
+	bool try_slot();
+	void release_slot();
+	/* Take the next request by deficit round-robin, the lock held */
+	bool pick(copper_fuse_fair_item* item, int64_t now);
+	/* Queue `item` on `t`, the lock held */
+	void enqueue(copper_fuse_tenant* t, copper_fuse_fair_item&& item);
+	void pump_run(copper_fuse_session* se);
+	void start_pump(copper_fuse_session* se);
+};
+
+#endif //! __COPPER_FUSE_FAIR_H__
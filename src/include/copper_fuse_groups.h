@@ -0,0 +1,94 @@
+/*
+  CopperFuse: C++ version Filesystem in Userspace
+  Copyright (C) 2023 Chen Miao <chenmiao.ku@gmail.com>
+
+  This program can be distributed under the terms of the GNU LGPLv2.
+  See the file COPYING.LIB.
+*/
+
+#ifndef __COPPER_FUSE_GROUPS_H__
+#define __COPPER_FUSE_GROUPS_H__
+
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <sys/types.h>
+#include <unordered_map>
+#include <vector>
+
+/** Number of independently locked parts of the groups cache */
+constexpr const unsigned COPPER_FUSE_GROUPS_SHARDS = 64;
+
+/** Seconds the groups of a process are trusted */
+constexpr const double COPPER_FUSE_GROUPS_TTL = 1.0;
+
+/** Processes remembered per shard, expired ones are evicted first */
+constexpr const size_t COPPER_FUSE_GROUPS_PER_SHARD = 256;
+
+struct copper_fuse_groups_entry {
+	uid_t uid;
+	gid_t gid;
+	/* Of the thread, in clock ticks since boot, tells a reused pid apart */
+	uint64_t start_time;
+	int64_t expires;
+	std::vector<gid_t> groups;
+};
+
+/**
+ * Supplementary groups of the callers, keyed by thread ID
+ *
+ * The kernel only sends the uid, gid and pid of a caller; its
+ * supplementary groups are read from /proc/<pid>/task/<pid>/status the
+ * first time they are asked for and kept for `ttl` seconds.  An entry
+ * is only used while the uid and gid of the request and the start time
+ * of the thread, read from /proc/<pid>/task/<pid>/stat on every call,
+ * match it, so a reused pid or a setuid() does not inherit stale
+ * groups.
+ */
+struct copper_fuse_groups_cache {
+	struct shard {
+		std::mutex lock;
+		std::unordered_map<pid_t, copper_fuse_groups_entry> procs;
+	};
+
+	shard  shards[COPPER_FUSE_GROUPS_SHARDS];
+	double ttl;
+
+public:
+	copper_fuse_groups_cache(double _ttl = COPPER_FUSE_GROUPS_TTL) : ttl(_ttl) {}
+
+	copper_fuse_groups_cache(const copper_fuse_groups_cache&) = delete;
+	copper_fuse_groups_cache& operator= (const copper_fuse_groups_cache&) = delete;
+
+	/**
+	 * Supplementary groups of `pid`, at most `size` stored in `list`
+	 *
+	 * @return total number of groups, or -errno if they could not
+	 *         be read, e.g. -ESRCH when the process is gone
+	 */
+	int get(pid_t pid, uid_t uid, gid_t gid, int size, gid_t list[]);
+
+	/** Forget `pid`, or everybody if `pid` is 0 */
+	void invalidate(pid_t pid);
+
+private:
+	shard& shard_of(pid_t pid) {
+		return shards[((uint64_t)pid * 0x9e3779b97f4a7c15ULL) >> 58];
+	}
+};
+
+/**
+ * Read the supplementary groups of thread `pid` from /proc
+ *
+ * @return 0 on success, -errno on failure
+ */
+int copper_fuse_read_groups(pid_t pid, std::vector<gid_t>* groups);
+
+/**
+ * Read the start time of thread `pid`, field 22 of its stat file
+ *
+ * @return 0 on success, -errno on failure
+ */
+int copper_fuse_read_start_time(pid_t pid, uint64_t* start_time);
+
+#endif //! __COPPER_FUSE_GROUPS_H__
@@ -0,0 +1,111 @@
+/*
+  CopperFuse: C++ version Filesystem in Userspace
+  Copyright (C) 2023 Chen Miao <chenmiao.ku@gmail.com>
+
+  This program can be distributed under the terms of the GNU LGPLv2.
+  See the file COPYING.LIB.
+*/
+
+#ifndef __COPPER_FUSE_HANDOFF_H__
+#define __COPPER_FUSE_HANDOFF_H__
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <type_traits>
+
+/**
+ * Live restart
+ *
+ * A daemon being replaced stops its loop, then hands the open /dev/fuse
+ * descriptor to its successor over a unix stream socket, followed by a
+ * snapshot of what the kernel still refers to: the negotiated
+ * connection, the node table, file locks and parked lock requests, and
+ * whatever the filesystem saves itself.  Requests the kernel queued
+ * meanwhile are read by the successor, none is lost or answered twice.
+ *
+ * On the wire: a copper_fuse_handoff_hdr carrying the descriptor in
+ * SCM_RIGHTS, then `size` bytes of snapshot.  Both processes must run
+ * the same COPPER_FUSE_HANDOFF_VERSION.
+ */
+
+#define COPPER_FUSE_HANDOFF_MAGIC 0x4f484643u	/* "CFHO" */
+
+/** Layout version of the snapshot, bumped on any change */
+constexpr const uint32_t COPPER_FUSE_HANDOFF_VERSION = 3;
+
+struct copper_fuse_handoff_hdr {
+	uint32_t magic;
+	uint32_t version;
+	uint64_t size;
+};
+
+/** Builds a snapshot out of fixed size values and strings */
+struct copper_fuse_snapshot_writer {
+	std::string buf;
+
+public:
+	template <typename T>
+	void put(T v) {
+		static_assert(std::is_trivially_copyable<T>::value, "raw values only");
+		buf.append(reinterpret_cast<const char*>(&v), sizeof(v));
+	}
+
+	void put_str(const std::string& s) {
+		put<uint64_t>(s.size());
+		buf.append(s);
+	}
+};
+
+/** Reads what copper_fuse_snapshot_writer wrote, any overrun fails the rest */
+struct copper_fuse_snapshot_reader {
+	const char* p;
+	const char* end;
+	bool failed;
+
+public:
+	copper_fuse_snapshot_reader(const std::string& s)
+		: p(s.data()), end(s.data() + s.size()), failed(false) {}
+
+	template <typename T>
+	bool get(T* v) {
+		static_assert(std::is_trivially_copyable<T>::value, "raw values only");
+		if (failed || (size_t)(end - p) < sizeof(*v))
+			return !(failed = true);
+		memcpy(v, p, sizeof(*v));
+		p += sizeof(*v);
+		return true;
+	}
+
+	bool get_str(std::string* s) {
+		uint64_t size;
+		if (!get(&size) || (uint64_t)(end - p) < size)
+			return !(failed = true);
+		s->assign(p, size);
+		p += size;
+		return true;
+	}
+
+	/** All read and nothing failed */
+	bool done() const {
+		return !failed && p == end;
+	}
+};
+
+/**
+ * Send `fd` and `snapshot` over the stream socket `sock`
+ *
+ * @return 0 on success, -errno on failure
+ */
+int copper_fuse_handoff_send(int sock, int fd, const std::string& snapshot);
+
+/**
+ * Receive what copper_fuse_handoff_send() sent
+ *
+ * @return 0 on success, -EPROTO on a foreign or mismatched peer,
+ *         -errno on failure
+ */
+int copper_fuse_handoff_recv(int sock, int* fd, std::string* snapshot);
+
+#endif //! __COPPER_FUSE_HANDOFF_H__
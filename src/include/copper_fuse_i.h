@@ -0,0 +1,219 @@
+/*
+  FUSE: Filesystem in Userspace
+  Copyright (C) 2001-2007  Miklos Szeredi <miklos@szeredi.hu>
+
+  This program can be distributed under the terms of the GNU LGPLv2.
+  See the file COPYING.LIB
+
+  CopperFuse: C++ version Filesystem in Userspace
+  Copyright (C) 2023 Chen Miao <chenmiao.ku@gmail.com>
+*/
+
+#ifndef __COPPER_FUSE_I_H__
+#define __COPPER_FUSE_I_H__
+
+#include "copper_cuse_lowlevel.h"
+#include "copper_fuse.h"
+#include "copper_fuse_block_cache.h"
+#include "copper_fuse_dir.h"
+#include "copper_fuse_lock.h"
+#include "copper_fuse_lookup.h"
+#include "copper_fuse_lowlevel.h"
+#include "copper_fuse_node.h"
+#include "copper_fuse_opt.h"
+#include "copper_fuse_path.h"
+#include "copper_fuse_perm.h"
+#include "copper_fuse_pool.h"
+#include "copper_fuse_write_behind.h"
+#include "copper_fuse_xattr_cache.h"
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+/** ----------------------------------------------------------- *
+ * High-level library internals				       *
+ * ------------------------------------------------------------ */
+
+/** Default size of the pieces of a library performed copy */
+constexpr const size_t COPPER_FUSE_DEFAULT_COPY_CHUNK = 1 << 20;
+
+/** Default number of threads working on one library performed copy */
+constexpr const unsigned COPPER_FUSE_DEFAULT_COPY_THREADS = 4;
+
+/** Default age in seconds at which a write-behind extent is written out */
+constexpr const double COPPER_FUSE_DEFAULT_WRITE_BEHIND_TIMEOUT = 0.05;
+
+/** Default size of the blocks of the block cache */
+constexpr const size_t COPPER_FUSE_DEFAULT_BLOCK_SIZE = 128 << 10;
+
+/** Default number of blocks the block cache reads ahead, and threads doing it */
+constexpr const unsigned COPPER_FUSE_DEFAULT_READAHEAD = 16;
+constexpr const unsigned COPPER_FUSE_DEFAULT_READAHEAD_THREADS = 4;
+
+struct copper_fuse {
+	struct copper_fuse_session* se;
+	struct copper_fuse_operations op;
+	struct copper_fuse_config conf;
+	void* user_data;
+
+	/** Names of the nodes, outlives the node tables */
+	copper_fuse_atom_table atoms;
+
+	/** The nodes known to the kernel, and those remembered */
+	copper_fuse_node_table nodes;
+
+	/** Helpers of library performed copies, see copy_range() */
+	std::unique_ptr<copper_fuse_pool> copy_pool;
+
+	/** Only set when conf.xattr_timeout is positive */
+	std::unique_ptr<copper_fuse_xattr_cache> xattr_cache;
+
+	/** Only set when conf.check_permissions is */
+	std::unique_ptr<copper_fuse_perm_cache> perms;
+
+	/** Only set when conf.write_behind is */
+	std::unique_ptr<copper_fuse_write_behind> write_behind;
+
+	/** Only set when conf.block_cache is */
+	std::unique_ptr<copper_fuse_block_cache> block_cache;
+
+	/** File locks, unless the filesystem implements ->lock() and ->flock() */
+	copper_fuse_lock_manager locks;
+
+	/** Open directories and their listings */
+	copper_fuse_dir_table dirs;
+
+	/** Lookups in flight and names known missing */
+	copper_fuse_lookup_table lookups;
+
+	/** The handler of conf.intr_signal was installed by init() */
+	int intr_installed;
+
+	/** Makes the names of hidden files unique */
+	std::atomic<unsigned> hidectr;
+
+	/** Prefixes of set_path_limits(), tenant COPPER_FUSE_TENANT_PATH + index */
+	std::shared_mutex path_rules_lock;
+	std::vector<std::string> path_rules;
+
+public:
+	copper_fuse(const struct copper_fuse_operations* _op, void* _user_data);
+	~copper_fuse();
+
+	copper_fuse(const copper_fuse&) = delete;
+	copper_fuse& operator= (const copper_fuse&) = delete;
+
+	/**
+	 * Parse the library options out of `args` and create the session
+	 *
+	 * @return 0 on success, -1 on failure
+	 */
+	int init(struct copper_fuse_args* args);
+
+	int mount(const char* mountpoint);
+	void unmount();
+	int loop();
+	int loop_mt(const struct copper_fuse_loop_config* config);
+	void exit();
+
+	/**
+	 * Hand the mount over to a new process, once the loop returned
+	 *
+	 * Sends the node table, the file locks with their waiters, the
+	 * open directories and ->save_state() along with the connection,
+	 * see copper_fuse_session::handoff().  exit() stops loop_mt() right
+	 * away, loop() only after one more request.
+	 *
+	 * @return 0 on success, -errno on failure
+	 */
+	int handoff(int sock);
+
+	/**
+	 * Take the mount over from handoff(), in place of mount()
+	 *
+	 * @return 0 on success, -errno on failure
+	 */
+	int takeover(int sock);
+
+	/**
+	 * Build the path of `nodeid`, with `name` appended if not null
+	 *
+	 * @return 0 on success, -ENOENT if the node is gone
+	 */
+	int get_path(fuse_ino_t nodeid, const char* name, std::string* path);
+
+	/** Find or create the node of `name` in `parent` and count one lookup */
+	std::shared_ptr<copper_fuse_node> find_node(fuse_ino_t parent, const char* name);
+	/** The nodeid of `name` in `parent` if the kernel knows it, FUSE_UNKNOWN_INO otherwise */
+	fuse_ino_t lookup_nodeid(fuse_ino_t parent, const char* name);
+	void forget_node(fuse_ino_t nodeid, uint64_t nlookup);
+
+	/**
+	 * Copy `len` bytes between two open files without a filesystem
+	 * copy_file_range handler
+	 *
+	 * The range is split into `conf.copy_chunk_size` pieces which are
+	 * copied by up to `conf.copy_threads` threads, the calling thread
+	 * included.  The pieces are moved with copy_file_range(2) when
+	 * ->backing_fd() yields a descriptor for both files, and through
+	 * ->read() and ->write() otherwise.
+	 *
+	 * @return bytes copied, the prefix of the range up to the first
+	 *         short or failed piece, or -errno if nothing was copied
+	 */
+	ssize_t copy_range(const char* path_in, struct fuse_file_info* fi_in, off_t off_in,
+		const char* path_out, struct fuse_file_info* fi_out, off_t off_out, size_t len);
+
+	/**
+	 * Fetch the value of `name`, or the list if `name` is null, from
+	 * the cache or with a single filesystem call
+	 *
+	 * @return 0 on success, -errno otherwise
+	 */
+	int get_xattr(fuse_ino_t nodeid, const char* path, const char* name, std::string* value);
+
+	/**
+	 * Limit the requests on nodes under `prefix`, an absolute path
+	 *
+	 * Such requests count for a tenant of their own instead of their
+	 * user, the longest matching prefix deciding; the rest stay with
+	 * their user.  Turns fairness on, see copper_fuse_fair.  The first
+	 * rule goes before the loop starts, later rules and the limits of
+	 * any may come any time.
+	 *
+	 * @return 0 on success, -EINVAL if `prefix` is not absolute
+	 */
+	int set_path_limits(const char* prefix, const copper_fuse_tenant_limits& limits);
+
+private:
+	/* Classifier of the session's copper_fuse_fair once there are path rules */
+	uint64_t tenant_of(const struct fuse_in_header* in);
+};
+
+/** ----------------------------------------------------------- *
+ * CUSE internals					       *
+ * ------------------------------------------------------------ */
+
+struct copper_cuse_data {
+	struct copper_cuse_lowlevel_ops clop;
+	unsigned max_read;
+	unsigned dev_major;
+	unsigned dev_minor;
+	unsigned flags;
+	/* The "KEY=value" strings of the device, each NUL terminated */
+	std::string dev_info;
+};
+
+/** Handler of CUSE_INIT, the first request of a character device */
+void copper_cuse_lowlevel_init(copper_fuse_req_t req, fuse_ino_t nodeid, const void* inarg);
+
+#endif //! __COPPER_FUSE_I_H__
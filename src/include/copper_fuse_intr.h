@@ -0,0 +1,86 @@
+/*
+  CopperFuse: C++ version Filesystem in Userspace
+  Copyright (C) 2023 Chen Miao <chenmiao.ku@gmail.com>
+
+  This program can be distributed under the terms of the GNU LGPLv2.
+  See the file COPYING.LIB.
+*/
+
+#ifndef __COPPER_FUSE_INTR_H__
+#define __COPPER_FUSE_INTR_H__
+
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+struct copper_fuse_req;
+
+/** Number of independently locked parts of the interrupt registry */
+constexpr const unsigned COPPER_FUSE_INTR_SHARDS = 64;
+
+/**
+ * In-flight requests of a session, keyed by their unique id
+ *
+ * An INTERRUPT names the request it cancels by unique id, the registry
+ * finds it without scanning the requests in flight.  In a
+ * multi-threaded loop an INTERRUPT may be read before the request it
+ * refers to is registered, such INTERRUPTs are parked in the shard of
+ * their target and matched on its registration.  The ones whose target
+ * already completed are answered with EAGAIN when the next request of
+ * the shard comes in, the kernel resends them only if the target is
+ * still pending.
+ *
+ * A registered request is referenced by the thread working on it and
+ * by every INTERRUPT running its callback, it is freed when the last
+ * one lets go.
+ */
+struct copper_fuse_intr_registry {
+	struct shard {
+		std::mutex lock;
+		std::unordered_map<uint64_t, copper_fuse_req*> reqs;
+		/* Unique id of the target and the INTERRUPT request */
+		std::vector<std::pair<uint64_t, copper_fuse_req*>> pending;
+	};
+
+	shard shards[COPPER_FUSE_INTR_SHARDS];
+
+public:
+	copper_fuse_intr_registry() = default;
+	~copper_fuse_intr_registry();
+
+	copper_fuse_intr_registry(const copper_fuse_intr_registry&) = delete;
+	copper_fuse_intr_registry& operator= (const copper_fuse_intr_registry&) = delete;
+
+	/**
+	 * Register a request read from the kernel
+	 *
+	 * Marks `req` interrupted if an INTERRUPT for it came first.
+	 *
+	 * @return a parked INTERRUPT to finish, `*matched` tells whether it
+	 *         was the one of `req` (no reply) or a stale one (EAGAIN)
+	 */
+	copper_fuse_req* add(copper_fuse_req* req, bool* matched);
+
+	/** Unregister `req` once replied to and drop its reference */
+	void remove(copper_fuse_req* req);
+
+	/**
+	 * Interrupt the request with unique id `unique`
+	 *
+	 * @return false if it is not registered yet, `intr` was parked
+	 */
+	bool interrupt(uint64_t unique, copper_fuse_req* intr);
+
+	/** Number of requests in flight */
+	size_t size();
+
+private:
+	shard& shard_of(uint64_t unique);
+	/* Drop a reference of `req` with the lock of its shard held */
+	bool put(copper_fuse_req* req);
+};
+
+#endif //! __COPPER_FUSE_INTR_H__
@@ -0,0 +1,149 @@
+/*
+  CopperFuse: C++ version Filesystem in Userspace
+  Copyright (C) 2023 Chen Miao <chenmiao.ku@gmail.com>
+
+  This program can be distributed under the terms of the GNU LGPLv2.
+  See the file COPYING.LIB.
+*/
+
+#ifndef __COPPER_FUSE_LOCK_H__
+#define __COPPER_FUSE_LOCK_H__
+
+#include "copper_fuse_handoff.h"
+#include "copper_fuse_lowlevel.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <fcntl.h>
+#include <list>
+#include <mutex>
+#include <sys/types.h>
+#include <unordered_map>
+
+/** Number of independently locked parts of the lock manager */
+constexpr const unsigned COPPER_FUSE_LOCK_SHARDS = 64;
+
+/** End of a lock reaching to the end of file */
+constexpr const off_t COPPER_FUSE_OFFSET_MAX = 0x7fffffffffffffffLL;
+
+/**
+ * A byte range held by one lock owner
+ *
+ * Ranges of one owner never overlap, a new lock splits or merges the
+ * ranges it touches.  Each inode keeps its ranges in an interval tree
+ * (a treap ordered by start, augmented with the largest end of each
+ * subtree), so conflicts are found without walking unrelated ranges.
+ */
+struct copper_fuse_lock_range {
+	off_t start;
+	/* Inclusive, COPPER_FUSE_OFFSET_MAX for a lock up to end of file */
+	off_t end;
+	int type;
+	uint64_t owner;
+	pid_t pid;
+
+	copper_fuse_lock_range* left;
+	copper_fuse_lock_range* right;
+	uint32_t prio;
+	off_t max_end;
+};
+
+/** A blocking SETLKW or flock() that is answered once it can be granted */
+struct copper_fuse_lock_waiter {
+	copper_fuse_req_t req;
+	uint64_t owner;
+	bool is_flock;
+	/* F_RDLCK or F_WRLCK */
+	int type;
+	off_t start;
+	off_t end;
+	pid_t pid;
+};
+
+struct copper_fuse_inode_locks {
+	copper_fuse_lock_range* root;
+	/* BSD locks, owner to F_RDLCK or F_WRLCK */
+	std::unordered_map<uint64_t, int> flocks;
+	std::list<copper_fuse_lock_waiter> waiters;
+};
+
+/**
+ * POSIX and BSD locks of the high-level API, for filesystems without
+ * ->lock() and ->flock()
+ *
+ * Blocking requests do not hold a worker thread: they are queued on the
+ * inode and replied to by whichever thread releases the conflicting
+ * lock, or with EINTR by cancel() when the kernel interrupts them.
+ * Locks are dropped when the owner flushes (POSIX) or releases (BSD)
+ * the file.  Each inode is guarded by the lock of its shard only.
+ */
+struct copper_fuse_lock_manager {
+	struct shard {
+		std::mutex lock;
+		std::unordered_map<fuse_ino_t, copper_fuse_inode_locks> inodes;
+	};
+
+	shard shards[COPPER_FUSE_LOCK_SHARDS];
+
+public:
+	copper_fuse_lock_manager() = default;
+	~copper_fuse_lock_manager();
+
+	copper_fuse_lock_manager(const copper_fuse_lock_manager&) = delete;
+	copper_fuse_lock_manager& operator= (const copper_fuse_lock_manager&) = delete;
+
+	/**
+	 * Test for a lock conflicting with `lk`
+	 *
+	 * `lk` is overwritten with the first conflicting lock, or its type
+	 * set to F_UNLCK if there is none.
+	 */
+	int getlk(fuse_ino_t ino, uint64_t owner, struct flock* lk);
+
+	/**
+	 * Acquire, change or release a POSIX lock
+	 *
+	 * With a non-null `waiter` a conflicting request is queued and
+	 * `waiter` is replied to once the lock is granted.
+	 *
+	 * @return 0 if done, 1 if queued, -EAGAIN on conflict, -EINTR if
+	 *         `waiter` was interrupted before it could be queued
+	 */
+	int setlk(fuse_ino_t ino, uint64_t owner, const struct flock* lk, copper_fuse_req_t waiter);
+
+	/**
+	 * Apply a flock(2) operation, LOCK_NB decides whether `req` waits
+	 *
+	 * @return 0 if done, 1 if queued, -EWOULDBLOCK on conflict, -EINTR
+	 *         if `req` was interrupted before it could be queued
+	 */
+	int flock(fuse_ino_t ino, uint64_t owner, int op, copper_fuse_req_t req);
+
+	/** Answer `req` with EINTR if it still waits for a lock on `ino` */
+	void cancel(fuse_ino_t ino, copper_fuse_req_t req);
+
+	/** Drop the POSIX locks of `owner`, on close(2) of any of its descriptors */
+	void release_posix(fuse_ino_t ino, uint64_t owner);
+
+	/** Drop the BSD lock of `owner`, on the last close of the open file */
+	void release_flock(fuse_ino_t ino, uint64_t owner);
+
+	/** Drop every lock and the waiters without a reply, before the session goes */
+	void clear();
+
+	/** Append every lock and waiter to `w`, for a live restart */
+	void save(copper_fuse_snapshot_writer* w);
+
+	/**
+	 * Restore what save() wrote into an empty manager, the waiters
+	 * become requests of `se` again
+	 *
+	 * @return 0 on success, -EPROTO on a malformed snapshot
+	 */
+	int restore(copper_fuse_snapshot_reader* r, struct copper_fuse_session* se);
+
+private:
+	shard& shard_of(fuse_ino_t ino);
+};
+
+#endif //! __COPPER_FUSE_LOCK_H__
@@ -0,0 +1,117 @@
+/*
+  CopperFuse: C++ version Filesystem in Userspace
+  Copyright (C) 2023 Chen Miao <chenmiao.ku@gmail.com>
+
+  This program can be distributed under the terms of the GNU LGPLv2.
+  See the file COPYING.LIB.
+*/
+
+#ifndef __COPPER_FUSE_LOOKUP_H__
+#define __COPPER_FUSE_LOOKUP_H__
+
+#include "copper_fuse_lowlevel.h"
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <sys/stat.h>
+#include <unordered_map>
+#include <utility>
+
+/** Number of independently locked parts of the lookup table */
+constexpr const unsigned COPPER_FUSE_LOOKUP_SHARDS = 64;
+
+/** Most names remembered as missing, over all shards */
+constexpr const size_t COPPER_FUSE_NEGATIVE_MAX = 1 << 16;
+
+/**
+ * Lookups of the high-level library in flight, and names known missing
+ *
+ * Concurrent lookups of one name in one directory share a single
+ * ->getattr() and its result, as a compiler searching the same include
+ * path from many processes causes them.  A name found missing is
+ * remembered for `negative_timeout` seconds, like the kernel remembers
+ * a negative entry, at most COPPER_FUSE_NEGATIVE_MAX of them with the
+ * oldest going first.
+ *
+ * forget() must follow anything that creates a name, it also keeps a
+ * lookup that started before from sharing its result or leaving a
+ * negative entry behind.
+ */
+struct copper_fuse_lookup_table {
+	/** Get the attributes of the name, as ->getattr() does */
+	using getattr_fn = std::function<int(struct stat* attr)>;
+
+	struct key {
+		fuse_ino_t parent;
+		std::string name;
+
+		bool operator== (const key& other) const {
+			return parent == other.parent && name == other.name;
+		}
+	};
+
+	struct key_hash {
+		size_t operator() (const key& k) const {
+			return std::hash<std::string>()(k.name) ^ (k.parent * 0x9e3779b97f4a7c15ULL);
+		}
+	};
+
+	struct flight {
+		bool done;
+		int res;
+		struct stat attr;
+	};
+
+	struct negative_entry {
+		int64_t expires;
+		/* Matches the one in `order` that is not stale */
+		uint64_t seq;
+	};
+
+	struct shard {
+		std::mutex lock;
+		/* Wakes the lookups waiting for a flight to land */
+		std::condition_variable landed;
+		std::unordered_map<key, std::shared_ptr<flight>, key_hash> flights;
+		std::unordered_map<key, negative_entry, key_hash> negative;
+		/* Negative entries oldest first, those forgotten meanwhile included */
+		std::deque<std::pair<key, uint64_t>> order;
+		uint64_t seq;
+		/* Bumped by forget(), a flight from before leaves no negative entry */
+		uint64_t version;
+	};
+
+	shard  shards[COPPER_FUSE_LOOKUP_SHARDS];
+	bool   coalesce;
+	double negative_timeout;
+
+public:
+	copper_fuse_lookup_table();
+
+	copper_fuse_lookup_table(const copper_fuse_lookup_table&) = delete;
+	copper_fuse_lookup_table& operator= (const copper_fuse_lookup_table&) = delete;
+
+	/**
+	 * Get the attributes of `name` in `parent` through `getattr`,
+	 * unless a lookup of it is in flight or it is known to be missing
+	 *
+	 * @return the result of `getattr`, -ENOENT for a negative entry
+	 */
+	int lookup(fuse_ino_t parent, const char* name, const getattr_fn& getattr, struct stat* attr);
+
+	/** `name` in `parent` came to exist, or may have */
+	void forget(fuse_ino_t parent, const char* name);
+
+private:
+	shard& shard_of(const key& k);
+	/* With the shard's lock held */
+	void remember_missing(shard& s, const key& k);
+};
+
+#endif //! __COPPER_FUSE_LOOKUP_H__
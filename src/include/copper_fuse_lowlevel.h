@@ -12,6 +12,1028 @@
 #ifndef __COPPER_FUSE_LOWLEVEL_H__
 #define __COPPER_FUSE_LOWLEVEL_H__
 
+#include "copper_fuse_buf.h"
+#include "copper_fuse_common.h"
+#include "copper_fuse_congestion.h"
+#include "copper_fuse_fair.h"
+#include "copper_fuse_groups.h"
+#include "copper_fuse_intr.h"
+#include "copper_fuse_kernel.h"
+#include "copper_fuse_poll.h"
+#include "copper_fuse_reply.h"
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <fcntl.h>
+#include <memory>
+#include <mutex>
+#include <semaphore.h>
+#include <string>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+/** ----------------------------------------------------------- *
+ * Miscellaneous definitions				       *
+ * ----------------------------------------------------------- */
+
+/** The node ID of the root inode */
+#define FUSE_ROOT_ID 1
+
+/** Inode number type */
+typedef uint64_t fuse_ino_t;
+
+/**
+ * The attributes a setattr changes, `to_set` of
+ * copper_fuse_lowlevel_ops::setattr
+ */
+#define FUSE_SET_ATTR_MODE	(1 << 0)
+#define FUSE_SET_ATTR_UID	(1 << 1)
+#define FUSE_SET_ATTR_GID	(1 << 2)
+#define FUSE_SET_ATTR_SIZE	(1 << 3)
+#define FUSE_SET_ATTR_ATIME	(1 << 4)
+#define FUSE_SET_ATTR_MTIME	(1 << 5)
+#define FUSE_SET_ATTR_ATIME_NOW	(1 << 7)
+#define FUSE_SET_ATTR_MTIME_NOW	(1 << 8)
+#define FUSE_SET_ATTR_CTIME	(1 << 10)
+
+/** Request pointer type */
+struct copper_fuse_req;
+using copper_fuse_req_t = struct copper_fuse_req*;
+
+struct copper_fuse_session;
+struct copper_cuse_data;
+struct copper_fuse_mount_opts;
+
+/** Directory entry parameters supplied to copper_fuse_req::reply_entry() */
+struct copper_fuse_entry_param {
+	/** Unique inode number
+	 *
+	 * In lookup, zero means negative entry (from version 2.5)
+	 * Returning ENOENT also means negative entry, but by setting zero
+	 * ino the kernel may cache negative entries for entry_timeout
+	 * seconds.
+	 */
+	fuse_ino_t ino;
+
+	/** Generation number for this entry.
+	 *
+	 * If the file system will be exported over NFS, the
+	 * ino/generation pairs need to be unique over the file
+	 * system's lifetime (rather than just the mount time). So if
+	 * the file system reuses an inode after it has been deleted,
+	 * it must assign a new, previously unused generation number
+	 * to the inode at the same time.
+	 */
+	uint64_t generation;
+
+	/** Inode attributes.
+	 *
+	 * Even if attr_timeout == 0, attr must be correct. For example,
+	 * for open(), FUSE uses attr.st_size from lookup() to determine
+	 * how many bytes to request. If this value is not correct,
+	 * incorrect data will be returned.
+	 */
+	struct stat attr;
+
+	/** Validity timeout (in seconds) for inode attributes. If
+	    attributes only change as a result of requests that come
+	    through the kernel, this should be set to a very large
+	    value. */
+	double attr_timeout;
+
+	/** Validity timeout (in seconds) for the name. If directory
+	    entries are changed/deleted only as a result of requests
+	    that come through the kernel, this should be set to a very
+	    large value. */
+	double entry_timeout;
+};
+
+/**
+ * Additional context associated with requests.
+ *
+ * Note that the reported client uid, gid and pid may be zero in some
+ * situations. For example, if the FUSE file system is running in a
+ * PID or user namespace but then accessed from outside the namespace,
+ * there is no valid uid/pid/gid that could be reported.
+ */
+struct copper_fuse_ctx {
+	/** User ID of the calling process */
+	uid_t uid;
+
+	/** Group ID of the calling process */
+	gid_t gid;
+
+	/** Thread ID of the calling process */
+	pid_t pid;
+
+	/** Umask of the calling process */
+	mode_t umask;
+};
+
+/** ----------------------------------------------------------- *
+ * Request methods and replies				       *
+ * ----------------------------------------------------------- */
+
+/**
+ * Low level filesystem operations
+ *
+ * Most of the methods (with the exception of init and destroy)
+ * receive a request handle (copper_fuse_req_t) as their first argument.
+ * This handle must be passed to one of the specified reply functions.
+ *
+ * This may be done inside the method invocation, or after the call
+ * has returned.  The request handle is valid until one of the reply
+ * functions is called.
+ *
+ * Other pointer arguments (name, fuse_file_info, etc) are not valid
+ * after the call has returned, so if they are needed later, their
+ * contents have to be copied.
+ */
+struct copper_fuse_lowlevel_ops {
+	/**
+	 * Initialize filesystem
+	 *
+	 * This function is called when libfuse establishes
+	 * communication with the FUSE kernel module. The file system
+	 * should use this module to inspect and/or modify the
+	 * connection parameters provided in the `conn` structure.
+	 */
+	operators_wrapper_type<void, void*, struct copper_fuse_conn_info*> init;
+
+	/**
+	 * Clean up filesystem.
+	 *
+	 * Called on filesystem exit. When this method is called, the
+	 * connection to the kernel may be gone already, so that eg. calls
+	 * to fuse_lowlevel_notify_* will fail.
+	 */
+	operators_wrapper_type<void, void*> destroy;
+
+	/**
+	 * Look up a directory entry by name and get its attributes.
+	 *
+	 * Valid replies:
+	 *   reply_entry
+	 *   reply_err
+	 */
+	operators_wrapper_type<void, copper_fuse_req_t, fuse_ino_t, const char*> lookup;
+
+	/**
+	 * Forget about an inode
+	 *
+	 * This function is called when the kernel removes an inode
+	 * from its internal caches.
+	 *
+	 * Valid replies:
+	 *   reply_none
+	 */
+	operators_wrapper_type<void, copper_fuse_req_t, fuse_ino_t, uint64_t> forget;
+
+	/**
+	 * Get file attributes.
+	 *
+	 * Valid replies:
+	 *   reply_attr
+	 *   reply_err
+	 */
+	operators_wrapper_type<void, copper_fuse_req_t, fuse_ino_t, struct fuse_file_info*> getattr;
+
+	/**
+	 * Set file attributes
+	 *
+	 * Only the attributes of `attr` named by `to_set`, FUSE_SET_ATTR_*
+	 * bits, change.  `fi` is set when the change comes through an open
+	 * file, as with ftruncate(2), and null otherwise.
+	 *
+	 * Valid replies:
+	 *   reply_attr
+	 *   reply_err
+	 */
+	operators_wrapper_type<void, copper_fuse_req_t, fuse_ino_t, struct stat*, int,
+		struct fuse_file_info*> setattr;
+
+	/**
+	 * Read symbolic link
+	 *
+	 * Valid replies:
+	 *   reply_readlink
+	 *   reply_err
+	 */
+	operators_wrapper_type<void, copper_fuse_req_t, fuse_ino_t> readlink;
+
+	/**
+	 * Create file node
+	 *
+	 * Create a regular file, character device, block device, fifo or
+	 * socket node.
+	 *
+	 * Valid replies:
+	 *   reply_entry
+	 *   reply_err
+	 */
+	operators_wrapper_type<void, copper_fuse_req_t, fuse_ino_t, const char*, mode_t, dev_t> mknod;
+
+	/**
+	 * Create a directory
+	 *
+	 * Valid replies:
+	 *   reply_entry
+	 *   reply_err
+	 */
+	operators_wrapper_type<void, copper_fuse_req_t, fuse_ino_t, const char*, mode_t> mkdir;
+
+	/**
+	 * Remove a file
+	 *
+	 * If the file's inode's lookup count is non-zero, the file
+	 * system is expected to postpone any removal of the inode
+	 * until the lookup count reaches zero (see description of the
+	 * forget function).
+	 *
+	 * Valid replies:
+	 *   reply_err
+	 */
+	operators_wrapper_type<void, copper_fuse_req_t, fuse_ino_t, const char*> unlink;
+
+	/**
+	 * Remove a directory
+	 *
+	 * Valid replies:
+	 *   reply_err
+	 */
+	operators_wrapper_type<void, copper_fuse_req_t, fuse_ino_t, const char*> rmdir;
+
+	/**
+	 * Create a symbolic link `name` in `parent` pointing to `link`
+	 *
+	 * Valid replies:
+	 *   reply_entry
+	 *   reply_err
+	 */
+	operators_wrapper_type<void, copper_fuse_req_t, const char*, fuse_ino_t, const char*> symlink;
+
+	/**
+	 * Rename a file
+	 *
+	 * If the target exists it should be atomically replaced.  `flags`
+	 * may be RENAME_EXCHANGE or RENAME_NOREPLACE, a filesystem that
+	 * does not support them returns EINVAL.
+	 *
+	 * Valid replies:
+	 *   reply_err
+	 */
+	operators_wrapper_type<void, copper_fuse_req_t, fuse_ino_t, const char*, fuse_ino_t,
+		const char*, unsigned int> rename;
+
+	/**
+	 * Create a hard link to `ino` named `newname` in `newparent`
+	 *
+	 * Valid replies:
+	 *   reply_entry
+	 *   reply_err
+	 */
+	operators_wrapper_type<void, copper_fuse_req_t, fuse_ino_t, fuse_ino_t, const char*> link;
+
+	/**
+	 * Open a file
+	 *
+	 * Valid replies:
+	 *   reply_open
+	 *   reply_err
+	 */
+	operators_wrapper_type<void, copper_fuse_req_t, fuse_ino_t, struct fuse_file_info*> open;
+
+	/**
+	 * Read data
+	 *
+	 * Valid replies:
+	 *   reply_buf
+	 *   reply_iov
+	 *   reply_err
+	 */
+	operators_wrapper_type<void, copper_fuse_req_t, fuse_ino_t, size_t, off_t, struct fuse_file_info*> read;
+
+	/**
+	 * Write data
+	 *
+	 * Valid replies:
+	 *   reply_write
+	 *   reply_err
+	 */
+	operators_wrapper_type<void, copper_fuse_req_t, fuse_ino_t, const char*, size_t, off_t,
+		struct fuse_file_info*> write;
+
+	/**
+	 * Flush method
+	 *
+	 * This is called on each close() of the opened file.
+	 *
+	 * Valid replies:
+	 *   reply_err
+	 */
+	operators_wrapper_type<void, copper_fuse_req_t, fuse_ino_t, struct fuse_file_info*> flush;
+
+	/**
+	 * Release an open file
+	 *
+	 * Release is called when there are no more references to an open
+	 * file: all file descriptors are closed and all memory mappings
+	 * are unmapped.
+	 *
+	 * Valid replies:
+	 *   reply_err
+	 */
+	operators_wrapper_type<void, copper_fuse_req_t, fuse_ino_t, struct fuse_file_info*> release;
+
+	/**
+	 * Synchronize file contents
+	 *
+	 * If the datasync parameter is non-zero, then only the user data
+	 * should be flushed, not the meta data.
+	 *
+	 * Valid replies:
+	 *   reply_err
+	 */
+	operators_wrapper_type<void, copper_fuse_req_t, fuse_ino_t, int, struct fuse_file_info*> fsync;
+
+	/**
+	 * Open a directory
+	 *
+	 * Filesystem may store an arbitrary file handle (pointer, index,
+	 * etc) in fi->fh, and use this in other all other directory
+	 * stream operations (readdir, releasedir).
+	 *
+	 * Valid replies:
+	 *   reply_open
+	 *   reply_err
+	 */
+	operators_wrapper_type<void, copper_fuse_req_t, fuse_ino_t, struct fuse_file_info*> opendir;
+
+	/**
+	 * Read directory
+	 *
+	 * Send a buffer of at most `size` bytes filled with
+	 * copper_fuse_add_direntry(), starting after the entry whose
+	 * offset is `off`, 0 being the start.  An empty buffer signals
+	 * the end of the stream.
+	 *
+	 * Valid replies:
+	 *   reply_buf
+	 *   reply_err
+	 */
+	operators_wrapper_type<void, copper_fuse_req_t, fuse_ino_t, size_t, off_t,
+		struct fuse_file_info*> readdir;
+
+	/**
+	 * Release an open directory
+	 *
+	 * For every opendir call there will be exactly one releasedir
+	 * call.
+	 *
+	 * Valid replies:
+	 *   reply_err
+	 */
+	operators_wrapper_type<void, copper_fuse_req_t, fuse_ino_t, struct fuse_file_info*> releasedir;
+
+	/**
+	 * Synchronize directory contents
+	 *
+	 * If the datasync parameter is non-zero, then only the directory
+	 * contents should be flushed, not the meta data.
+	 *
+	 * Valid replies:
+	 *   reply_err
+	 */
+	operators_wrapper_type<void, copper_fuse_req_t, fuse_ino_t, int, struct fuse_file_info*> fsyncdir;
+
+	/**
+	 * Read directory with attributes
+	 *
+	 * As readdir, the buffer is filled with
+	 * copper_fuse_add_direntry_plus().  Every entry with a non-zero
+	 * `ino` counts one lookup of it, as reply_entry() would; the
+	 * entries left out of the reply must not count.
+	 *
+	 * Valid replies:
+	 *   reply_buf
+	 *   reply_err
+	 */
+	operators_wrapper_type<void, copper_fuse_req_t, fuse_ino_t, size_t, off_t,
+		struct fuse_file_info*> readdirplus;
+
+	/**
+	 * Get file system statistics
+	 *
+	 * Valid replies:
+	 *   reply_statfs
+	 *   reply_err
+	 */
+	operators_wrapper_type<void, copper_fuse_req_t, fuse_ino_t> statfs;
+
+	/**
+	 * Create and open a file
+	 *
+	 * Valid replies:
+	 *   reply_create
+	 *   reply_err
+	 */
+	operators_wrapper_type<void, copper_fuse_req_t, fuse_ino_t, const char*, mode_t,
+		struct fuse_file_info*> create;
+
+	/**
+	 * Copy a range of data from one file to another
+	 *
+	 * Performs an optimized copy between two file descriptors without the
+	 * additional cost of transferring data through the FUSE kernel module
+	 * to user space (glibc) and then back into the FUSE filesystem again.
+	 *
+	 * Valid replies:
+	 *   reply_write
+	 *   reply_err
+	 */
+	operators_wrapper_type<void, copper_fuse_req_t, fuse_ino_t, off_t, struct fuse_file_info*,
+		fuse_ino_t, off_t, struct fuse_file_info*, size_t, int> copy_file_range;
+
+	/**
+	 * Allocate requested space, or punch a hole with
+	 * FALLOC_FL_PUNCH_HOLE
+	 *
+	 * If this function returns ENOSYS, the kernel will not call it
+	 * again and fallocate(2) fails with EOPNOTSUPP.
+	 *
+	 * Valid replies:
+	 *   reply_err
+	 */
+	operators_wrapper_type<void, copper_fuse_req_t, fuse_ino_t, int, off_t, off_t,
+		struct fuse_file_info*> fallocate;
+
+	/**
+	 * Find next data or hole after the specified offset
+	 *
+	 * Only SEEK_DATA and SEEK_HOLE reach the filesystem, the kernel
+	 * handles the other whence values itself.  If this function
+	 * returns ENOSYS, the kernel treats the whole file as data.
+	 *
+	 * Valid replies:
+	 *   reply_lseek
+	 *   reply_err
+	 */
+	operators_wrapper_type<void, copper_fuse_req_t, fuse_ino_t, off_t, int,
+		struct fuse_file_info*> lseek;
+
+	/**
+	 * Set an extended attribute
+	 *
+	 * Valid replies:
+	 *   reply_err
+	 */
+	operators_wrapper_type<void, copper_fuse_req_t, fuse_ino_t, const char*, const char*,
+		size_t, int> setxattr;
+
+	/**
+	 * Get an extended attribute
+	 *
+	 * If size is zero, the size of the value should be sent with
+	 * reply_xattr().
+	 *
+	 * If the size is non-zero, and the value fits in the buffer, the
+	 * value should be sent with reply_buf().
+	 *
+	 * If the size is too small for the value, the ERANGE error should
+	 * be sent.
+	 *
+	 * Valid replies:
+	 *   reply_buf
+	 *   reply_xattr
+	 *   reply_err
+	 */
+	operators_wrapper_type<void, copper_fuse_req_t, fuse_ino_t, const char*, size_t> getxattr;
+
+	/**
+	 * List extended attribute names
+	 *
+	 * Same size protocol as getxattr, the list is a series of NUL
+	 * terminated names.
+	 *
+	 * Valid replies:
+	 *   reply_buf
+	 *   reply_xattr
+	 *   reply_err
+	 */
+	operators_wrapper_type<void, copper_fuse_req_t, fuse_ino_t, size_t> listxattr;
+
+	/**
+	 * Remove an extended attribute
+	 *
+	 * Valid replies:
+	 *   reply_err
+	 */
+	operators_wrapper_type<void, copper_fuse_req_t, fuse_ino_t, const char*> removexattr;
+
+	/**
+	 * Check file access permissions
+	 *
+	 * This will be called for the access() and chdir() system calls.
+	 * If not implemented, the kernel assumes success and does not
+	 * ask again.
+	 *
+	 * Valid replies:
+	 *   reply_err
+	 */
+	operators_wrapper_type<void, copper_fuse_req_t, fuse_ino_t, int> access;
+
+	/**
+	 * Test for a POSIX file lock
+	 *
+	 * Valid replies:
+	 *   reply_lock
+	 *   reply_err
+	 */
+	operators_wrapper_type<void, copper_fuse_req_t, fuse_ino_t, struct fuse_file_info*,
+		struct flock*> getlk;
+
+	/**
+	 * Acquire, modify or release a POSIX file lock
+	 *
+	 * For POSIX threads (NPTL) there's a 1-1 relation between pid and
+	 * owner, but otherwise this is not always the case.  For checking
+	 * lock ownership, 'fi->owner' must be used.  The l_pid field in
+	 * 'struct flock' should only be used to fill in this field in
+	 * getlk().
+	 *
+	 * With `sleep` set the request may be replied to only once the
+	 * lock is granted, the kernel sends an INTERRUPT if the caller
+	 * gives up.
+	 *
+	 * Note: if the locking methods are not implemented, the kernel
+	 * will still allow file locking to work locally.  Hence these are
+	 * only interesting for network filesystems and similar.
+	 *
+	 * Valid replies:
+	 *   reply_err
+	 */
+	operators_wrapper_type<void, copper_fuse_req_t, fuse_ino_t, struct fuse_file_info*,
+		struct flock*, int> setlk;
+
+	/**
+	 * Acquire, modify or release a BSD file lock
+	 *
+	 * `op` is LOCK_SH, LOCK_EX or LOCK_UN, possibly or-ed with LOCK_NB.
+	 * Note: if the locking methods are not implemented, the kernel
+	 * will still allow file locking to work locally.
+	 *
+	 * Valid replies:
+	 *   reply_err
+	 */
+	operators_wrapper_type<void, copper_fuse_req_t, fuse_ino_t, struct fuse_file_info*, int> flock;
+
+	/**
+	 * Ioctl
+	 *
+	 * In a restricted ioctl the kernel decodes the size and direction
+	 * of `arg` from the command, `in_buf` holds `in_bufsz` bytes read
+	 * from it and up to `out_bufsz` bytes of the reply are copied
+	 * back.  Unrestricted ioctls (FUSE_IOCTL_UNRESTRICTED in `flags`,
+	 * only sent to CUSE devices asking for them) start with whatever
+	 * the filesystem asks for through reply_ioctl_retry(), and are
+	 * sent again with the requested memory.
+	 *
+	 * Valid replies:
+	 *   reply_ioctl_retry
+	 *   reply_ioctl
+	 *   reply_ioctl_iov
+	 *   reply_err
+	 */
+	operators_wrapper_type<void, copper_fuse_req_t, fuse_ino_t, unsigned int, void*,
+		struct fuse_file_info*, unsigned, const void*, size_t, size_t> ioctl;
+
+	/**
+	 * Poll for IO readiness
+	 *
+	 * If `ph` is non-NULL, the client should notify when IO readiness
+	 * events occur by calling copper_fuse_session::notify_poll() with
+	 * the specified `ph`, and delete it when it is no longer needed.
+	 *
+	 * Regardless of the number of times poll with a non-NULL `ph` is
+	 * received, single notification is enough to clear all.  Extra
+	 * notifications are filtered by the session, see
+	 * copper_fuse_poll_registry.
+	 *
+	 * Valid replies:
+	 *   reply_poll
+	 *   reply_err
+	 */
+	operators_wrapper_type<void, copper_fuse_req_t, fuse_ino_t, struct fuse_file_info*,
+		struct fuse_pollhandle*> poll;
+};
+
+/**
+ * A poll waiter the kernel wants to hear about
+ *
+ * Handed to the poll method when the kernel asks to be notified, it
+ * stays valid until the filesystem deletes it, which must happen
+ * before the session goes away.
+ */
+struct fuse_pollhandle {
+	uint64_t kh;
+	struct copper_fuse_session* se;
+
+public:
+	fuse_pollhandle(struct copper_fuse_session* _se, uint64_t _kh);
+	~fuse_pollhandle();
+
+	fuse_pollhandle(const fuse_pollhandle&) = delete;
+	fuse_pollhandle& operator= (const fuse_pollhandle&) = delete;
+};
+
+/**
+ * A request from the kernel
+ *
+ * Created by the session for every request it reads and destroyed by
+ * the reply, so the request must not be touched after a reply_*()
+ * call.
+ */
+struct copper_fuse_req {
+	struct copper_fuse_session* se;
+	uint64_t unique;
+	uint32_t opcode;
+	struct copper_fuse_ctx ctx;
+
+	/* In the interrupt registry, which holds `ctr` references */
+	bool tracked;
+	unsigned ctr;
+
+	/* Held while `intr_func` runs, so clearing it waits for the callback */
+	std::mutex lock;
+	operators_wrapper_type<void, copper_fuse_req*> intr_func;
+	std::atomic<bool> interrupted;
+	std::shared_ptr<struct copper_fuse_cancel_token> token;
+
+	/* READ and WRITE only, see copper_fuse_congestion::start() */
+	int64_t start_ns;
+	size_t inflight_bytes;
+	std::shared_ptr<struct copper_fuse_budget> budget;
+
+	/* Holding a dispatch slot of this tenant, see copper_fuse_fair */
+	struct copper_fuse_tenant* tenant;
+
+public:
+	copper_fuse_req(struct copper_fuse_session* _se, const struct fuse_in_header* in);
+
+	copper_fuse_req(const copper_fuse_req&) = delete;
+	copper_fuse_req& operator= (const copper_fuse_req&) = delete;
+
+	/** Get the userdata from the request */
+	void* userdata() const;
+
+	/** Get the context from the request */
+	const struct copper_fuse_ctx* get_ctx() const;
+
+	/**
+	 * Get the supplementary groups of the caller
+	 *
+	 * Read from /proc the first time and cached per caller for a
+	 * while, see copper_fuse_groups_cache.  At most `size` groups are
+	 * stored in `list`.
+	 *
+	 * @return total number of groups, or -errno on failure
+	 */
+	int getgroups(int size, gid_t list[]) const;
+
+	/**
+	 * Register a callback for when the request is interrupted
+	 *
+	 * The callback runs in the thread handling the INTERRUPT, right
+	 * away if the request already was.  Clearing it with nullptr waits
+	 * for a running callback to return, which may reply to the
+	 * request.  Once the request is replied to, a late callback may
+	 * still run until it is cleared.
+	 */
+	void interrupt_func(operators_wrapper_type<void, copper_fuse_req*> func);
+
+	/** Check if the kernel interrupted the request */
+	bool is_interrupted() const;
+
+	/**
+	 * Cancellation token of the request
+	 *
+	 * Shared with the request, it can be handed to backend work that
+	 * outlives the reply.
+	 */
+	std::shared_ptr<struct copper_fuse_cancel_token> cancel_token();
+
+	/** Mark the request interrupted and run its callback, see do_interrupt() */
+	void interrupt();
+
+	/**
+	 * Reply with an error code or success.
+	 *
+	 * @param err the positive error value, or zero for success
+	 * @return zero for success, -errno for failure to send reply
+	 */
+	int reply_err(int err);
+
+	/** Don't send reply, only for forget */
+	void reply_none();
+
+	/** Reply with a directory entry */
+	int reply_entry(const struct copper_fuse_entry_param* e);
+
+	/** Reply with a directory entry and open parameters */
+	int reply_create(const struct copper_fuse_entry_param* e, const struct fuse_file_info* fi);
+
+	/** Reply with attributes */
+	int reply_attr(const struct stat* attr, double attr_timeout);
+
+	/** Reply with open parameters */
+	int reply_open(const struct fuse_file_info* fi);
+
+	/** Reply with number of bytes written */
+	int reply_write(size_t count);
+
+	/** Reply with data */
+	int reply_buf(const char* buf, size_t size);
+
+	/** Reply with the contents of a symbolic link */
+	int reply_readlink(const char* link);
+
+	/** Reply with filesystem statistics */
+	int reply_statfs(const struct statvfs* stbuf);
+
+	/** Reply with offset */
+	int reply_lseek(off_t off);
+
+	/** Reply with the needed buffer size */
+	int reply_xattr(size_t count);
+
+	/**
+	 * Reply with data vector
+	 *
+	 * @param iov the vector containing the data
+	 * @param count the size of vector
+	 */
+	int reply_iov(const struct iovec* iov, int count);
+
+	/**
+	 * Reply to ask for data fetch and output buffer preparation.  ioctl
+	 * will be retried with the specified input data fetched and output
+	 * buffer prepared.
+	 *
+	 * Only valid for unrestricted ioctls.
+	 *
+	 * @param in_iov iovec specifying data to fetch from the caller
+	 * @param in_count number of entries in in_iov
+	 * @param out_iov iovec specifying addresses to write output to
+	 * @param out_count number of entries in out_iov
+	 */
+	int reply_ioctl_retry(const struct iovec* in_iov, size_t in_count,
+		const struct iovec* out_iov, size_t out_count);
+
+	/**
+	 * Reply to finish ioctl
+	 *
+	 * @param result result to be passed to the caller
+	 * @param buf buffer containing output data
+	 * @param size length of output data
+	 */
+	int reply_ioctl(int result, const void* buf, size_t size);
+
+	/** Reply to finish ioctl with iov buffer */
+	int reply_ioctl_iov(int result, const struct iovec* iov, int count);
+
+	/** Reply with poll result event mask */
+	int reply_poll(unsigned revents);
+
+	/** Reply with a file lock */
+	int reply_lock(const struct flock* lock);
+
+	/** Reply with the pieces gathered in `rb`, in a single write */
+	int reply_builder(copper_fuse_reply_builder* rb);
+
+private:
+	int send_reply_ok(const void* arg, size_t argsize);
+	int send_reply(int error, copper_fuse_reply_builder* rb);
+	void destroy();
+};
+
+/**
+ * Add a directory entry to the buffer of a readdir reply
+ *
+ * `type` is the file type, the S_IFMT bits of a mode; `off` is the
+ * offset the kernel passes to readdir to continue after this entry.
+ *
+ * @return the space the entry needs, which is only written when it
+ *         fits in `bufsize`
+ */
+size_t copper_fuse_add_direntry(char* buf, size_t bufsize, const char* name, size_t namelen,
+	uint64_t ino, mode_t type, off_t off);
+
+/**
+ * Add a directory entry with its attributes to the buffer of a
+ * readdirplus reply
+ *
+ * As copper_fuse_add_direntry(), the inode number and type come from
+ * `e->attr`.  An `e->ino` of zero passes the entry without a lookup.
+ */
+size_t copper_fuse_add_direntry_plus(char* buf, size_t bufsize, const char* name, size_t namelen,
+	const struct copper_fuse_entry_param* e, off_t off);
+
+/** ----------------------------------------------------------- *
+ * Session interface					       *
+ * ----------------------------------------------------------- */
+
+/**
+ * A connection to the kernel
+ *
+ * The session reads requests from `fd`, which is usually an open
+ * /dev/fuse, but any descriptor that preserves message boundaries in
+ * both directions (e.g. one end of a SOCK_SEQPACKET socketpair) can
+ * stand in for it.
+ */
+struct copper_fuse_session {
+	struct copper_fuse_lowlevel_ops op;
+	void* userdata;
+
+	int fd;
+	/* Log every request and reply */
+	int verbose;
+	int got_init;
+	int got_destroy;
+	size_t bufsize;
+	struct copper_fuse_conn_info conn;
+	std::atomic<int> exited;
+	/* Posted by exit(), which may run in a signal handler */
+	sem_t exit_sem;
+	int error;
+
+	/* Only set for character devices, see copper_cuse_lowlevel.h */
+	struct copper_cuse_data* cuse_data;
+
+	/* Outstanding fuse_pollhandle objects */
+	struct copper_fuse_poll_registry polls;
+
+	/* Requests in flight, for INTERRUPT */
+	struct copper_fuse_intr_registry intrs;
+
+	/* Background limit and admission of READ and WRITE */
+	struct copper_fuse_congestion cong;
+
+	/* Rate limits and fair dispatch among tenants, off unless set up */
+	struct copper_fuse_fair fair;
+
+	/* Supplementary groups of callers, filled by copper_fuse_req::getgroups() */
+	struct copper_fuse_groups_cache groups;
+
+	/* Receive buffers of `bufsize`, see set_max_pages() */
+	struct copper_fuse_bufpool bufs;
+
+	/* How to mount, created on demand by mount() */
+	struct copper_fuse_mount_opts* mo;
+	/* Empty unless mount() mounted the filesystem itself */
+	std::string mountpoint;
+
+	/* Cleared once sendmmsg() finds `fd` is no socket */
+	std::atomic<int> notify_mmsg;
+
+public:
+	copper_fuse_session(const struct copper_fuse_lowlevel_ops* _op, void* _userdata);
+	~copper_fuse_session();
+
+	copper_fuse_session(const copper_fuse_session&) = delete;
+	copper_fuse_session& operator= (const copper_fuse_session&) = delete;
+
+	/**
+	 * Mount the filesystem
+	 *
+	 * A "/dev/fd/N" mount point names an already open /dev/fuse
+	 * descriptor, anything else is mounted according to `mo`, see
+	 * copper_fuse_kernel_mount().
+	 *
+	 * @return 0 on success, -1 on failure
+	 */
+	int mount(const char* mountpoint);
+
+	/** Undo mount(), a no-op for a passed descriptor */
+	void unmount();
+
+	/**
+	 * Hand the connection over to another process, see
+	 * copper_fuse_handoff.h
+	 *
+	 * Call once the loop returned.  Sends the descriptor, the
+	 * negotiated connection and `state` of the layers above over the
+	 * stream socket `sock`.  The filesystem is not destroyed with the
+	 * session afterwards, it lives on in the other process.
+	 *
+	 * @return 0 on success, -errno on failure
+	 */
+	int handoff(int sock, const std::string& state);
+
+	/**
+	 * Take over a connection passed by handoff(), in place of mount()
+	 *
+	 * The session starts out initialized: ->init() runs against the
+	 * restored connection, whose negotiated parameters it can no
+	 * longer change.
+	 *
+	 * @return 0 on success, -errno on failure
+	 */
+	int takeover(int sock, std::string* state);
+
+	/** Use an already open descriptor instead of mounting */
+	void set_fd(int _fd);
+
+	/**
+	 * Let requests carry up to `pages` pages of payload
+	 *
+	 * 32 pages, 128 KiB, by default.  More are offered to the kernel
+	 * with FUSE_MAX_PAGES at INIT, capped at its max_pages_limit
+	 * (256 pages, 1 MiB, before Linux 6.13).  Sizes the receive
+	 * buffers, so call it before the loop starts.  A kernel without
+	 * FUSE_MAX_PAGES keeps sending 128 KiB at most.
+	 *
+	 * @return the pages granted, -EBUSY once initialized
+	 */
+	int set_max_pages(unsigned pages);
+
+	/**
+	 * Enter a single threaded, blocking event loop.
+	 *
+	 * @return 0 on success, -errno on failure
+	 */
+	int loop();
+
+	/**
+	 * Enter a multi-threaded event loop.
+	 *
+	 * Idle workers are woken at exit with SIGRTMIN + 1, which gets a
+	 * no-op handler unless the application handles it already.
+	 *
+	 * @return 0 on success, -errno on failure
+	 */
+	int loop_mt(const struct copper_fuse_loop_config* config);
+
+	/**
+	 * Flag the session as terminated, the loops return soon after
+	 *
+	 * Safe to call from a signal handler.  loop_mt() stops without
+	 * losing a request, what the kernel queued meanwhile stays queued.
+	 */
+	void exit();
+
+	/**
+	 * Read one raw request
+	 *
+	 * @return size of the request, 0 if the session ended, -errno
+	 *         on failure
+	 */
+	int receive_buf(char* buf, size_t size);
+
+	/** Decode and dispatch one raw request */
+	void process_buf(const char* buf, size_t len);
+
+	/** Run the handler of a request process_buf() decoded */
+	void dispatch(copper_fuse_req* req, const struct fuse_in_header* in, const void* inarg);
+
+	/** Write one message to the kernel */
+	int send_msg(struct iovec* iov, int count);
+
+	/**
+	 * Notify IO readiness event
+	 *
+	 * For more information, please read comment for poll operation.
+	 *
+	 * @return zero for success, -errno for failure
+	 */
+	int notify_poll(struct fuse_pollhandle* ph);
+
+	/**
+	 * Notify IO readiness of many handles at once
+	 *
+	 * Handles may repeat or share a kernel handle, each waiting file
+	 * is notified once.  Handles whose files were closed meanwhile are
+	 * skipped.
+	 *
+	 * @return number of notifications sent, -errno for failure
+	 */
+	int notify_poll(struct fuse_pollhandle* const* phs, size_t count);
+
+	/**
+	 * Send queued notifications, see copper_fuse_notify_batch
+	 *
+	 * A notification about a file released meanwhile is skipped.
+	 *
+	 * @return zero for success, -errno for the first failure
+	 */
+	int send_notify_batch(copper_fuse_notify_batch* batch);
+
+private:
+	int send_notify_poll(uint64_t kh);
+};
+
 /** ---------------------------------------------------------- *
  * Filesystem setup & teardown                                 *
  * ----------------------------------------------------------- */
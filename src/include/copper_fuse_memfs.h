@@ -0,0 +1,249 @@
+/*
+  CopperFuse: C++ version Filesystem in Userspace
+  Copyright (C) 2023 Chen Miao <chenmiao.ku@gmail.com>
+
+  This program can be distributed under the terms of the GNU LGPLv2.
+  See the file COPYING.LIB.
+*/
+
+#ifndef __COPPER_FUSE_MEMFS_H__
+#define __COPPER_FUSE_MEMFS_H__
+
+#include "copper_fuse.h"
+#include "copper_fuse_common.h"
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+/** ----------------------------------------------------------- *
+ * In-memory filesystem engine (tmpfs-like)
+ * ------------------------------------------------------------ */
+
+/** Size of a data page handed out by the page arena */
+constexpr const size_t COPPER_MEMFS_PAGE_SIZE = 4096;
+
+/** Largest run the arena hands out: 2^9 pages = 2 MiB, one arena chunk */
+constexpr const unsigned COPPER_MEMFS_MAX_ORDER = 9;
+
+/** Files up to this size keep their data inside the inode */
+constexpr const size_t COPPER_MEMFS_INLINE_MAX = 128;
+
+/** Number of inodes per inode table chunk */
+constexpr const size_t COPPER_MEMFS_CHUNK_INODES = 1024;
+
+/** Upper bound of inode table chunks, i.e. 64M inodes */
+constexpr const size_t COPPER_MEMFS_MAX_CHUNKS = 65536;
+
+/**
+ * Page arena
+ *
+ * Hands out runs of 2^order contiguous pages carved from 2 MiB aligned
+ * chunks.  Freed runs are merged with their buddy, so a file that is
+ * deleted gives whole chunks back to the free lists.  Chunks are never
+ * returned to the system while the arena lives.
+ */
+struct copper_memfs_arena {
+	std::mutex lock;
+	std::vector<void*> chunks;
+	std::unordered_set<char*> free_runs[COPPER_MEMFS_MAX_ORDER + 1];
+
+	/** Limit on bytes handed out, 0 means unlimited */
+	size_t max_bytes;
+	std::atomic<size_t> used_bytes;
+
+public:
+	copper_memfs_arena(size_t _max_bytes = 0);
+	~copper_memfs_arena();
+
+	copper_memfs_arena(const copper_memfs_arena&) = delete;
+	copper_memfs_arena& operator= (const copper_memfs_arena&) = delete;
+
+	/**
+	 * Allocate a zero filled run of 2^order pages
+	 *
+	 * @return the run, or nullptr if the arena is exhausted
+	 */
+	char* alloc(unsigned order);
+	void free(char* run, unsigned order);
+};
+
+/**
+ * A contiguous piece of file data backed by one arena run
+ *
+ * Extents of a file are kept sorted by offset and never overlap; bytes
+ * not covered by any extent are holes and read as zeros.
+ */
+struct copper_memfs_extent {
+	off_t    off;	/* file offset, page aligned */
+	size_t   len;	/* COPPER_MEMFS_PAGE_SIZE << order */
+	char*    data;
+	unsigned order;
+};
+
+/**
+ * Directory contents
+ *
+ * `entries` owns the names, `index` maps a name to its slot in
+ * `entries` and the slot position is the stable readdir cookie.  Removed
+ * entries leave a tombstone (name == nullptr) until the slot array is
+ * compacted.
+ */
+struct copper_memfs_dirent {
+	std::unique_ptr<std::string> name;
+	uint64_t ino;
+};
+
+struct copper_memfs_dir {
+	std::vector<copper_memfs_dirent> entries;
+	std::unordered_map<std::string_view, uint32_t> index;
+	uint32_t tombstones;
+
+	/** Parent directory, only changed under copper_memfs::rename_lock */
+	uint64_t parent;
+};
+
+struct copper_memfs_inode {
+	/**
+	 * Protects everything below.  For directories the lock also covers
+	 * the entry table; lock ordering is always parent before child and,
+	 * for two unrelated directories, lower inode number first.
+	 */
+	std::shared_mutex lock;
+
+	/** Lookups in flight that pinned this inode */
+	std::atomic<uint32_t> refs;
+	uint32_t opencount;
+	uint32_t generation;
+	bool     live;
+
+	uint64_t ino;
+	mode_t   mode;
+	nlink_t  nlink;
+	uid_t    uid;
+	gid_t    gid;
+	dev_t    rdev;
+	off_t    size;
+	struct timespec atime;
+	struct timespec mtime;
+	struct timespec ctime;
+
+	char inline_data[COPPER_MEMFS_INLINE_MAX];
+	std::vector<copper_memfs_extent> extents;
+	std::unique_ptr<copper_memfs_dir> dir;
+	std::string link;
+};
+
+/**
+ * The in-memory filesystem
+ *
+ * Inodes live in a chunked array indexed by inode number, so an inode
+ * number or a file handle maps to its inode without any lock.  Every
+ * inode carries its own reader/writer lock; there is no filesystem wide
+ * lock on the read/write path.  Only renames across directories
+ * serialize on `rename_lock`, which keeps the tree acyclic and the
+ * ancestry of the two parents still while they are locked.
+ *
+ * Handlers follow `copper_fuse_operations` conventions and return
+ * -errno on failure.  `operations()` returns a table bound to this
+ * instance that can be passed straight to copper_fuse_main().
+ */
+struct copper_memfs {
+	copper_memfs_arena arena;
+
+	std::atomic<copper_memfs_inode*> chunks[COPPER_MEMFS_MAX_CHUNKS];
+	std::mutex   table_lock;
+	std::vector<uint64_t> free_inos;
+	uint64_t     next_ino;
+	size_t       max_inodes;
+	std::atomic<size_t> used_inodes;
+
+	std::mutex   rename_lock;
+
+public:
+	/**
+	 * @param max_bytes limit on file data, 0 means unlimited
+	 * @param max_inodes limit on inodes, 0 means the table maximum
+	 */
+	copper_memfs(size_t max_bytes = 0, size_t max_inodes = 0);
+	~copper_memfs();
+
+	copper_memfs(const copper_memfs&) = delete;
+	copper_memfs& operator= (const copper_memfs&) = delete;
+
+	/** Operation table bound to this instance */
+	copper_fuse_operations operations();
+
+	int getattr(const char* path, struct stat* stbuf, struct fuse_file_info* fi);
+	int readlink(const char* path, char* buf, size_t size);
+	int mknod(const char* path, mode_t mode, dev_t rdev);
+	int mkdir(const char* path, mode_t mode);
+	int unlink(const char* path);
+	int rmdir(const char* path);
+	int symlink(const char* from, const char* to);
+	int rename(const char* from, const char* to, unsigned int flags);
+	int link(const char* from, const char* to);
+	int chmod(const char* path, mode_t mode, struct fuse_file_info* fi);
+	int chown(const char* path, uid_t uid, gid_t gid, struct fuse_file_info* fi);
+	int truncate(const char* path, off_t size, struct fuse_file_info* fi);
+	int open(const char* path, struct fuse_file_info* fi);
+	int create(const char* path, mode_t mode, struct fuse_file_info* fi);
+	int read(const char* path, char* buf, size_t size, off_t off, struct fuse_file_info* fi);
+	int write(const char* path, const char* buf, size_t size, off_t off, struct fuse_file_info* fi);
+	int statfs(const char* path, struct statvfs* stbuf);
+	int release(const char* path, struct fuse_file_info* fi);
+	int opendir(const char* path, struct fuse_file_info* fi);
+	int readdir(const char* path, void* buf, fuse_fill_dir_t filler, off_t off,
+		struct fuse_file_info* fi, enum fuse_readdir_flags flags);
+	int releasedir(const char* path, struct fuse_file_info* fi);
+	int utimens(const char* path, const struct timespec tv[2], struct fuse_file_info* fi);
+	int fallocate(const char* path, int mode, off_t off, off_t len, struct fuse_file_info* fi);
+	/** Only SEEK_DATA and SEEK_HOLE, holes are the ranges without extents */
+	off_t lseek(const char* path, off_t off, int whence, struct fuse_file_info* fi);
+
+private:
+	copper_memfs_inode* inode(uint64_t ino) const;
+	copper_memfs_inode* alloc_inode(mode_t mode);
+	void free_inode(copper_memfs_inode* node);
+	void put(copper_memfs_inode* node);
+
+	/**
+	 * Walk `path` from the root and return its inode with a reference
+	 * held, the caller drops it with put()
+	 */
+	int resolve(std::string_view path, copper_memfs_inode** nodep);
+	/**
+	 * Resolve everything but the last component of `path`, which is
+	 * returned in `name`
+	 */
+	int resolve_parent(std::string_view path, copper_memfs_inode** parentp,
+		std::string_view* name);
+	/** Resolve through the open handle if there is one, else by path */
+	int resolve_fi(const char* path, struct fuse_file_info* fi,
+		copper_memfs_inode** nodep);
+
+	int make_node(const char* path, mode_t mode, dev_t rdev,
+		const char* link, copper_memfs_inode** nodep);
+	int remove_node(const char* path, bool dir);
+
+	bool is_below(const copper_memfs_inode* node, uint64_t ino) const;
+	void lock_pair(copper_memfs_inode* a, copper_memfs_inode* b);
+	void fill_stat(const copper_memfs_inode* node, struct stat* stbuf) const;
+
+	ssize_t read_data(copper_memfs_inode* node, char* buf, size_t size, off_t off);
+	ssize_t write_data(copper_memfs_inode* node, const char* buf, size_t size, off_t off);
+	int     resize_data(copper_memfs_inode* node, off_t size);
+	int     materialize(copper_memfs_inode* node, off_t off, off_t end);
+	void    punch_data(copper_memfs_inode* node, off_t off, off_t end);
+	void    release_data(copper_memfs_inode* node);
+};
+
+#endif //! __COPPER_FUSE_MEMFS_H__
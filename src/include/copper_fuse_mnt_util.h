@@ -12,8 +12,25 @@
 #ifndef __COPPER_FUSE_MOUNT_UTIL_H__
 #define __COPPER_FUSE_MOUNT_UTIL_H__
 
+#include <cstddef>
 #include <sys/types.h>
 
 int copper_fuse_mnt_parse_fd(const char* mountpoint);
 
-#endif //! __COPPER_FUSE_MOUNT_UTIL_H__
\ No newline at end of file
+/**
+ * Send a message over a unix socket, with `fd` attached unless it is -1
+ *
+ * @return 0 on success, -errno on failure
+ */
+int copper_fuse_mnt_send_fd(int sock, const void* buf, size_t size, int fd);
+
+/**
+ * Receive a message sent by copper_fuse_mnt_send_fd()
+ *
+ * `*fd` is set to the attached descriptor, or -1 if there was none.
+ *
+ * @return size of the message, 0 on end of file, -errno on failure
+ */
+ssize_t copper_fuse_mnt_recv_fd(int sock, void* buf, size_t size, int* fd);
+
+#endif //! __COPPER_FUSE_MOUNT_UTIL_H__
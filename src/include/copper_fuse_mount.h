@@ -0,0 +1,192 @@
+/*
+  FUSE: Filesystem in Userspace
+  Copyright (C) 2001-2007  Miklos Szeredi <miklos@szeredi.hu>
+
+  This program can be distributed under the terms of the GNU LGPLv2.
+  See the file COPYING.LIB.
+
+  CopperFuse: C++ version Filesystem in Userspace
+  Copyright (C) 2023 Chen Miao <chenmiao.ku@gmail.com>
+*/
+
+#ifndef __COPPER_FUSE_MOUNT_H__
+#define __COPPER_FUSE_MOUNT_H__
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <sys/socket.h>
+#include <sys/types.h>
+
+struct copper_fuse_args;
+
+/** Environment variable naming the socket of a running mount helper */
+#define COPPER_FUSE_MOUNT_HELPER_ENV "COPPER_FUSE_MOUNT_HELPER"
+
+/**
+ * Mount options of a session
+ *
+ * Parsed out of the command line by copper_fuse_parse_mount_opts(),
+ * which leaves the other options in place.
+ */
+struct copper_fuse_mount_opts {
+	int allow_other;
+	/* MS_* flags of mount(2) */
+	int flags;
+	char* fsname;
+	char* subtype;
+	/* Socket of a mount helper, see copper_fuse_mount_helper */
+	char* mount_helper;
+	/* Passed on to the kernel, after "fd=", "rootmode=" and the ids */
+	char* kernel_opts;
+	/* Only understood by fusermount */
+	char* fusermount_opts;
+
+public:
+	copper_fuse_mount_opts();
+	~copper_fuse_mount_opts();
+
+	copper_fuse_mount_opts(const copper_fuse_mount_opts&) = delete;
+	copper_fuse_mount_opts& operator= (const copper_fuse_mount_opts&) = delete;
+};
+
+/**
+ * Take the mount options out of `args`
+ *
+ * @return the options, nullptr on a parse error
+ */
+struct copper_fuse_mount_opts* copper_fuse_parse_mount_opts(struct copper_fuse_args* args);
+
+/**
+ * Mount a filesystem on `mountpoint`
+ *
+ * Mounts with mount(2) when privileged.  Otherwise asks the mount
+ * helper listening on mo->mount_helper, or $COPPER_FUSE_MOUNT_HELPER,
+ * over a connection the process keeps for its later mounts.  Without a
+ * helper, fusermount3 is run as a last resort.
+ *
+ * @return the /dev/fuse descriptor of the mount, -1 on failure
+ */
+int copper_fuse_kernel_mount(const char* mountpoint, const struct copper_fuse_mount_opts* mo);
+
+/** Undo copper_fuse_kernel_mount(), `fd` is the descriptor it returned */
+void copper_fuse_kernel_unmount(const char* mountpoint, int fd, const struct copper_fuse_mount_opts* mo);
+
+/** ----------------------------------------------------------- *
+ * Mount helper						       *
+ * ----------------------------------------------------------- */
+
+enum copper_fuse_helper_op : uint32_t {
+	COPPER_FUSE_HELPER_MOUNT   = 1,
+	COPPER_FUSE_HELPER_UNMOUNT = 2,
+};
+
+/**
+ * A request to the mount helper
+ *
+ * Followed by `len` bytes of NUL terminated strings: the mountpoint,
+ * the kernel options, fsname and subtype, the last three possibly
+ * empty.
+ */
+struct copper_fuse_helper_msg {
+	uint32_t op;
+	/* MS_* flags of mount(2) */
+	uint32_t flags;
+	uint32_t len;
+};
+
+/** The answer, a successful mount carries the descriptor in SCM_RIGHTS */
+struct copper_fuse_helper_reply {
+	int32_t error;
+};
+
+/** Largest request accepted by the helper */
+constexpr const size_t COPPER_FUSE_HELPER_MSG_MAX = 16384;
+
+struct copper_fuse_mount_req {
+	std::string mountpoint;
+	std::string kernel_opts;
+	std::string fsname;
+	std::string subtype;
+	int flags;
+};
+
+/**
+ * Open /dev/fuse and mount it on req->mountpoint for `uid` and `gid`
+ *
+ * @return the descriptor, -errno on failure
+ */
+int copper_fuse_mount_sys(const struct copper_fuse_mount_req* req, uid_t uid, gid_t gid);
+
+/**
+ * Mount through the helper listening on `sock_path`
+ *
+ * @return the descriptor, -errno on failure
+ */
+int copper_fuse_helper_mount(const char* sock_path, const struct copper_fuse_mount_req* req);
+
+/** @return 0 on success, -errno on failure */
+int copper_fuse_helper_unmount(const char* sock_path, const char* mountpoint);
+
+/**
+ * A privileged process mounting for others
+ *
+ * Replaces a fork and exec of fusermount per mount by a round trip on
+ * a unix socket: clients keep their connection open and send any
+ * number of requests, the descriptor of each mount comes back with
+ * SCM_RIGHTS.  A single thread serves all connections.
+ *
+ * Unless `mounter` is set, unprivileged peers get the rules of
+ * fusermount: they must own the mountpoint, which must not be a
+ * symlink, the mount is nosuid and nodev, and only a few kernel
+ * options are allowed, allow_other only with `user_allow_other`.
+ * Peers may only unmount fuse mounts with their own user_id.
+ */
+struct copper_fuse_mount_helper {
+	using mounter_type = std::function<int(const struct ucred*, const struct copper_fuse_mount_req*)>;
+	using unmounter_type = std::function<int(const struct ucred*, const char*)>;
+
+	int listen_fd;
+	/* Wakes serve() up for exit() */
+	int event_fd;
+	std::atomic<int> exited;
+	int user_allow_other;
+
+	/* Performs a checked request, returns the descriptor or -errno */
+	mounter_type mounter;
+	/* Returns 0 or -errno */
+	unmounter_type unmounter;
+
+public:
+	copper_fuse_mount_helper();
+	~copper_fuse_mount_helper();
+
+	copper_fuse_mount_helper(const copper_fuse_mount_helper&) = delete;
+	copper_fuse_mount_helper& operator= (const copper_fuse_mount_helper&) = delete;
+
+	/**
+	 * Listen on `sock_path`, replacing a stale socket
+	 *
+	 * @return 0 on success, -errno on failure
+	 */
+	int listen(const char* sock_path);
+
+	/**
+	 * Serve requests until exit()
+	 *
+	 * @return 0 on success, -errno on failure
+	 */
+	int serve();
+
+	/** Make serve() return, from any thread */
+	void exit();
+
+private:
+	int handle(int sock);
+	int do_mount(const struct ucred* cred, const struct copper_fuse_mount_req* req);
+	int do_unmount(const struct ucred* cred, const char* mountpoint);
+};
+
+#endif //! __COPPER_FUSE_MOUNT_H__
@@ -0,0 +1,226 @@
+/*
+  CopperFuse: C++ version Filesystem in Userspace
+  Copyright (C) 2023 Chen Miao <chenmiao.ku@gmail.com>
+
+  This program can be distributed under the terms of the GNU LGPLv2.
+  See the file COPYING.LIB.
+*/
+
+#ifndef __COPPER_FUSE_NODE_H__
+#define __COPPER_FUSE_NODE_H__
+
+#include "copper_fuse_handoff.h"
+#include "copper_fuse_lowlevel.h"
+#include "copper_fuse_path.h"
+#include "copper_fuse_timer.h"
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <unordered_map>
+
+#define FUSE_UNKNOWN_INO 0xffffffff
+
+/** Number of independently locked parts of the id and name tables */
+constexpr const unsigned COPPER_FUSE_NODE_SHARDS = 64;
+
+/** Number of locks the directories are striped over, a power of two */
+constexpr const unsigned COPPER_FUSE_DIR_LOCKS = 256;
+
+/** Times get_path() starts over when a rename moved a node under it, before holding renames off */
+constexpr const unsigned COPPER_FUSE_PATH_RETRIES = 8;
+
+struct copper_fuse_node;
+
+/** Where a node is in the tree, replaced as a whole when it moves */
+struct copper_fuse_node_link {
+	std::shared_ptr<copper_fuse_node> parent;
+	copper_fuse_atom_ref name;
+};
+
+/**
+ * A node of the high-level name tree
+ *
+ * Nodes live as long as the kernel holds a lookup count on them or on
+ * one of their children, or for conf.remember seconds after, the path
+ * of a node is rebuilt from its links on every request.  A link holds
+ * its parent, so a path being built never meets a freed node.
+ */
+struct copper_fuse_node {
+	fuse_ino_t nodeid;
+	uint64_t   generation;
+	std::atomic<uint64_t> nlookup;
+	std::atomic<unsigned> open_count;
+	/* Protected by the lock of the node's own directory */
+	unsigned   children;
+	/* Renamed to a hidden name while open, removed with the last release */
+	std::atomic<bool> hidden;
+
+	/* Null once unhashed, only with std::atomic_load() and std::atomic_store() */
+	std::shared_ptr<const copper_fuse_node_link> link;
+
+	/* Armed while remembered, drops the node when it fires */
+	copper_fuse_timer timer;
+};
+
+/** Key of the name table, names being atoms compare by pointer */
+struct copper_fuse_name_key {
+	fuse_ino_t parent;
+	const copper_fuse_atom* name;
+
+	bool operator== (const copper_fuse_name_key& other) const {
+		return parent == other.parent && name == other.name;
+	}
+};
+
+struct copper_fuse_name_hash {
+	size_t operator() (const copper_fuse_name_key& key) const {
+		return key.name->hash ^ (key.parent * 0x9e3779b97f4a7c15ULL);
+	}
+};
+
+/**
+ * The nodes of the high-level library, by nodeid and by name
+ *
+ * Both tables are sharded, a lookup of a known name takes nothing but
+ * the lock of its shard.  Whatever changes a directory, a new child, a
+ * rename into or out of it or a node going away, holds the lock its
+ * nodeid is striped onto; a rename or a removal holding two of them
+ * takes the lower stripe first.  Lock order is the rename lock, then
+ * directory stripes, then a name shard, then an id shard, then the
+ * timer wheel.
+ *
+ * get_path() takes no lock but that of the id shard: it follows the
+ * links up and starts over if a rename ran meanwhile, so it never
+ * returns a path that was never there.  Renames hold `rename_lock`
+ * shared, a get_path() that kept losing the race takes it exclusive
+ * for its last walk.
+ *
+ * With `remember` a node the kernel forgot stays for that many seconds
+ * on a timer of `timers`, armed and cancelled in O(1), so nothing scans
+ * the table for nodes to expire.
+ */
+struct copper_fuse_node_table {
+	/** Told of every node that goes, for what is cached by nodeid */
+	using forget_fn = std::function<void(fuse_ino_t nodeid)>;
+
+	struct id_shard {
+		std::mutex lock;
+		std::unordered_map<fuse_ino_t, std::shared_ptr<copper_fuse_node>> nodes;
+	};
+
+	struct name_shard {
+		std::mutex lock;
+		std::unordered_map<copper_fuse_name_key, std::shared_ptr<copper_fuse_node>,
+			copper_fuse_name_hash> nodes;
+	};
+
+	/** Names of the nodes, must outlive the table */
+	copper_fuse_atom_table* atoms;
+	/** Seconds a forgotten node is kept, -1 for ever */
+	int remember;
+	forget_fn forgotten;
+	/** Where remembered nodes wait, the shared wheel unless set before use */
+	copper_fuse_timer_wheel* timers;
+
+	id_shard   ids[COPPER_FUSE_NODE_SHARDS];
+	name_shard names[COPPER_FUSE_NODE_SHARDS];
+	std::mutex dir_locks[COPPER_FUSE_DIR_LOCKS];
+
+	std::atomic<uint64_t> ctr;
+	std::atomic<uint64_t> generation;
+	/* Renames started and finished, get_path() retries across one */
+	std::atomic<uint64_t> renames_started;
+	std::atomic<uint64_t> renames_finished;
+	/* Held shared by renames, taken before the directory stripes */
+	std::shared_mutex rename_lock;
+
+public:
+	copper_fuse_node_table(copper_fuse_atom_table* _atoms);
+	~copper_fuse_node_table();
+
+	copper_fuse_node_table(const copper_fuse_node_table&) = delete;
+	copper_fuse_node_table& operator= (const copper_fuse_node_table&) = delete;
+
+	std::shared_ptr<copper_fuse_node> get(fuse_ino_t nodeid);
+
+	/** Find or create the node of `name` in `parent` and count one lookup */
+	std::shared_ptr<copper_fuse_node> find(fuse_ino_t parent, const char* name);
+
+	/** The node of `name` in `parent`, without counting a lookup */
+	std::shared_ptr<copper_fuse_node> child(fuse_ino_t parent, const char* name);
+
+	/** The nodeid of `name` in `parent` if the kernel knows it, FUSE_UNKNOWN_INO otherwise */
+	fuse_ino_t lookup_nodeid(fuse_ino_t parent, const char* name);
+
+	void forget(fuse_ino_t nodeid, uint64_t nlookup);
+
+	/**
+	 * Build the path of `nodeid`, with `name` appended if not null
+	 *
+	 * @return 0 on success, -ENOENT if the node is gone or unhashed
+	 */
+	int get_path(fuse_ino_t nodeid, const char* name, std::string* path);
+
+	/**
+	 * Move `oldname` in `olddir` to `newname` in `newdir`, after the
+	 * filesystem did, the node there before is unhashed or, with
+	 * `exchange`, moved the other way
+	 *
+	 * @return 0 on success, -ENOMEM
+	 */
+	int rename(fuse_ino_t olddir, const char* oldname, fuse_ino_t newdir, const char* newname,
+		bool exchange);
+
+	/** Unhash `name` in `dir` after it was removed */
+	void remove(fuse_ino_t dir, const char* name);
+
+	/** Unhash `nodeid` wherever it is */
+	void unhash(fuse_ino_t nodeid);
+
+	/** Count an open handle of `nodeid` */
+	void opened(fuse_ino_t nodeid);
+
+	/**
+	 * Count the release of a handle of `nodeid`
+	 *
+	 * @return true for the last handle of a hidden node, which is to be
+	 *         removed now
+	 */
+	bool closed(fuse_ino_t nodeid);
+
+	void save(copper_fuse_snapshot_writer* w);
+	int restore(copper_fuse_snapshot_reader* r);
+
+	/** Nodes in the table */
+	size_t size();
+
+private:
+	id_shard& id_shard_of(fuse_ino_t nodeid);
+	name_shard& name_shard_of(const copper_fuse_name_key& key);
+	std::mutex& dir_lock(fuse_ino_t nodeid);
+	/* Lock the stripes of two directories, the lower one first */
+	void lock_dirs(fuse_ino_t a, fuse_ino_t b);
+	void unlock_dirs(fuse_ino_t a, fuse_ino_t b);
+
+	/* Insert `node` under a fresh nodeid */
+	void insert_id(std::shared_ptr<copper_fuse_node> node);
+	/* With the stripe of the node's parent held */
+	void unhash_locked(copper_fuse_node* node, const copper_fuse_node_link* link);
+	/* No lookup counted and not remembered */
+	bool unused(copper_fuse_node* node);
+	/* Drop `node` if nothing keeps it, then its parent if that was its last child */
+	void drop(std::shared_ptr<copper_fuse_node> node);
+
+	/* Remember a node the kernel forgot */
+	void arm(std::shared_ptr<copper_fuse_node> node);
+	/* Cancel every remembered node's timer, before the nodes go */
+	void disarm_all();
+};
+
+#endif //! __COPPER_FUSE_NODE_H__
@@ -0,0 +1,240 @@
+/*
+  CopperFuse: C++ version Filesystem in Userspace
+  Copyright (C) 2023 Chen Miao <chenmiao.ku@gmail.com>
+
+  This program can be distributed under the terms of the GNU LGPLv2.
+  See the file COPYING.LIB.
+*/
+
+#ifndef __COPPER_FUSE_PASSTHROUGH_H__
+#define __COPPER_FUSE_PASSTHROUGH_H__
+
+#include "copper_fuse.h"
+#include "copper_fuse_common.h"
+#include "copper_fuse_config.h"
+
+#include <atomic>
+#include <cstdint>
+#include <ctime>
+#include <dirent.h>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+/** ----------------------------------------------------------- *
+ * Passthrough (loopback) filesystem engine
+ * ------------------------------------------------------------ */
+
+/** Idle file descriptors kept open for reuse, across all inodes */
+constexpr const unsigned COPPER_PASSTHROUGH_MAX_IDLE_FDS = 1024;
+
+/** Default bound on cached dentries, each may hold an O_PATH descriptor */
+constexpr const size_t COPPER_PASSTHROUGH_MAX_DENTRIES = 16384;
+
+struct copper_passthrough;
+struct copper_passthrough_dentry;
+
+/**
+ * An inode of the underlying filesystem
+ *
+ * `fd` is an O_PATH descriptor, used as the directory argument of the
+ * *at() syscalls, so operations below this inode never re-resolve the
+ * full path.  Inodes are shared by every name linking to them.
+ */
+struct copper_passthrough_inode {
+	int   fd;
+	dev_t dev;
+	ino_t ino;
+
+	/**
+	 * Children looked up so far, keys view the name owned by the
+	 * dentry.  Only used for directories.
+	 */
+	std::shared_mutex lock;
+	std::unordered_map<std::string_view, std::unique_ptr<copper_passthrough_dentry>> children;
+	/* Size of `children`, for the LRU which can't take `lock` */
+	std::atomic<size_t> nchildren;
+
+	/**
+	 * Read/write descriptors by open mode.  A descriptor is shared by
+	 * all handles opened with the same mode and stays open for reuse
+	 * after the last of them is released.
+	 */
+	struct shared_fd {
+		int fd;
+		int mode;
+		unsigned users;
+	};
+	std::mutex fds_lock;
+	std::vector<shared_fd> fds;
+
+public:
+	copper_passthrough_inode(int _fd, dev_t _dev, ino_t _ino);
+	~copper_passthrough_inode();
+
+	copper_passthrough_inode(const copper_passthrough_inode&) = delete;
+	copper_passthrough_inode& operator= (const copper_passthrough_inode&) = delete;
+};
+
+/** Place of a dentry in copper_passthrough::lru, with its directory */
+struct copper_passthrough_lru_entry {
+	std::weak_ptr<copper_passthrough_inode> dir;
+	copper_passthrough_dentry* dentry;
+};
+
+struct copper_passthrough_dentry {
+	copper_passthrough* fs;
+	std::string name;
+	std::shared_ptr<copper_passthrough_inode> node;
+	struct timespec validated;
+	std::list<copper_passthrough_lru_entry>::iterator lru;
+
+public:
+	/** Takes its place at the front of fs->lru */
+	copper_passthrough_dentry(copper_passthrough* _fs,
+		const std::shared_ptr<copper_passthrough_inode>& dir, std::string _name,
+		std::shared_ptr<copper_passthrough_inode> _node);
+	~copper_passthrough_dentry();
+
+	copper_passthrough_dentry(const copper_passthrough_dentry&) = delete;
+	copper_passthrough_dentry& operator= (const copper_passthrough_dentry&) = delete;
+};
+
+/** State behind fuse_file_info::fh */
+struct copper_passthrough_handle {
+	std::shared_ptr<copper_passthrough_inode> node;
+	int fd;
+	int mode;
+
+	/* Directory stream, only for handles from opendir() */
+	DIR* dp;
+	struct dirent* entry;
+	off_t offset;
+};
+
+/**
+ * The passthrough filesystem
+ *
+ * Mirrors the tree below `source`.  Paths from the high-level API are
+ * walked component by component through the per-directory dentry
+ * cache; the final component is handed to the *at() syscall together
+ * with the O_PATH descriptor of its parent.  Cached dentries are
+ * revalidated with one fstatat() once they are older than
+ * `dentry_timeout`, so changes made to the source tree behind the
+ * mount's back are picked up.
+ *
+ * At most `max_dentries` dentries are cached.  They are kept in `lru`
+ * by their last validation, which a dentry in use renews every
+ * `dentry_timeout`, and the oldest one without dentries of its own
+ * below it is dropped to make room.  Lock order is a directory's
+ * `lock`, then `lru_lock`.
+ *
+ * Handlers follow `copper_fuse_operations` conventions and return
+ * -errno on failure.
+ */
+struct copper_passthrough {
+	std::shared_ptr<copper_passthrough_inode> root;
+	double dentry_timeout;
+	/** Set before use */
+	size_t max_dentries;
+
+	std::mutex lru_lock;
+	std::list<copper_passthrough_lru_entry> lru;
+
+	/** (st_dev, st_ino) to inode, so hard links share descriptors */
+	std::mutex inodes_lock;
+	std::map<std::pair<dev_t, ino_t>, std::weak_ptr<copper_passthrough_inode>> inodes;
+
+public:
+	copper_passthrough();
+	~copper_passthrough();
+
+	copper_passthrough(const copper_passthrough&) = delete;
+	copper_passthrough& operator= (const copper_passthrough&) = delete;
+
+	/**
+	 * Open the source directory
+	 *
+	 * @param source directory to mirror
+	 * @param timeout seconds a cached dentry is trusted without a check
+	 * @return 0 on success, -errno otherwise
+	 */
+	int init(const char* source, double timeout = 1.0);
+
+	/** Operation table bound to this instance */
+	copper_fuse_operations operations();
+
+	int getattr(const char* path, struct stat* stbuf, struct fuse_file_info* fi);
+	int readlink(const char* path, char* buf, size_t size);
+	int mknod(const char* path, mode_t mode, dev_t rdev);
+	int mkdir(const char* path, mode_t mode);
+	int unlink(const char* path);
+	int rmdir(const char* path);
+	int symlink(const char* from, const char* to);
+	int rename(const char* from, const char* to, unsigned int flags);
+	int link(const char* from, const char* to);
+	int chmod(const char* path, mode_t mode, struct fuse_file_info* fi);
+	int chown(const char* path, uid_t uid, gid_t gid, struct fuse_file_info* fi);
+	int truncate(const char* path, off_t size, struct fuse_file_info* fi);
+	int open(const char* path, struct fuse_file_info* fi);
+	int create(const char* path, mode_t mode, struct fuse_file_info* fi);
+	int read(const char* path, char* buf, size_t size, off_t off, struct fuse_file_info* fi);
+	int write(const char* path, const char* buf, size_t size, off_t off, struct fuse_file_info* fi);
+	int statfs(const char* path, struct statvfs* stbuf);
+	int flush(const char* path, struct fuse_file_info* fi);
+	int release(const char* path, struct fuse_file_info* fi);
+	int fsync(const char* path, int datasync, struct fuse_file_info* fi);
+#ifdef HAVE_SETXATTR
+	int setxattr(const char* path, const char* name, const char* value, size_t size, int flags);
+	int getxattr(const char* path, const char* name, char* value, size_t size);
+	int listxattr(const char* path, char* list, size_t size);
+	int removexattr(const char* path, const char* name);
+#endif
+	int opendir(const char* path, struct fuse_file_info* fi);
+	int readdir(const char* path, void* buf, fuse_fill_dir_t filler, off_t off,
+		struct fuse_file_info* fi, enum fuse_readdir_flags flags);
+	int releasedir(const char* path, struct fuse_file_info* fi);
+	int access(const char* path, int mask);
+	int utimens(const char* path, const struct timespec tv[2], struct fuse_file_info* fi);
+	int fallocate(const char* path, int mode, off_t off, off_t len, struct fuse_file_info* fi);
+	ssize_t copy_file_range(const char* path_in, struct fuse_file_info* fi_in, off_t off_in,
+		const char* path_out, struct fuse_file_info* fi_out, off_t off_out, size_t len, int flags);
+	off_t lseek(const char* path, off_t off, int whence, struct fuse_file_info* fi);
+	int backing_fd(const char* path, struct fuse_file_info* fi);
+
+private:
+	int lookup(const std::shared_ptr<copper_passthrough_inode>& dir, std::string_view name,
+		std::shared_ptr<copper_passthrough_inode>* nodep);
+	/** @return whether a dentry was dropped */
+	bool forget(const std::shared_ptr<copper_passthrough_inode>& dir, std::string_view name);
+	/** Drop the oldest dentries while there are more than `max_dentries` */
+	void shrink();
+
+	int resolve(const char* path, std::shared_ptr<copper_passthrough_inode>* nodep);
+	/**
+	 * Resolve everything but the last component of `path`, `name` is
+	 * set to point at that component inside `path`.  The root resolves
+	 * to itself with the name ".".
+	 */
+	int resolve_parent(const char* path, std::shared_ptr<copper_passthrough_inode>* parentp,
+		const char** name);
+
+	/**
+	 * Create the handle for `fi`, reusing a descriptor of `node` opened
+	 * with the same mode if there is one.  `fd`, if not -1, is a fresh
+	 * descriptor to use instead of reopening the inode.
+	 */
+	int open_fd(const std::shared_ptr<copper_passthrough_inode>& node, int flags, int fd,
+		struct fuse_file_info* fi);
+	/** Descriptor to operate on: the handle's, or a temporary one for `path` */
+	int path_fd(const char* path, struct fuse_file_info* fi, int flags, bool* temporary);
+};
+
+#endif //! __COPPER_FUSE_PASSTHROUGH_H__
@@ -0,0 +1,189 @@
+/*
+  CopperFuse: C++ version Filesystem in Userspace
+  Copyright (C) 2023 Chen Miao <chenmiao.ku@gmail.com>
+
+  This program can be distributed under the terms of the GNU LGPLv2.
+  See the file COPYING.LIB.
+*/
+
+#ifndef __COPPER_FUSE_PATH_H__
+#define __COPPER_FUSE_PATH_H__
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+/** Number of independently locked parts of an atom table */
+constexpr const unsigned COPPER_FUSE_ATOM_SHARDS = 64;
+
+/**
+ * Kernels for names and paths
+ *
+ * One set per instruction set, the best one the CPU supports is picked
+ * the first time any is used: AVX2, SSE4.2 (SSE2 compares and the
+ * crc32 instruction), plain C otherwise.  All of them give the same
+ * results, hashes included.
+ *
+ * The vector `len` and `sep` read whole aligned blocks around the
+ * string, never across a page boundary but past its end, as libc does.
+ */
+struct copper_fuse_path_kernels {
+	const char* isa;
+
+	/** Length of a NUL terminated string */
+	size_t (*len)(const char* s);
+
+	/** Hash of `len` bytes */
+	uint64_t (*hash)(const char* s, size_t len);
+
+	/** First '/' in `len` bytes, nullptr if there is none */
+	const char* (*sep)(const char* s, size_t len);
+
+	/** Compare like memcmp() on the common prefix, then by length */
+	int (*cmp)(const char* a, size_t alen, const char* b, size_t blen);
+};
+
+/** The kernels in use, until the first call ones that pick them */
+extern std::atomic<const copper_fuse_path_kernels*> copper_fuse_path_active;
+
+inline const copper_fuse_path_kernels* copper_fuse_path_ops() {
+	return copper_fuse_path_active.load(std::memory_order_relaxed);
+}
+
+/**
+ * The kernels for `isa`, "scalar", "sse4.2" or "avx2"
+ *
+ * @return nullptr if the CPU or the build lacks them
+ */
+const copper_fuse_path_kernels* copper_fuse_path_ops(const char* isa);
+
+inline size_t copper_fuse_path_len(const char* s) {
+	return copper_fuse_path_ops()->len(s);
+}
+
+inline uint64_t copper_fuse_path_hash(const char* s, size_t len) {
+	return copper_fuse_path_ops()->hash(s, len);
+}
+
+inline const char* copper_fuse_path_sep(const char* s, size_t len) {
+	return copper_fuse_path_ops()->sep(s, len);
+}
+
+inline int copper_fuse_path_cmp(const char* a, size_t alen, const char* b, size_t blen) {
+	return copper_fuse_path_ops()->cmp(a, alen, b, blen);
+}
+
+/**
+ * Append "/name" to `path`
+ *
+ * @return the length of `path` afterwards
+ */
+size_t copper_fuse_path_join(std::string* path, const char* name, size_t len);
+
+/**
+ * An interned name
+ *
+ * There is one atom per distinct name in a table, so two atoms of the
+ * same table are equal exactly when their pointers are.  The hash and
+ * length are computed once, when the name is first interned.
+ */
+struct copper_fuse_atom {
+	uint64_t hash;
+	std::atomic<unsigned> refs;
+	unsigned len;
+	char name[];
+};
+
+struct copper_fuse_atom_table;
+
+/** A counted reference to an atom, empty or owning one reference */
+struct copper_fuse_atom_ref {
+	copper_fuse_atom_table* table;
+	copper_fuse_atom* atom;
+
+public:
+	copper_fuse_atom_ref() : table(nullptr), atom(nullptr) {}
+	copper_fuse_atom_ref(copper_fuse_atom_table* _table, copper_fuse_atom* _atom)
+		: table(_table), atom(_atom) {}
+	copper_fuse_atom_ref(const copper_fuse_atom_ref& other);
+	copper_fuse_atom_ref(copper_fuse_atom_ref&& other) noexcept;
+	~copper_fuse_atom_ref();
+
+	copper_fuse_atom_ref& operator= (copper_fuse_atom_ref other) noexcept;
+
+	copper_fuse_atom* get() const { return atom; }
+	const char* c_str() const { return atom ? atom->name : ""; }
+	size_t size() const { return atom ? atom->len : 0; }
+	std::string_view view() const { return { c_str(), size() }; }
+	explicit operator bool() const { return atom != nullptr; }
+
+	bool operator== (const copper_fuse_atom_ref& other) const { return atom == other.atom; }
+	bool operator!= (const copper_fuse_atom_ref& other) const { return atom != other.atom; }
+};
+
+/**
+ * Table of interned names
+ *
+ * Sharded by hash, each shard an open addressing table behind its own
+ * lock, probed linearly and compacted on removal so it has no
+ * tombstones.  Slots keep the hash, an atom is only looked at when it
+ * matches.  An atom is freed when its last reference goes; the drop to
+ * zero only happens under the shard lock, so intern() never hands out
+ * an atom being freed.
+ */
+struct copper_fuse_atom_table {
+	struct slot {
+		uint64_t hash;
+		copper_fuse_atom* atom;
+	};
+
+	struct shard {
+		std::mutex lock;
+		/* A power of two in size, empty until the first atom */
+		std::vector<slot> slots;
+		size_t used = 0;
+	};
+
+	shard shards[COPPER_FUSE_ATOM_SHARDS];
+	std::atomic<size_t> count;
+
+public:
+	copper_fuse_atom_table() : count(0) {}
+	~copper_fuse_atom_table();
+
+	copper_fuse_atom_table(const copper_fuse_atom_table&) = delete;
+	copper_fuse_atom_table& operator= (const copper_fuse_atom_table&) = delete;
+
+	/**
+	 * The atom of `len` bytes at `name`, created if needed
+	 *
+	 * @return an empty reference if out of memory
+	 */
+	copper_fuse_atom_ref intern(const char* name, size_t len);
+	copper_fuse_atom_ref intern(const char* name) {
+		return intern(name, copper_fuse_path_len(name));
+	}
+
+	/** Distinct names interned */
+	size_t size() const { return count.load(std::memory_order_relaxed); }
+
+	/** Take an extra reference of `atom` */
+	static void get(copper_fuse_atom* atom);
+
+	/** Drop a reference of `atom`, freeing it with the last one */
+	void put(copper_fuse_atom* atom);
+
+private:
+	shard& shard_of(uint64_t hash) {
+		return shards[(hash * 0x9e3779b97f4a7c15ULL) >> 58];
+	}
+
+	/* Double the slots of `s`, which must be locked */
+	static bool grow(shard& s);
+};
+
+#endif //! __COPPER_FUSE_PATH_H__
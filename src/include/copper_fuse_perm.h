@@ -0,0 +1,158 @@
+/*
+  CopperFuse: C++ version Filesystem in Userspace
+  Copyright (C) 2023 Chen Miao <chenmiao.ku@gmail.com>
+
+  This program can be distributed under the terms of the GNU LGPLv2.
+  See the file COPYING.LIB.
+*/
+
+#ifndef __COPPER_FUSE_PERM_H__
+#define __COPPER_FUSE_PERM_H__
+
+#include "copper_fuse_groups.h"
+#include "copper_fuse_lowlevel.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unordered_map>
+#include <vector>
+
+/** Number of independently locked parts of the permission cache */
+constexpr const unsigned COPPER_FUSE_PERM_SHARDS = 64;
+
+/** Supplementary groups a credential holds without allocating */
+constexpr const int COPPER_FUSE_CRED_GROUPS = 32;
+
+/** Name of the access ACL attribute */
+constexpr const char* COPPER_FUSE_ACL_ACCESS = "system.posix_acl_access";
+
+/** Tags of ACL entries, as stored in the attribute */
+constexpr const uint16_t COPPER_FUSE_ACL_USER_OBJ  = 0x01;
+constexpr const uint16_t COPPER_FUSE_ACL_USER      = 0x02;
+constexpr const uint16_t COPPER_FUSE_ACL_GROUP_OBJ = 0x04;
+constexpr const uint16_t COPPER_FUSE_ACL_GROUP     = 0x08;
+constexpr const uint16_t COPPER_FUSE_ACL_MASK      = 0x10;
+constexpr const uint16_t COPPER_FUSE_ACL_OTHER     = 0x20;
+
+struct copper_fuse_acl_entry {
+	uint16_t tag;
+	uint16_t perm;
+	uint32_t id;
+};
+
+/** A POSIX access ACL */
+struct copper_fuse_acl {
+	std::vector<copper_fuse_acl_entry> entries;
+
+public:
+	/**
+	 * Decode the value of system.posix_acl_access
+	 *
+	 * @return 0 on success, -EINVAL if it is malformed
+	 */
+	int parse(const void* value, size_t size);
+};
+
+/**
+ * Who a request acts for
+ *
+ * The supplementary groups are only fetched, through the groups cache,
+ * when a decision depends on them.
+ */
+struct copper_fuse_cred {
+	uid_t uid;
+	gid_t gid;
+	pid_t pid;
+	copper_fuse_groups_cache* cache;
+
+	/* -1 until fetched, a failed fetch leaves the primary group only */
+	int ngroups;
+	gid_t small[COPPER_FUSE_CRED_GROUPS];
+	std::vector<gid_t> big;
+
+public:
+	copper_fuse_cred(uid_t _uid, gid_t _gid, pid_t _pid, copper_fuse_groups_cache* _cache)
+		: uid(_uid), gid(_gid), pid(_pid), cache(_cache), ngroups(-1) {}
+
+	/** Whether the caller is a member of `group` */
+	bool in_group(gid_t group);
+};
+
+/**
+ * Decide whether `cred` may access a file as `mask` asks
+ *
+ * `mask` is made of R_OK, W_OK and X_OK.  Follows POSIX.1e: the owner
+ * class, named users, then the group class, where a matching group
+ * that does not grant the access denies it, then others.  Without
+ * `acl` the mode bits stand for the three minimal entries.  Root may
+ * do anything but execute a file without any execute bit.
+ *
+ * @return 0 if allowed, -EACCES otherwise
+ */
+int copper_fuse_perm_check(mode_t mode, uid_t owner, gid_t group, const copper_fuse_acl* acl,
+	copper_fuse_cred* cred, int mask);
+
+/** What the permission cache knows of a node */
+struct copper_fuse_perm_node {
+	mode_t mode;
+	uid_t uid;
+	gid_t gid;
+	int64_t expires;
+	/* Whether `acl` was looked up, null then means there is none */
+	bool acl_known;
+	std::shared_ptr<const copper_fuse_acl> acl;
+};
+
+/**
+ * Owner, mode and ACL of the nodes, for permission checks in the
+ * library
+ *
+ * Attributes are refreshed by every attribute the library hands to the
+ * kernel and expire after `timeout` seconds, as the kernel's copy does.
+ * A change of mode drops the ACL, its mask being the group bits.  An
+ * ACL is remembered once fetched, until invalidate().
+ */
+struct copper_fuse_perm_cache {
+	struct shard {
+		std::mutex lock;
+		std::unordered_map<fuse_ino_t, copper_fuse_perm_node> nodes;
+		/* Bumped by every invalidation, see set_acl() */
+		uint64_t version;
+	};
+
+	shard  shards[COPPER_FUSE_PERM_SHARDS];
+	double timeout;
+
+public:
+	copper_fuse_perm_cache(double _timeout);
+
+	copper_fuse_perm_cache(const copper_fuse_perm_cache&) = delete;
+	copper_fuse_perm_cache& operator= (const copper_fuse_perm_cache&) = delete;
+
+	/**
+	 * The cached state of `ino`, unless expired
+	 *
+	 * @return true on a hit, with `*version` to pass to set_acl()
+	 */
+	bool lookup(fuse_ino_t ino, copper_fuse_perm_node* node, uint64_t* version);
+
+	/** Take fresh attributes of `ino` */
+	void update(fuse_ino_t ino, const struct stat* stbuf);
+
+	/** Remember the ACL of `ino`, unless invalidated since `version` */
+	void set_acl(fuse_ino_t ino, uint64_t version, std::shared_ptr<const copper_fuse_acl> acl);
+
+	/** Drop everything about `ino`, its attributes or ACL changed */
+	void invalidate(fuse_ino_t ino);
+
+private:
+	shard& shard_of(fuse_ino_t ino) {
+		return shards[(ino * 0x9e3779b97f4a7c15ULL) >> 58];
+	}
+};
+
+#endif //! __COPPER_FUSE_PERM_H__
@@ -0,0 +1,84 @@
+/*
+  CopperFuse: C++ version Filesystem in Userspace
+  Copyright (C) 2023 Chen Miao <chenmiao.ku@gmail.com>
+
+  This program can be distributed under the terms of the GNU LGPLv2.
+  See the file COPYING.LIB.
+*/
+
+#ifndef __COPPER_FUSE_POLL_H__
+#define __COPPER_FUSE_POLL_H__
+
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <unordered_map>
+
+/** Number of independently locked parts of the poll registry */
+constexpr const unsigned COPPER_FUSE_POLL_SHARDS = 64;
+
+/**
+ * Poll waiters of a session, keyed by the kernel handle `kh`
+ *
+ * The kernel names every polled file by a kh and sends POLL with
+ * FUSE_POLL_SCHEDULE_NOTIFY each time a poller goes back to sleep on
+ * it, while a single NOTIFY_POLL wakes all pollers of that kh.  The
+ * registry remembers which kh were polled since their last
+ * notification (armed) and lets only those through, however many
+ * handles the filesystem holds or how often it signals readiness.
+ *
+ * An entry lives as long as a fuse_pollhandle for its kh does.  The
+ * shards are locked independently, handles are created, notified and
+ * deleted without a global lock.
+ */
+struct copper_fuse_poll_registry {
+	struct waiter {
+		/* Live fuse_pollhandle objects for the kh */
+		unsigned handles;
+		bool armed;
+	};
+
+	struct shard {
+		std::mutex lock;
+		std::unordered_map<uint64_t, waiter> waiters;
+	};
+
+	shard shards[COPPER_FUSE_POLL_SHARDS];
+
+public:
+	copper_fuse_poll_registry() = default;
+
+	copper_fuse_poll_registry(const copper_fuse_poll_registry&) = delete;
+	copper_fuse_poll_registry& operator= (const copper_fuse_poll_registry&) = delete;
+
+	/** A handle for `kh` was handed out, the kernel waits for it */
+	void arm(uint64_t kh);
+
+	/** A handle for `kh` was deleted */
+	void release(uint64_t kh);
+
+	/**
+	 * Consume the pending wakeup of `kh`
+	 *
+	 * @return true if the kernel has to be notified
+	 */
+	bool disarm(uint64_t kh);
+
+	/**
+	 * disarm() a batch, taking each shard lock once
+	 *
+	 * `khs` is reordered and may hold duplicates, on return its first
+	 * entries are the distinct kh the kernel has to be notified of.
+	 *
+	 * @return number of such entries
+	 */
+	size_t disarm_batch(uint64_t* khs, size_t count);
+
+	/** Number of kh with live handles */
+	size_t size();
+
+private:
+	shard& shard_of(uint64_t kh);
+};
+
+#endif //! __COPPER_FUSE_POLL_H__
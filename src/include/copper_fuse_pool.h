@@ -0,0 +1,50 @@
+/*
+  CopperFuse: C++ version Filesystem in Userspace
+  Copyright (C) 2023 Chen Miao <chenmiao.ku@gmail.com>
+
+  This program can be distributed under the terms of the GNU LGPLv2.
+  See the file COPYING.LIB.
+*/
+
+#ifndef __COPPER_FUSE_POOL_H__
+#define __COPPER_FUSE_POOL_H__
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/**
+ * Fixed size pool of worker threads
+ *
+ * Used by the library for background work that must not hold up the
+ * threads reading from the kernel.  Threads are started lazily, when
+ * work is submitted and none is idle, the destructor waits for queued
+ * work to finish.
+ */
+struct copper_fuse_pool {
+	std::mutex lock;
+	std::condition_variable cond;
+	std::deque<std::function<void()>> queue;
+	std::vector<std::thread> threads;
+	size_t max_threads;
+	size_t idle;
+	bool stopping;
+
+public:
+	copper_fuse_pool(size_t _max_threads);
+	~copper_fuse_pool();
+
+	copper_fuse_pool(const copper_fuse_pool&) = delete;
+	copper_fuse_pool& operator= (const copper_fuse_pool&) = delete;
+
+	void submit(std::function<void()> work);
+
+private:
+	void worker();
+};
+
+#endif //! __COPPER_FUSE_POOL_H__
@@ -0,0 +1,99 @@
+/*
+  CopperFuse: C++ version Filesystem in Userspace
+  Copyright (C) 2023 Chen Miao <chenmiao.ku@gmail.com>
+
+  This program can be distributed under the terms of the GNU LGPLv2.
+  See the file COPYING.LIB.
+*/
+
+#ifndef __COPPER_FUSE_REPLY_H__
+#define __COPPER_FUSE_REPLY_H__
+
+#include "copper_fuse_kernel.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <sys/uio.h>
+#include <vector>
+
+/** Segments a reply holds without allocating */
+constexpr const unsigned COPPER_FUSE_REPLY_IOVS = 16;
+
+/** Room next to the header for copied pieces */
+constexpr const size_t COPPER_FUSE_REPLY_STAGE = 8192;
+
+/** Pieces up to this size are copied rather than given a segment */
+constexpr const size_t COPPER_FUSE_REPLY_COALESCE = 4096;
+
+/**
+ * One reply or notification gathered from pieces, for a single writev()
+ *
+ * The header sits at the start of a staging buffer, small pieces are
+ * copied after it and after each other as long as nothing else comes
+ * between them, so an attr-sized argument or a run of dirent records
+ * costs no segment of its own.  Larger pieces are referenced in place
+ * and must stay valid until the message is sent.  Segments live in
+ * the builder up to COPPER_FUSE_REPLY_IOVS, reserve() sizes them for
+ * more up front.
+ */
+struct copper_fuse_reply_builder {
+	alignas(8) char stage[sizeof(struct fuse_out_header) + COPPER_FUSE_REPLY_STAGE];
+	size_t staged;
+	struct iovec local[COPPER_FUSE_REPLY_IOVS];
+	std::vector<struct iovec> spill;
+	struct iovec* iov;
+	int count;
+	int capacity;
+	size_t len;
+
+public:
+	copper_fuse_reply_builder();
+
+	copper_fuse_reply_builder(const copper_fuse_reply_builder&) = delete;
+	copper_fuse_reply_builder& operator= (const copper_fuse_reply_builder&) = delete;
+
+	/** Make room for `pieces` more segments */
+	void reserve(int pieces);
+
+	/** Append `size` bytes */
+	void add(const void* data, size_t size);
+
+	/** Append each of `count` segments */
+	void add_iov(const struct iovec* segs, int count);
+
+	/** Bytes appended so far, without the header */
+	size_t size() const;
+
+	/**
+	 * Fill in the header
+	 *
+	 * @return the segments of the message, `*n` of them
+	 */
+	struct iovec* finish(uint64_t unique, int32_t error, int* n);
+
+	/** Start a new message */
+	void clear();
+};
+
+/**
+ * Notifications to send together
+ *
+ * The kernel takes one message per write() on /dev/fuse, there they
+ * still go out one by one but without an allocation each.  On a
+ * socket standing in for the device, a batch is a single sendmmsg().
+ */
+struct copper_fuse_notify_batch {
+	std::vector<char> buf;
+	std::vector<size_t> ends;
+
+public:
+	/** Queue a notification with argument `arg` */
+	void add(int code, const void* arg, size_t size);
+
+	/** Number of notifications queued */
+	size_t size() const;
+
+	void clear();
+};
+
+#endif //! __COPPER_FUSE_REPLY_H__
@@ -0,0 +1,146 @@
+/*
+  CopperFuse: C++ version Filesystem in Userspace
+  Copyright (C) 2023 Chen Miao <chenmiao.ku@gmail.com>
+
+  This program can be distributed under the terms of the GNU LGPLv2.
+  See the file COPYING.LIB.
+*/
+
+#ifndef __COPPER_FUSE_TIMER_H__
+#define __COPPER_FUSE_TIMER_H__
+
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+/** Slots of each level of the timer wheel, a power of two */
+constexpr const unsigned COPPER_FUSE_TIMER_SLOTS = 256;
+
+/** Levels of the timer wheel, each 256 times coarser than the one below */
+constexpr const unsigned COPPER_FUSE_TIMER_LEVELS = 4;
+
+/** Resolution of the timer wheel in nanoseconds */
+constexpr const int64_t COPPER_FUSE_TIMER_TICK_NS = 1000000;
+
+/**
+ * A callback run once after a delay
+ *
+ * Armed on a copper_fuse_timer_wheel, which owns the fields below
+ * `fire` and protects them with its lock.  A timer must not go away
+ * while armed: cancel_sync() it first, or make sure, under a lock the
+ * callback takes too, that it is not pending().
+ */
+struct copper_fuse_timer {
+	std::function<void()> fire;
+
+	copper_fuse_timer* prev;
+	copper_fuse_timer* next;
+	/* Tick of the wheel it is due at */
+	int64_t expires;
+	/* Slot it is on, -1 while not armed */
+	int slot;
+
+public:
+	copper_fuse_timer();
+	explicit copper_fuse_timer(std::function<void()> _fire);
+
+	copper_fuse_timer(const copper_fuse_timer&) = delete;
+	copper_fuse_timer& operator= (const copper_fuse_timer&) = delete;
+};
+
+/**
+ * Hierarchical timer wheel shared by everything that expires
+ *
+ * Four levels of 256 slots, the first one of one millisecond ticks, the
+ * next ones each covering a turn of the one below, 49 days in all.  A
+ * timer goes onto the slot of the level its delay falls in and moves
+ * down a level each time the one below wraps, so arming and cancelling
+ * are O(1) and a timer is touched at most once per level.
+ *
+ * One thread, started with the first timer armed, sleeps until the next
+ * slot holding anything, found with a bitmap per level, and runs the
+ * callbacks due one at a time without the lock held.  A callback may
+ * arm or cancel timers, its own included, and free its own timer; it
+ * should be short, every other timer waits for it.
+ */
+struct copper_fuse_timer_wheel {
+	std::mutex lock;
+	/* Wakes the thread, for a timer due before it planned to */
+	std::condition_variable cond;
+	/* A callback returned, for cancel_sync() */
+	std::condition_variable done;
+	std::thread thread;
+	bool stopping;
+
+	/* Every level's slots, then the list of timers due and not run yet */
+	copper_fuse_timer* slots[COPPER_FUSE_TIMER_LEVELS * COPPER_FUSE_TIMER_SLOTS + 1];
+	uint64_t occupied[COPPER_FUSE_TIMER_LEVELS][COPPER_FUSE_TIMER_SLOTS / 64];
+	/* Tick 0 */
+	std::chrono::steady_clock::time_point base;
+	/* The next tick to expire, the thread sleeps until `wake` */
+	int64_t cur;
+	int64_t wake;
+	size_t armed;
+	/* Whose callback is running */
+	copper_fuse_timer* running;
+
+public:
+	copper_fuse_timer_wheel();
+	/* Stops the thread, timers still armed never fire */
+	~copper_fuse_timer_wheel();
+
+	copper_fuse_timer_wheel(const copper_fuse_timer_wheel&) = delete;
+	copper_fuse_timer_wheel& operator= (const copper_fuse_timer_wheel&) = delete;
+
+	/** The wheel of the process, used by the library's caches and loops */
+	static copper_fuse_timer_wheel& shared();
+
+	/**
+	 * Fire `timer` in `seconds`, rounded up to the next tick, moving it
+	 * if it was armed already
+	 *
+	 * @return 0 on success, -ENOMEM if the thread could not start
+	 */
+	int arm(copper_fuse_timer* timer, double seconds);
+
+	/**
+	 * Disarm `timer`, its callback may still be running
+	 *
+	 * @return true if it was armed
+	 */
+	bool cancel(copper_fuse_timer* timer);
+
+	/**
+	 * Disarm `timer` and wait for its callback to return, unless called
+	 * from that callback
+	 *
+	 * @return true if it was armed
+	 */
+	bool cancel_sync(copper_fuse_timer* timer);
+
+	/** Armed and not fired yet */
+	bool pending(copper_fuse_timer* timer);
+
+	/** Timers armed */
+	size_t size();
+
+private:
+	int64_t now_tick();
+	/* Put an unlinked timer on the slot `expires` falls in, from `cur` */
+	void place(copper_fuse_timer* timer);
+	void link(copper_fuse_timer* timer, int slot);
+	void unlink(copper_fuse_timer* timer);
+	/* Move the slot of `level` that `cur` reached down a level */
+	void cascade(unsigned level);
+	/* Expire every tick up to `to` onto the due list */
+	void advance(int64_t to);
+	/* The first tick after `cur` - 1 at which a slot is expired or cascaded */
+	int64_t next_tick();
+	void run();
+};
+
+#endif //! __COPPER_FUSE_TIMER_H__
@@ -0,0 +1,120 @@
+/*
+  CopperFuse: C++ version Filesystem in Userspace
+  Copyright (C) 2023 Chen Miao <chenmiao.ku@gmail.com>
+
+  This program can be distributed under the terms of the GNU LGPLv2.
+  See the file COPYING.LIB.
+*/
+
+#ifndef __COPPER_FUSE_WRITE_BEHIND_H__
+#define __COPPER_FUSE_WRITE_BEHIND_H__
+
+#include "copper_fuse_lowlevel.h"
+#include "copper_fuse_pool.h"
+#include "copper_fuse_timer.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+
+/** Threads writing out extents that aged, off the timer thread */
+constexpr const unsigned COPPER_FUSE_WRITE_BEHIND_THREADS = 2;
+
+/**
+ * Write-behind of the high-level write path
+ *
+ * Writes of an open file are answered at once and gathered into one
+ * extent per handle for as long as each starts where the extent ends
+ * or lands within it.  The extent goes to ->write() in one call once
+ * it holds `max_bytes`, is `max_age` seconds old, or a write elsewhere
+ * in the file, a FLUSH, FSYNC or RELEASE of the handle, or a request
+ * that reads the file or its size comes along.
+ *
+ * An extent getting its first byte arms a timer of the handle, which
+ * has a thread of `pool` write it out if it's still there `max_age`
+ * seconds later.  ->write() may block, it never runs on the timer
+ * thread shared with the other timers.
+ *
+ * A write that fails later is reported like the kernel reports a
+ * failed writeback: the error sticks to the handle and is returned by
+ * the next write, flush or fsync of it, once.  Handles opened with
+ * O_SYNC or O_DSYNC are written through.
+ */
+struct copper_fuse_write_behind {
+	/** Write `size` bytes of `buf` at `off` to the file, as ->write() does */
+	using write_fn = std::function<int(fuse_ino_t ino, const char* buf, size_t size, off_t off,
+		struct fuse_file_info* fi)>;
+
+	struct handle {
+		/* Held across the ->write() of the extent, orders the handle's writes */
+		std::mutex lock;
+		struct fuse_file_info fi;
+		off_t off;
+		std::string data;
+		/* When `data` got its first byte */
+		int64_t since;
+		/* Of an extent written behind the caller's back, not reported yet */
+		int error;
+		/* Armed while `data` holds anything */
+		copper_fuse_timer timer;
+	};
+
+	write_fn write_out;
+	size_t max_bytes;
+	int64_t max_age_ns;
+
+	/* Open handles by node and fh, so a node's extents are adjacent */
+	std::mutex lock;
+	std::map<std::pair<fuse_ino_t, uint64_t>, std::shared_ptr<handle>> handles;
+
+	/** Where the handles' timers run, the shared wheel unless set before use */
+	copper_fuse_timer_wheel* timers;
+
+	/* Write-outs of aged extents, last so that it is joined before the rest goes */
+	copper_fuse_pool pool;
+
+public:
+	copper_fuse_write_behind(write_fn _write_out, size_t _max_bytes, double _max_age);
+	/* Extents still pending are lost, flush_all() first */
+	~copper_fuse_write_behind();
+
+	copper_fuse_write_behind(const copper_fuse_write_behind&) = delete;
+	copper_fuse_write_behind& operator= (const copper_fuse_write_behind&) = delete;
+
+	/**
+	 * Take a write of the handle `fi` of `ino`
+	 *
+	 * @return `size` on success, -errno from writing out an extent
+	 */
+	int write(fuse_ino_t ino, struct fuse_file_info* fi, const char* buf, size_t size, off_t off);
+
+	/**
+	 * Write out the extent of a handle, for FLUSH and FSYNC
+	 *
+	 * @return 0, or the error of this or an earlier write-out
+	 */
+	int flush(fuse_ino_t ino, const struct fuse_file_info* fi);
+
+	/** Write out the extents of every handle of `ino`, errors stay with the handles */
+	void flush_ino(fuse_ino_t ino);
+
+	/** flush() and forget the handle, for RELEASE */
+	int release(fuse_ino_t ino, const struct fuse_file_info* fi);
+
+	/** Write out everything, before the filesystem goes away */
+	void flush_all();
+
+private:
+	std::shared_ptr<handle> find(fuse_ino_t ino, uint64_t fh);
+	/* With `h->lock` held */
+	int write_extent(fuse_ino_t ino, handle* h);
+	/* The timer of the handle `fh` of `ino` fired, on a thread of `pool` */
+	void expire(fuse_ino_t ino, uint64_t fh);
+};
+
+#endif //! __COPPER_FUSE_WRITE_BEHIND_H__
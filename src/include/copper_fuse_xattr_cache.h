@@ -0,0 +1,99 @@
+/*
+  CopperFuse: C++ version Filesystem in Userspace
+  Copyright (C) 2023 Chen Miao <chenmiao.ku@gmail.com>
+
+  This program can be distributed under the terms of the GNU LGPLv2.
+  See the file COPYING.LIB.
+*/
+
+#ifndef __COPPER_FUSE_XATTR_CACHE_H__
+#define __COPPER_FUSE_XATTR_CACHE_H__
+
+#include "copper_fuse_lowlevel.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <ctime>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+/** Number of independently locked parts of the xattr cache */
+constexpr const unsigned COPPER_FUSE_XATTR_SHARDS = 64;
+
+/** Default bound on cached names and values, across all shards */
+constexpr const size_t COPPER_FUSE_XATTR_CACHE_BYTES = 16 << 20;
+
+/**
+ * A cached getxattr() or listxattr() result
+ *
+ * `err` is 0 with the data in `value`, or the positive error the
+ * filesystem returned, ENODATA being the one worth remembering.
+ */
+struct copper_fuse_xattr_entry {
+	int err;
+	std::string value;
+	struct timespec stamp;
+};
+
+struct copper_fuse_xattr_node {
+	std::unordered_map<std::string, copper_fuse_xattr_entry> names;
+	bool has_list;
+	copper_fuse_xattr_entry list;
+};
+
+/**
+ * Extended attribute cache of the high-level API, keyed by node
+ *
+ * The classic size probe protocol costs two getxattr() round trips to
+ * the filesystem per lookup; the cache fetches the value once and
+ * serves both the probe and the fetch from it.  Misses (ENODATA) are
+ * cached too, which matters for the security.capability lookup the
+ * kernel does on every write.  Entries expire after `timeout` seconds
+ * and are dropped when the attribute is set or removed through this
+ * mount.
+ */
+struct copper_fuse_xattr_cache {
+	struct shard {
+		std::mutex lock;
+		std::unordered_map<fuse_ino_t, copper_fuse_xattr_node> nodes;
+		size_t bytes;
+		/**
+		 * Bumped by every invalidation, a fill that started before
+		 * must not overwrite the newer state
+		 */
+		uint64_t version;
+	};
+
+	shard  shards[COPPER_FUSE_XATTR_SHARDS];
+	double timeout;
+	size_t max_bytes;
+
+public:
+	copper_fuse_xattr_cache(double _timeout, size_t _max_bytes = COPPER_FUSE_XATTR_CACHE_BYTES);
+
+	copper_fuse_xattr_cache(const copper_fuse_xattr_cache&) = delete;
+	copper_fuse_xattr_cache& operator= (const copper_fuse_xattr_cache&) = delete;
+
+	/**
+	 * Look up a cached attribute, `name` == nullptr means the list
+	 *
+	 * @return true on a hit, with `*err` and `*value` filled in;
+	 *         false on a miss, with `*version` to pass to store()
+	 */
+	bool lookup(fuse_ino_t ino, const char* name, int* err, std::string* value, uint64_t* version);
+
+	/** Remember what the filesystem returned, unless invalidated since `version` */
+	void store(fuse_ino_t ino, const char* name, uint64_t version, int err, const std::string& value);
+
+	/** Drop `name` and the list of `ino`, `name` == nullptr drops all of them */
+	void invalidate(fuse_ino_t ino, const char* name);
+
+	/** Drop everything about a node the kernel forgot */
+	void forget(fuse_ino_t ino);
+
+private:
+	shard& shard_of(fuse_ino_t ino);
+};
+
+#endif //! __COPPER_FUSE_XATTR_CACHE_H__
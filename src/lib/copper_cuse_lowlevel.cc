@@ -0,0 +1,290 @@
+/*
+  CUSE: Character device in Userspace
+  Copyright (C) 2008       SUSE Linux Products GmbH
+  Copyright (C) 2008       Tejun Heo <teheo@suse.de>
+
+  This program can be distributed under the terms of the GNU LGPLv2.
+  See the file COPYING.LIB.
+
+  CopperCuse: C++ version Character device in Userspace
+  Copyright (C) 2023 Chen Miao <chenmiao.ku@gmail.com>
+*/
+
+#include "copper_cuse_lowlevel.h"
+#include "copper_fuse_i.h"
+#include "copper_log.h"
+
+#include <cerrno>
+#include <cstddef>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+
+/* Room for the request header and the fixed part of the biggest request */
+#define CUSE_BUFFER_HEADER_SIZE 0x1000
+
+/** ---------------------------------------------------
+ * FOR COPPER CUSE OPT
+ * ---------------------------------------------------*/
+
+struct copper_cuse_conf {
+	int verbose;
+	unsigned max_read;
+};
+
+#define CUSE_LIB_OPT(t, p, v)	\
+		{ t, offsetof(copper_cuse_conf, p), v }
+
+static const struct copper_fuse_opt copper_cuse_lib_opts[] = {
+	CUSE_LIB_OPT("debug",        verbose, 1),
+	CUSE_LIB_OPT("-d",           verbose, 1),
+	CUSE_LIB_OPT("max_read=%u",  max_read, 0),
+	COPPER_FUSE_OPT_END
+};
+
+static void copper_cuse_help() {
+	printf("    -h   --help            print help\n"
+	       "    -d   -o debug          enable debug output (implies -f)\n"
+	       "    -f                     foreground operation\n"
+	       "    -s                     disable multi-threaded operation\n"
+	       "    -o max_read=N          largest read passed to the device\n"
+	       "                           (default: 128 KiB)\n");
+}
+
+/** ---------------------------------------------------
+ * FOR COPPER CUSE SESSION
+ * ---------------------------------------------------*/
+
+/* Every request of a character device is about the device, drop the inode */
+static struct copper_fuse_lowlevel_ops cuse_ll_ops(copper_cuse_data* cd) {
+	struct copper_fuse_lowlevel_ops lop;
+	const struct copper_cuse_lowlevel_ops* clop = &cd->clop;
+
+	lop.init    = clop->init;
+	lop.destroy = clop->destroy;
+	if (clop->open)
+		lop.open = [clop](copper_fuse_req_t req, fuse_ino_t, struct fuse_file_info* fi) {
+			clop->open(req, fi);
+		};
+	if (clop->read)
+		lop.read = [clop](copper_fuse_req_t req, fuse_ino_t, size_t size, off_t off,
+			struct fuse_file_info* fi) {
+			clop->read(req, size, off, fi);
+		};
+	if (clop->write)
+		lop.write = [clop](copper_fuse_req_t req, fuse_ino_t, const char* buf, size_t size,
+			off_t off, struct fuse_file_info* fi) {
+			clop->write(req, buf, size, off, fi);
+		};
+	if (clop->flush)
+		lop.flush = [clop](copper_fuse_req_t req, fuse_ino_t, struct fuse_file_info* fi) {
+			clop->flush(req, fi);
+		};
+	if (clop->release)
+		lop.release = [clop](copper_fuse_req_t req, fuse_ino_t, struct fuse_file_info* fi) {
+			clop->release(req, fi);
+		};
+	if (clop->fsync)
+		lop.fsync = [clop](copper_fuse_req_t req, fuse_ino_t, int datasync,
+			struct fuse_file_info* fi) {
+			clop->fsync(req, datasync, fi);
+		};
+	if (clop->ioctl)
+		lop.ioctl = [clop](copper_fuse_req_t req, fuse_ino_t, unsigned int cmd, void* arg,
+			struct fuse_file_info* fi, unsigned flags, const void* in_buf,
+			size_t in_bufsz, size_t out_bufsz) {
+			clop->ioctl(req, cmd, arg, fi, flags, in_buf, in_bufsz, out_bufsz);
+		};
+	if (clop->poll)
+		lop.poll = [clop](copper_fuse_req_t req, fuse_ino_t, struct fuse_file_info* fi,
+			struct fuse_pollhandle* ph) {
+			clop->poll(req, fi, ph);
+		};
+
+	return lop;
+}
+
+struct copper_fuse_session* copper_cuse_lowlevel_new(struct copper_fuse_args* args,
+	const struct copper_cuse_info* ci, const struct copper_cuse_lowlevel_ops* clop, void* userdata) {
+	copper_cuse_conf conf;
+	memset(&conf, 0, sizeof(conf));
+
+	if (args && args->parse_opt(&conf, copper_cuse_lib_opts, nullptr) == -1)
+		return nullptr;
+
+	copper_cuse_data* cd = new (std::nothrow) copper_cuse_data;
+	if (!cd) {
+		erron << "cuse: failed to allocate cuse_data";
+		return nullptr;
+	}
+
+	cd->clop      = *clop;
+	cd->max_read  = conf.max_read;
+	cd->dev_major = ci->dev_major;
+	cd->dev_minor = ci->dev_minor;
+	cd->flags     = ci->flags;
+	for (unsigned i = 0; i < ci->dev_info_argc; i++) {
+		cd->dev_info.append(ci->dev_info_argv[i]);
+		cd->dev_info.push_back('\0');
+	}
+	if (cd->dev_info.size() > CUSE_INIT_INFO_MAX) {
+		erron << "cuse: dev_info (" << cd->dev_info.size() << ") too large, limit="
+			<< CUSE_INIT_INFO_MAX;
+		delete cd;
+		return nullptr;
+	}
+
+	struct copper_fuse_lowlevel_ops lop = cuse_ll_ops(cd);
+	copper_fuse_session* se = new (std::nothrow) copper_fuse_session(&lop, userdata);
+	if (!se) {
+		delete cd;
+		return nullptr;
+	}
+	se->cuse_data = cd;
+	se->verbose = conf.verbose;
+	return se;
+}
+
+void copper_cuse_lowlevel_init(copper_fuse_req_t req, fuse_ino_t nodeid, const void* inarg) {
+	const struct cuse_init_in* arg = (const struct cuse_init_in*)inarg;
+	struct cuse_init_out outarg;
+	copper_fuse_session* se = req->se;
+	copper_cuse_data* cd = se->cuse_data;
+	size_t bufsize = se->bufsize;
+	static_cast<void>(nodeid);
+
+	if (!cd) {
+		/* A filesystem session, not a character device */
+		req->reply_err(ENOSYS);
+		return;
+	}
+
+	if (se->verbose) {
+		info << "CUSE_INIT: " << arg->major << "." << arg->minor
+			<< " flags=0x" << std::hex << arg->flags << std::dec;
+	}
+
+	se->conn.proto_major = arg->major;
+	se->conn.proto_minor = arg->minor;
+	se->conn.capable = 0;
+	se->conn.want = 0;
+
+	if (arg->major < 7) {
+		erron << "cuse: unsupported protocol version: " << arg->major << "." << arg->minor;
+		req->reply_err(EPROTO);
+		return;
+	}
+
+	if (bufsize < FUSE_MIN_READ_BUFFER)
+		bufsize = FUSE_MIN_READ_BUFFER;
+
+	/* Reads and writes both get the whole buffer, so a stream moves in big pieces */
+	bufsize -= CUSE_BUFFER_HEADER_SIZE;
+	if (bufsize < se->conn.max_write)
+		se->conn.max_write = bufsize;
+	if (!cd->max_read || cd->max_read > bufsize)
+		cd->max_read = bufsize;
+
+	se->got_init = 1;
+	if (se->op.init)
+		se->op.init(se->userdata, &se->conn);
+
+	memset(&outarg, 0, sizeof(outarg));
+	outarg.major     = FUSE_KERNEL_VERSION;
+	outarg.minor     = FUSE_KERNEL_MINOR_VERSION;
+	outarg.flags     = cd->flags;
+	outarg.max_read  = cd->max_read;
+	outarg.max_write = se->conn.max_write;
+	outarg.dev_major = cd->dev_major;
+	outarg.dev_minor = cd->dev_minor;
+
+	if (se->verbose) {
+		info << "   CUSE_INIT: " << outarg.major << "." << outarg.minor
+			<< " flags=0x" << std::hex << outarg.flags << std::dec
+			<< " max_read=" << outarg.max_read << " max_write=" << outarg.max_write
+			<< " dev_major=" << outarg.dev_major << " dev_minor=" << outarg.dev_minor;
+	}
+
+	struct iovec iov[2];
+	iov[0].iov_base = &outarg;
+	iov[0].iov_len  = sizeof(outarg);
+	iov[1].iov_base = (void*)cd->dev_info.data();
+	iov[1].iov_len  = cd->dev_info.size();
+	req->reply_iov(iov, 2);
+
+	if (cd->clop.init_done)
+		cd->clop.init_done(se->userdata);
+}
+
+struct copper_fuse_session* copper_cuse_lowlevel_setup(int argc, char* argv[],
+	const struct copper_cuse_info* ci, const struct copper_cuse_lowlevel_ops* clop,
+	int* multithreaded, void* userdata) {
+	const char* devname = "/dev/cuse";
+	copper_fuse_args args(argc, argv);
+	copper_fuse_cmdline_opts opts;
+	int fd;
+
+	if (args.parse_cmdline(&opts) == -1)
+		return nullptr;
+	free(opts.mountpoint);
+
+	if (opts.show_help) {
+		if (args.argv[0][0] != '\0')
+			printf("usage: %s [options]\n\n", args.argv[0]);
+		printf("CUSE options:\n");
+		copper_cuse_help();
+		return nullptr;
+	}
+	*multithreaded = !opts.singlethread;
+
+	/*
+	 * Make sure file descriptors 0, 1 and 2 are open, otherwise chaos
+	 * would ensue.
+	 */
+	do {
+		fd = open("/dev/null", O_RDWR);
+		if (fd > 2)
+			close(fd);
+	} while (fd >= 0 && fd <= 2);
+
+	copper_fuse_session* se = copper_cuse_lowlevel_new(&args, ci, clop, userdata);
+	if (!se)
+		return nullptr;
+
+	fd = open(devname, O_RDWR | O_CLOEXEC);
+	if (fd == -1) {
+		if (errno == ENODEV || errno == ENOENT)
+			erron << "cuse: device not found, try 'modprobe cuse' first";
+		else
+			erron << "cuse: failed to open " << devname << ": " << strerror(errno);
+		delete se;
+		return nullptr;
+	}
+	se->set_fd(fd);
+	return se;
+}
+
+void copper_cuse_lowlevel_teardown(struct copper_fuse_session* se) {
+	delete se;
+}
+
+int copper_cuse_lowlevel_main(int argc, char* argv[], const struct copper_cuse_info* ci,
+	const struct copper_cuse_lowlevel_ops* clop, void* userdata) {
+	int multithreaded;
+	int res;
+
+	copper_fuse_session* se = copper_cuse_lowlevel_setup(argc, argv, ci, clop,
+		&multithreaded, userdata);
+	if (!se)
+		return 1;
+
+	if (multithreaded)
+		res = se->loop_mt(nullptr);
+	else
+		res = se->loop();
+
+	copper_cuse_lowlevel_teardown(se);
+	return res ? 1 : 0;
+}
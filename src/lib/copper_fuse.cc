@@ -12,4 +12,2180 @@
   Copyright (C) 2023 Chen Miao <chenmiao.ku@gmail.com>
 */
 
-#include "copper_fuse.h"
\ No newline at end of file
+#include "copper_fuse.h"
+#include "copper_fuse_config.h"
+#include "copper_fuse_i.h"
+#include "copper_fuse_mount.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <climits>
+#include <condition_variable>
+#include <csignal>
+#include <cstdio>
+#include <cstring>
+#include <pthread.h>
+#include <sys/file.h>
+#include <unistd.h>
+#include <vector>
+
+#define FUSE_LIB_OPT(t, p, v)	\
+		{ t, offsetof(copper_fuse_config, p), v }
+
+static const struct copper_fuse_opt copper_fuse_lib_opts[] = {
+	FUSE_LIB_OPT("debug",                 debug, 1),
+	FUSE_LIB_OPT("-d",                    debug, 1),
+	FUSE_LIB_OPT("kernel_cache",          kernel_cache, 1),
+	FUSE_LIB_OPT("auto_cache",            auto_cache, 1),
+	FUSE_LIB_OPT("noauto_cache",          auto_cache, 0),
+	FUSE_LIB_OPT("umask=",                set_mode, 1),
+	FUSE_LIB_OPT("umask=%o",              umask, 0),
+	FUSE_LIB_OPT("uid=",                  set_uid, 1),
+	FUSE_LIB_OPT("uid=%d",                uid, 0),
+	FUSE_LIB_OPT("gid=",                  set_gid, 1),
+	FUSE_LIB_OPT("gid=%d",                gid, 0),
+	FUSE_LIB_OPT("entry_timeout=%lf",     entry_timeout, 0),
+	FUSE_LIB_OPT("attr_timeout=%lf",      attr_timeout, 0),
+	FUSE_LIB_OPT("ac_attr_timeout=%lf",   ac_attr_timeout, 0),
+	FUSE_LIB_OPT("ac_attr_timeout=",      ac_attr_timeout_set, 1),
+	FUSE_LIB_OPT("negative_timeout=%lf",  negative_timeout, 0),
+	FUSE_LIB_OPT("noforget",              remember, -1),
+	FUSE_LIB_OPT("remember=%u",           remember, 0),
+	FUSE_LIB_OPT("hard_remove",           hard_remove, 1),
+	FUSE_LIB_OPT("use_ino",               use_ino, 1),
+	FUSE_LIB_OPT("readdir_ino",           readdir_ino, 1),
+	FUSE_LIB_OPT("direct_io",             direct_io, 1),
+	FUSE_LIB_OPT("intr",                  intr, 1),
+	FUSE_LIB_OPT("intr_signal=%d",        intr_signal, 0),
+	FUSE_LIB_OPT("xattr_timeout=%lf",     xattr_timeout, 0),
+	FUSE_LIB_OPT("copy_chunk_size=%zu",   copy_chunk_size, 0),
+	FUSE_LIB_OPT("copy_threads=%u",       copy_threads, 0),
+	FUSE_LIB_OPT("fair_slots=%u",         fair_slots, 0),
+	FUSE_LIB_OPT("fair_ops=%lf",          fair_ops, 0),
+	FUSE_LIB_OPT("fair_bytes=%lf",        fair_bytes, 0),
+	FUSE_LIB_OPT("check_permissions",     check_permissions, 1),
+	FUSE_LIB_OPT("posix_acl",             posix_acl, 1),
+	FUSE_LIB_OPT("max_pages=%u",          max_pages, 0),
+	FUSE_LIB_OPT("write_behind=%zu",      write_behind, 0),
+	FUSE_LIB_OPT("write_behind_timeout=%lf", write_behind_timeout, 0),
+	FUSE_LIB_OPT("block_cache=%zu",       block_cache, 0),
+	FUSE_LIB_OPT("block_size=%zu",        block_size, 0),
+	FUSE_LIB_OPT("readahead=%u",          readahead, 0),
+	FUSE_LIB_OPT("readahead_threads=%u",  readahead_threads, 0),
+	FUSE_LIB_OPT("lookup_coalesce",       lookup_coalesce, 1),
+	FUSE_LIB_OPT("nolookup_coalesce",     lookup_coalesce, 0),
+	COPPER_FUSE_OPT_END
+};
+
+/** ---------------------------------------------------
+ * FOR COPPER FUSE NODE TABLE
+ * ---------------------------------------------------*/
+
+std::shared_ptr<copper_fuse_node> copper_fuse::find_node(fuse_ino_t parent, const char* name) {
+	return nodes.find(parent, name);
+}
+
+fuse_ino_t copper_fuse::lookup_nodeid(fuse_ino_t parent, const char* name) {
+	return nodes.lookup_nodeid(parent, name);
+}
+
+void copper_fuse::forget_node(fuse_ino_t nodeid, uint64_t nlookup) {
+	nodes.forget(nodeid, nlookup);
+}
+
+int copper_fuse::get_path(fuse_ino_t nodeid, const char* name, std::string* path) {
+	return nodes.get_path(nodeid, name, path);
+}
+
+/** ---------------------------------------------------
+ * FOR COPPER FUSE FAIRNESS
+ * ---------------------------------------------------*/
+
+uint64_t copper_fuse::tenant_of(const struct fuse_in_header* in) {
+	std::string path;
+	size_t best = 0;
+	uint64_t key = in->uid;
+
+	if (get_path(in->nodeid, nullptr, &path) != 0)
+		return key;
+	/* The longest prefix ending on a component boundary wins */
+	std::shared_lock<std::shared_mutex> guard(path_rules_lock);
+	for (size_t i = 0; i < path_rules.size(); i++) {
+		const std::string& prefix = path_rules[i];
+		size_t len = prefix.size();
+		if (len < best || len > path.size() ||
+		    copper_fuse_path_cmp(path.data(), len, prefix.data(), len) != 0)
+			continue;
+		if (len == path.size() || path[len] == '/' || prefix.back() == '/') {
+			best = len;
+			key  = COPPER_FUSE_TENANT_PATH + i;
+		}
+	}
+	return key;
+}
+
+int copper_fuse::set_path_limits(const char* prefix, const copper_fuse_tenant_limits& limits) {
+	std::string rule(prefix);
+	size_t i;
+
+	if (rule.empty() || rule[0] != '/')
+		return -EINVAL;
+	while (rule.size() > 1 && rule.back() == '/')
+		rule.pop_back();
+
+	{
+		std::unique_lock<std::shared_mutex> guard(path_rules_lock);
+		for (i = 0; i < path_rules.size() && path_rules[i] != rule; i++);
+		if (i == path_rules.size())
+			path_rules.push_back(rule);
+	}
+
+	if (!se->fair.enabled.load(std::memory_order_relaxed))
+		se->fair.setup(conf.fair_slots);
+	if (!se->fair.classify)
+		se->fair.classify = [this](const struct fuse_in_header* in, const void*) {
+			return tenant_of(in);
+		};
+	se->fair.set_limits(COPPER_FUSE_TENANT_PATH + i, limits);
+	return 0;
+}
+
+/** ---------------------------------------------------
+ * FOR COPPER FUSE COPY
+ * ---------------------------------------------------*/
+
+/* State shared by the threads working on one copy_range() call */
+struct copy_job {
+	const copper_fuse* f;
+	const char* path_in;
+	struct fuse_file_info* fi_in;
+	off_t off_in;
+	const char* path_out;
+	struct fuse_file_info* fi_out;
+	off_t off_out;
+	size_t len;
+	size_t chunk;
+	int fd_in;
+	int fd_out;
+	/* Of the request, for the ->read() and ->write() of the helpers */
+	struct copper_fuse_context ctx;
+
+	size_t nchunks;
+	std::atomic<size_t> next;
+	std::atomic<bool> stop;
+	std::vector<ssize_t> res;
+
+	/* Helpers that started before the caller closed the job */
+	std::mutex lock;
+	std::condition_variable cond;
+	unsigned active;
+	bool closed;
+};
+
+static ssize_t copy_chunk_buf(copy_job* job, off_t in, off_t out, size_t size) {
+	static thread_local std::vector<char> buf;
+	if (buf.size() < size)
+		buf.resize(size);
+
+	size_t done = 0;
+	while (done < size) {
+		int n = job->f->op.read(job->path_in, buf.data(), size - done, in + done, job->fi_in);
+		if (n < 0)
+			return done ? (ssize_t)done : n;
+		if (n == 0)
+			break;
+
+		for (int written = 0; written < n; ) {
+			int w = job->f->op.write(job->path_out, buf.data() + written, n - written,
+				out + done + written, job->fi_out);
+			if (w <= 0) {
+				done += written;
+				return done ? (ssize_t)done : (w < 0 ? w : -EIO);
+			}
+			written += w;
+		}
+		done += n;
+	}
+	return done;
+}
+
+static ssize_t copy_chunk_fd(copy_job* job, off_t in, off_t out, size_t size) {
+	size_t done = 0;
+
+	while (done < size) {
+		loff_t oi = in + done;
+		loff_t oo = out + done;
+		ssize_t n = ::copy_file_range(job->fd_in, &oi, job->fd_out, &oo, size - done, 0);
+		if (n == -1) {
+			int err = errno;
+			if (!done && (err == EXDEV || err == EOPNOTSUPP || err == ENOSYS || err == EINVAL))
+				return copy_chunk_buf(job, in, out, size);
+			return done ? (ssize_t)done : -err;
+		}
+		if (n == 0)
+			break;
+		done += n;
+	}
+	return done;
+}
+
+static void copy_work(copy_job* job) {
+	size_t i;
+
+	while (!job->stop.load(std::memory_order_relaxed) &&
+	       (i = job->next.fetch_add(1, std::memory_order_relaxed)) < job->nchunks) {
+		off_t skip = (off_t)(i * job->chunk);
+		size_t size = std::min(job->chunk, job->len - i * job->chunk);
+		ssize_t res;
+
+#ifdef HAVE_COPY_FILE_RANGE
+		if (job->fd_in >= 0 && job->fd_out >= 0)
+			res = copy_chunk_fd(job, job->off_in + skip, job->off_out + skip, size);
+		else
+#endif
+			res = copy_chunk_buf(job, job->off_in + skip, job->off_out + skip, size);
+
+		job->res[i] = res;
+		/* Nothing after a short piece counts, don't bother copying it */
+		if (res < (ssize_t)size)
+			job->stop.store(true, std::memory_order_relaxed);
+	}
+}
+
+ssize_t copper_fuse::copy_range(const char* path_in, struct fuse_file_info* fi_in, off_t off_in,
+	const char* path_out, struct fuse_file_info* fi_out, off_t off_out, size_t len) {
+	if (!op.read || !op.write)
+		return -ENOSYS;
+	if (!len)
+		return 0;
+
+	auto job = std::make_shared<copy_job>();
+	job->f        = this;
+	job->path_in  = path_in;
+	job->fi_in    = fi_in;
+	job->off_in   = off_in;
+	job->path_out = path_out;
+	job->fi_out   = fi_out;
+	job->off_out  = off_out;
+	job->len      = len;
+	job->chunk    = conf.copy_chunk_size ? conf.copy_chunk_size : COPPER_FUSE_DEFAULT_COPY_CHUNK;
+	job->fd_in    = op.backing_fd ? op.backing_fd(path_in, fi_in) : -1;
+	job->fd_out   = op.backing_fd ? op.backing_fd(path_out, fi_out) : -1;
+	job->ctx      = *copper_fuse_get_context();
+	job->nchunks  = (len - 1) / job->chunk + 1;
+	job->next     = 0;
+	job->stop     = false;
+	job->res.assign(job->nchunks, 0);
+	job->active   = 0;
+	job->closed   = false;
+
+	/*
+	 * Helpers that only get to run after the caller is done must not
+	 * touch the paths and file infos any more, so a helper checks in
+	 * under the job lock and the caller waits for those that did.
+	 */
+	size_t helpers = std::min<size_t>(job->nchunks, conf.copy_threads) - 1;
+	if (helpers && copy_pool) {
+		for (size_t i = 0; i < helpers; i++) {
+			copy_pool->submit([job] {
+				{
+					std::lock_guard<std::mutex> guard(job->lock);
+					if (job->closed)
+						return;
+					job->active++;
+				}
+				*copper_fuse_get_context() = job->ctx;
+				copy_work(job.get());
+				std::lock_guard<std::mutex> guard(job->lock);
+				if (--job->active == 0)
+					job->cond.notify_all();
+			});
+		}
+	}
+
+	copy_work(job.get());
+	{
+		std::unique_lock<std::mutex> guard(job->lock);
+		job->closed = true;
+		job->cond.wait(guard, [&job] { return job->active == 0; });
+	}
+
+	ssize_t total = 0;
+	for (size_t i = 0; i < job->nchunks; i++) {
+		ssize_t res = job->res[i];
+		if (res < 0)
+			return total ? total : res;
+		total += res;
+		if ((size_t)res < std::min(job->chunk, len - i * job->chunk))
+			break;
+	}
+	return total;
+}
+
+/** ---------------------------------------------------
+ * FOR COPPER FUSE XATTR
+ * ---------------------------------------------------*/
+
+/* Values larger than this don't fit in the kernel's buffer anyway */
+#define FUSE_XATTR_SIZE_MAX 65536
+
+/* Most values and lists fit, the rest costs a size probe first */
+#define FUSE_XATTR_FETCH_SIZE 4096
+
+int copper_fuse::get_xattr(fuse_ino_t nodeid, const char* path, const char* name, std::string* value) {
+	uint64_t version = 0;
+	int err;
+
+	if (xattr_cache && xattr_cache->lookup(nodeid, name, &err, value, &version))
+		return -err;
+
+	size_t size = FUSE_XATTR_FETCH_SIZE;
+	int res;
+	for (;;) {
+		value->resize(size);
+		res = name ? op.getxattr(path, name, &(*value)[0], size) :
+			op.listxattr(path, &(*value)[0], size);
+		if (res != -ERANGE || size >= FUSE_XATTR_SIZE_MAX)
+			break;
+
+		/* Ask for the size, it may still change before the next fetch */
+		res = name ? op.getxattr(path, name, nullptr, 0) : op.listxattr(path, nullptr, 0);
+		if (res < 0)
+			break;
+		size = std::min<size_t>(std::max<size_t>(res, size * 2), FUSE_XATTR_SIZE_MAX);
+	}
+
+	value->resize(res > 0 ? res : 0);
+	if (xattr_cache)
+		xattr_cache->store(nodeid, name, version, res < 0 ? -res : 0, *value);
+	return res < 0 ? res : 0;
+}
+
+/** ---------------------------------------------------
+ * FOR COPPER FUSE LOWLEVEL OPERATIONS
+ * ---------------------------------------------------*/
+
+/* Context of the request a method of this thread runs for, see copper_fuse_get_context() */
+static thread_local struct copper_fuse_context fuse_context;
+
+/* Every method starts here, which makes it the place to fill the context */
+static copper_fuse* req_fuse(copper_fuse_req_t req) {
+	copper_fuse* f = static_cast<copper_fuse*>(req->userdata());
+
+	fuse_context.fuse         = f;
+	fuse_context.uid          = req->ctx.uid;
+	fuse_context.gid          = req->ctx.gid;
+	fuse_context.pid          = req->ctx.pid;
+	fuse_context.private_data = f->user_data;
+	fuse_context.umask        = req->ctx.umask;
+	return f;
+}
+
+/* The request a filesystem method of this thread runs for */
+static thread_local copper_fuse_req_t fuse_intr_req = nullptr;
+
+/* A filesystem call the intr option may interrupt */
+struct fuse_intr_data {
+	pthread_t id;
+	std::mutex lock;
+	std::condition_variable cond;
+	bool finished;
+};
+
+static void fuse_intr_sighandler(int sig) {
+	static_cast<void>(sig);
+}
+
+/* Keep signalling until the call returns, the signal may race with a blocking syscall */
+static void fuse_interrupt(copper_fuse* f, fuse_intr_data* d) {
+	if (pthread_equal(d->id, pthread_self()))
+		return;
+
+	std::unique_lock<std::mutex> guard(d->lock);
+	while (!d->finished) {
+		pthread_kill(d->id, f->conf.intr_signal);
+		d->cond.wait_for(guard, std::chrono::seconds(1));
+	}
+}
+
+static void fuse_prepare_interrupt(copper_fuse* f, copper_fuse_req_t req, fuse_intr_data* d) {
+	fuse_intr_req = req;
+	if (!f->conf.intr)
+		return;
+
+	d->id = pthread_self();
+	d->finished = false;
+	req->interrupt_func([f, d](copper_fuse_req_t) { fuse_interrupt(f, d); });
+}
+
+static void fuse_finish_interrupt(copper_fuse* f, copper_fuse_req_t req, fuse_intr_data* d) {
+	fuse_intr_req = nullptr;
+	if (!f->conf.intr)
+		return;
+
+	{
+		std::lock_guard<std::mutex> guard(d->lock);
+		d->finished = true;
+		d->cond.notify_all();
+	}
+	/* Waits for a running fuse_interrupt(), `d` goes away after this */
+	req->interrupt_func(nullptr);
+}
+
+static void set_stat(copper_fuse* f, fuse_ino_t nodeid, struct stat* stbuf) {
+	if (!f->conf.use_ino)
+		stbuf->st_ino = nodeid;
+	if (f->conf.set_mode)
+		stbuf->st_mode = (stbuf->st_mode & S_IFMT) | (0777 & ~f->conf.umask);
+	if (f->conf.set_uid)
+		stbuf->st_uid = f->conf.uid;
+	if (f->conf.set_gid)
+		stbuf->st_gid = f->conf.gid;
+	if (f->perms)
+		f->perms->update(nodeid, stbuf);
+}
+
+static int lookup_path(copper_fuse* f, fuse_ino_t nodeid, const char* name,
+	const char* path, struct copper_fuse_entry_param* e, struct fuse_file_info* fi) {
+	memset(e, 0, sizeof(*e));
+
+	if (!f->op.getattr)
+		return -ENOSYS;
+	int res;
+	if (fi)
+		res = f->op.getattr(path, &e->attr, fi);
+	else
+		res = f->lookups.lookup(nodeid, name, [f, path](struct stat* attr) {
+			return f->op.getattr(path, attr, nullptr);
+		}, &e->attr);
+	if (res != 0)
+		return res;
+
+	std::shared_ptr<copper_fuse_node> node = f->find_node(nodeid, name);
+	if (!node)
+		return -ENOMEM;
+
+	e->ino           = node->nodeid;
+	e->generation    = node->generation;
+	e->entry_timeout = f->conf.entry_timeout;
+	e->attr_timeout  = f->conf.attr_timeout;
+	set_stat(f, e->ino, &e->attr);
+	return 0;
+}
+
+/**
+ * Owner, mode and ACL of `ino`, for the permission checks of the library
+ *
+ * The attributes are fetched with ->getattr() unless cached, the ACL
+ * with ->getxattr() the first time.
+ *
+ * @return 0 on success, -ENOSYS without ->getattr(), -errno otherwise
+ */
+static int fuse_perm_node(copper_fuse* f, fuse_ino_t ino, copper_fuse_perm_node* nodep) {
+	copper_fuse_perm_node& node = *nodep;
+	uint64_t version;
+	std::string path;
+	int err;
+
+	if (!f->perms->lookup(ino, &node, &version)) {
+		struct stat buf;
+		if (!f->op.getattr)
+			return -ENOSYS;
+		memset(&buf, 0, sizeof(buf));
+		err = f->get_path(ino, nullptr, &path);
+		if (!err)
+			err = f->op.getattr(path.c_str(), &buf, nullptr);
+		if (err)
+			return err;
+		set_stat(f, ino, &buf);
+		node.mode      = buf.st_mode;
+		node.uid       = buf.st_uid;
+		node.gid       = buf.st_gid;
+		node.acl_known = false;
+	}
+
+	if (f->conf.posix_acl && !node.acl_known) {
+		std::shared_ptr<copper_fuse_acl> acl;
+		std::string value;
+		err = path.empty() ? f->get_path(ino, nullptr, &path) : 0;
+		if (!err)
+			err = f->get_xattr(ino, path.c_str(), COPPER_FUSE_ACL_ACCESS, &value);
+		if (!err) {
+			acl = std::make_shared<copper_fuse_acl>();
+			/* A malformed ACL is as good as none, the mode still applies */
+			if (acl->parse(value.data(), value.size()) != 0)
+				acl.reset();
+		} else if (err != -ENODATA && err != -ENOTSUP && err != -ENOSYS) {
+			return err;
+		}
+		f->perms->set_acl(ino, version, acl);
+		node.acl = acl;
+	}
+	return 0;
+}
+
+/* Check `mask` on `ino` for the caller, when the library checks permissions */
+static int fuse_check_access(copper_fuse* f, fuse_ino_t ino, int mask) {
+	copper_fuse_perm_node node;
+
+	if (!f->perms)
+		return 0;
+	int err = fuse_perm_node(f, ino, &node);
+	if (err)
+		return err == -ENOSYS ? 0 : err;
+
+	copper_fuse_cred cred(fuse_context.uid, fuse_context.gid, fuse_context.pid, &f->se->groups);
+	return copper_fuse_perm_check(node.mode, node.uid, node.gid, node.acl.get(), &cred, mask);
+}
+
+/*
+ * Check that the caller may remove `name` from `parent`, or rename it
+ * away, when the library checks permissions: write and search access
+ * to `parent` and, when it is sticky, ownership of `parent` or of the
+ * entry.  A directory moved to another parent rewrites its "..", so
+ * `reparent` asks for write access to the entry too.
+ */
+static int fuse_check_remove(copper_fuse* f, fuse_ino_t parent, const char* name,
+	const char* path, bool reparent) {
+	copper_fuse_perm_node dir, node;
+
+	if (!f->perms)
+		return 0;
+	int err = fuse_perm_node(f, parent, &dir);
+	if (err)
+		return err == -ENOSYS ? 0 : err;
+
+	copper_fuse_cred cred(fuse_context.uid, fuse_context.gid, fuse_context.pid, &f->se->groups);
+	err = copper_fuse_perm_check(dir.mode, dir.uid, dir.gid, dir.acl.get(), &cred, W_OK | X_OK);
+	if (err || (!(dir.mode & S_ISVTX) && !reparent))
+		return err;
+
+	/* The kernel looked the entry up first, it is rarely unknown */
+	fuse_ino_t ino = f->lookup_nodeid(parent, name);
+	if (ino != FUSE_UNKNOWN_INO) {
+		err = fuse_perm_node(f, ino, &node);
+	} else if (!f->op.getattr) {
+		return 0;
+	} else {
+		struct stat buf;
+		memset(&buf, 0, sizeof(buf));
+		err = f->op.getattr(path, &buf, nullptr);
+		node.mode = buf.st_mode;
+		node.uid  = buf.st_uid;
+		node.gid  = buf.st_gid;
+	}
+	if (err)
+		return err;
+
+	if ((dir.mode & S_ISVTX) && cred.uid != 0 && cred.uid != dir.uid && cred.uid != node.uid)
+		return -EPERM;
+	if (reparent && S_ISDIR(node.mode))
+		return copper_fuse_perm_check(node.mode, node.uid, node.gid, node.acl.get(), &cred, W_OK);
+	return 0;
+}
+
+/*
+ * Check a setattr of `ino` for the caller, when the library checks
+ * permissions: the owner changes the mode and the times, root the
+ * owner, the owner the group to one of its own.  Truncating and
+ * touching the times to now take write access.
+ */
+static int fuse_check_setattr(copper_fuse* f, fuse_ino_t ino, const struct stat* attr, int valid,
+	struct fuse_file_info* fi) {
+	copper_fuse_perm_node node;
+
+	if (!f->perms)
+		return 0;
+	int err = fuse_perm_node(f, ino, &node);
+	if (err)
+		return err == -ENOSYS ? 0 : err;
+
+	copper_fuse_cred cred(fuse_context.uid, fuse_context.gid, fuse_context.pid, &f->se->groups);
+	bool owner = cred.uid == 0 || cred.uid == node.uid;
+	int now = FUSE_SET_ATTR_ATIME | FUSE_SET_ATTR_MTIME |
+		FUSE_SET_ATTR_ATIME_NOW | FUSE_SET_ATTR_MTIME_NOW;
+	int mask = 0;
+
+	if ((valid & FUSE_SET_ATTR_MODE) && !owner)
+		return -EPERM;
+	if ((valid & FUSE_SET_ATTR_UID) && cred.uid != 0 && attr->st_uid != node.uid)
+		return -EPERM;
+	if ((valid & FUSE_SET_ATTR_GID) && cred.uid != 0 && attr->st_gid != node.gid &&
+		(cred.uid != node.uid || !cred.in_group(attr->st_gid)))
+		return -EPERM;
+	if ((valid & (FUSE_SET_ATTR_ATIME | FUSE_SET_ATTR_MTIME)) && !owner) {
+		if ((valid & now) != now)
+			return -EPERM;
+		mask |= W_OK;
+	}
+	/* Through an open file, the open checked already */
+	if ((valid & FUSE_SET_ATTR_SIZE) && !fi)
+		mask |= W_OK;
+	if (!mask)
+		return 0;
+	return copper_fuse_perm_check(node.mode, node.uid, node.gid, node.acl.get(), &cred, mask);
+}
+
+static int open_access_mask(int flags) {
+	int mask = 0;
+
+	if ((flags & O_ACCMODE) != O_WRONLY)
+		mask |= R_OK;
+	if ((flags & O_ACCMODE) != O_RDONLY || (flags & O_TRUNC))
+		mask |= W_OK;
+	return mask;
+}
+
+static void fuse_lib_init(void* data, struct copper_fuse_conn_info* conn) {
+	copper_fuse* f = static_cast<copper_fuse*>(data);
+
+	memset(&fuse_context, 0, sizeof(fuse_context));
+	fuse_context.fuse         = f;
+	fuse_context.private_data = f->user_data;
+	if (f->op.init) {
+		void* user_data = f->op.init(conn, &f->conf);
+		if (user_data)
+			f->user_data = user_data;
+	}
+
+	f->lookups.coalesce         = f->conf.lookup_coalesce;
+	f->lookups.negative_timeout = f->conf.negative_timeout;
+	if (f->conf.copy_threads > 1 && !f->copy_pool)
+		f->copy_pool.reset(new copper_fuse_pool(f->conf.copy_threads - 1));
+	if (f->conf.xattr_timeout > 0 && !f->xattr_cache)
+		f->xattr_cache.reset(new copper_fuse_xattr_cache(f->conf.xattr_timeout));
+	if (f->conf.check_permissions && !f->perms)
+		f->perms.reset(new copper_fuse_perm_cache(f->conf.attr_timeout));
+	if (f->conf.write_behind && f->op.write && !f->write_behind)
+		f->write_behind.reset(new copper_fuse_write_behind(
+			[f](fuse_ino_t ino, const char* buf, size_t size, off_t off, struct fuse_file_info* fi) {
+				/* Also runs on the timer thread, which has no request and serves every mount */
+				bool borrowed = !fuse_context.fuse;
+				if (borrowed) {
+					fuse_context.fuse         = f;
+					fuse_context.private_data = f->user_data;
+				}
+				std::string path;
+				int res = f->get_path(ino, nullptr, &path);
+				if (!res)
+					res = f->op.write(path.c_str(), buf, size, off, fi);
+				if (f->block_cache)
+					f->block_cache->invalidate(ino);
+				if (borrowed) {
+					fuse_context.fuse         = nullptr;
+					fuse_context.private_data = nullptr;
+				}
+				return res;
+			}, f->conf.write_behind, f->conf.write_behind_timeout));
+	if (f->conf.block_cache && f->op.read && !f->block_cache)
+		f->block_cache.reset(new copper_fuse_block_cache(
+			[f](fuse_ino_t ino, char* buf, size_t size, off_t off, struct fuse_file_info* fi) {
+				/* Also runs on the readahead threads, which have no request */
+				if (!fuse_context.fuse) {
+					fuse_context.fuse         = f;
+					fuse_context.private_data = f->user_data;
+				}
+				std::string path;
+				int err = f->get_path(ino, nullptr, &path);
+				return err ? err : f->op.read(path.c_str(), buf, size, off, fi);
+			}, f->conf.block_cache,
+			f->conf.block_size ? f->conf.block_size : COPPER_FUSE_DEFAULT_BLOCK_SIZE,
+			f->conf.readahead, f->conf.readahead_threads));
+}
+
+static void fuse_lib_destroy(void* data) {
+	copper_fuse* f = static_cast<copper_fuse*>(data);
+
+	if (f->write_behind)
+		f->write_behind->flush_all();
+	if (f->block_cache)
+		f->block_cache->stop();
+	if (f->op.destroy)
+		f->op.destroy(f->user_data);
+}
+
+static void fuse_lib_lookup(copper_fuse_req_t req, fuse_ino_t parent, const char* name) {
+	copper_fuse* f = req_fuse(req);
+	struct copper_fuse_entry_param e;
+	std::string path;
+
+	int err = fuse_check_access(f, parent, X_OK);
+	if (!err)
+		err = f->get_path(parent, name, &path);
+	if (!err) {
+		fuse_intr_data d;
+		fuse_prepare_interrupt(f, req, &d);
+		err = lookup_path(f, parent, name, path.c_str(), &e, nullptr);
+		fuse_finish_interrupt(f, req, &d);
+	}
+	if (err == -ENOENT && f->conf.negative_timeout != 0.0) {
+		e.ino = 0;
+		e.entry_timeout = f->conf.negative_timeout;
+		err = 0;
+	}
+	if (err)
+		req->reply_err(-err);
+	else if (req->reply_entry(&e) == -ENOENT && e.ino)
+		f->forget_node(e.ino, 1);
+}
+
+static void fuse_lib_forget(copper_fuse_req_t req, fuse_ino_t ino, uint64_t nlookup) {
+	req_fuse(req)->forget_node(ino, nlookup);
+	req->reply_none();
+}
+
+static void fuse_lib_getattr(copper_fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi) {
+	copper_fuse* f = req_fuse(req);
+	struct stat buf;
+	std::string path;
+
+	if (!f->op.getattr) {
+		req->reply_err(ENOSYS);
+		return;
+	}
+
+	/* The size must account for the writes held back */
+	if (f->write_behind)
+		f->write_behind->flush_ino(ino);
+
+	memset(&buf, 0, sizeof(buf));
+	int err = f->get_path(ino, nullptr, &path);
+	if (!err) {
+		fuse_intr_data d;
+		fuse_prepare_interrupt(f, req, &d);
+		err = f->op.getattr(path.c_str(), &buf, fi);
+		fuse_finish_interrupt(f, req, &d);
+	}
+	if (err) {
+		req->reply_err(-err);
+		return;
+	}
+
+	set_stat(f, ino, &buf);
+	req->reply_attr(&buf, f->conf.attr_timeout);
+}
+
+static void fuse_lib_setattr(copper_fuse_req_t req, fuse_ino_t ino, struct stat* attr, int valid,
+	struct fuse_file_info* fi) {
+	copper_fuse* f = req_fuse(req);
+	struct stat buf;
+	std::string path;
+
+	if (!f->op.getattr) {
+		req->reply_err(ENOSYS);
+		return;
+	}
+
+	/* A truncate must not be overtaken by the writes held back */
+	if (f->write_behind && (valid & FUSE_SET_ATTR_SIZE))
+		f->write_behind->flush_ino(ino);
+
+	int err = fuse_check_setattr(f, ino, attr, valid, fi);
+	if (!err)
+		err = f->get_path(ino, nullptr, &path);
+	if (!err) {
+		fuse_intr_data d;
+		fuse_prepare_interrupt(f, req, &d);
+		if (valid & FUSE_SET_ATTR_MODE)
+			err = f->op.chmod ? f->op.chmod(path.c_str(), attr->st_mode, fi) : -ENOSYS;
+		if (!err && (valid & (FUSE_SET_ATTR_UID | FUSE_SET_ATTR_GID))) {
+			uid_t uid = (valid & FUSE_SET_ATTR_UID) ? attr->st_uid : (uid_t)-1;
+			gid_t gid = (valid & FUSE_SET_ATTR_GID) ? attr->st_gid : (gid_t)-1;
+			err = f->op.chown ? f->op.chown(path.c_str(), uid, gid, fi) : -ENOSYS;
+		}
+		if (!err && (valid & FUSE_SET_ATTR_SIZE))
+			err = f->op.truncate ? f->op.truncate(path.c_str(), attr->st_size, fi) : -ENOSYS;
+		if (!err && (valid & (FUSE_SET_ATTR_ATIME | FUSE_SET_ATTR_MTIME))) {
+			struct timespec tv[2];
+			tv[0].tv_sec  = 0;
+			tv[0].tv_nsec = UTIME_OMIT;
+			tv[1]         = tv[0];
+			if (valid & FUSE_SET_ATTR_ATIME_NOW)
+				tv[0].tv_nsec = UTIME_NOW;
+			else if (valid & FUSE_SET_ATTR_ATIME)
+				tv[0] = attr->st_atim;
+			if (valid & FUSE_SET_ATTR_MTIME_NOW)
+				tv[1].tv_nsec = UTIME_NOW;
+			else if (valid & FUSE_SET_ATTR_MTIME)
+				tv[1] = attr->st_mtim;
+			err = f->op.utimens ? f->op.utimens(path.c_str(), tv, fi) : -ENOSYS;
+		}
+		if (!err) {
+			memset(&buf, 0, sizeof(buf));
+			err = f->op.getattr(path.c_str(), &buf, fi);
+		}
+		fuse_finish_interrupt(f, req, &d);
+	}
+
+	/* Even a failed change may have been partly made */
+	if (f->perms && (valid & (FUSE_SET_ATTR_MODE | FUSE_SET_ATTR_UID | FUSE_SET_ATTR_GID)))
+		f->perms->invalidate(ino);
+	/* The mode is the ACL's mask */
+	if (f->xattr_cache && (valid & FUSE_SET_ATTR_MODE))
+		f->xattr_cache->invalidate(ino, COPPER_FUSE_ACL_ACCESS);
+	if (f->block_cache && (valid & FUSE_SET_ATTR_SIZE))
+		f->block_cache->invalidate(ino);
+	if (err) {
+		req->reply_err(-err);
+		return;
+	}
+
+	set_stat(f, ino, &buf);
+	req->reply_attr(&buf, f->conf.attr_timeout);
+}
+
+static void fuse_lib_readlink(copper_fuse_req_t req, fuse_ino_t ino) {
+	copper_fuse* f = req_fuse(req);
+	char linkname[PATH_MAX + 1];
+	std::string path;
+
+	int err = f->get_path(ino, nullptr, &path);
+	if (!err && !f->op.readlink)
+		err = -ENOSYS;
+	if (!err) {
+		fuse_intr_data d;
+		fuse_prepare_interrupt(f, req, &d);
+		err = f->op.readlink(path.c_str(), linkname, sizeof(linkname));
+		fuse_finish_interrupt(f, req, &d);
+	}
+	if (err) {
+		req->reply_err(-err);
+		return;
+	}
+
+	linkname[PATH_MAX] = '\0';
+	req->reply_readlink(linkname);
+}
+
+/* Reply with the entry of `name`, just created in `parent` */
+static void fuse_reply_new_entry(copper_fuse* f, copper_fuse_req_t req, fuse_ino_t parent,
+	const struct copper_fuse_entry_param* e) {
+	f->dirs.changed(parent);
+	if (req->reply_entry(e) == -ENOENT)
+		f->forget_node(e->ino, 1);
+}
+
+static void fuse_lib_mknod(copper_fuse_req_t req, fuse_ino_t parent, const char* name,
+	mode_t mode, dev_t rdev) {
+	copper_fuse* f = req_fuse(req);
+	struct copper_fuse_entry_param e;
+	std::string path;
+
+	int err = fuse_check_access(f, parent, W_OK | X_OK);
+	if (!err)
+		err = f->get_path(parent, name, &path);
+	if (!err && !f->op.mknod && !(S_ISREG(mode) && f->op.create))
+		err = -ENOSYS;
+	if (!err) {
+		fuse_intr_data d;
+		fuse_prepare_interrupt(f, req, &d);
+		if (f->op.mknod) {
+			err = f->op.mknod(path.c_str(), mode, rdev);
+		} else {
+			/* A regular file, made by creating and closing it */
+			struct fuse_file_info fi;
+			memset(&fi, 0, sizeof(fi));
+			fi.flags = O_CREAT | O_EXCL | O_WRONLY;
+			err = f->op.create(path.c_str(), mode, &fi);
+			if (!err && f->op.release)
+				f->op.release(path.c_str(), &fi);
+		}
+		if (!err) {
+			f->lookups.forget(parent, name);
+			err = lookup_path(f, parent, name, path.c_str(), &e, nullptr);
+		}
+		fuse_finish_interrupt(f, req, &d);
+	}
+	if (err)
+		req->reply_err(-err);
+	else
+		fuse_reply_new_entry(f, req, parent, &e);
+}
+
+static void fuse_lib_mkdir(copper_fuse_req_t req, fuse_ino_t parent, const char* name, mode_t mode) {
+	copper_fuse* f = req_fuse(req);
+	struct copper_fuse_entry_param e;
+	std::string path;
+
+	int err = fuse_check_access(f, parent, W_OK | X_OK);
+	if (!err)
+		err = f->get_path(parent, name, &path);
+	if (!err && !f->op.mkdir)
+		err = -ENOSYS;
+	if (!err) {
+		fuse_intr_data d;
+		fuse_prepare_interrupt(f, req, &d);
+		err = f->op.mkdir(path.c_str(), mode);
+		if (!err) {
+			f->lookups.forget(parent, name);
+			err = lookup_path(f, parent, name, path.c_str(), &e, nullptr);
+		}
+		fuse_finish_interrupt(f, req, &d);
+	}
+	if (err)
+		req->reply_err(-err);
+	else
+		fuse_reply_new_entry(f, req, parent, &e);
+}
+
+static void fuse_lib_symlink(copper_fuse_req_t req, const char* linkname, fuse_ino_t parent,
+	const char* name) {
+	copper_fuse* f = req_fuse(req);
+	struct copper_fuse_entry_param e;
+	std::string path;
+
+	int err = fuse_check_access(f, parent, W_OK | X_OK);
+	if (!err)
+		err = f->get_path(parent, name, &path);
+	if (!err && !f->op.symlink)
+		err = -ENOSYS;
+	if (!err) {
+		fuse_intr_data d;
+		fuse_prepare_interrupt(f, req, &d);
+		err = f->op.symlink(linkname, path.c_str());
+		if (!err) {
+			f->lookups.forget(parent, name);
+			err = lookup_path(f, parent, name, path.c_str(), &e, nullptr);
+		}
+		fuse_finish_interrupt(f, req, &d);
+	}
+	if (err)
+		req->reply_err(-err);
+	else
+		fuse_reply_new_entry(f, req, parent, &e);
+}
+
+/* Write out what is held back for `name` in `dir`, its path is about to change */
+static void fuse_flush_name(copper_fuse* f, fuse_ino_t dir, const char* name) {
+	if (!f->write_behind)
+		return;
+	fuse_ino_t ino = f->lookup_nodeid(dir, name);
+	if (ino != FUSE_UNKNOWN_INO)
+		f->write_behind->flush_ino(ino);
+}
+
+/* The node of `name` in `dir` if it is open, which removing it would hide instead */
+static std::shared_ptr<copper_fuse_node> fuse_open_node(copper_fuse* f, fuse_ino_t dir,
+	const char* name) {
+	if (f->conf.hard_remove)
+		return nullptr;
+	std::shared_ptr<copper_fuse_node> node = f->nodes.child(dir, name);
+	return node && node->open_count.load() ? node : nullptr;
+}
+
+/*
+ * Rename the open `node`, `name` in `dir`, to a free .fuse_hidden name
+ * in place of removing it, the last release removes it then
+ */
+static int fuse_hide_node(copper_fuse* f, fuse_ino_t dir, const char* name, const char* path,
+	copper_fuse_node* node) {
+	char hidden[64];
+	std::string newpath;
+	int err = -EBUSY;
+
+	if (!f->op.rename)
+		return -EBUSY;
+	for (int tries = 0; tries < 10; tries++) {
+		snprintf(hidden, sizeof(hidden), ".fuse_hidden%08x%08x", (unsigned)node->nodeid,
+			(unsigned)++f->hidectr);
+		if (f->lookup_nodeid(dir, hidden) != FUSE_UNKNOWN_INO)
+			continue;
+		err = f->get_path(dir, hidden, &newpath);
+		if (err)
+			return err;
+		if (f->op.getattr) {
+			struct stat buf;
+			if (f->op.getattr(newpath.c_str(), &buf, nullptr) != -ENOENT) {
+				err = -EBUSY;
+				continue;
+			}
+		}
+
+		/* Before the rename, a release racing with it removes the file either way */
+		node->hidden = true;
+		err = f->op.rename(path, newpath.c_str(), 0);
+		if (!err)
+			err = f->nodes.rename(dir, name, dir, hidden, false);
+		if (err)
+			node->hidden = false;
+		else
+			f->lookups.forget(dir, hidden);
+		return err;
+	}
+	return err;
+}
+
+static void fuse_lib_unlink(copper_fuse_req_t req, fuse_ino_t parent, const char* name) {
+	copper_fuse* f = req_fuse(req);
+	std::string path;
+
+	int err = f->get_path(parent, name, &path);
+	if (!err)
+		err = fuse_check_remove(f, parent, name, path.c_str(), false);
+	if (!err && !f->op.unlink)
+		err = -ENOSYS;
+	if (!err) {
+		fuse_flush_name(f, parent, name);
+		fuse_intr_data d;
+		fuse_prepare_interrupt(f, req, &d);
+		std::shared_ptr<copper_fuse_node> open = fuse_open_node(f, parent, name);
+		if (open) {
+			err = fuse_hide_node(f, parent, name, path.c_str(), open.get());
+		} else {
+			err = f->op.unlink(path.c_str());
+			if (!err)
+				f->nodes.remove(parent, name);
+		}
+		fuse_finish_interrupt(f, req, &d);
+	}
+	if (!err)
+		f->dirs.changed(parent);
+	req->reply_err(-err);
+}
+
+static void fuse_lib_rmdir(copper_fuse_req_t req, fuse_ino_t parent, const char* name) {
+	copper_fuse* f = req_fuse(req);
+	std::string path;
+
+	int err = f->get_path(parent, name, &path);
+	if (!err)
+		err = fuse_check_remove(f, parent, name, path.c_str(), false);
+	if (!err && !f->op.rmdir)
+		err = -ENOSYS;
+	if (!err) {
+		fuse_intr_data d;
+		fuse_prepare_interrupt(f, req, &d);
+		err = f->op.rmdir(path.c_str());
+		fuse_finish_interrupt(f, req, &d);
+	}
+	if (!err) {
+		f->nodes.remove(parent, name);
+		f->dirs.changed(parent);
+	}
+	req->reply_err(-err);
+}
+
+static void fuse_lib_rename(copper_fuse_req_t req, fuse_ino_t olddir, const char* oldname,
+	fuse_ino_t newdir, const char* newname, unsigned int flags) {
+	copper_fuse* f = req_fuse(req);
+	std::string oldpath, newpath;
+
+	int err = f->get_path(olddir, oldname, &oldpath);
+	if (!err)
+		err = f->get_path(newdir, newname, &newpath);
+	if (!err)
+		err = fuse_check_remove(f, olddir, oldname, oldpath.c_str(), newdir != olddir);
+	/* What the target replaces, or is exchanged with, goes away from `newdir` */
+	if (!err && !(flags & RENAME_NOREPLACE) && f->perms &&
+		f->lookup_nodeid(newdir, newname) != FUSE_UNKNOWN_INO)
+		err = fuse_check_remove(f, newdir, newname, newpath.c_str(),
+			(flags & RENAME_EXCHANGE) && newdir != olddir);
+	else if (!err && newdir != olddir)
+		err = fuse_check_access(f, newdir, W_OK | X_OK);
+	if (!err && !f->op.rename)
+		err = -ENOSYS;
+	if (!err) {
+		fuse_flush_name(f, olddir, oldname);
+		fuse_flush_name(f, newdir, newname);
+		fuse_intr_data d;
+		fuse_prepare_interrupt(f, req, &d);
+		/* An open file replaced is hidden first, one that must not be replaced is left alone */
+		std::shared_ptr<copper_fuse_node> open;
+		if (!(flags & (RENAME_EXCHANGE | RENAME_NOREPLACE)))
+			open = fuse_open_node(f, newdir, newname);
+		if (open)
+			err = fuse_hide_node(f, newdir, newname, newpath.c_str(), open.get());
+		if (!err)
+			err = f->op.rename(oldpath.c_str(), newpath.c_str(), flags);
+		if (!err)
+			err = f->nodes.rename(olddir, oldname, newdir, newname, flags & RENAME_EXCHANGE);
+		fuse_finish_interrupt(f, req, &d);
+	}
+	if (!err) {
+		f->lookups.forget(newdir, newname);
+		if (flags & RENAME_EXCHANGE)
+			f->lookups.forget(olddir, oldname);
+		f->dirs.changed(olddir);
+		if (newdir != olddir)
+			f->dirs.changed(newdir);
+	}
+	req->reply_err(-err);
+}
+
+static void fuse_lib_link(copper_fuse_req_t req, fuse_ino_t ino, fuse_ino_t newparent,
+	const char* newname) {
+	copper_fuse* f = req_fuse(req);
+	struct copper_fuse_entry_param e;
+	std::string oldpath, newpath;
+
+	int err = fuse_check_access(f, newparent, W_OK | X_OK);
+	if (!err)
+		err = f->get_path(ino, nullptr, &oldpath);
+	if (!err)
+		err = f->get_path(newparent, newname, &newpath);
+	if (!err && !f->op.link)
+		err = -ENOSYS;
+	if (!err) {
+		fuse_intr_data d;
+		fuse_prepare_interrupt(f, req, &d);
+		err = f->op.link(oldpath.c_str(), newpath.c_str());
+		if (!err) {
+			f->lookups.forget(newparent, newname);
+			err = lookup_path(f, newparent, newname, newpath.c_str(), &e, nullptr);
+		}
+		fuse_finish_interrupt(f, req, &d);
+	}
+	if (err)
+		req->reply_err(-err);
+	else
+		fuse_reply_new_entry(f, req, newparent, &e);
+}
+
+static void open_auto_cache(copper_fuse* f, struct fuse_file_info* fi) {
+	if (f->conf.direct_io)
+		fi->direct_io = 1;
+	if (f->conf.kernel_cache)
+		fi->keep_cache = 1;
+}
+
+static void fuse_lib_open(copper_fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi) {
+	copper_fuse* f = req_fuse(req);
+	std::string path;
+
+	int err = fuse_check_access(f, ino, open_access_mask(fi->flags));
+	if (!err)
+		err = f->get_path(ino, nullptr, &path);
+	if (!err && f->op.open) {
+		fuse_intr_data d;
+		fuse_prepare_interrupt(f, req, &d);
+		err = f->op.open(path.c_str(), fi);
+		fuse_finish_interrupt(f, req, &d);
+	}
+	if (err) {
+		req->reply_err(-err);
+		return;
+	}
+
+	open_auto_cache(f, fi);
+	/* As the kernel drops its cache of the file */
+	if (f->block_cache && !fi->keep_cache)
+		f->block_cache->invalidate(ino);
+	f->nodes.opened(ino);
+
+	if (req->reply_open(fi) == -ENOENT) {
+		/* The open syscall was interrupted, so it must be cancelled */
+		if (f->op.release)
+			f->op.release(path.c_str(), fi);
+		f->nodes.closed(ino);
+	}
+}
+
+static void fuse_lib_read(copper_fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+	struct fuse_file_info* fi) {
+	copper_fuse* f = req_fuse(req);
+	static thread_local std::vector<char> buf;
+	std::string path;
+
+	if (!f->op.read) {
+		req->reply_err(ENOSYS);
+		return;
+	}
+
+	if (f->write_behind)
+		f->write_behind->flush_ino(ino);
+
+	if (buf.size() < size)
+		buf.resize(size);
+	int res = 0;
+	fuse_intr_data d;
+	if (f->block_cache) {
+		fuse_prepare_interrupt(f, req, &d);
+		res = f->block_cache->read(ino, fi, buf.data(), size, off);
+		fuse_finish_interrupt(f, req, &d);
+	} else if (!(res = f->get_path(ino, nullptr, &path))) {
+		fuse_prepare_interrupt(f, req, &d);
+		res = f->op.read(path.c_str(), buf.data(), size, off, fi);
+		fuse_finish_interrupt(f, req, &d);
+	}
+
+	if (res >= 0)
+		req->reply_buf(buf.data(), std::min<size_t>(res, size));
+	else
+		req->reply_err(-res);
+}
+
+static void fuse_lib_write(copper_fuse_req_t req, fuse_ino_t ino, const char* buf,
+	size_t size, off_t off, struct fuse_file_info* fi) {
+	copper_fuse* f = req_fuse(req);
+	std::string path;
+
+	if (!f->op.write) {
+		req->reply_err(ENOSYS);
+		return;
+	}
+
+	int res;
+	if (f->write_behind) {
+		res = f->write_behind->write(ino, fi, buf, size, off);
+	} else {
+		res = f->get_path(ino, nullptr, &path);
+		if (!res) {
+			fuse_intr_data d;
+			fuse_prepare_interrupt(f, req, &d);
+			res = f->op.write(path.c_str(), buf, size, off, fi);
+			fuse_finish_interrupt(f, req, &d);
+		}
+		if (f->block_cache)
+			f->block_cache->invalidate(ino);
+	}
+
+	if (res >= 0)
+		req->reply_write(res);
+	else
+		req->reply_err(-res);
+}
+
+/* close(2) drops all POSIX locks of the closing process */
+static void fuse_release_posix_locks(copper_fuse* f, fuse_ino_t ino, const char* path,
+	struct fuse_file_info* fi) {
+	if (f->op.lock) {
+		struct flock lock;
+
+		if (!path)
+			return;
+		memset(&lock, 0, sizeof(lock));
+		lock.l_type = F_UNLCK;
+		lock.l_whence = SEEK_SET;
+		f->op.lock(path, fi, F_SETLK, &lock);
+	} else {
+		f->locks.release_posix(ino, fi->lock_owner);
+	}
+}
+
+static void fuse_lib_flush(copper_fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi) {
+	copper_fuse* f = req_fuse(req);
+	std::string path;
+
+	int wb_err = f->write_behind ? f->write_behind->flush(ino, fi) : 0;
+	int err = f->get_path(ino, nullptr, &path);
+	if (f->se->conn.want & FUSE_POSIX_LOCKS)
+		fuse_release_posix_locks(f, ino, err ? nullptr : path.c_str(), fi);
+	if (!err && f->op.flush) {
+		fuse_intr_data d;
+		fuse_prepare_interrupt(f, req, &d);
+		err = f->op.flush(path.c_str(), fi);
+		fuse_finish_interrupt(f, req, &d);
+	} else if (!err) {
+		err = -ENOSYS;
+	}
+	/* ENOSYS would stop the kernel sending FLUSH, and with it the lock release or write-out */
+	if (err == -ENOSYS && ((f->se->conn.want & FUSE_POSIX_LOCKS) || f->write_behind))
+		err = 0;
+	if (wb_err)
+		err = wb_err;
+	req->reply_err(-err);
+}
+
+static void fuse_lib_release(copper_fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi) {
+	copper_fuse* f = req_fuse(req);
+	std::string path;
+	int err = 0;
+
+	if (f->write_behind)
+		err = f->write_behind->release(ino, fi);
+	if (f->block_cache)
+		f->block_cache->release(ino, fi);
+
+	int res = f->get_path(ino, nullptr, &path);
+	if (fi->flush && (f->se->conn.want & FUSE_POSIX_LOCKS))
+		fuse_release_posix_locks(f, ino, res ? nullptr : path.c_str(), fi);
+	if (fi->flush && f->op.flush) {
+		int flush_err = f->op.flush(res ? nullptr : path.c_str(), fi);
+		if (!err && flush_err != -ENOSYS)
+			err = flush_err;
+	}
+	if (fi->flock_release) {
+		if (f->op.flock)
+			f->op.flock(res ? nullptr : path.c_str(), fi, LOCK_UN);
+		else
+			f->locks.release_flock(ino, fi->lock_owner);
+	}
+	if (f->op.release)
+		f->op.release(res ? nullptr : path.c_str(), fi);
+
+	/* The last release of a file unlinked while open removes it for good */
+	if (f->nodes.closed(ino)) {
+		if (!res && f->op.unlink)
+			f->op.unlink(path.c_str());
+		f->nodes.unhash(ino);
+	}
+	req->reply_err(-err);
+}
+
+static void fuse_lib_fsync(copper_fuse_req_t req, fuse_ino_t ino, int datasync,
+	struct fuse_file_info* fi) {
+	copper_fuse* f = req_fuse(req);
+	std::string path;
+
+	int wb_err = f->write_behind ? f->write_behind->flush(ino, fi) : 0;
+	int err = f->get_path(ino, nullptr, &path);
+	if (!err && f->op.fsync) {
+		fuse_intr_data d;
+		fuse_prepare_interrupt(f, req, &d);
+		err = f->op.fsync(path.c_str(), datasync, fi);
+		fuse_finish_interrupt(f, req, &d);
+	} else if (!err) {
+		err = -ENOSYS;
+	}
+	/* ENOSYS would stop the kernel sending FSYNC, and with it the write-out */
+	if (err == -ENOSYS && f->write_behind)
+		err = 0;
+	if (wb_err)
+		err = wb_err;
+	req->reply_err(-err);
+}
+
+static void fuse_lib_statfs(copper_fuse_req_t req, fuse_ino_t ino) {
+	copper_fuse* f = req_fuse(req);
+	struct statvfs buf;
+	std::string path;
+	int err = 0;
+
+	memset(&buf, 0, sizeof(buf));
+	if (f->op.statfs) {
+		err = f->get_path(ino, nullptr, &path);
+		if (!err) {
+			fuse_intr_data d;
+			fuse_prepare_interrupt(f, req, &d);
+			err = f->op.statfs(path.c_str(), &buf);
+			fuse_finish_interrupt(f, req, &d);
+		}
+	} else {
+		buf.f_namemax = 255;
+		buf.f_bsize   = 512;
+	}
+	if (err)
+		req->reply_err(-err);
+	else
+		req->reply_statfs(&buf);
+}
+
+static void fuse_lib_create(copper_fuse_req_t req, fuse_ino_t parent, const char* name,
+	mode_t mode, struct fuse_file_info* fi) {
+	copper_fuse* f = req_fuse(req);
+	struct copper_fuse_entry_param e;
+	std::string path;
+
+	int err = fuse_check_access(f, parent, W_OK | X_OK);
+	if (!err)
+		err = f->get_path(parent, name, &path);
+	if (!err) {
+		if (f->op.create) {
+			fuse_intr_data d;
+			fuse_prepare_interrupt(f, req, &d);
+			err = f->op.create(path.c_str(), mode, fi);
+			if (!err) {
+				f->lookups.forget(parent, name);
+				err = lookup_path(f, parent, name, path.c_str(), &e, fi);
+				/* Opened but not found, only then is there a handle to release */
+				if (err && f->op.release)
+					f->op.release(path.c_str(), fi);
+			}
+			fuse_finish_interrupt(f, req, &d);
+			if (!err && !S_ISREG(e.attr.st_mode)) {
+				err = -EIO;
+				if (f->op.release)
+					f->op.release(path.c_str(), fi);
+				f->forget_node(e.ino, 1);
+			}
+		} else {
+			err = -ENOSYS;
+		}
+	}
+	if (err) {
+		req->reply_err(-err);
+		return;
+	}
+
+	f->dirs.changed(parent);
+	open_auto_cache(f, fi);
+	f->nodes.opened(e.ino);
+
+	if (req->reply_create(&e, fi) == -ENOENT) {
+		/* The create and open syscalls were interrupted, so they must be cancelled */
+		if (f->op.release)
+			f->op.release(path.c_str(), fi);
+		f->nodes.closed(e.ino);
+		f->forget_node(e.ino, 1);
+	}
+}
+
+static void fuse_lib_copy_file_range(copper_fuse_req_t req, fuse_ino_t nodeid_in, off_t off_in,
+	struct fuse_file_info* fi_in, fuse_ino_t nodeid_out, off_t off_out,
+	struct fuse_file_info* fi_out, size_t len, int flags) {
+	copper_fuse* f = req_fuse(req);
+	std::string path_in, path_out;
+	ssize_t res;
+
+	if (f->write_behind) {
+		f->write_behind->flush_ino(nodeid_in);
+		f->write_behind->flush_ino(nodeid_out);
+	}
+
+	res = f->get_path(nodeid_in, nullptr, &path_in);
+	if (!res)
+		res = f->get_path(nodeid_out, nullptr, &path_out);
+	if (res) {
+		req->reply_err(-res);
+		return;
+	}
+
+	/* Like copy_file_range(2), no copying within overlapping ranges of one file */
+	if (nodeid_in == nodeid_out && off_in < (off_t)(off_out + len) && off_out < (off_t)(off_in + len)) {
+		req->reply_err(EINVAL);
+		return;
+	}
+
+	fuse_intr_data d;
+	fuse_prepare_interrupt(f, req, &d);
+	res = -ENOSYS;
+	if (f->op.copy_file_range)
+		res = f->op.copy_file_range(path_in.c_str(), fi_in, off_in,
+			path_out.c_str(), fi_out, off_out, len, flags);
+	if (res == -ENOSYS || res == -EOPNOTSUPP || res == -EXDEV) {
+		if (flags)
+			res = -EINVAL;
+		else
+			res = f->copy_range(path_in.c_str(), fi_in, off_in,
+				path_out.c_str(), fi_out, off_out, len);
+	}
+	fuse_finish_interrupt(f, req, &d);
+	if (f->block_cache)
+		f->block_cache->invalidate(nodeid_out);
+
+	if (res >= 0)
+		req->reply_write(res);
+	else
+		req->reply_err(-res);
+}
+
+static void fuse_lib_fallocate(copper_fuse_req_t req, fuse_ino_t ino, int mode, off_t offset,
+	off_t length, struct fuse_file_info* fi) {
+	copper_fuse* f = req_fuse(req);
+	std::string path;
+
+	if (!f->op.fallocate) {
+		req->reply_err(ENOSYS);
+		return;
+	}
+
+	if (f->write_behind)
+		f->write_behind->flush_ino(ino);
+
+	int err = f->get_path(ino, nullptr, &path);
+	if (!err) {
+		fuse_intr_data d;
+		fuse_prepare_interrupt(f, req, &d);
+		err = f->op.fallocate(path.c_str(), mode, offset, length, fi);
+		fuse_finish_interrupt(f, req, &d);
+	}
+	if (f->block_cache)
+		f->block_cache->invalidate(ino);
+	req->reply_err(-err);
+}
+
+static void fuse_lib_lseek(copper_fuse_req_t req, fuse_ino_t ino, off_t off, int whence,
+	struct fuse_file_info* fi) {
+	copper_fuse* f = req_fuse(req);
+	std::string path;
+
+	if (!f->op.lseek) {
+		req->reply_err(ENOSYS);
+		return;
+	}
+
+	if (f->write_behind)
+		f->write_behind->flush_ino(ino);
+
+	off_t res = f->get_path(ino, nullptr, &path);
+	if (!res)
+		res = f->op.lseek(path.c_str(), off, whence, fi);
+	if (res >= 0)
+		req->reply_lseek(res);
+	else
+		req->reply_err(-res);
+}
+
+static void fuse_lib_setxattr(copper_fuse_req_t req, fuse_ino_t ino, const char* name,
+	const char* value, size_t size, int flags) {
+	copper_fuse* f = req_fuse(req);
+	std::string path;
+
+	int err = f->get_path(ino, nullptr, &path);
+	if (!err)
+		err = f->op.setxattr ? f->op.setxattr(path.c_str(), name, value, size, flags) : -ENOSYS;
+	if (f->xattr_cache)
+		f->xattr_cache->invalidate(ino, name);
+	/* Setting an ACL may change the mode as well */
+	if (f->perms && !strncmp(name, "system.posix_acl_", 17))
+		f->perms->invalidate(ino);
+	req->reply_err(-err);
+}
+
+static void reply_xattr_value(copper_fuse_req_t req, const std::string& value, size_t size) {
+	if (!size)
+		req->reply_xattr(value.size());
+	else if (value.size() > size)
+		req->reply_err(ERANGE);
+	else
+		req->reply_buf(value.data(), value.size());
+}
+
+static void fuse_lib_getxattr(copper_fuse_req_t req, fuse_ino_t ino, const char* name, size_t size) {
+	copper_fuse* f = req_fuse(req);
+	std::string path, value;
+
+	if (!f->op.getxattr) {
+		req->reply_err(ENOSYS);
+		return;
+	}
+
+	int err = f->get_path(ino, nullptr, &path);
+	if (!err)
+		err = f->get_xattr(ino, path.c_str(), name, &value);
+	if (err)
+		req->reply_err(-err);
+	else
+		reply_xattr_value(req, value, size);
+}
+
+static void fuse_lib_listxattr(copper_fuse_req_t req, fuse_ino_t ino, size_t size) {
+	copper_fuse* f = req_fuse(req);
+	std::string path, value;
+
+	if (!f->op.listxattr) {
+		req->reply_err(ENOSYS);
+		return;
+	}
+
+	int err = f->get_path(ino, nullptr, &path);
+	if (!err)
+		err = f->get_xattr(ino, path.c_str(), nullptr, &value);
+	if (err)
+		req->reply_err(-err);
+	else
+		reply_xattr_value(req, value, size);
+}
+
+static void fuse_lib_removexattr(copper_fuse_req_t req, fuse_ino_t ino, const char* name) {
+	copper_fuse* f = req_fuse(req);
+	std::string path;
+
+	int err = f->get_path(ino, nullptr, &path);
+	if (!err)
+		err = f->op.removexattr ? f->op.removexattr(path.c_str(), name) : -ENOSYS;
+	if (f->xattr_cache)
+		f->xattr_cache->invalidate(ino, name);
+	/* Removing an ACL changes the effective permissions, the cached ones go stale */
+	if (f->perms && !strncmp(name, "system.posix_acl_", 17))
+		f->perms->invalidate(ino);
+	req->reply_err(-err);
+}
+
+static void fuse_lib_poll(copper_fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi,
+	struct fuse_pollhandle* ph) {
+	copper_fuse* f = req_fuse(req);
+	std::string path;
+	unsigned revents = 0;
+
+	if (!f->op.poll) {
+		delete ph;
+		req->reply_err(ENOSYS);
+		return;
+	}
+
+	int err = f->get_path(ino, nullptr, &path);
+	if (!err) {
+		fuse_intr_data d;
+		fuse_prepare_interrupt(f, req, &d);
+		err = f->op.poll(path.c_str(), fi, ph, &revents);
+		fuse_finish_interrupt(f, req, &d);
+	} else {
+		delete ph;
+	}
+	if (!err)
+		req->reply_poll(revents);
+	else
+		req->reply_err(-err);
+}
+
+static void fuse_lib_opendir(copper_fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi) {
+	copper_fuse* f = req_fuse(req);
+	std::unique_ptr<copper_fuse_dir_handle> dh(new (std::nothrow) copper_fuse_dir_handle);
+	std::string path;
+
+	int err = dh ? fuse_check_access(f, ino, R_OK) : -ENOMEM;
+	if (!err)
+		err = f->get_path(ino, nullptr, &path);
+	if (!err && f->op.opendir) {
+		fuse_intr_data d;
+		fuse_prepare_interrupt(f, req, &d);
+		err = f->op.opendir(path.c_str(), fi);
+		fuse_finish_interrupt(f, req, &d);
+	}
+	if (err) {
+		req->reply_err(-err);
+		return;
+	}
+
+	dh->nodeid = ino;
+	dh->fi     = *fi;
+	/* The version a listing must be of to be shared, unknown without ->getattr() */
+	memset(&dh->sig, 0, sizeof(dh->sig));
+	if (f->op.getattr) {
+		struct stat buf;
+		memset(&buf, 0, sizeof(buf));
+		if (f->op.getattr(path.c_str(), &buf, nullptr) == 0) {
+			dh->sig.mtime = buf.st_mtim;
+			dh->sig.ctime = buf.st_ctim;
+			dh->sig.size  = buf.st_size;
+		}
+	}
+
+	fi->fh = f->dirs.add(std::move(dh));
+	if (req->reply_open(fi) == -ENOENT) {
+		/* The opendir syscall was interrupted, so it must be cancelled */
+		dh = f->dirs.remove(fi->fh);
+		if (f->op.releasedir)
+			f->op.releasedir(path.c_str(), &dh->fi);
+	}
+}
+
+/* List the whole directory of `dh` with a single ->readdir() call */
+static int fuse_list_dir(copper_fuse* f, copper_fuse_req_t req, copper_fuse_dir_handle* dh,
+	std::shared_ptr<const copper_fuse_dir_snapshot>* snapp) {
+	std::string path;
+	int err, fill_err = 0;
+
+	if (!f->op.readdir)
+		return -ENOSYS;
+	err = f->get_path(dh->nodeid, nullptr, &path);
+	if (err)
+		return err;
+
+	std::shared_ptr<copper_fuse_dir_snapshot> snap(new (std::nothrow) copper_fuse_dir_snapshot);
+	if (!snap)
+		return -ENOMEM;
+	snap->sig = dh->sig;
+	fuse_ino_t parent = dh->nodeid;
+	fuse_fill_dir_t filler = [f, parent, &fill_err](void* buf, const char* name,
+		const struct stat* stbuf, off_t, enum fuse_fill_dir_flags) {
+		copper_fuse_dir_snapshot* s = static_cast<copper_fuse_dir_snapshot*>(buf);
+		uint64_t ino = FUSE_UNKNOWN_INO;
+		if (stbuf && f->conf.use_ino)
+			ino = stbuf->st_ino;
+		else if (f->conf.readdir_ino && strcmp(name, ".") && strcmp(name, ".."))
+			ino = f->lookup_nodeid(parent, name);
+		/* Never full, the filesystem goes on to the end */
+		fill_err = s->add(name, ino, stbuf ? stbuf->st_mode : 0);
+		return fill_err ? 1 : 0;
+	};
+
+	struct fuse_file_info fi = dh->fi;
+	fuse_intr_data d;
+	fuse_prepare_interrupt(f, req, &d);
+	err = f->op.readdir(path.c_str(), snap.get(), filler, 0, &fi, (enum fuse_readdir_flags)0);
+	fuse_finish_interrupt(f, req, &d);
+	if (err)
+		return err;
+	if (fill_err)
+		return fill_err;
+	*snapp = std::move(snap);
+	return 0;
+}
+
+/* Give `dh` the listing to read at `off` from, called with dh->lock held */
+static int fuse_dir_snapshot(copper_fuse* f, copper_fuse_req_t req, fuse_ino_t ino,
+	copper_fuse_dir_handle* dh, off_t off) {
+	if (dh->snap && off != 0)
+		return 0;
+
+	std::shared_ptr<const copper_fuse_dir_snapshot> snap;
+	/* A rewind lists the directory as it is now */
+	bool rewind = dh->snap != nullptr;
+	if (!rewind)
+		snap = f->dirs.find(ino, dh->sig);
+	if (!snap) {
+		int err = fuse_list_dir(f, req, dh, &snap);
+		if (err)
+			return err;
+		if (!rewind)
+			f->dirs.publish(ino, snap);
+	}
+	dh->snap = std::move(snap);
+	return 0;
+}
+
+static void fuse_lib_readdir(copper_fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+	struct fuse_file_info* fi) {
+	copper_fuse* f = req_fuse(req);
+	copper_fuse_dir_handle* dh = f->dirs.get(fi->fh);
+
+	if (!dh) {
+		req->reply_err(EBADF);
+		return;
+	}
+
+	std::unique_lock<std::mutex> guard(dh->lock);
+	int err = fuse_dir_snapshot(f, req, ino, dh, off);
+	if (err) {
+		guard.unlock();
+		req->reply_err(-err);
+		return;
+	}
+
+	std::unique_ptr<char[]> buf(new (std::nothrow) char[size]);
+	if (!buf) {
+		guard.unlock();
+		req->reply_err(ENOMEM);
+		return;
+	}
+	size_t used = dh->snap->fill(buf.get(), size, off);
+	guard.unlock();
+	req->reply_buf(buf.get(), used);
+}
+
+/*
+ * Like readdir, with each entry looked up as well.  An entry that can't
+ * be looked up, or without search permission on the directory, goes
+ * out with only its name and the kernel looks it up itself.
+ */
+static void fuse_lib_readdirplus(copper_fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+	struct fuse_file_info* fi) {
+	copper_fuse* f = req_fuse(req);
+	copper_fuse_dir_handle* dh = f->dirs.get(fi->fh);
+	std::string dirpath, path;
+
+	if (!dh) {
+		req->reply_err(EBADF);
+		return;
+	}
+
+	std::unique_lock<std::mutex> guard(dh->lock);
+	int err = fuse_dir_snapshot(f, req, ino, dh, off);
+	if (err) {
+		guard.unlock();
+		req->reply_err(-err);
+		return;
+	}
+	std::shared_ptr<const copper_fuse_dir_snapshot> snap = dh->snap;
+	guard.unlock();
+
+	std::unique_ptr<char[]> buf(new (std::nothrow) char[size]);
+	if (!buf) {
+		req->reply_err(ENOMEM);
+		return;
+	}
+	bool lookup = fuse_check_access(f, ino, X_OK) == 0 &&
+		f->get_path(ino, nullptr, &dirpath) == 0;
+
+	size_t used = 0;
+	for (size_t i = off < 0 ? 0 : off; i < snap->entries.size(); i++) {
+		const copper_fuse_dir_snapshot::entry& ent = snap->entries[i];
+		std::string name(snap->names, ent.name, ent.len);
+		struct copper_fuse_entry_param e;
+
+		err = -ENOENT;
+		if (lookup && name != "." && name != "..") {
+			path = dirpath;
+			if (path.size() > 1)
+				path += '/';
+			path += name;
+			err = lookup_path(f, ino, name.c_str(), path.c_str(), &e, nullptr);
+		}
+		if (err) {
+			memset(&e, 0, sizeof(e));
+			e.attr.st_ino  = ent.ino;
+			e.attr.st_mode = (mode_t)ent.type << 12;
+		}
+
+		size_t res = copper_fuse_add_direntry_plus(buf.get() + used, size - used,
+			name.c_str(), name.size(), &e, i + 1);
+		if (res > size - used) {
+			/* Didn't fit, the kernel never sees this lookup */
+			if (e.ino)
+				f->forget_node(e.ino, 1);
+			break;
+		}
+		used += res;
+	}
+	req->reply_buf(buf.get(), used);
+}
+
+static void fuse_lib_fsyncdir(copper_fuse_req_t req, fuse_ino_t ino, int datasync,
+	struct fuse_file_info* fi) {
+	copper_fuse* f = req_fuse(req);
+	copper_fuse_dir_handle* dh = f->dirs.get(fi->fh);
+	std::string path;
+
+	int err = dh ? f->get_path(ino, nullptr, &path) : -EBADF;
+	if (!err && f->op.fsyncdir) {
+		fuse_intr_data d;
+		fuse_prepare_interrupt(f, req, &d);
+		err = f->op.fsyncdir(path.c_str(), datasync, &dh->fi);
+		fuse_finish_interrupt(f, req, &d);
+	}
+	req->reply_err(-err);
+}
+
+static void fuse_lib_releasedir(copper_fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi) {
+	copper_fuse* f = req_fuse(req);
+	std::unique_ptr<copper_fuse_dir_handle> dh = f->dirs.remove(fi->fh);
+	std::string path;
+
+	if (dh && f->op.releasedir) {
+		f->get_path(ino, nullptr, &path);
+		f->op.releasedir(path.c_str(), &dh->fi);
+	}
+	req->reply_err(0);
+}
+
+static void fuse_lib_access(copper_fuse_req_t req, fuse_ino_t ino, int mask) {
+	copper_fuse* f = req_fuse(req);
+	std::string path;
+	int err;
+
+	if (f->perms) {
+		req->reply_err(-fuse_check_access(f, ino, mask));
+		return;
+	}
+	if (!f->op.access) {
+		req->reply_err(ENOSYS);
+		return;
+	}
+	err = f->get_path(ino, nullptr, &path);
+	if (!err)
+		err = f->op.access(path.c_str(), mask);
+	req->reply_err(-err);
+}
+
+static void fuse_lib_getlk(copper_fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi,
+	struct flock* lock) {
+	copper_fuse* f = req_fuse(req);
+	std::string path;
+	int err;
+
+	if (f->op.lock) {
+		err = f->get_path(ino, nullptr, &path);
+		if (!err) {
+			fuse_intr_data d;
+			fuse_prepare_interrupt(f, req, &d);
+			err = f->op.lock(path.c_str(), fi, F_GETLK, lock);
+			fuse_finish_interrupt(f, req, &d);
+		}
+	} else {
+		err = f->locks.getlk(ino, fi->lock_owner, lock);
+	}
+	if (!err)
+		req->reply_lock(lock);
+	else
+		req->reply_err(-err);
+}
+
+static void fuse_lib_setlk(copper_fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi,
+	struct flock* lock, int sleep) {
+	copper_fuse* f = req_fuse(req);
+	std::string path;
+
+	if (f->op.lock) {
+		int err = f->get_path(ino, nullptr, &path);
+		if (!err) {
+			fuse_intr_data d;
+			fuse_prepare_interrupt(f, req, &d);
+			err = f->op.lock(path.c_str(), fi, sleep ? F_SETLKW : F_SETLK, lock);
+			fuse_finish_interrupt(f, req, &d);
+		}
+		req->reply_err(-err);
+		return;
+	}
+
+	/* A waiter is answered by the thread that releases the conflicting lock */
+	if (sleep)
+		req->interrupt_func([f, ino](copper_fuse_req_t r) { f->locks.cancel(ino, r); });
+	int res = f->locks.setlk(ino, fi->lock_owner, lock, sleep ? req : nullptr);
+	if (res <= 0)
+		req->reply_err(-res);
+}
+
+static void fuse_lib_flock(copper_fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi, int op) {
+	copper_fuse* f = req_fuse(req);
+	std::string path;
+
+	if (f->op.flock) {
+		int err = f->get_path(ino, nullptr, &path);
+		if (!err) {
+			fuse_intr_data d;
+			fuse_prepare_interrupt(f, req, &d);
+			err = f->op.flock(path.c_str(), fi, op);
+			fuse_finish_interrupt(f, req, &d);
+		}
+		req->reply_err(-err);
+		return;
+	}
+
+	if (!(op & LOCK_NB))
+		req->interrupt_func([f, ino](copper_fuse_req_t r) { f->locks.cancel(ino, r); });
+	int res = f->locks.flock(ino, fi->lock_owner, op, req);
+	if (res <= 0)
+		req->reply_err(-res);
+}
+
+static const struct copper_fuse_lowlevel_ops* fuse_path_ops() {
+	static struct copper_fuse_lowlevel_ops ops = [] {
+		struct copper_fuse_lowlevel_ops o;
+		o.init            = fuse_lib_init;
+		o.destroy         = fuse_lib_destroy;
+		o.lookup          = fuse_lib_lookup;
+		o.forget          = fuse_lib_forget;
+		o.getattr         = fuse_lib_getattr;
+		o.setattr         = fuse_lib_setattr;
+		o.readlink        = fuse_lib_readlink;
+		o.mknod           = fuse_lib_mknod;
+		o.mkdir           = fuse_lib_mkdir;
+		o.unlink          = fuse_lib_unlink;
+		o.rmdir           = fuse_lib_rmdir;
+		o.symlink         = fuse_lib_symlink;
+		o.rename          = fuse_lib_rename;
+		o.link            = fuse_lib_link;
+		o.open            = fuse_lib_open;
+		o.read            = fuse_lib_read;
+		o.write           = fuse_lib_write;
+		o.flush           = fuse_lib_flush;
+		o.release         = fuse_lib_release;
+		o.fsync           = fuse_lib_fsync;
+		o.statfs          = fuse_lib_statfs;
+		o.create          = fuse_lib_create;
+		o.copy_file_range = fuse_lib_copy_file_range;
+		o.fallocate       = fuse_lib_fallocate;
+		o.lseek           = fuse_lib_lseek;
+		o.setxattr        = fuse_lib_setxattr;
+		o.getxattr        = fuse_lib_getxattr;
+		o.listxattr       = fuse_lib_listxattr;
+		o.removexattr     = fuse_lib_removexattr;
+		o.opendir         = fuse_lib_opendir;
+		o.readdir         = fuse_lib_readdir;
+		o.readdirplus     = fuse_lib_readdirplus;
+		o.fsyncdir        = fuse_lib_fsyncdir;
+		o.releasedir      = fuse_lib_releasedir;
+		o.access          = fuse_lib_access;
+		o.poll            = fuse_lib_poll;
+		o.getlk           = fuse_lib_getlk;
+		o.setlk           = fuse_lib_setlk;
+		o.flock           = fuse_lib_flock;
+		return o;
+	}();
+	return &ops;
+}
+
+/** ---------------------------------------------------
+ * FOR COPPER FUSE
+ * ---------------------------------------------------*/
+
+int copper_fuse_notify_poll(struct fuse_pollhandle* ph) {
+	return ph->se->notify_poll(ph);
+}
+
+int copper_fuse_notify_poll_batch(struct fuse_pollhandle* const* phs, size_t count) {
+	if (!count)
+		return 0;
+	return phs[0]->se->notify_poll(phs, count);
+}
+
+void copper_fuse_pollhandle_destroy(struct fuse_pollhandle* ph) {
+	delete ph;
+}
+
+int copper_fuse_interrupted() {
+	return fuse_intr_req ? fuse_intr_req->is_interrupted() : 0;
+}
+
+std::shared_ptr<struct copper_fuse_cancel_token> copper_fuse_get_cancel_token() {
+	return fuse_intr_req ? fuse_intr_req->cancel_token() : nullptr;
+}
+
+struct copper_fuse_context* copper_fuse_get_context() {
+	return &fuse_context;
+}
+
+int copper_fuse_getgroups(int size, gid_t list[]) {
+	if (!fuse_context.fuse || !fuse_context.pid)
+		return -EINVAL;
+	return fuse_context.fuse->se->groups.get(fuse_context.pid, fuse_context.uid,
+		fuse_context.gid, size, list);
+}
+
+int copper_fuse_get_cache_stats(struct copper_fuse* f, struct copper_fuse_cache_stats* stats) {
+	if (!f->block_cache)
+		return -ENOENT;
+	f->block_cache->stats(stats);
+	return 0;
+}
+
+static int fuse_init_intr_signal(int signum, int* installed) {
+	struct sigaction old_sa;
+
+	if (sigaction(signum, nullptr, &old_sa) == -1) {
+		perror("fuse: cannot get old signal handler");
+		return -1;
+	}
+
+	/* Only a no-op handler, and without SA_RESTART, so blocking calls fail with EINTR */
+	if (old_sa.sa_handler == SIG_DFL) {
+		struct sigaction sa;
+		memset(&sa, 0, sizeof(sa));
+		sa.sa_handler = fuse_intr_sighandler;
+		sigemptyset(&sa.sa_mask);
+		if (sigaction(signum, &sa, nullptr) == -1) {
+			perror("fuse: cannot set interrupt signal handler");
+			return -1;
+		}
+		*installed = 1;
+	}
+	return 0;
+}
+
+static void fuse_restore_intr_signal(int signum) {
+	struct sigaction sa;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = SIG_DFL;
+	sigaction(signum, &sa, nullptr);
+}
+
+copper_fuse::copper_fuse(const struct copper_fuse_operations* _op, void* _user_data)
+	: se(nullptr), op(*_op), user_data(_user_data), nodes(&atoms), intr_installed(0), hidectr(0) {
+	memset(&conf, 0, sizeof(conf));
+	conf.entry_timeout   = 1.0;
+	conf.attr_timeout    = 1.0;
+	conf.intr_signal     = SIGUSR1;
+	conf.xattr_timeout   = 1.0;
+	conf.copy_chunk_size = COPPER_FUSE_DEFAULT_COPY_CHUNK;
+	conf.copy_threads    = COPPER_FUSE_DEFAULT_COPY_THREADS;
+	conf.write_behind_timeout = COPPER_FUSE_DEFAULT_WRITE_BEHIND_TIMEOUT;
+	conf.readahead            = COPPER_FUSE_DEFAULT_READAHEAD;
+	conf.readahead_threads    = COPPER_FUSE_DEFAULT_READAHEAD_THREADS;
+	conf.lookup_coalesce      = 1;
+
+	nodes.forgotten = [this](fuse_ino_t ino) {
+		if (xattr_cache)
+			xattr_cache->forget(ino);
+		if (perms)
+			perms->invalidate(ino);
+	};
+}
+
+copper_fuse::~copper_fuse() {
+	/* Lock waiters are requests of the session */
+	locks.clear();
+	delete se;
+	if (intr_installed)
+		fuse_restore_intr_signal(conf.intr_signal);
+	/* Copies in flight reference the filesystem, finish them first */
+	copy_pool.reset();
+}
+
+int copper_fuse::init(struct copper_fuse_args* args) {
+	if (args->parse_opt(&conf, copper_fuse_lib_opts, nullptr) == -1)
+		return -1;
+
+	if (!conf.ac_attr_timeout_set)
+		conf.ac_attr_timeout = conf.attr_timeout;
+	nodes.remember = conf.remember;
+	if (!conf.copy_threads)
+		conf.copy_threads = 1;
+	if (conf.intr && fuse_init_intr_signal(conf.intr_signal, &intr_installed) == -1)
+		return -1;
+
+	struct copper_fuse_mount_opts* mo = copper_fuse_parse_mount_opts(args);
+	if (!mo)
+		return -1;
+
+	se = new copper_fuse_session(fuse_path_ops(), this);
+	se->verbose = conf.debug;
+	se->mo = mo;
+	if (conf.max_pages)
+		se->set_max_pages(conf.max_pages);
+	if (conf.fair_slots || conf.fair_ops > 0 || conf.fair_bytes > 0) {
+		copper_fuse_tenant_limits limits;
+		limits.ops_per_sec   = conf.fair_ops;
+		limits.bytes_per_sec = conf.fair_bytes;
+		se->fair.setup(conf.fair_slots);
+		se->fair.set_default(limits);
+	}
+	return 0;
+}
+
+int copper_fuse::mount(const char* mountpoint) {
+	return se->mount(mountpoint);
+}
+
+void copper_fuse::unmount() {
+	se->unmount();
+}
+
+int copper_fuse::loop() {
+	return se->loop();
+}
+
+int copper_fuse::loop_mt(const struct copper_fuse_loop_config* config) {
+	return se->loop_mt(config);
+}
+
+void copper_fuse::exit() {
+	se->exit();
+}
+
+int copper_fuse::handoff(int sock) {
+	copper_fuse_snapshot_writer w;
+	std::string fs_state;
+
+	/* The successor knows nothing of the writes held back */
+	if (write_behind)
+		write_behind->flush_all();
+	if (op.save_state) {
+		int res = op.save_state(&fs_state);
+		if (res < 0)
+			return res;
+	}
+	nodes.save(&w);
+	locks.save(&w);
+	dirs.save(&w);
+	w.put_str(fs_state);
+	return se->handoff(sock, w.buf);
+}
+
+int copper_fuse::takeover(int sock) {
+	std::string state;
+
+	int res = se->takeover(sock, &state);
+	if (res < 0)
+		return res;
+
+	copper_fuse_snapshot_reader r(state);
+	std::string fs_state;
+
+	res = nodes.restore(&r);
+	if (res == 0)
+		res = locks.restore(&r, se);
+	if (res == 0)
+		res = dirs.restore(&r);
+	if (res == 0 && (!r.get_str(&fs_state) || !r.done()))
+		res = -EPROTO;
+	if (res == 0 && op.restore_state)
+		res = op.restore_state(fs_state);
+	if (res < 0)
+		locks.clear();
+	return res;
+}
@@ -0,0 +1,298 @@
+/*
+  CopperFuse: C++ version Filesystem in Userspace
+  Copyright (C) 2023 Chen Miao <chenmiao.ku@gmail.com>
+
+  This program can be distributed under the terms of the GNU LGPLv2.
+  See the file COPYING.LIB.
+*/
+
+#include "copper_fuse_block_cache.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <new>
+
+/* The first window of a handle found reading sequentially */
+#define CACHE_FIRST_WINDOW 2
+
+/** ---------------------------------------------------
+ * FOR COPPER FUSE BLOCK CACHE
+ * ---------------------------------------------------*/
+
+copper_fuse_block_cache::copper_fuse_block_cache(read_fn _read_in, size_t _capacity,
+	size_t _block_size, unsigned _readahead, unsigned threads)
+	: read_in(std::move(_read_in)), block_size(_block_size), max_window(_readahead), hits(0),
+	  misses(0), waits(0), read_ahead(0), ahead_hits(0), evictions(0), pool(threads) {
+	capacity = std::max<size_t>(_capacity / block_size / COPPER_FUSE_CACHE_SHARDS, 1);
+	for (auto& gen : gens)
+		gen = 0;
+	for (shard& s : shards)
+		s.hand = 0;
+}
+
+copper_fuse_block_cache::shard& copper_fuse_block_cache::shard_of(const key& k) {
+	return shards[key_hash()(k) >> 60 & (COPPER_FUSE_CACHE_SHARDS - 1)];
+}
+
+bool copper_fuse_block_cache::evict_one(shard& s, std::unique_ptr<char[]>* spare) {
+	for (size_t scanned = 0; scanned < 2 * s.ring.size(); scanned++) {
+		if (s.hand >= s.ring.size())
+			s.hand = 0;
+		block* b = s.ring[s.hand].get();
+		bool stale = b->error || b->key.gen != gens[b->key.ino % COPPER_FUSE_CACHE_GENS].load();
+		if (b->loading || (b->referenced && !stale)) {
+			b->referenced = false;
+			s.hand++;
+			continue;
+		}
+
+		auto it = s.blocks.find(b->key);
+		if (it != s.blocks.end() && it->second.get() == b)
+			s.blocks.erase(it);
+		if (!b->error)
+			evictions++;
+		/* Readers get blocks under the lock only, none has it if the ring is the last */
+		if (s.ring[s.hand].use_count() == 1 && b->data)
+			*spare = std::move(b->data);
+		s.ring[s.hand] = std::move(s.ring.back());
+		s.ring.pop_back();
+		return true;
+	}
+	return false;
+}
+
+void copper_fuse_block_cache::insert(shard& s, std::shared_ptr<block> b) {
+	/* Nothing to evict while all are loading, the budget stretches by the loads */
+	while (s.ring.size() >= capacity && evict_one(s, &b->data))
+		;
+	s.blocks[b->key] = b;
+	s.ring.push_back(std::move(b));
+}
+
+void copper_fuse_block_cache::load(shard& s, block* b, struct fuse_file_info* fi) {
+	/* An evicted block's memory if insert() found one, faulting in new memory costs */
+	std::unique_ptr<char[]> data(b->data ? b->data.release() : new (std::nothrow) char[block_size]);
+	int res = data ? read_in(b->key.ino, data.get(), block_size, b->key.index * block_size, fi)
+		: -ENOMEM;
+
+	{
+		std::lock_guard<std::mutex> guard(s.lock);
+		b->loading = false;
+		if (res < 0) {
+			b->error = res;
+			/* Not to be found again, the next reader tries anew */
+			auto it = s.blocks.find(b->key);
+			if (it != s.blocks.end() && it->second.get() == b)
+				s.blocks.erase(it);
+		} else {
+			b->len  = std::min<size_t>(res, block_size);
+			b->data = std::move(data);
+		}
+	}
+	s.loaded.notify_all();
+}
+
+int copper_fuse_block_cache::get(const key& k, struct fuse_file_info* fi,
+	std::shared_ptr<block>* out) {
+	shard& s = shard_of(k);
+	std::unique_lock<std::mutex> guard(s.lock);
+
+	auto it = s.blocks.find(k);
+	if (it != s.blocks.end()) {
+		std::shared_ptr<block> b = it->second;
+		if (b->loading) {
+			waits++;
+			s.loaded.wait(guard, [&b] { return !b->loading; });
+		} else {
+			hits++;
+		}
+		if (b->error)
+			return b->error;
+		if (b->ahead) {
+			b->ahead = false;
+			ahead_hits++;
+		}
+		b->referenced = true;
+		*out = std::move(b);
+		return 0;
+	}
+
+	misses++;
+	std::shared_ptr<block> b = std::make_shared<block>();
+	b->key        = k;
+	b->loading    = true;
+	b->referenced = true;
+	b->ahead      = false;
+	b->error      = 0;
+	b->len        = 0;
+	insert(s, b);
+	guard.unlock();
+
+	load(s, b.get(), fi);
+	if (b->error)
+		return b->error;
+	*out = std::move(b);
+	return 0;
+}
+
+int copper_fuse_block_cache::read(fuse_ino_t ino, struct fuse_file_info* fi, char* buf,
+	size_t size, off_t off) {
+	if (!size)
+		return 0;
+
+	key k = { ino, gens[ino % COPPER_FUSE_CACHE_GENS].load(), off / block_size };
+	uint64_t last = (off + size - 1) / block_size;
+	size_t done = 0;
+	bool eof = false;
+
+	for (; k.index <= last && !eof; k.index++) {
+		std::shared_ptr<block> b;
+		int err = get(k, fi, &b);
+		if (err)
+			return done ? (int)done : err;
+
+		size_t from = done ? 0 : off % block_size;
+		if (b->len > from) {
+			size_t n = std::min(b->len - from, size - done);
+			memcpy(buf + done, b->data.get() + from, n);
+			done += n;
+		}
+		eof = b->len < block_size;
+	}
+
+	if (max_window)
+		sequential(ino, fi, off, size, k.index - 1, eof);
+	return done;
+}
+
+void copper_fuse_block_cache::sequential(fuse_ino_t ino, struct fuse_file_info* fi, off_t off,
+	size_t size, uint64_t last, bool eof) {
+	std::shared_ptr<stream> st;
+	uint64_t from, to;
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		std::shared_ptr<stream>& slot = streams[{ ino, fi->fh }];
+		if (!slot) {
+			slot = std::make_shared<stream>();
+			slot->fi       = *fi;
+			slot->next     = 0;
+			slot->window   = 0;
+			slot->ahead    = 0;
+			slot->end      = UINT64_MAX;
+			slot->inflight = 0;
+			slot->closed   = false;
+		}
+		st = slot;
+		if (eof)
+			st->end = std::min(st->end, last);
+		if (st->closed || off != st->next) {
+			/* A seek: start over, from where a sequential read would follow */
+			st->next   = off + size;
+			st->window = 0;
+			st->ahead  = 0;
+			return;
+		}
+
+		st->next   = off + size;
+		st->window = st->window ? std::min(st->window * 2, max_window)
+			: std::min<unsigned>(CACHE_FIRST_WINDOW, max_window);
+		from = std::max(st->ahead, last + 1);
+		to   = std::min(last + st->window, st->end);
+		if (from > to)
+			return;
+		st->ahead     = to + 1;
+		st->inflight += to - from + 1;
+	}
+
+	for (uint64_t index = from; index <= to; index++)
+		pool.submit([this, st, ino, index] { load_ahead(st, ino, index); });
+}
+
+void copper_fuse_block_cache::load_ahead(std::shared_ptr<stream> st, fuse_ino_t ino,
+	uint64_t index) {
+	key k = { ino, gens[ino % COPPER_FUSE_CACHE_GENS].load(), index };
+	shard& s = shard_of(k);
+	std::shared_ptr<block> b;
+	bool closed;
+
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		closed = st->closed;
+	}
+	/* The handle may be gone, in which case nothing must be read through it */
+	if (!closed) {
+		std::lock_guard<std::mutex> guard(s.lock);
+		if (!s.blocks.count(k)) {
+			b = std::make_shared<block>();
+			b->key        = k;
+			b->loading    = true;
+			b->referenced = false;
+			b->ahead      = true;
+			b->error      = 0;
+			b->len        = 0;
+			insert(s, b);
+		}
+	}
+	if (b) {
+		read_ahead++;
+		load(s, b.get(), &st->fi);
+	}
+
+	std::lock_guard<std::mutex> guard(lock);
+	if (b && !b->error && b->len < block_size)
+		st->end = std::min(st->end, index);
+	if (--st->inflight == 0)
+		idle.notify_all();
+}
+
+void copper_fuse_block_cache::invalidate(fuse_ino_t ino) {
+	gens[ino % COPPER_FUSE_CACHE_GENS]++;
+
+	/* What was read ahead is stale, read it again */
+	std::lock_guard<std::mutex> guard(lock);
+	for (auto it = streams.lower_bound({ ino, 0 }); it != streams.end() && it->first.first == ino; ++it) {
+		it->second->ahead = 0;
+		it->second->end   = UINT64_MAX;
+	}
+}
+
+void copper_fuse_block_cache::release(fuse_ino_t ino, const struct fuse_file_info* fi) {
+	std::unique_lock<std::mutex> guard(lock);
+
+	auto it = streams.find({ ino, fi->fh });
+	if (it == streams.end())
+		return;
+	std::shared_ptr<stream> st = it->second;
+	streams.erase(it);
+	st->closed = true;
+	idle.wait(guard, [&st] { return st->inflight == 0; });
+}
+
+void copper_fuse_block_cache::stop() {
+	std::unique_lock<std::mutex> guard(lock);
+
+	for (auto& it : streams)
+		it.second->closed = true;
+	idle.wait(guard, [this] {
+		for (auto& it : streams)
+			if (it.second->inflight)
+				return false;
+		return true;
+	});
+}
+
+void copper_fuse_block_cache::stats(struct copper_fuse_cache_stats* st) {
+	st->hits       = hits.load();
+	st->misses     = misses.load();
+	st->waits      = waits.load();
+	st->read_ahead = read_ahead.load();
+	st->ahead_hits = ahead_hits.load();
+	st->evictions  = evictions.load();
+	st->blocks     = 0;
+	for (shard& s : shards) {
+		std::lock_guard<std::mutex> guard(s.lock);
+		st->blocks += s.ring.size();
+	}
+	st->block_size = block_size;
+}
@@ -0,0 +1,111 @@
+/*
+  CopperFuse: C++ version Filesystem in Userspace
+  Copyright (C) 2023 Chen Miao <chenmiao.ku@gmail.com>
+
+  This program can be distributed under the terms of the GNU LGPLv2.
+  See the file COPYING.LIB.
+*/
+
+#include "copper_fuse_buf.h"
+
+#include <cerrno>
+#include <cstdint>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT 26
+#endif
+#ifndef MAP_HUGE_2MB
+#define MAP_HUGE_2MB (21 << MAP_HUGE_SHIFT)
+#endif
+
+static size_t round_up(size_t size, size_t unit) {
+	return (size + unit - 1) / unit * unit;
+}
+
+static int buf_map(size_t size, bool huge, copper_fuse_recv_buf* buf) {
+	const int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+	void* p;
+
+	buf->size = size;
+	if (huge) {
+		buf->mapped = round_up(size, COPPER_FUSE_HUGE_PAGE);
+		p = mmap(nullptr, buf->mapped, PROT_READ | PROT_WRITE, flags | MAP_HUGETLB | MAP_HUGE_2MB,
+			-1, 0);
+		if (p != MAP_FAILED) {
+			buf->data = (char*)p;
+			buf->kind = COPPER_FUSE_BUF_HUGETLB;
+			return 0;
+		}
+
+		/* No reserved huge pages: align by hand and ask for transparent ones */
+		size_t len = buf->mapped + COPPER_FUSE_HUGE_PAGE;
+		p = mmap(nullptr, len, PROT_READ | PROT_WRITE, flags, -1, 0);
+		if (p != MAP_FAILED) {
+			uintptr_t start = round_up((uintptr_t)p, COPPER_FUSE_HUGE_PAGE);
+			size_t head = start - (uintptr_t)p;
+			if (head)
+				munmap(p, head);
+			munmap((char*)start + buf->mapped, len - head - buf->mapped);
+			buf->data = (char*)start;
+			buf->kind = madvise(buf->data, buf->mapped, MADV_HUGEPAGE) == 0 ?
+				COPPER_FUSE_BUF_THP : COPPER_FUSE_BUF_PAGES;
+			return 0;
+		}
+	}
+
+	buf->mapped = round_up(size, getpagesize());
+	p = mmap(nullptr, buf->mapped, PROT_READ | PROT_WRITE, flags, -1, 0);
+	if (p == MAP_FAILED)
+		return -ENOMEM;
+	buf->data = (char*)p;
+	buf->kind = COPPER_FUSE_BUF_PAGES;
+	return 0;
+}
+
+/** ---------------------------------------------------
+ * FOR COPPER FUSE BUFFER POOL
+ * ---------------------------------------------------*/
+
+copper_fuse_bufpool::copper_fuse_bufpool() : huge(true) {
+	for (auto& n : mapped)
+		n = 0;
+}
+
+copper_fuse_bufpool::~copper_fuse_bufpool() {
+	for (copper_fuse_recv_buf& buf : free)
+		munmap(buf.data, buf.mapped);
+}
+
+int copper_fuse_bufpool::get(size_t size, copper_fuse_recv_buf* buf) {
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		while (!free.empty()) {
+			*buf = free.back();
+			free.pop_back();
+			if (buf->size >= size)
+				return 0;
+			/* Left from before max_pages grew */
+			munmap(buf->data, buf->mapped);
+		}
+	}
+
+	int res = buf_map(size, huge && size >= COPPER_FUSE_HUGE_PAGE / 2, buf);
+	if (res == 0)
+		mapped[buf->kind]++;
+	return res;
+}
+
+void copper_fuse_bufpool::put(copper_fuse_recv_buf* buf) {
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		if (free.size() < COPPER_FUSE_BUFPOOL_MAX) {
+			free.push_back(*buf);
+			buf->data = nullptr;
+			return;
+		}
+	}
+	munmap(buf->data, buf->mapped);
+	buf->data = nullptr;
+}
@@ -0,0 +1,228 @@
+/*
+  CopperFuse: C++ version Filesystem in Userspace
+  Copyright (C) 2023 Chen Miao <chenmiao.ku@gmail.com>
+
+  This program can be distributed under the terms of the GNU LGPLv2.
+  See the file COPYING.LIB.
+*/
+
+#include "copper_fuse_congestion.h"
+#include "copper_fuse_lowlevel.h"
+#include "copper_log.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <fstream>
+#include <sstream>
+#include <unistd.h>
+
+static int64_t congestion_now() {
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+copper_fuse_congestion::copper_fuse_congestion()
+	: adaptive(false), min(0), max(0), target(0), max_inflight_bytes(0),
+	  limit(0), threshold(0), lat_sum(0), lat_count(0),
+	  inflight(0), peak(0), next_tick(0), period(0), noload(0), last_avg(0),
+	  ctl_bg(-2), ctl_cong(-2) {
+	std::fill(mins, mins + COPPER_FUSE_CONGESTION_WINDOW, UINT64_MAX);
+}
+
+copper_fuse_congestion::~copper_fuse_congestion() {
+	if (ctl_bg >= 0)
+		close(ctl_bg);
+	if (ctl_cong >= 0)
+		close(ctl_cong);
+}
+
+void copper_fuse_congestion::setup(const struct copper_fuse_conn_info* conn) {
+	max_inflight_bytes.store(conn->max_inflight_bytes, std::memory_order_relaxed);
+	target = (int64_t)conn->target_latency_us * 1000;
+	min = std::max(conn->max_background_min, 1u);
+	max = std::min(conn->max_background_max, COPPER_FUSE_MAX_BACKGROUND);
+	adaptive = max >= min && conn->max_background_max;
+
+	/* Zero leaves the kernel default, 12 and 9 */
+	unsigned bg = conn->max_background ? conn->max_background : 12;
+	if (adaptive)
+		bg = std::min(std::max(bg, min), max);
+	limit.store(bg, std::memory_order_relaxed);
+	threshold.store(conn->congestion_threshold ? conn->congestion_threshold : bg * 3 / 4,
+		std::memory_order_relaxed);
+	next_tick.store(congestion_now() + COPPER_FUSE_CONGESTION_PERIOD, std::memory_order_relaxed);
+}
+
+void copper_fuse_congestion::start(copper_fuse_req* req, size_t bytes,
+	const std::shared_ptr<copper_fuse_budget>& budget) {
+	req->start_ns = congestion_now();
+	req->inflight_bytes = bytes;
+	if (max_inflight_bytes.load(std::memory_order_relaxed) && budget) {
+		req->budget = budget;
+		budget->bytes.fetch_add(bytes);
+	}
+
+	unsigned n = inflight.fetch_add(1, std::memory_order_relaxed) + 1;
+	unsigned p = peak.load(std::memory_order_relaxed);
+	while (n > p && !peak.compare_exchange_weak(p, n, std::memory_order_relaxed))
+		;
+}
+
+void copper_fuse_congestion::complete(copper_fuse_req* req) {
+	int64_t now = congestion_now();
+	uint64_t lat = now - req->start_ns;
+
+	inflight.fetch_sub(1, std::memory_order_relaxed);
+	lat_sum.fetch_add(lat, std::memory_order_relaxed);
+	lat_count.fetch_add(1, std::memory_order_relaxed);
+
+	if (req->budget) {
+		copper_fuse_budget* b = req->budget.get();
+		size_t left = b->bytes.fetch_sub(req->inflight_bytes) - req->inflight_bytes;
+		if (left < max_inflight_bytes.load(std::memory_order_relaxed) && b->waiting.load()) {
+			std::lock_guard<std::mutex> guard(b->lock);
+			b->cond.notify_all();
+		}
+		req->budget.reset();
+	}
+
+	/* Whoever completes a request past the end of the period adjusts */
+	int64_t tick = next_tick.load(std::memory_order_relaxed);
+	if (now >= tick && next_tick.compare_exchange_strong(tick, now + COPPER_FUSE_CONGESTION_PERIOD))
+		adjust(req->se);
+}
+
+bool copper_fuse_congestion::admit(copper_fuse_session* se, copper_fuse_budget* budget) {
+	size_t max_bytes = max_inflight_bytes.load(std::memory_order_relaxed);
+	if (!max_bytes || budget->bytes.load() < max_bytes)
+		return true;
+
+	std::unique_lock<std::mutex> guard(budget->lock);
+	budget->waiting.store(true);
+	/* A waiting worker still counts as idle, the loop won't add one for it */
+	while (budget->bytes.load() >= max_bytes) {
+		if (se->exited.load(std::memory_order_acquire))
+			break;
+		budget->cond.wait_for(guard, std::chrono::milliseconds(10));
+	}
+	budget->waiting.store(false);
+	return !se->exited.load(std::memory_order_acquire);
+}
+
+unsigned copper_fuse_congestion::background() const {
+	return limit.load(std::memory_order_relaxed);
+}
+
+uint64_t copper_fuse_congestion::latency() {
+	std::lock_guard<std::mutex> guard(lock);
+	return last_avg;
+}
+
+void copper_fuse_congestion::adjust(copper_fuse_session* se) {
+	std::unique_lock<std::mutex> guard(lock, std::try_to_lock);
+	if (!guard.owns_lock())
+		return;
+
+	uint64_t count = lat_count.exchange(0, std::memory_order_relaxed);
+	uint64_t sum = lat_sum.exchange(0, std::memory_order_relaxed);
+	unsigned reached = peak.exchange(inflight.load(std::memory_order_relaxed),
+		std::memory_order_relaxed);
+	if (!count)
+		return;
+
+	uint64_t avg = sum / count;
+	last_avg = last_avg ? (last_avg * 3 + avg) / 4 : avg;
+
+	/*
+	 * The best average of the window is as good as unloaded, single
+	 * requests vary too much to tell.  It drifts with the backend,
+	 * older periods are forgotten.
+	 */
+	mins[period++ % COPPER_FUSE_CONGESTION_WINDOW] = avg;
+	noload = *std::min_element(mins, mins + COPPER_FUSE_CONGESTION_WINDOW);
+	if (!adaptive)
+		return;
+
+	unsigned cur = limit.load(std::memory_order_relaxed);
+	unsigned next = cur;
+	if (avg > noload + noload / 2 || (target && (int64_t)avg > target))
+		next = std::max(cur - cur / 4, min);
+	else if (avg < noload + noload / 4 && reached >= cur)
+		next = std::min(cur + cur / 8 + 1, max);
+	if (next == cur)
+		return;
+
+	limit.store(next, std::memory_order_relaxed);
+	threshold.store(next * 3 / 4, std::memory_order_relaxed);
+	apply(se, next, next * 3 / 4);
+}
+
+/*
+ * The control directory is named after the device number of the
+ * connection, a lookup in mountinfo finds it without touching the
+ * mount itself, which may be ours and busy.
+ */
+static int congestion_conn_id(const std::string& mountpoint, unsigned* id) {
+	std::ifstream mountinfo("/proc/self/mountinfo");
+	std::string line;
+	int found = 0;
+
+	while (std::getline(mountinfo, line)) {
+		std::istringstream fields(line);
+		std::string mid, parent, dev, root, mnt, field;
+		fields >> mid >> parent >> dev >> root >> mnt;
+
+		/* Spaces and such come as octal escapes */
+		std::string path;
+		for (size_t i = 0; i < mnt.size(); i++) {
+			if (mnt[i] == '\\' && i + 3 < mnt.size()) {
+				path += (char)strtol(mnt.substr(i + 1, 3).c_str(), nullptr, 8);
+				i += 3;
+			} else {
+				path += mnt[i];
+			}
+		}
+		if (path != mountpoint)
+			continue;
+
+		while (fields >> field && field != "-")
+			;
+		fields >> field;
+		unsigned major, minor;
+		if (field.compare(0, 4, "fuse") == 0 &&
+			sscanf(dev.c_str(), "%u:%u", &major, &minor) == 2) {
+			/* The kernel's own encoding, the last mount on top wins */
+			*id = (major << 20) | minor;
+			found = 1;
+		}
+	}
+	return found;
+}
+
+void copper_fuse_congestion::apply(copper_fuse_session* se, unsigned bg, unsigned cong) {
+	se->conn.max_background = bg;
+	se->conn.congestion_threshold = cong;
+
+	if (ctl_bg == -2) {
+		unsigned id = 0;
+		ctl_bg = ctl_cong = -1;
+		if (!se->mountpoint.empty() && congestion_conn_id(se->mountpoint, &id)) {
+			std::string dir = "/sys/fs/fuse/connections/" + std::to_string(id);
+			ctl_bg = open((dir + "/max_background").c_str(), O_WRONLY | O_CLOEXEC);
+			ctl_cong = open((dir + "/congestion_threshold").c_str(), O_WRONLY | O_CLOEXEC);
+		}
+		if (ctl_bg == -1 || ctl_cong == -1)
+			warn << "fuse control filesystem not available, max_background stays as negotiated";
+	}
+	if (ctl_bg < 0 || ctl_cong < 0)
+		return;
+
+	std::string b = std::to_string(bg), c = std::to_string(cong);
+	if (pwrite(ctl_bg, b.data(), b.size(), 0) == -1 ||
+		pwrite(ctl_cong, c.data(), c.size(), 0) == -1)
+		warn << "setting max_background to " << bg << ": " << strerror(errno);
+}
@@ -0,0 +1,196 @@
+/*
+  CopperFuse: C++ version Filesystem in Userspace
+  Copyright (C) 2023 Chen Miao <chenmiao.ku@gmail.com>
+
+  This program can be distributed under the terms of the GNU LGPLv2.
+  See the file COPYING.LIB.
+*/
+
+#include "copper_fuse_dir.h"
+
+#include <cerrno>
+#include <climits>
+#include <cstring>
+#include <new>
+
+/** ---------------------------------------------------
+ * FOR COPPER FUSE DIR SNAPSHOT
+ * ---------------------------------------------------*/
+
+bool copper_fuse_dir_sig::valid() const {
+	return mtime.tv_sec || mtime.tv_nsec || ctime.tv_sec || ctime.tv_nsec;
+}
+
+bool copper_fuse_dir_sig::operator== (const copper_fuse_dir_sig& other) const {
+	return mtime.tv_sec == other.mtime.tv_sec && mtime.tv_nsec == other.mtime.tv_nsec &&
+		ctime.tv_sec == other.ctime.tv_sec && ctime.tv_nsec == other.ctime.tv_nsec &&
+		size == other.size;
+}
+
+int copper_fuse_dir_snapshot::add(const char* name, uint64_t ino, mode_t type) {
+	size_t len = strlen(name);
+
+	if (len > UINT16_MAX)
+		return -ENAMETOOLONG;
+	if (names.size() + len > UINT32_MAX)
+		return -ENOMEM;
+	try {
+		entries.push_back({ ino, (uint32_t)names.size(), (uint16_t)len,
+			(uint16_t)((type & S_IFMT) >> 12) });
+		names.append(name, len);
+	} catch (const std::bad_alloc&) {
+		return -ENOMEM;
+	}
+	return 0;
+}
+
+size_t copper_fuse_dir_snapshot::fill(char* buf, size_t size, off_t off) const {
+	size_t used = 0;
+
+	for (size_t i = off < 0 ? 0 : off; i < entries.size(); i++) {
+		const entry& e = entries[i];
+		size_t res = copper_fuse_add_direntry(buf + used, size - used, names.data() + e.name,
+			e.len, e.ino, (mode_t)e.type << 12, i + 1);
+		if (res > size - used)
+			break;
+		used += res;
+	}
+	return used;
+}
+
+void copper_fuse_dir_snapshot::save(copper_fuse_snapshot_writer* w) const {
+	w->put(sig);
+	w->put<uint64_t>(entries.size());
+	for (const entry& e : entries)
+		w->put(e);
+	w->put_str(names);
+}
+
+bool copper_fuse_dir_snapshot::restore(copper_fuse_snapshot_reader* r) {
+	uint64_t count;
+
+	if (!r->get(&sig) || !r->get(&count) || count > (uint64_t)(r->end - r->p) / sizeof(entry))
+		return false;
+	entries.resize(count);
+	for (entry& e : entries)
+		r->get(&e);
+	if (!r->get_str(&names))
+		return false;
+	for (const entry& e : entries)
+		if ((size_t)e.name + e.len > names.size())
+			return false;
+	return true;
+}
+
+/** ---------------------------------------------------
+ * FOR COPPER FUSE DIR TABLE
+ * ---------------------------------------------------*/
+
+uint64_t copper_fuse_dir_table::add(std::unique_ptr<copper_fuse_dir_handle> dh) {
+	std::lock_guard<std::mutex> guard(lock);
+
+	uint64_t fh = next_fh++;
+	handles.emplace(fh, std::move(dh));
+	return fh;
+}
+
+copper_fuse_dir_handle* copper_fuse_dir_table::get(uint64_t fh) {
+	std::lock_guard<std::mutex> guard(lock);
+
+	auto it = handles.find(fh);
+	return it == handles.end() ? nullptr : it->second.get();
+}
+
+std::unique_ptr<copper_fuse_dir_handle> copper_fuse_dir_table::remove(uint64_t fh) {
+	std::lock_guard<std::mutex> guard(lock);
+
+	auto it = handles.find(fh);
+	if (it == handles.end())
+		return nullptr;
+	std::unique_ptr<copper_fuse_dir_handle> dh = std::move(it->second);
+	handles.erase(it);
+	/* The listing goes with its last handle, and its slot with it */
+	dh->snap.reset();
+	auto sit = shared.find(dh->nodeid);
+	if (sit != shared.end() && sit->second.expired())
+		shared.erase(sit);
+	return dh;
+}
+
+std::shared_ptr<const copper_fuse_dir_snapshot> copper_fuse_dir_table::find(fuse_ino_t nodeid,
+	const copper_fuse_dir_sig& sig) {
+	std::lock_guard<std::mutex> guard(lock);
+
+	auto it = shared.find(nodeid);
+	if (it == shared.end())
+		return nullptr;
+	std::shared_ptr<const copper_fuse_dir_snapshot> snap = it->second.lock();
+	if (!snap) {
+		shared.erase(it);
+		return nullptr;
+	}
+	return snap->sig == sig ? snap : nullptr;
+}
+
+void copper_fuse_dir_table::publish(fuse_ino_t nodeid,
+	const std::shared_ptr<const copper_fuse_dir_snapshot>& snap) {
+	if (!snap->sig.valid())
+		return;
+
+	std::lock_guard<std::mutex> guard(lock);
+	shared[nodeid] = snap;
+}
+
+void copper_fuse_dir_table::changed(fuse_ino_t nodeid) {
+	std::lock_guard<std::mutex> guard(lock);
+
+	shared.erase(nodeid);
+}
+
+void copper_fuse_dir_table::save(copper_fuse_snapshot_writer* w) {
+	std::lock_guard<std::mutex> guard(lock);
+
+	w->put<uint64_t>(next_fh);
+	w->put<uint64_t>(handles.size());
+	for (auto& it : handles) {
+		copper_fuse_dir_handle* dh = it.second.get();
+		std::lock_guard<std::mutex> dguard(dh->lock);
+		w->put<uint64_t>(it.first);
+		w->put<uint64_t>(dh->nodeid);
+		w->put(dh->fi);
+		w->put(dh->sig);
+		w->put<uint8_t>(dh->snap ? 1 : 0);
+		if (dh->snap)
+			dh->snap->save(w);
+	}
+}
+
+int copper_fuse_dir_table::restore(copper_fuse_snapshot_reader* r) {
+	uint64_t count = 0;
+
+	std::lock_guard<std::mutex> guard(lock);
+	handles.clear();
+	shared.clear();
+	r->get(&next_fh);
+	r->get(&count);
+	for (uint64_t i = 0; i < count && !r->failed; i++) {
+		std::unique_ptr<copper_fuse_dir_handle> dh(new copper_fuse_dir_handle);
+		uint64_t fh = 0;
+		uint8_t has_snap = 0;
+
+		r->get(&fh);
+		r->get(&dh->nodeid);
+		r->get(&dh->fi);
+		r->get(&dh->sig);
+		r->get(&has_snap);
+		if (has_snap) {
+			std::shared_ptr<copper_fuse_dir_snapshot> snap(new copper_fuse_dir_snapshot);
+			if (!snap->restore(r))
+				return -EPROTO;
+			dh->snap = std::move(snap);
+		}
+		if (!r->failed)
+			handles[fh] = std::move(dh);
+	}
+	return r->failed ? -EPROTO : 0;
+}
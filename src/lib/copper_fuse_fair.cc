@@ -0,0 +1,396 @@
+/*
+  CopperFuse: C++ version Filesystem in Userspace
+  Copyright (C) 2023 Chen Miao <chenmiao.ku@gmail.com>
+
+  This program can be distributed under the terms of the GNU LGPLv2.
+  See the file COPYING.LIB.
+*/
+
+#include "copper_fuse_fair.h"
+#include "copper_fuse_kernel.h"
+#include "copper_fuse_lowlevel.h"
+
+#include <algorithm>
+#include <chrono>
+#include <climits>
+#include <cstring>
+#include <new>
+#include <vector>
+
+static int64_t fair_now() {
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/** ---------------------------------------------------
+ * FOR COPPER FUSE TOKEN BUCKET
+ * ---------------------------------------------------*/
+
+void copper_fuse_token_bucket::setup(double _rate, double burst, int64_t now) {
+	rate     = std::max(_rate, 0.0);
+	capacity = std::max(rate * burst, 1.0);
+	tokens   = capacity;
+	stamp    = now;
+}
+
+int64_t copper_fuse_token_bucket::check(double cost, int64_t now) {
+	if (!rate)
+		return 0;
+
+	tokens = std::min(capacity, tokens + (now - stamp) * rate / 1e9);
+	stamp  = now;
+	double need = std::min(cost, capacity);
+	if (tokens >= need)
+		return 0;
+	return (int64_t)((need - tokens) / rate * 1e9) + 1;
+}
+
+void copper_fuse_token_bucket::take(double cost) {
+	if (rate)
+		tokens -= cost;
+}
+
+/** ---------------------------------------------------
+ * FOR COPPER FUSE TENANT
+ * ---------------------------------------------------*/
+
+copper_fuse_tenant::copper_fuse_tenant(uint64_t _key, const copper_fuse_tenant_limits& _limits,
+	int64_t now)
+	: key(_key), custom(false), waiting(0), deficit(0), active(false), turn(false), quantum(0),
+	  dispatched(0), delayed(0) {
+	set_limits(_limits, now);
+}
+
+int64_t copper_fuse_tenant::take(size_t size, int64_t now) {
+	std::lock_guard<std::mutex> guard(lock);
+
+	int64_t wait = std::max(ops.check(1, now), bytes.check(size, now));
+	if (wait)
+		return wait;
+	ops.take(1);
+	bytes.take(size);
+	dispatched.fetch_add(1, std::memory_order_relaxed);
+	return 0;
+}
+
+void copper_fuse_tenant::set_limits(const copper_fuse_tenant_limits& _limits, int64_t now) {
+	std::lock_guard<std::mutex> guard(lock);
+
+	limits = _limits;
+	ops.setup(limits.ops_per_sec, limits.burst, now);
+	bytes.setup(limits.bytes_per_sec, limits.burst, now);
+	quantum.store(std::max(limits.weight, 1u) * COPPER_FUSE_FAIR_QUANTUM, std::memory_order_relaxed);
+}
+
+/** ---------------------------------------------------
+ * FOR COPPER FUSE FAIR
+ * ---------------------------------------------------*/
+
+copper_fuse_fair::copper_fuse_fair()
+	: enabled(false), slots(UINT_MAX), inflight(0), queued(0), kick(false), wake_at(0),
+	  stopping(false) {}
+
+copper_fuse_fair::~copper_fuse_fair() {
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		stopping = true;
+	}
+	cond.notify_all();
+	if (pump.joinable())
+		pump.join();
+
+	/* The loop is gone, nobody will answer these */
+	for (copper_fuse_tenant* t : active)
+		for (copper_fuse_fair_item& item : t->queue)
+			item.req->reply_none();
+}
+
+void copper_fuse_fair::setup(unsigned _slots) {
+	slots = _slots ? _slots : UINT_MAX;
+	enabled.store(true, std::memory_order_relaxed);
+}
+
+void copper_fuse_fair::set_default(const copper_fuse_tenant_limits& limits) {
+	int64_t now = fair_now();
+
+	{
+		std::lock_guard<std::mutex> guard(defaults_lock);
+		defaults = limits;
+	}
+	for (shard& s : shards) {
+		std::lock_guard<std::mutex> guard(s.lock);
+		for (auto& it : s.tenants)
+			if (!it.second->custom.load(std::memory_order_relaxed))
+				it.second->set_limits(limits, now);
+	}
+}
+
+void copper_fuse_fair::set_limits(uint64_t key, const copper_fuse_tenant_limits& limits) {
+	int64_t now = fair_now();
+	copper_fuse_tenant* t = tenant_of(key, now);
+
+	if (!t)
+		return;
+	t->custom.store(true, std::memory_order_relaxed);
+	t->set_limits(limits, now);
+}
+
+bool copper_fuse_fair::stats(uint64_t key, uint64_t* dispatched, uint64_t* delayed) {
+	shard& s = shards[(key * 0x9e3779b97f4a7c15ULL) >> 58];
+	std::lock_guard<std::mutex> guard(s.lock);
+
+	auto it = s.tenants.find(key);
+	if (it == s.tenants.end())
+		return false;
+	*dispatched = it->second->dispatched.load(std::memory_order_relaxed);
+	*delayed    = it->second->delayed.load(std::memory_order_relaxed);
+	return true;
+}
+
+copper_fuse_tenant* copper_fuse_fair::tenant_of(uint64_t key, int64_t now) {
+	shard& s = shards[(key * 0x9e3779b97f4a7c15ULL) >> 58];
+	std::lock_guard<std::mutex> guard(s.lock);
+
+	auto it = s.tenants.find(key);
+	if (it != s.tenants.end())
+		return it->second.get();
+
+	copper_fuse_tenant_limits limits;
+	{
+		std::lock_guard<std::mutex> dguard(defaults_lock);
+		limits = defaults;
+	}
+	/* Tenants stay until the session goes, their requests point to them */
+	std::unique_ptr<copper_fuse_tenant> t(new (std::nothrow) copper_fuse_tenant(key, limits, now));
+	copper_fuse_tenant* res = t.get();
+	if (res)
+		s.tenants.emplace(key, std::move(t));
+	return res;
+}
+
+bool copper_fuse_fair::try_slot() {
+	unsigned n = inflight.load(std::memory_order_relaxed);
+
+	do {
+		if (n >= slots)
+			return false;
+	} while (!inflight.compare_exchange_weak(n, n + 1, std::memory_order_acquire,
+		std::memory_order_relaxed));
+	return true;
+}
+
+void copper_fuse_fair::release_slot() {
+	inflight.fetch_sub(1, std::memory_order_release);
+}
+
+bool copper_fuse_fair::submit(copper_fuse_session* se, copper_fuse_req* req, const char* buf,
+	size_t len) {
+	const struct fuse_in_header* in = (const struct fuse_in_header*)buf;
+	const char* inarg = buf + sizeof(*in);
+
+	switch (in->opcode) {
+	/* Free resources or steer other requests, holding them back helps nobody */
+	case FUSE_INIT:
+	case FUSE_DESTROY:
+	case FUSE_FORGET:
+	case FUSE_BATCH_FORGET:
+	case FUSE_INTERRUPT:
+	case FUSE_RELEASE:
+	case FUSE_RELEASEDIR:
+	case FUSE_NOTIFY_REPLY:
+		return false;
+	}
+
+	int64_t now = fair_now();
+	copper_fuse_tenant* t = tenant_of(classify ? classify(in, inarg) : in->uid, now);
+	if (!t)
+		return false;
+
+	size_t bytes = 0;
+	if (in->opcode == FUSE_READ)
+		bytes = ((const struct fuse_read_in*)inarg)->size;
+	else if (in->opcode == FUSE_WRITE)
+		bytes = ((const struct fuse_write_in*)inarg)->size;
+
+	/* Nothing of this tenant waits, a slot and tokens: no need to queue */
+	if (!t->waiting.load(std::memory_order_acquire) && try_slot()) {
+		if (!t->take(bytes, now)) {
+			req->tenant = t;
+			return false;
+		}
+		release_slot();
+	}
+
+	copper_fuse_fair_item item;
+	item.req   = req;
+	item.bytes = bytes;
+	item.buf.reset(new (std::nothrow) char[len]);
+	if (!item.buf) {
+		/* Can't hold on to it, let it through unaccounted */
+		return false;
+	}
+	memcpy(item.buf.get(), buf, len);
+	t->delayed.fetch_add(1, std::memory_order_relaxed);
+
+	std::lock_guard<std::mutex> guard(lock);
+	enqueue(t, std::move(item));
+	if (!pump.joinable() && !stopping)
+		start_pump(se);
+	return true;
+}
+
+void copper_fuse_fair::enqueue(copper_fuse_tenant* t, copper_fuse_fair_item&& item) {
+	t->queue.push_back(std::move(item));
+	t->waiting.fetch_add(1, std::memory_order_release);
+	queued.fetch_add(1, std::memory_order_relaxed);
+	if (!t->active) {
+		t->active  = true;
+		t->deficit = 0;
+		active.push_back(t);
+	}
+}
+
+void copper_fuse_fair::complete(copper_fuse_req* req) {
+	req->tenant = nullptr;
+	release_slot();
+	if (!backlog())
+		return;
+
+	/* The reply may come from a thread of the filesystem, wake the pump */
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		kick = true;
+	}
+	cond.notify_one();
+}
+
+bool copper_fuse_fair::pick(copper_fuse_fair_item* item, int64_t now) {
+	if (active.empty() || !try_slot())
+		return false;
+
+	int64_t earliest = 0;
+	for (size_t skipped = 0; skipped < active.size();) {
+		copper_fuse_tenant* t = active.front();
+		copper_fuse_fair_item& head = t->queue.front();
+		size_t cost = COPPER_FUSE_FAIR_OP_COST + head.bytes;
+
+		/* Credit left from an earlier turn is kept, but never grows past need */
+		if (!t->turn) {
+			t->turn = true;
+			if (t->deficit < cost)
+				t->deficit += t->quantum.load(std::memory_order_relaxed);
+		}
+		/* Out of credit, the turn passes to the next tenant */
+		if (t->deficit < cost) {
+			t->turn = false;
+			active.pop_front();
+			active.push_back(t);
+			skipped = 0;
+			continue;
+		}
+		int64_t wait = t->take(head.bytes, now);
+		if (wait) {
+			earliest = earliest ? std::min(earliest, now + wait) : now + wait;
+			t->turn = false;
+			active.pop_front();
+			active.push_back(t);
+			skipped++;
+			continue;
+		}
+
+		t->deficit -= cost;
+		*item = std::move(head);
+		item->req->tenant = t;
+		t->queue.pop_front();
+		t->waiting.fetch_sub(1, std::memory_order_release);
+		queued.fetch_sub(1, std::memory_order_relaxed);
+		if (t->queue.empty()) {
+			t->active  = false;
+			t->turn    = false;
+			t->deficit = 0;
+			active.pop_front();
+		}
+		return true;
+	}
+
+	release_slot();
+	/* Everybody waits for tokens, the pump comes back when the first has some */
+	if (earliest && (!wake_at || earliest < wake_at)) {
+		wake_at = earliest;
+		cond.notify_one();
+	}
+	return false;
+}
+
+void copper_fuse_fair::run(copper_fuse_session* se) {
+	for (;;) {
+		copper_fuse_fair_item item;
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			if (!pick(&item, fair_now()))
+				return;
+		}
+		const struct fuse_in_header* in = (const struct fuse_in_header*)item.buf.get();
+		se->dispatch(item.req, in, item.buf.get() + sizeof(*in));
+	}
+}
+
+void copper_fuse_fair::flush(copper_fuse_session* se) {
+	std::vector<copper_fuse_fair_item> items;
+
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		stopping = true;
+	}
+	cond.notify_all();
+	if (pump.joinable())
+		pump.join();
+
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		for (copper_fuse_tenant* t : active) {
+			for (copper_fuse_fair_item& item : t->queue) {
+				item.req->tenant = t;
+				items.push_back(std::move(item));
+			}
+			t->waiting.store(0, std::memory_order_relaxed);
+			t->queue.clear();
+			t->active  = false;
+			t->turn    = false;
+			t->deficit = 0;
+		}
+		active.clear();
+		queued.store(0, std::memory_order_relaxed);
+		stopping = false;
+		wake_at  = 0;
+	}
+
+	for (copper_fuse_fair_item& item : items) {
+		const struct fuse_in_header* in = (const struct fuse_in_header*)item.buf.get();
+		inflight.fetch_add(1, std::memory_order_relaxed);
+		se->dispatch(item.req, in, item.buf.get() + sizeof(*in));
+	}
+}
+
+void copper_fuse_fair::start_pump(copper_fuse_session* se) {
+	pump = std::thread([this, se] { pump_run(se); });
+}
+
+void copper_fuse_fair::pump_run(copper_fuse_session* se) {
+	std::unique_lock<std::mutex> guard(lock);
+
+	while (!stopping) {
+		if (!kick && wake_at)
+			cond.wait_until(guard, std::chrono::steady_clock::time_point(
+				std::chrono::nanoseconds(wake_at)));
+		else if (!kick)
+			cond.wait(guard);
+		if (stopping)
+			break;
+		kick    = false;
+		wake_at = 0;
+		guard.unlock();
+		run(se);
+		guard.lock();
+	}
+}
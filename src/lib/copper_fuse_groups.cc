@@ -0,0 +1,159 @@
+/*
+  CopperFuse: C++ version Filesystem in Userspace
+  Copyright (C) 2023 Chen Miao <chenmiao.ku@gmail.com>
+
+  This program can be distributed under the terms of the GNU LGPLv2.
+  See the file COPYING.LIB.
+*/
+
+#include "copper_fuse_groups.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+
+static int64_t groups_now() {
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+int copper_fuse_read_groups(pid_t pid, std::vector<gid_t>* groups) {
+	char path[64];
+	char buf[8192];
+	size_t len = 0;
+
+	snprintf(path, sizeof(path), "/proc/%d/task/%d/status", (int)pid, (int)pid);
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1)
+		return errno == ENOENT ? -ESRCH : -errno;
+	/* The groups come early, well within the buffer */
+	while (len < sizeof(buf) - 1) {
+		ssize_t res = read(fd, buf + len, sizeof(buf) - 1 - len);
+		if (res == -1 && errno == EINTR)
+			continue;
+		if (res == -1) {
+			int err = errno;
+			close(fd);
+			return -err;
+		}
+		if (res == 0)
+			break;
+		len += res;
+	}
+	close(fd);
+	buf[len] = '\0';
+
+	const char* line = strstr(buf, "\nGroups:");
+	if (!line)
+		return -EIO;
+	groups->clear();
+	for (const char* p = line + 8; *p && *p != '\n';) {
+		char* end;
+		unsigned long gid = strtoul(p, &end, 10);
+		if (end == p) {
+			p++;
+			continue;
+		}
+		groups->push_back((gid_t)gid);
+		p = end;
+	}
+	return 0;
+}
+
+int copper_fuse_read_start_time(pid_t pid, uint64_t* start_time) {
+	char path[64];
+	char buf[1024];
+	ssize_t len;
+
+	snprintf(path, sizeof(path), "/proc/%d/task/%d/stat", (int)pid, (int)pid);
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1)
+		return errno == ENOENT ? -ESRCH : -errno;
+	do {
+		len = read(fd, buf, sizeof(buf) - 1);
+	} while (len == -1 && errno == EINTR);
+	int err = errno;
+	close(fd);
+	if (len == -1)
+		return -err;
+	buf[len] = '\0';
+
+	/* The command in field 2 may hold anything, fields 3 on follow the last ')' */
+	const char* p = strrchr(buf, ')');
+	if (!p)
+		return -EIO;
+	for (int field = 2; field < 22; field++) {
+		p = strchr(p + 1, ' ');
+		if (!p)
+			return -EIO;
+	}
+	char* end;
+	*start_time = strtoull(p + 1, &end, 10);
+	return end == p + 1 ? -EIO : 0;
+}
+
+int copper_fuse_groups_cache::get(pid_t pid, uid_t uid, gid_t gid, int size, gid_t list[]) {
+	if (pid <= 0)
+		return -ESRCH;
+
+	/*
+	 * Before the groups, a thread taking the pid in between is seen as
+	 * another one the next time
+	 */
+	uint64_t start_time;
+	int err = copper_fuse_read_start_time(pid, &start_time);
+	if (err)
+		return err;
+
+	shard& s = shard_of(pid);
+	int64_t now = groups_now();
+	{
+		std::lock_guard<std::mutex> guard(s.lock);
+		auto it = s.procs.find(pid);
+		if (it != s.procs.end() && it->second.uid == uid && it->second.gid == gid &&
+		    it->second.start_time == start_time && it->second.expires > now) {
+			const std::vector<gid_t>& groups = it->second.groups;
+			std::copy_n(groups.begin(), std::min<size_t>(std::max(size, 0), groups.size()), list);
+			return groups.size();
+		}
+	}
+
+	/* Read without the lock, two callers racing both read the same */
+	copper_fuse_groups_entry e;
+	err = copper_fuse_read_groups(pid, &e.groups);
+	if (err)
+		return err;
+	e.uid        = uid;
+	e.gid        = gid;
+	e.start_time = start_time;
+	e.expires    = now + (int64_t)(ttl * 1e9);
+	std::copy_n(e.groups.begin(), std::min<size_t>(std::max(size, 0), e.groups.size()), list);
+	int count = e.groups.size();
+
+	std::lock_guard<std::mutex> guard(s.lock);
+	if (s.procs.size() >= COPPER_FUSE_GROUPS_PER_SHARD) {
+		for (auto it = s.procs.begin(); it != s.procs.end();)
+			it = it->second.expires <= now ? s.procs.erase(it) : std::next(it);
+		if (s.procs.size() >= COPPER_FUSE_GROUPS_PER_SHARD)
+			s.procs.clear();
+	}
+	s.procs[pid] = std::move(e);
+	return count;
+}
+
+void copper_fuse_groups_cache::invalidate(pid_t pid) {
+	if (pid) {
+		shard& s = shard_of(pid);
+		std::lock_guard<std::mutex> guard(s.lock);
+		s.procs.erase(pid);
+		return;
+	}
+	for (shard& s : shards) {
+		std::lock_guard<std::mutex> guard(s.lock);
+		s.procs.clear();
+	}
+}
@@ -0,0 +1,78 @@
+/*
+  CopperFuse: C++ version Filesystem in Userspace
+  Copyright (C) 2023 Chen Miao <chenmiao.ku@gmail.com>
+
+  This program can be distributed under the terms of the GNU LGPLv2.
+  See the file COPYING.LIB.
+*/
+
+#include "copper_fuse_handoff.h"
+#include "copper_fuse_mnt_util.h"
+
+#include <cerrno>
+#include <sys/socket.h>
+#include <unistd.h>
+
+static int handoff_write(int sock, const char* buf, size_t size) {
+	while (size) {
+		ssize_t res = send(sock, buf, size, MSG_NOSIGNAL);
+		if (res == -1) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		buf  += res;
+		size -= res;
+	}
+	return 0;
+}
+
+static int handoff_read(int sock, char* buf, size_t size) {
+	while (size) {
+		ssize_t res = read(sock, buf, size);
+		if (res == -1) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		if (res == 0)
+			return -ECONNRESET;
+		buf  += res;
+		size -= res;
+	}
+	return 0;
+}
+
+int copper_fuse_handoff_send(int sock, int fd, const std::string& snapshot) {
+	struct copper_fuse_handoff_hdr hdr = {
+		COPPER_FUSE_HANDOFF_MAGIC, COPPER_FUSE_HANDOFF_VERSION, snapshot.size()
+	};
+
+	int res = copper_fuse_mnt_send_fd(sock, &hdr, sizeof(hdr), fd);
+	if (res < 0)
+		return res;
+	return handoff_write(sock, snapshot.data(), snapshot.size());
+}
+
+int copper_fuse_handoff_recv(int sock, int* fd, std::string* snapshot) {
+	struct copper_fuse_handoff_hdr hdr;
+
+	/* The descriptor comes with the first byte, a stream may split the rest */
+	ssize_t n = copper_fuse_mnt_recv_fd(sock, &hdr, sizeof(hdr), fd);
+	if (n <= 0)
+		return n < 0 ? n : -ECONNRESET;
+
+	int res = handoff_read(sock, (char*)&hdr + n, sizeof(hdr) - n);
+	if (res == 0 && (*fd == -1 || hdr.magic != COPPER_FUSE_HANDOFF_MAGIC ||
+		hdr.version != COPPER_FUSE_HANDOFF_VERSION))
+		res = -EPROTO;
+	if (res == 0) {
+		snapshot->resize(hdr.size);
+		res = handoff_read(sock, &(*snapshot)[0], hdr.size);
+	}
+	if (res < 0 && *fd != -1) {
+		close(*fd);
+		*fd = -1;
+	}
+	return res;
+}
@@ -0,0 +1,103 @@
+/*
+  CopperFuse: C++ version Filesystem in Userspace
+  Copyright (C) 2023 Chen Miao <chenmiao.ku@gmail.com>
+
+  This program can be distributed under the terms of the GNU LGPLv2.
+  See the file COPYING.LIB.
+*/
+
+#include "copper_fuse_intr.h"
+#include "copper_fuse_lowlevel.h"
+
+copper_fuse_intr_registry::~copper_fuse_intr_registry() {
+	for (auto& s : shards)
+		for (auto& intr : s.pending)
+			delete intr.second;
+}
+
+copper_fuse_intr_registry::shard& copper_fuse_intr_registry::shard_of(uint64_t unique) {
+	return shards[(unique * 0x9e3779b97f4a7c15ULL) >> 58];
+}
+
+bool copper_fuse_intr_registry::put(copper_fuse_req* req) {
+	return --req->ctr == 0;
+}
+
+copper_fuse_req* copper_fuse_intr_registry::add(copper_fuse_req* req, bool* matched) {
+	shard& s = shard_of(req->unique);
+	std::lock_guard<std::mutex> guard(s.lock);
+
+	s.reqs.emplace(req->unique, req);
+	req->tracked = true;
+	req->ctr = 1;
+	if (s.pending.empty())
+		return nullptr;
+
+	copper_fuse_req* intr;
+	for (auto it = s.pending.begin(); it != s.pending.end(); ++it) {
+		if (it->first != req->unique)
+			continue;
+		intr = it->second;
+		s.pending.erase(it);
+		/* Nobody else sees `req` yet, no callback to run */
+		req->interrupted.store(true, std::memory_order_release);
+		*matched = true;
+		return intr;
+	}
+
+	/* Retry one INTERRUPT at a time, not to busy loop with the kernel */
+	intr = s.pending.back().second;
+	s.pending.pop_back();
+	*matched = false;
+	return intr;
+}
+
+void copper_fuse_intr_registry::remove(copper_fuse_req* req) {
+	shard& s = shard_of(req->unique);
+	bool last;
+
+	{
+		std::lock_guard<std::mutex> guard(s.lock);
+		s.reqs.erase(req->unique);
+		last = put(req);
+	}
+	if (last)
+		delete req;
+}
+
+bool copper_fuse_intr_registry::interrupt(uint64_t unique, copper_fuse_req* intr) {
+	shard& s = shard_of(unique);
+	copper_fuse_req* req;
+
+	{
+		std::lock_guard<std::mutex> guard(s.lock);
+		auto it = s.reqs.find(unique);
+		if (it == s.reqs.end()) {
+			s.pending.emplace_back(unique, intr);
+			return false;
+		}
+		req = it->second;
+		req->ctr++;
+	}
+
+	/* The callback may reply, the reference keeps `req` alive meanwhile */
+	req->interrupt();
+
+	bool last;
+	{
+		std::lock_guard<std::mutex> guard(s.lock);
+		last = put(req);
+	}
+	if (last)
+		delete req;
+	return true;
+}
+
+size_t copper_fuse_intr_registry::size() {
+	size_t n = 0;
+	for (auto& s : shards) {
+		std::lock_guard<std::mutex> guard(s.lock);
+		n += s.reqs.size();
+	}
+	return n;
+}
@@ -0,0 +1,534 @@
+/*
+  CopperFuse: C++ version Filesystem in Userspace
+  Copyright (C) 2023 Chen Miao <chenmiao.ku@gmail.com>
+
+  This program can be distributed under the terms of the GNU LGPLv2.
+  See the file COPYING.LIB.
+*/
+
+#include "copper_fuse_lock.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <sys/file.h>
+#include <vector>
+
+/** ---------------------------------------------------
+ * FOR COPPER FUSE LOCK INTERVAL TREE
+ * ---------------------------------------------------*/
+
+static off_t lock_max_end(const copper_fuse_lock_range* r) {
+	return r ? r->max_end : -1;
+}
+
+static void lock_update(copper_fuse_lock_range* r) {
+	r->max_end = std::max(r->end, std::max(lock_max_end(r->left), lock_max_end(r->right)));
+}
+
+/* Ranges of one owner are disjoint, (start, owner) is unique */
+static bool lock_less(const copper_fuse_lock_range* a, const copper_fuse_lock_range* b) {
+	return a->start < b->start || (a->start == b->start && a->owner < b->owner);
+}
+
+static copper_fuse_lock_range* lock_rotate_right(copper_fuse_lock_range* n) {
+	copper_fuse_lock_range* l = n->left;
+	n->left = l->right;
+	l->right = n;
+	lock_update(n);
+	lock_update(l);
+	return l;
+}
+
+static copper_fuse_lock_range* lock_rotate_left(copper_fuse_lock_range* n) {
+	copper_fuse_lock_range* r = n->right;
+	n->right = r->left;
+	r->left = n;
+	lock_update(n);
+	lock_update(r);
+	return r;
+}
+
+static copper_fuse_lock_range* lock_insert(copper_fuse_lock_range* root, copper_fuse_lock_range* node) {
+	if (!root) {
+		node->left = node->right = nullptr;
+		node->max_end = node->end;
+		return node;
+	}
+
+	if (lock_less(node, root)) {
+		root->left = lock_insert(root->left, node);
+		if (root->left->prio > root->prio)
+			return lock_rotate_right(root);
+	} else {
+		root->right = lock_insert(root->right, node);
+		if (root->right->prio > root->prio)
+			return lock_rotate_left(root);
+	}
+	lock_update(root);
+	return root;
+}
+
+static copper_fuse_lock_range* lock_erase(copper_fuse_lock_range* root, copper_fuse_lock_range* node) {
+	if (root == node) {
+		if (!root->left)
+			return root->right;
+		if (!root->right)
+			return root->left;
+		if (root->left->prio > root->right->prio) {
+			root = lock_rotate_right(root);
+			root->right = lock_erase(root->right, node);
+		} else {
+			root = lock_rotate_left(root);
+			root->left = lock_erase(root->left, node);
+		}
+	} else if (lock_less(node, root)) {
+		root->left = lock_erase(root->left, node);
+	} else {
+		root->right = lock_erase(root->right, node);
+	}
+	lock_update(root);
+	return root;
+}
+
+/* Call `fn` on the ranges overlapping [start, end] in order, until it returns true */
+template <typename F>
+static bool lock_overlap(copper_fuse_lock_range* root, off_t start, off_t end, F& fn) {
+	if (!root || root->max_end < start)
+		return false;
+	if (lock_overlap(root->left, start, end, fn))
+		return true;
+	if (root->start > end)
+		return false;
+	if (root->end >= start && fn(root))
+		return true;
+	return lock_overlap(root->right, start, end, fn);
+}
+
+static void lock_free(copper_fuse_lock_range* root) {
+	if (!root)
+		return;
+	lock_free(root->left);
+	lock_free(root->right);
+	delete root;
+}
+
+static void lock_save(const copper_fuse_lock_range* root, copper_fuse_snapshot_writer* w) {
+	if (!root)
+		return;
+	lock_save(root->left, w);
+	w->put<int64_t>(root->start);
+	w->put<int64_t>(root->end);
+	w->put<int32_t>(root->type);
+	w->put<uint64_t>(root->owner);
+	w->put<int32_t>(root->pid);
+	lock_save(root->right, w);
+}
+
+static size_t lock_count(const copper_fuse_lock_range* root) {
+	return root ? 1 + lock_count(root->left) + lock_count(root->right) : 0;
+}
+
+static copper_fuse_lock_range* lock_new(off_t start, off_t end, int type, uint64_t owner, pid_t pid) {
+	copper_fuse_lock_range* r = new copper_fuse_lock_range;
+	r->start = start;
+	r->end   = end;
+	r->type  = type;
+	r->owner = owner;
+	r->pid   = pid;
+	/* Any well mixed value keeps the treap balanced */
+	uint64_t h = ((uint64_t)start ^ owner ^ (uintptr_t)r) * 0x9e3779b97f4a7c15ULL;
+	r->prio = h >> 32;
+	return r;
+}
+
+/** ---------------------------------------------------
+ * FOR COPPER FUSE LOCK MANAGER
+ * ---------------------------------------------------*/
+
+static void flock_to_range(const struct flock* lk, off_t* start, off_t* end) {
+	*start = lk->l_start;
+	*end = lk->l_len == 0 ? COPPER_FUSE_OFFSET_MAX : lk->l_start + lk->l_len - 1;
+}
+
+static const copper_fuse_lock_range* posix_conflict(copper_fuse_inode_locks& il, uint64_t owner,
+	int type, off_t start, off_t end) {
+	const copper_fuse_lock_range* found = nullptr;
+	auto fn = [&](copper_fuse_lock_range* r) {
+		if (r->owner == owner || (type != F_WRLCK && r->type != F_WRLCK))
+			return false;
+		found = r;
+		return true;
+	};
+	lock_overlap(il.root, start, end, fn);
+	return found;
+}
+
+/* Replace what `owner` holds in [start, end] by `type`, F_UNLCK included */
+static void posix_apply(copper_fuse_inode_locks& il, uint64_t owner, pid_t pid, int type,
+	off_t start, off_t end) {
+	std::vector<copper_fuse_lock_range*> mine;
+	auto fn = [&](copper_fuse_lock_range* r) {
+		if (r->owner == owner)
+			mine.push_back(r);
+		return false;
+	};
+	/* One byte wider on both sides, to merge adjacent ranges of the same type */
+	lock_overlap(il.root, start > 0 ? start - 1 : start,
+		end < COPPER_FUSE_OFFSET_MAX ? end + 1 : end, fn);
+
+	for (copper_fuse_lock_range* r : mine) {
+		bool adjacent = r->end < start || r->start > end;
+		if (adjacent && r->type != type)
+			continue;
+
+		il.root = lock_erase(il.root, r);
+		if (r->type == type) {
+			start = std::min(start, r->start);
+			end = std::max(end, r->end);
+		} else {
+			if (r->start < start)
+				il.root = lock_insert(il.root, lock_new(r->start, start - 1, r->type, owner, r->pid));
+			if (r->end > end)
+				il.root = lock_insert(il.root, lock_new(end + 1, r->end, r->type, owner, r->pid));
+		}
+		delete r;
+	}
+
+	if (type != F_UNLCK)
+		il.root = lock_insert(il.root, lock_new(start, end, type, owner, pid));
+}
+
+static bool flock_conflict(const copper_fuse_inode_locks& il, uint64_t owner, int type) {
+	for (const auto& held : il.flocks)
+		if (held.first != owner && (type == F_WRLCK || held.second == F_WRLCK))
+			return true;
+	return false;
+}
+
+/* Grant what the last change made possible, in arrival order */
+static void wake_waiters(copper_fuse_inode_locks& il, std::vector<copper_fuse_req_t>* granted) {
+	for (auto it = il.waiters.begin(); it != il.waiters.end(); ) {
+		const copper_fuse_lock_waiter& w = *it;
+		if (w.is_flock) {
+			if (flock_conflict(il, w.owner, w.type)) {
+				++it;
+				continue;
+			}
+			il.flocks[w.owner] = w.type;
+		} else {
+			if (posix_conflict(il, w.owner, w.type, w.start, w.end)) {
+				++it;
+				continue;
+			}
+			posix_apply(il, w.owner, w.pid, w.type, w.start, w.end);
+		}
+		granted->push_back(w.req);
+		it = il.waiters.erase(it);
+	}
+}
+
+static void reply_granted(const std::vector<copper_fuse_req_t>& granted) {
+	for (copper_fuse_req_t req : granted)
+		req->reply_err(0);
+}
+
+copper_fuse_lock_manager::~copper_fuse_lock_manager() {
+	clear();
+}
+
+void copper_fuse_lock_manager::clear() {
+	for (auto& s : shards) {
+		std::lock_guard<std::mutex> guard(s.lock);
+		for (auto& inode : s.inodes) {
+			lock_free(inode.second.root);
+			for (auto& w : inode.second.waiters)
+				w.req->reply_none();
+		}
+		s.inodes.clear();
+	}
+}
+
+copper_fuse_lock_manager::shard& copper_fuse_lock_manager::shard_of(fuse_ino_t ino) {
+	return shards[(ino * 0x9e3779b97f4a7c15ULL) >> 58];
+}
+
+int copper_fuse_lock_manager::getlk(fuse_ino_t ino, uint64_t owner, struct flock* lk) {
+	shard& s = shard_of(ino);
+	std::lock_guard<std::mutex> guard(s.lock);
+	off_t start, end;
+
+	flock_to_range(lk, &start, &end);
+	auto it = s.inodes.find(ino);
+	const copper_fuse_lock_range* r = it == s.inodes.end() ? nullptr :
+		posix_conflict(it->second, owner, lk->l_type, start, end);
+	if (!r) {
+		lk->l_type = F_UNLCK;
+		return 0;
+	}
+
+	lk->l_type   = r->type;
+	lk->l_whence = SEEK_SET;
+	lk->l_start  = r->start;
+	lk->l_len    = r->end == COPPER_FUSE_OFFSET_MAX ? 0 : r->end - r->start + 1;
+	lk->l_pid    = r->pid;
+	return 0;
+}
+
+int copper_fuse_lock_manager::setlk(fuse_ino_t ino, uint64_t owner, const struct flock* lk,
+	copper_fuse_req_t waiter) {
+	shard& s = shard_of(ino);
+	std::vector<copper_fuse_req_t> granted;
+	off_t start, end;
+
+	flock_to_range(lk, &start, &end);
+	{
+		std::lock_guard<std::mutex> guard(s.lock);
+		copper_fuse_inode_locks& il = s.inodes[ino];
+
+		if (lk->l_type != F_UNLCK && posix_conflict(il, owner, lk->l_type, start, end)) {
+			/* Checked under the shard lock, cancel() finds it queued otherwise */
+			if (!waiter || waiter->is_interrupted()) {
+				if (!il.root && il.flocks.empty() && il.waiters.empty())
+					s.inodes.erase(ino);
+				return waiter ? -EINTR : -EAGAIN;
+			}
+			il.waiters.push_back({ waiter, owner, false, lk->l_type, start, end, lk->l_pid });
+			return 1;
+		}
+
+		posix_apply(il, owner, lk->l_pid, lk->l_type, start, end);
+		wake_waiters(il, &granted);
+		if (!il.root && il.flocks.empty() && il.waiters.empty())
+			s.inodes.erase(ino);
+	}
+	reply_granted(granted);
+	return 0;
+}
+
+int copper_fuse_lock_manager::flock(fuse_ino_t ino, uint64_t owner, int op, copper_fuse_req_t req) {
+	shard& s = shard_of(ino);
+	std::vector<copper_fuse_req_t> granted;
+	int type = (op & LOCK_EX) ? F_WRLCK : (op & LOCK_SH) ? F_RDLCK : F_UNLCK;
+	int res = 0;
+
+	{
+		std::lock_guard<std::mutex> guard(s.lock);
+		copper_fuse_inode_locks& il = s.inodes[ino];
+
+		if (type != F_UNLCK && flock_conflict(il, owner, type)) {
+			if ((op & LOCK_NB) || req->is_interrupted()) {
+				if (!il.root && il.flocks.empty() && il.waiters.empty())
+					s.inodes.erase(ino);
+				return (op & LOCK_NB) ? -EWOULDBLOCK : -EINTR;
+			}
+			/* A conversion drops the old lock before waiting, like flock(2) */
+			il.flocks.erase(owner);
+			il.waiters.push_back({ req, owner, true, type, 0, 0, 0 });
+			res = 1;
+		} else if (type == F_UNLCK) {
+			il.flocks.erase(owner);
+		} else {
+			il.flocks[owner] = type;
+		}
+
+		wake_waiters(il, &granted);
+		if (!il.root && il.flocks.empty() && il.waiters.empty())
+			s.inodes.erase(ino);
+	}
+	reply_granted(granted);
+	return res;
+}
+
+void copper_fuse_lock_manager::cancel(fuse_ino_t ino, copper_fuse_req_t req) {
+	shard& s = shard_of(ino);
+	bool found = false;
+
+	{
+		std::lock_guard<std::mutex> guard(s.lock);
+		auto it = s.inodes.find(ino);
+		if (it == s.inodes.end())
+			return;
+
+		copper_fuse_inode_locks& il = it->second;
+		for (auto w = il.waiters.begin(); w != il.waiters.end(); ++w) {
+			if (w->req == req) {
+				il.waiters.erase(w);
+				found = true;
+				break;
+			}
+		}
+		if (!il.root && il.flocks.empty() && il.waiters.empty())
+			s.inodes.erase(it);
+	}
+	/* Granted meanwhile otherwise, the grant wins */
+	if (found)
+		req->reply_err(EINTR);
+}
+
+void copper_fuse_lock_manager::release_posix(fuse_ino_t ino, uint64_t owner) {
+	shard& s = shard_of(ino);
+	std::vector<copper_fuse_req_t> granted;
+
+	{
+		std::lock_guard<std::mutex> guard(s.lock);
+		auto it = s.inodes.find(ino);
+		if (it == s.inodes.end())
+			return;
+
+		copper_fuse_inode_locks& il = it->second;
+		posix_apply(il, owner, 0, F_UNLCK, 0, COPPER_FUSE_OFFSET_MAX);
+		wake_waiters(il, &granted);
+		if (!il.root && il.flocks.empty() && il.waiters.empty())
+			s.inodes.erase(it);
+	}
+	reply_granted(granted);
+}
+
+void copper_fuse_lock_manager::release_flock(fuse_ino_t ino, uint64_t owner) {
+	shard& s = shard_of(ino);
+	std::vector<copper_fuse_req_t> granted;
+
+	{
+		std::lock_guard<std::mutex> guard(s.lock);
+		auto it = s.inodes.find(ino);
+		if (it == s.inodes.end())
+			return;
+
+		copper_fuse_inode_locks& il = it->second;
+		il.flocks.erase(owner);
+		wake_waiters(il, &granted);
+		if (!il.root && il.flocks.empty() && il.waiters.empty())
+			s.inodes.erase(it);
+	}
+	reply_granted(granted);
+}
+
+void copper_fuse_lock_manager::save(copper_fuse_snapshot_writer* w) {
+	size_t count = 0;
+	copper_fuse_snapshot_writer inodes;
+
+	for (auto& s : shards) {
+		std::lock_guard<std::mutex> guard(s.lock);
+		for (auto& inode : s.inodes) {
+			const copper_fuse_inode_locks& il = inode.second;
+
+			inodes.put<uint64_t>(inode.first);
+			inodes.put<uint64_t>(lock_count(il.root));
+			lock_save(il.root, &inodes);
+			inodes.put<uint64_t>(il.flocks.size());
+			for (auto& fl : il.flocks) {
+				inodes.put<uint64_t>(fl.first);
+				inodes.put<int32_t>(fl.second);
+			}
+			inodes.put<uint64_t>(il.waiters.size());
+			for (auto& wt : il.waiters) {
+				inodes.put<uint64_t>(wt.req->unique);
+				inodes.put<uint32_t>(wt.req->opcode);
+				inodes.put<uint32_t>(wt.req->ctx.uid);
+				inodes.put<uint32_t>(wt.req->ctx.gid);
+				inodes.put<uint32_t>(wt.req->ctx.pid);
+				inodes.put<uint64_t>(wt.owner);
+				inodes.put<uint8_t>(wt.is_flock);
+				inodes.put<int32_t>(wt.type);
+				inodes.put<int64_t>(wt.start);
+				inodes.put<int64_t>(wt.end);
+				inodes.put<int32_t>(wt.pid);
+			}
+			count++;
+		}
+	}
+	w->put<uint64_t>(count);
+	w->buf.append(inodes.buf);
+}
+
+int copper_fuse_lock_manager::restore(copper_fuse_snapshot_reader* r, struct copper_fuse_session* se) {
+	std::vector<std::pair<fuse_ino_t, copper_fuse_req_t>> parked;
+	uint64_t count = 0;
+
+	r->get(&count);
+	for (uint64_t i = 0; i < count && !r->failed; i++) {
+		copper_fuse_inode_locks il;
+		uint64_t ino = 0, n = 0;
+
+		il.root = nullptr;
+		r->get(&ino);
+		r->get(&n);
+		for (uint64_t j = 0; j < n && !r->failed; j++) {
+			int64_t start = 0, end = 0;
+			int32_t type = 0, pid = 0;
+			uint64_t owner = 0;
+
+			r->get(&start);
+			r->get(&end);
+			r->get(&type);
+			r->get(&owner);
+			r->get(&pid);
+			if (!r->failed)
+				il.root = lock_insert(il.root, lock_new(start, end, type, owner, pid));
+		}
+
+		r->get(&n);
+		for (uint64_t j = 0; j < n && !r->failed; j++) {
+			uint64_t owner = 0;
+			int32_t type = 0;
+
+			r->get(&owner);
+			r->get(&type);
+			if (!r->failed)
+				il.flocks[owner] = type;
+		}
+
+		r->get(&n);
+		for (uint64_t j = 0; j < n && !r->failed; j++) {
+			struct fuse_in_header in;
+			copper_fuse_lock_waiter wt;
+			uint8_t is_flock = 0;
+			int32_t type = 0, pid = 0;
+			int64_t start = 0, end = 0;
+
+			memset(&in, 0, sizeof(in));
+			in.nodeid = ino;
+			r->get(&in.unique);
+			r->get(&in.opcode);
+			r->get(&in.uid);
+			r->get(&in.gid);
+			r->get(&in.pid);
+			r->get(&wt.owner);
+			r->get(&is_flock);
+			r->get(&type);
+			r->get(&start);
+			r->get(&end);
+			r->get(&pid);
+			if (r->failed)
+				break;
+
+			wt.req      = new copper_fuse_req(se, &in);
+			wt.is_flock = is_flock;
+			wt.type     = type;
+			wt.start    = start;
+			wt.end      = end;
+			wt.pid      = pid;
+			il.waiters.push_back(wt);
+			parked.emplace_back(ino, wt.req);
+		}
+
+		shard& s = shard_of(ino);
+		std::lock_guard<std::mutex> guard(s.lock);
+		s.inodes[ino] = std::move(il);
+	}
+	if (r->failed)
+		return -EPROTO;
+
+	/* As in process_buf(), an INTERRUPT may have come meanwhile */
+	for (auto& p : parked) {
+		bool matched;
+		copper_fuse_req* intr = se->intrs.add(p.second, &matched);
+		if (intr && matched)
+			intr->reply_none();
+		else if (intr)
+			intr->reply_err(EAGAIN);
+		p.second->interrupt_func([this, ino = p.first](copper_fuse_req_t req) { cancel(ino, req); });
+	}
+	return 0;
+}
@@ -0,0 +1,110 @@
+/*
+  CopperFuse: C++ version Filesystem in Userspace
+  Copyright (C) 2023 Chen Miao <chenmiao.ku@gmail.com>
+
+  This program can be distributed under the terms of the GNU LGPLv2.
+  See the file COPYING.LIB.
+*/
+
+#include "copper_fuse_lookup.h"
+
+#include <cerrno>
+#include <chrono>
+
+static int64_t lookup_now() {
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/** ---------------------------------------------------
+ * FOR COPPER FUSE LOOKUP TABLE
+ * ---------------------------------------------------*/
+
+copper_fuse_lookup_table::copper_fuse_lookup_table() : coalesce(true), negative_timeout(0.0) {
+	for (shard& s : shards) {
+		s.seq     = 0;
+		s.version = 0;
+	}
+}
+
+copper_fuse_lookup_table::shard& copper_fuse_lookup_table::shard_of(const key& k) {
+	return shards[key_hash()(k) % COPPER_FUSE_LOOKUP_SHARDS];
+}
+
+void copper_fuse_lookup_table::remember_missing(shard& s, const key& k) {
+	const size_t max = COPPER_FUSE_NEGATIVE_MAX / COPPER_FUSE_LOOKUP_SHARDS;
+
+	negative_entry& e = s.negative[k];
+	e.expires = lookup_now() + (int64_t)(negative_timeout * 1e9);
+	e.seq     = ++s.seq;
+	s.order.emplace_back(k, e.seq);
+
+	while (s.negative.size() > max || s.order.size() > 2 * max) {
+		auto it = s.negative.find(s.order.front().first);
+		if (it != s.negative.end() && it->second.seq == s.order.front().second)
+			s.negative.erase(it);
+		s.order.pop_front();
+	}
+}
+
+int copper_fuse_lookup_table::lookup(fuse_ino_t parent, const char* name,
+	const getattr_fn& getattr, struct stat* attr) {
+	if (!coalesce && negative_timeout <= 0)
+		return getattr(attr);
+
+	key k = { parent, name };
+	shard& s = shard_of(k);
+	std::unique_lock<std::mutex> guard(s.lock);
+
+	auto neg = s.negative.find(k);
+	if (neg != s.negative.end()) {
+		if (lookup_now() < neg->second.expires)
+			return -ENOENT;
+		s.negative.erase(neg);
+	}
+
+	std::shared_ptr<flight> fl;
+	if (coalesce) {
+		auto it = s.flights.find(k);
+		if (it != s.flights.end()) {
+			fl = it->second;
+			s.landed.wait(guard, [&fl] { return fl->done; });
+			*attr = fl->attr;
+			return fl->res;
+		}
+		fl = std::make_shared<flight>();
+		fl->done = false;
+		s.flights.emplace(k, fl);
+	}
+	uint64_t version = s.version;
+	guard.unlock();
+
+	int res = getattr(attr);
+
+	guard.lock();
+	if (fl) {
+		fl->done = true;
+		fl->res  = res;
+		fl->attr = *attr;
+		auto it = s.flights.find(k);
+		if (it != s.flights.end() && it->second == fl)
+			s.flights.erase(it);
+	}
+	if (res == -ENOENT && negative_timeout > 0 && version == s.version)
+		remember_missing(s, k);
+	guard.unlock();
+	if (fl)
+		s.landed.notify_all();
+	return res;
+}
+
+void copper_fuse_lookup_table::forget(fuse_ino_t parent, const char* name) {
+	key k = { parent, name };
+	shard& s = shard_of(k);
+	std::lock_guard<std::mutex> guard(s.lock);
+
+	s.version++;
+	s.negative.erase(k);
+	/* Lookups from now on must not share a result from before */
+	s.flights.erase(k);
+}
@@ -1,7 +1,61 @@
+/*
+  FUSE: Filesystem in Userspace
+  Copyright (C) 2001-2007  Miklos Szeredi <miklos@szeredi.hu>
+
+  Implementation of (most of) the low-level FUSE API. The session loop
+  functions are implemented in separate files.
+
+  This program can be distributed under the terms of the GNU LGPLv2.
+  See the file COPYING.LIB
+
+  CopperFuse: C++ version Filesystem in Userspace
+  Copyright (C) 2023 Chen Miao <chenmiao.ku@gmail.com>
+*/
+
 #include "copper_fuse_lowlevel.h"
+#include "copper_fuse_handoff.h"
+#include "copper_fuse_i.h"
+#include "copper_fuse_mnt_util.h"
+#include "copper_fuse_mount.h"
+#include "copper_fuse_timer.h"
 #include "copper_log.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <climits>
+#include <condition_variable>
+#include <csignal>
+#include <cstddef>
+#include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <fcntl.h>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <pthread.h>
+#include <semaphore.h>
+#include <sys/file.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+/* Room for the request header and the fixed part of the biggest request */
+#define FUSE_BUFFER_HEADER_SIZE 0x1000
+
+/* End of a lock reaching to the end of file */
+#define OFFSET_MAX 0x7fffffffffffffffLL
+
+/* Pages of payload a request may carry by default, i.e. 128 KiB */
+#define FUSE_DEFAULT_MAX_PAGES 32
+
+/* Limit of kernels without fs.fuse.max_pages_limit, i.e. 1 MiB */
+#define FUSE_MAX_MAX_PAGES 256
+
+#define FUSE_DEFAULT_MAX_THREADS 10
 
 /** ---------------------------------------------------
  * FOR COPPER FUSE CMDLINE OPT
@@ -34,4 +88,1919 @@ int add_opt_common(char** opts, const char* opt, int esc) {
 
 int copper_fuse_cmdline_opts::add_opt(const char *opt) {
 	return add_opt_common(&mountpoint, opt, 0);
-}
\ No newline at end of file
+}
+
+/** ---------------------------------------------------
+ * FOR COPPER FUSE REPLY
+ * ---------------------------------------------------*/
+
+static void convert_stat(const struct stat* stbuf, struct fuse_attr* attr) {
+	attr->ino       = stbuf->st_ino;
+	attr->mode      = stbuf->st_mode;
+	attr->nlink     = stbuf->st_nlink;
+	attr->uid       = stbuf->st_uid;
+	attr->gid       = stbuf->st_gid;
+	attr->rdev      = stbuf->st_rdev;
+	attr->size      = stbuf->st_size;
+	attr->blksize   = stbuf->st_blksize;
+	attr->blocks    = stbuf->st_blocks;
+	attr->atime     = stbuf->st_atim.tv_sec;
+	attr->mtime     = stbuf->st_mtim.tv_sec;
+	attr->ctime     = stbuf->st_ctim.tv_sec;
+	attr->atimensec = stbuf->st_atim.tv_nsec;
+	attr->mtimensec = stbuf->st_mtim.tv_nsec;
+	attr->ctimensec = stbuf->st_ctim.tv_nsec;
+}
+
+static void convert_statfs(const struct statvfs* stbuf, struct fuse_kstatfs* kstatfs) {
+	kstatfs->bsize   = stbuf->f_bsize;
+	kstatfs->frsize  = stbuf->f_frsize;
+	kstatfs->blocks  = stbuf->f_blocks;
+	kstatfs->bfree   = stbuf->f_bfree;
+	kstatfs->bavail  = stbuf->f_bavail;
+	kstatfs->files   = stbuf->f_files;
+	kstatfs->ffree   = stbuf->f_ffree;
+	kstatfs->namelen = stbuf->f_namemax;
+}
+
+static unsigned long calc_timeout_sec(double t) {
+	if (t > (double)ULONG_MAX)
+		return ULONG_MAX;
+	else if (t < 0.0)
+		return 0;
+	else
+		return (unsigned long)t;
+}
+
+static unsigned int calc_timeout_nsec(double t) {
+	double f = t - (double)calc_timeout_sec(t);
+	if (f < 0.0)
+		return 0;
+	else if (f >= 0.999999999)
+		return 999999999;
+	else
+		return (unsigned int)(f * 1.0e9);
+}
+
+static void fill_entry(struct fuse_entry_out* arg, const struct copper_fuse_entry_param* e) {
+	arg->nodeid           = e->ino;
+	arg->generation       = e->generation;
+	arg->entry_valid      = calc_timeout_sec(e->entry_timeout);
+	arg->entry_valid_nsec = calc_timeout_nsec(e->entry_timeout);
+	arg->attr_valid       = calc_timeout_sec(e->attr_timeout);
+	arg->attr_valid_nsec  = calc_timeout_nsec(e->attr_timeout);
+	convert_stat(&e->attr, &arg->attr);
+}
+
+static void fill_open(struct fuse_open_out* arg, const struct fuse_file_info* f) {
+	arg->fh = f->fh;
+	if (f->direct_io)
+		arg->open_flags |= FOPEN_DIRECT_IO;
+	if (f->keep_cache)
+		arg->open_flags |= FOPEN_KEEP_CACHE;
+	if (f->parallel_direct_writes)
+		arg->open_flags |= FOPEN_PARALLEL_DIRECT_WRITES;
+	if (f->nonseekable)
+		arg->open_flags |= FOPEN_NONSEEKABLE;
+	if (f->cache_readdir)
+		arg->open_flags |= FOPEN_CACHE_DIR;
+	if (f->noflush)
+		arg->open_flags |= FOPEN_NOFLUSH;
+}
+
+copper_fuse_req::copper_fuse_req(struct copper_fuse_session* _se, const struct fuse_in_header* in)
+	: se(_se), unique(in->unique), opcode(in->opcode), tracked(false), ctr(1), interrupted(false),
+	  start_ns(0), inflight_bytes(0), tenant(nullptr) {
+	ctx.uid   = in->uid;
+	ctx.gid   = in->gid;
+	ctx.pid   = in->pid;
+	ctx.umask = 0;
+}
+
+void copper_fuse_req::destroy() {
+	if (start_ns)
+		se->cong.complete(this);
+	if (tenant)
+		se->fair.complete(this);
+	/* A running interrupt callback still holds a reference */
+	if (tracked)
+		se->intrs.remove(this);
+	else
+		delete this;
+}
+
+void copper_fuse_req::interrupt_func(operators_wrapper_type<void, copper_fuse_req*> func) {
+	std::lock_guard<std::mutex> guard(lock);
+
+	intr_func = std::move(func);
+	if (intr_func && interrupted.load(std::memory_order_acquire))
+		intr_func(this);
+}
+
+bool copper_fuse_req::is_interrupted() const {
+	return interrupted.load(std::memory_order_acquire);
+}
+
+std::shared_ptr<struct copper_fuse_cancel_token> copper_fuse_req::cancel_token() {
+	std::lock_guard<std::mutex> guard(lock);
+
+	if (!token) {
+		token = std::make_shared<struct copper_fuse_cancel_token>();
+		if (interrupted.load(std::memory_order_acquire))
+			token->cancelled.store(true, std::memory_order_release);
+	}
+	return token;
+}
+
+void copper_fuse_req::interrupt() {
+	std::lock_guard<std::mutex> guard(lock);
+
+	interrupted.store(true, std::memory_order_release);
+	if (token)
+		token->cancelled.store(true, std::memory_order_release);
+	if (intr_func)
+		intr_func(this);
+}
+
+void* copper_fuse_req::userdata() const {
+	return se->userdata;
+}
+
+const struct copper_fuse_ctx* copper_fuse_req::get_ctx() const {
+	return &ctx;
+}
+
+int copper_fuse_req::getgroups(int size, gid_t list[]) const {
+	return se->groups.get(ctx.pid, ctx.uid, ctx.gid, size, list);
+}
+
+int copper_fuse_req::send_reply(int error, copper_fuse_reply_builder* rb) {
+	int count;
+
+	if (error <= -1000 || error > 0) {
+		erron << "bad error value: " << error;
+		error = -ERANGE;
+	}
+
+	struct iovec* iov = rb->finish(unique, error, &count);
+	int res = se->send_msg(iov, count);
+	destroy();
+	return res;
+}
+
+int copper_fuse_req::send_reply_ok(const void* arg, size_t argsize) {
+	copper_fuse_reply_builder rb;
+
+	rb.add(arg, argsize);
+	return send_reply(0, &rb);
+}
+
+int copper_fuse_req::reply_err(int err) {
+	copper_fuse_reply_builder rb;
+	return send_reply(-err, &rb);
+}
+
+void copper_fuse_req::reply_none() {
+	destroy();
+}
+
+int copper_fuse_req::reply_entry(const struct copper_fuse_entry_param* e) {
+	struct fuse_entry_out arg;
+	size_t size = se->conn.proto_minor < 9 ?
+		FUSE_COMPAT_ENTRY_OUT_SIZE : sizeof(arg);
+
+	/* before ABI 7.4 e->ino == 0 was invalid, only ENOENT meant
+	   negative entry */
+	if (!e->ino && se->conn.proto_minor < 4)
+		return reply_err(ENOENT);
+
+	memset(&arg, 0, sizeof(arg));
+	fill_entry(&arg, e);
+	return send_reply_ok(&arg, size);
+}
+
+int copper_fuse_req::reply_create(const struct copper_fuse_entry_param* e, const struct fuse_file_info* fi) {
+	char buf[sizeof(struct fuse_entry_out) + sizeof(struct fuse_open_out)];
+	size_t entrysize = se->conn.proto_minor < 9 ?
+		FUSE_COMPAT_ENTRY_OUT_SIZE : sizeof(struct fuse_entry_out);
+	struct fuse_entry_out* earg = (struct fuse_entry_out*)buf;
+	struct fuse_open_out* oarg = (struct fuse_open_out*)(buf + entrysize);
+
+	memset(buf, 0, sizeof(buf));
+	fill_entry(earg, e);
+	fill_open(oarg, fi);
+	return send_reply_ok(buf, entrysize + sizeof(struct fuse_open_out));
+}
+
+int copper_fuse_req::reply_attr(const struct stat* attr, double attr_timeout) {
+	struct fuse_attr_out arg;
+	size_t size = se->conn.proto_minor < 9 ?
+		FUSE_COMPAT_ATTR_OUT_SIZE : sizeof(arg);
+
+	memset(&arg, 0, sizeof(arg));
+	arg.attr_valid      = calc_timeout_sec(attr_timeout);
+	arg.attr_valid_nsec = calc_timeout_nsec(attr_timeout);
+	convert_stat(attr, &arg.attr);
+	return send_reply_ok(&arg, size);
+}
+
+int copper_fuse_req::reply_open(const struct fuse_file_info* fi) {
+	struct fuse_open_out arg;
+
+	memset(&arg, 0, sizeof(arg));
+	fill_open(&arg, fi);
+	return send_reply_ok(&arg, sizeof(arg));
+}
+
+int copper_fuse_req::reply_write(size_t count) {
+	struct fuse_write_out arg;
+
+	memset(&arg, 0, sizeof(arg));
+	arg.size = count;
+	return send_reply_ok(&arg, sizeof(arg));
+}
+
+size_t copper_fuse_add_direntry(char* buf, size_t bufsize, const char* name, size_t namelen,
+	uint64_t ino, mode_t type, off_t off) {
+	size_t entlen = FUSE_NAME_OFFSET + namelen;
+	size_t entsize = FUSE_DIRENT_ALIGN(entlen);
+
+	if (!buf || entsize > bufsize)
+		return entsize;
+
+	struct fuse_dirent* dirent = (struct fuse_dirent*)buf;
+	dirent->ino     = ino;
+	dirent->off     = off;
+	dirent->namelen = namelen;
+	dirent->type    = (type & S_IFMT) >> 12;
+	memcpy(dirent->name, name, namelen);
+	memset(dirent->name + namelen, 0, entsize - entlen);
+	return entsize;
+}
+
+size_t copper_fuse_add_direntry_plus(char* buf, size_t bufsize, const char* name, size_t namelen,
+	const struct copper_fuse_entry_param* e, off_t off) {
+	size_t entlen = FUSE_NAME_OFFSET_DIRENTPLUS + namelen;
+	size_t entsize = FUSE_DIRENT_ALIGN(entlen);
+
+	if (!buf || entsize > bufsize)
+		return entsize;
+
+	struct fuse_direntplus* dp = (struct fuse_direntplus*)buf;
+	memset(&dp->entry_out, 0, sizeof(dp->entry_out));
+	fill_entry(&dp->entry_out, e);
+
+	struct fuse_dirent* dirent = &dp->dirent;
+	dirent->ino     = e->attr.st_ino;
+	dirent->off     = off;
+	dirent->namelen = namelen;
+	dirent->type    = (e->attr.st_mode & S_IFMT) >> 12;
+	memcpy(dirent->name, name, namelen);
+	memset(dirent->name + namelen, 0, entsize - entlen);
+	return entsize;
+}
+
+int copper_fuse_req::reply_buf(const char* buf, size_t size) {
+	return send_reply_ok(buf, size);
+}
+
+int copper_fuse_req::reply_readlink(const char* link) {
+	return send_reply_ok(link, strlen(link));
+}
+
+int copper_fuse_req::reply_statfs(const struct statvfs* stbuf) {
+	struct fuse_statfs_out arg;
+	size_t size = se->conn.proto_minor < 4 ?
+		FUSE_COMPAT_STATFS_SIZE : sizeof(arg);
+
+	memset(&arg, 0, sizeof(arg));
+	convert_statfs(stbuf, &arg.st);
+	return send_reply_ok(&arg, size);
+}
+
+int copper_fuse_req::reply_lseek(off_t off) {
+	struct fuse_lseek_out arg;
+
+	memset(&arg, 0, sizeof(arg));
+	arg.offset = off;
+	return send_reply_ok(&arg, sizeof(arg));
+}
+
+int copper_fuse_req::reply_xattr(size_t count) {
+	struct fuse_getxattr_out arg;
+
+	memset(&arg, 0, sizeof(arg));
+	arg.size = count;
+	return send_reply_ok(&arg, sizeof(arg));
+}
+
+int copper_fuse_req::reply_iov(const struct iovec* iov, int count) {
+	copper_fuse_reply_builder rb;
+
+	rb.add_iov(iov, count);
+	return send_reply(0, &rb);
+}
+
+int copper_fuse_req::reply_builder(copper_fuse_reply_builder* rb) {
+	return send_reply(0, rb);
+}
+
+static std::unique_ptr<struct fuse_ioctl_iovec[]> fuse_ioctl_iovec_copy(const struct iovec* iov,
+	size_t count) {
+	std::unique_ptr<struct fuse_ioctl_iovec[]> fiov(new (std::nothrow) struct fuse_ioctl_iovec[count]);
+	if (!fiov)
+		return nullptr;
+
+	for (size_t i = 0; i < count; i++) {
+		fiov[i].base = (uintptr_t)iov[i].iov_base;
+		fiov[i].len  = iov[i].iov_len;
+	}
+	return fiov;
+}
+
+int copper_fuse_req::reply_ioctl_retry(const struct iovec* in_iov, size_t in_count,
+	const struct iovec* out_iov, size_t out_count) {
+	struct fuse_ioctl_out arg;
+	std::unique_ptr<struct fuse_ioctl_iovec[]> in_fiov, out_fiov;
+	copper_fuse_reply_builder rb;
+
+	memset(&arg, 0, sizeof(arg));
+	arg.flags |= FUSE_IOCTL_RETRY;
+	arg.in_iovs  = in_count;
+	arg.out_iovs = out_count;
+	rb.add(&arg, sizeof(arg));
+
+	if (se->conn.proto_minor < 16) {
+		rb.add(in_iov, sizeof(in_iov[0]) * in_count);
+		rb.add(out_iov, sizeof(out_iov[0]) * out_count);
+	} else {
+		if (in_count) {
+			in_fiov = fuse_ioctl_iovec_copy(in_iov, in_count);
+			if (!in_fiov)
+				return reply_err(ENOMEM);
+			rb.add(in_fiov.get(), sizeof(in_fiov[0]) * in_count);
+		}
+		if (out_count) {
+			out_fiov = fuse_ioctl_iovec_copy(out_iov, out_count);
+			if (!out_fiov)
+				return reply_err(ENOMEM);
+			rb.add(out_fiov.get(), sizeof(out_fiov[0]) * out_count);
+		}
+	}
+
+	return send_reply(0, &rb);
+}
+
+int copper_fuse_req::reply_ioctl(int result, const void* buf, size_t size) {
+	struct fuse_ioctl_out arg;
+	copper_fuse_reply_builder rb;
+
+	memset(&arg, 0, sizeof(arg));
+	arg.result = result;
+	rb.add(&arg, sizeof(arg));
+	rb.add(buf, size);
+	return send_reply(0, &rb);
+}
+
+int copper_fuse_req::reply_ioctl_iov(int result, const struct iovec* iov, int count) {
+	struct fuse_ioctl_out arg;
+	copper_fuse_reply_builder rb;
+
+	memset(&arg, 0, sizeof(arg));
+	arg.result = result;
+	rb.add(&arg, sizeof(arg));
+	rb.add_iov(iov, count);
+	return send_reply(0, &rb);
+}
+
+int copper_fuse_req::reply_poll(unsigned revents) {
+	struct fuse_poll_out arg;
+
+	memset(&arg, 0, sizeof(arg));
+	arg.revents = revents;
+	return send_reply_ok(&arg, sizeof(arg));
+}
+
+int copper_fuse_req::reply_lock(const struct flock* lock) {
+	struct fuse_lk_out arg;
+
+	memset(&arg, 0, sizeof(arg));
+	arg.lk.type = lock->l_type;
+	if (lock->l_type != F_UNLCK) {
+		arg.lk.start = lock->l_start;
+		if (lock->l_len == 0)
+			arg.lk.end = OFFSET_MAX;
+		else
+			arg.lk.end = lock->l_start + lock->l_len - 1;
+	}
+	arg.lk.pid = lock->l_pid;
+	return send_reply_ok(&arg, sizeof(arg));
+}
+
+/** ---------------------------------------------------
+ * FOR COPPER FUSE REQUEST DISPATCH
+ * ---------------------------------------------------*/
+
+static void do_lookup(copper_fuse_req_t req, fuse_ino_t nodeid, const void* inarg) {
+	const char* name = (const char*)inarg;
+
+	if (req->se->op.lookup)
+		req->se->op.lookup(req, nodeid, name);
+	else
+		req->reply_err(ENOSYS);
+}
+
+static void do_forget(copper_fuse_req_t req, fuse_ino_t nodeid, const void* inarg) {
+	const struct fuse_forget_in* arg = (const struct fuse_forget_in*)inarg;
+
+	if (req->se->op.forget)
+		req->se->op.forget(req, nodeid, arg->nlookup);
+	else
+		req->reply_none();
+}
+
+static void convert_attr(const struct fuse_setattr_in* attr, struct stat* stbuf) {
+	stbuf->st_mode         = attr->mode;
+	stbuf->st_uid          = attr->uid;
+	stbuf->st_gid          = attr->gid;
+	stbuf->st_size         = attr->size;
+	stbuf->st_atim.tv_sec  = attr->atime;
+	stbuf->st_mtim.tv_sec  = attr->mtime;
+	stbuf->st_ctim.tv_sec  = attr->ctime;
+	stbuf->st_atim.tv_nsec = attr->atimensec;
+	stbuf->st_mtim.tv_nsec = attr->mtimensec;
+	stbuf->st_ctim.tv_nsec = attr->ctimensec;
+}
+
+static void do_setattr(copper_fuse_req_t req, fuse_ino_t nodeid, const void* inarg) {
+	const struct fuse_setattr_in* arg = (const struct fuse_setattr_in*)inarg;
+	struct fuse_file_info* fip = nullptr;
+	struct fuse_file_info fi;
+	struct stat stbuf;
+
+	if (!req->se->op.setattr) {
+		req->reply_err(ENOSYS);
+		return;
+	}
+
+	memset(&stbuf, 0, sizeof(stbuf));
+	convert_attr(arg, &stbuf);
+	if (arg->valid & FATTR_FH) {
+		memset(&fi, 0, sizeof(fi));
+		fi.fh = arg->fh;
+		fip = &fi;
+	}
+
+	int to_set = arg->valid & (FUSE_SET_ATTR_MODE | FUSE_SET_ATTR_UID | FUSE_SET_ATTR_GID |
+		FUSE_SET_ATTR_SIZE | FUSE_SET_ATTR_ATIME | FUSE_SET_ATTR_MTIME |
+		FUSE_SET_ATTR_ATIME_NOW | FUSE_SET_ATTR_MTIME_NOW | FUSE_SET_ATTR_CTIME);
+	req->se->op.setattr(req, nodeid, &stbuf, to_set, fip);
+}
+
+static void do_readlink(copper_fuse_req_t req, fuse_ino_t nodeid, const void* inarg) {
+	static_cast<void>(inarg);
+
+	if (req->se->op.readlink)
+		req->se->op.readlink(req, nodeid);
+	else
+		req->reply_err(ENOSYS);
+}
+
+static void do_mknod(copper_fuse_req_t req, fuse_ino_t nodeid, const void* inarg) {
+	const struct fuse_mknod_in* arg = (const struct fuse_mknod_in*)inarg;
+	const char* name = (const char*)(arg + 1);
+
+	if (req->se->conn.proto_minor >= 12)
+		req->ctx.umask = arg->umask;
+	else
+		name = (const char*)inarg + FUSE_COMPAT_MKNOD_IN_SIZE;
+
+	if (req->se->op.mknod)
+		req->se->op.mknod(req, nodeid, name, arg->mode, arg->rdev);
+	else
+		req->reply_err(ENOSYS);
+}
+
+static void do_mkdir(copper_fuse_req_t req, fuse_ino_t nodeid, const void* inarg) {
+	const struct fuse_mkdir_in* arg = (const struct fuse_mkdir_in*)inarg;
+
+	if (req->se->op.mkdir) {
+		if (req->se->conn.proto_minor >= 12)
+			req->ctx.umask = arg->umask;
+		req->se->op.mkdir(req, nodeid, (const char*)(arg + 1), arg->mode);
+	} else {
+		req->reply_err(ENOSYS);
+	}
+}
+
+static void do_unlink(copper_fuse_req_t req, fuse_ino_t nodeid, const void* inarg) {
+	const char* name = (const char*)inarg;
+
+	if (req->se->op.unlink)
+		req->se->op.unlink(req, nodeid, name);
+	else
+		req->reply_err(ENOSYS);
+}
+
+static void do_rmdir(copper_fuse_req_t req, fuse_ino_t nodeid, const void* inarg) {
+	const char* name = (const char*)inarg;
+
+	if (req->se->op.rmdir)
+		req->se->op.rmdir(req, nodeid, name);
+	else
+		req->reply_err(ENOSYS);
+}
+
+static void do_symlink(copper_fuse_req_t req, fuse_ino_t nodeid, const void* inarg) {
+	const char* name = (const char*)inarg;
+	const char* linkname = name + strlen(name) + 1;
+
+	if (req->se->op.symlink)
+		req->se->op.symlink(req, linkname, nodeid, name);
+	else
+		req->reply_err(ENOSYS);
+}
+
+static void do_rename(copper_fuse_req_t req, fuse_ino_t nodeid, const void* inarg) {
+	const struct fuse_rename_in* arg = (const struct fuse_rename_in*)inarg;
+	const char* oldname = (const char*)(arg + 1);
+	const char* newname = oldname + strlen(oldname) + 1;
+
+	if (req->se->op.rename)
+		req->se->op.rename(req, nodeid, oldname, arg->newdir, newname, 0);
+	else
+		req->reply_err(ENOSYS);
+}
+
+static void do_rename2(copper_fuse_req_t req, fuse_ino_t nodeid, const void* inarg) {
+	const struct fuse_rename2_in* arg = (const struct fuse_rename2_in*)inarg;
+	const char* oldname = (const char*)(arg + 1);
+	const char* newname = oldname + strlen(oldname) + 1;
+
+	if (req->se->op.rename)
+		req->se->op.rename(req, nodeid, oldname, arg->newdir, newname, arg->flags);
+	else
+		req->reply_err(ENOSYS);
+}
+
+static void do_link(copper_fuse_req_t req, fuse_ino_t nodeid, const void* inarg) {
+	const struct fuse_link_in* arg = (const struct fuse_link_in*)inarg;
+
+	if (req->se->op.link)
+		req->se->op.link(req, arg->oldnodeid, nodeid, (const char*)(arg + 1));
+	else
+		req->reply_err(ENOSYS);
+}
+
+static void do_batch_forget(copper_fuse_req_t req, fuse_ino_t nodeid, const void* inarg) {
+	const struct fuse_batch_forget_in* arg = (const struct fuse_batch_forget_in*)inarg;
+	const struct fuse_forget_one* param = (const struct fuse_forget_one*)(arg + 1);
+	static_cast<void>(nodeid);
+
+	if (req->se->op.forget) {
+		struct fuse_in_header in;
+		memset(&in, 0, sizeof(in));
+		in.unique = req->unique;
+		in.opcode = FUSE_FORGET;
+		in.uid    = req->ctx.uid;
+		in.gid    = req->ctx.gid;
+		in.pid    = req->ctx.pid;
+
+		for (uint32_t i = 0; i < arg->count; i++) {
+			/* Every forget gets its own request, each is answered by reply_none() */
+			copper_fuse_req* dummy = new (std::nothrow) copper_fuse_req(req->se, &in);
+			if (!dummy)
+				break;
+			req->se->op.forget(dummy, param[i].nodeid, param[i].nlookup);
+		}
+	}
+	req->reply_none();
+}
+
+static void do_getattr(copper_fuse_req_t req, fuse_ino_t nodeid, const void* inarg) {
+	struct fuse_file_info* fip = nullptr;
+	struct fuse_file_info fi;
+
+	if (req->se->conn.proto_minor >= 9) {
+		const struct fuse_getattr_in* arg = (const struct fuse_getattr_in*)inarg;
+		if (arg->getattr_flags & FUSE_GETATTR_FH) {
+			memset(&fi, 0, sizeof(fi));
+			fi.fh = arg->fh;
+			fip = &fi;
+		}
+	}
+
+	if (req->se->op.getattr)
+		req->se->op.getattr(req, nodeid, fip);
+	else
+		req->reply_err(ENOSYS);
+}
+
+static void do_open(copper_fuse_req_t req, fuse_ino_t nodeid, const void* inarg) {
+	const struct fuse_open_in* arg = (const struct fuse_open_in*)inarg;
+	struct fuse_file_info fi;
+
+	memset(&fi, 0, sizeof(fi));
+	fi.flags = arg->flags;
+
+	if (req->se->op.open)
+		req->se->op.open(req, nodeid, &fi);
+	else
+		req->reply_open(&fi);
+}
+
+static void do_read(copper_fuse_req_t req, fuse_ino_t nodeid, const void* inarg) {
+	const struct fuse_read_in* arg = (const struct fuse_read_in*)inarg;
+	struct fuse_file_info fi;
+
+	memset(&fi, 0, sizeof(fi));
+	fi.fh = arg->fh;
+	if (req->se->conn.proto_minor >= 9) {
+		fi.lock_owner = arg->lock_owner;
+		fi.flags = arg->flags;
+	}
+
+	if (req->se->op.read)
+		req->se->op.read(req, nodeid, arg->size, arg->offset, &fi);
+	else
+		req->reply_err(ENOSYS);
+}
+
+static void do_write(copper_fuse_req_t req, fuse_ino_t nodeid, const void* inarg) {
+	const struct fuse_write_in* arg = (const struct fuse_write_in*)inarg;
+	struct fuse_file_info fi;
+	const char* param;
+
+	memset(&fi, 0, sizeof(fi));
+	fi.fh = arg->fh;
+	fi.writepage = (arg->write_flags & FUSE_WRITE_CACHE) != 0;
+
+	if (req->se->conn.proto_minor < 9) {
+		param = ((const char*)arg) + FUSE_COMPAT_WRITE_IN_SIZE;
+	} else {
+		fi.lock_owner = arg->lock_owner;
+		fi.flags = arg->flags;
+		param = (const char*)(arg + 1);
+	}
+
+	if (req->se->op.write)
+		req->se->op.write(req, nodeid, param, arg->size, arg->offset, &fi);
+	else
+		req->reply_err(ENOSYS);
+}
+
+static void do_flush(copper_fuse_req_t req, fuse_ino_t nodeid, const void* inarg) {
+	const struct fuse_flush_in* arg = (const struct fuse_flush_in*)inarg;
+	struct fuse_file_info fi;
+
+	memset(&fi, 0, sizeof(fi));
+	fi.fh = arg->fh;
+	fi.flush = 1;
+	if (req->se->conn.proto_minor >= 7)
+		fi.lock_owner = arg->lock_owner;
+
+	if (req->se->op.flush)
+		req->se->op.flush(req, nodeid, &fi);
+	else
+		req->reply_err(ENOSYS);
+}
+
+static void do_release(copper_fuse_req_t req, fuse_ino_t nodeid, const void* inarg) {
+	const struct fuse_release_in* arg = (const struct fuse_release_in*)inarg;
+	struct fuse_file_info fi;
+
+	memset(&fi, 0, sizeof(fi));
+	fi.flags = arg->flags;
+	fi.fh = arg->fh;
+	if (req->se->conn.proto_minor >= 8) {
+		fi.flush = (arg->release_flags & FUSE_RELEASE_FLUSH) ? 1 : 0;
+		fi.lock_owner = arg->lock_owner;
+	}
+	if (arg->release_flags & FUSE_RELEASE_FLOCK_UNLOCK) {
+		fi.flock_release = 1;
+		fi.lock_owner = arg->lock_owner;
+	}
+
+	if (req->se->op.release)
+		req->se->op.release(req, nodeid, &fi);
+	else
+		req->reply_err(0);
+}
+
+static void do_fsync(copper_fuse_req_t req, fuse_ino_t nodeid, const void* inarg) {
+	const struct fuse_fsync_in* arg = (const struct fuse_fsync_in*)inarg;
+	struct fuse_file_info fi;
+	int datasync = arg->fsync_flags & 1;
+
+	memset(&fi, 0, sizeof(fi));
+	fi.fh = arg->fh;
+
+	if (req->se->op.fsync)
+		req->se->op.fsync(req, nodeid, datasync, &fi);
+	else
+		req->reply_err(ENOSYS);
+}
+
+static void do_create(copper_fuse_req_t req, fuse_ino_t nodeid, const void* inarg) {
+	const struct fuse_create_in* arg = (const struct fuse_create_in*)inarg;
+
+	if (req->se->op.create) {
+		struct fuse_file_info fi;
+		const char* name = (const char*)(arg + 1);
+
+		memset(&fi, 0, sizeof(fi));
+		fi.flags = arg->flags;
+
+		if (req->se->conn.proto_minor >= 12)
+			req->ctx.umask = arg->umask;
+		else
+			name = (const char*)inarg + sizeof(struct fuse_open_in);
+
+		req->se->op.create(req, nodeid, name, arg->mode, &fi);
+	} else {
+		req->reply_err(ENOSYS);
+	}
+}
+
+static void do_copy_file_range(copper_fuse_req_t req, fuse_ino_t nodeid_in, const void* inarg) {
+	const struct fuse_copy_file_range_in* arg = (const struct fuse_copy_file_range_in*)inarg;
+	struct fuse_file_info fi_in, fi_out;
+
+	memset(&fi_in, 0, sizeof(fi_in));
+	fi_in.fh = arg->fh_in;
+
+	memset(&fi_out, 0, sizeof(fi_out));
+	fi_out.fh = arg->fh_out;
+
+	if (req->se->op.copy_file_range)
+		req->se->op.copy_file_range(req, nodeid_in, arg->off_in, &fi_in,
+			arg->nodeid_out, arg->off_out, &fi_out, arg->len, arg->flags);
+	else
+		req->reply_err(ENOSYS);
+}
+
+static void do_fallocate(copper_fuse_req_t req, fuse_ino_t nodeid, const void* inarg) {
+	const struct fuse_fallocate_in* arg = (const struct fuse_fallocate_in*)inarg;
+	struct fuse_file_info fi;
+
+	memset(&fi, 0, sizeof(fi));
+	fi.fh = arg->fh;
+
+	if (req->se->op.fallocate)
+		req->se->op.fallocate(req, nodeid, arg->mode, arg->offset, arg->length, &fi);
+	else
+		req->reply_err(ENOSYS);
+}
+
+static void do_lseek(copper_fuse_req_t req, fuse_ino_t nodeid, const void* inarg) {
+	const struct fuse_lseek_in* arg = (const struct fuse_lseek_in*)inarg;
+	struct fuse_file_info fi;
+
+	memset(&fi, 0, sizeof(fi));
+	fi.fh = arg->fh;
+
+	if (req->se->op.lseek)
+		req->se->op.lseek(req, nodeid, arg->offset, arg->whence, &fi);
+	else
+		req->reply_err(ENOSYS);
+}
+
+static void do_setxattr(copper_fuse_req_t req, fuse_ino_t nodeid, const void* inarg) {
+	const struct fuse_setxattr_in* arg = (const struct fuse_setxattr_in*)inarg;
+	int xattr_ext = (req->se->conn.want & FUSE_SETXATTR_EXT) != 0;
+	const char* name = xattr_ext ? (const char*)(arg + 1) :
+		(const char*)inarg + FUSE_COMPAT_SETXATTR_IN_SIZE;
+	const char* value = name + strlen(name) + 1;
+
+	if (req->se->op.setxattr)
+		req->se->op.setxattr(req, nodeid, name, value, arg->size, arg->flags);
+	else
+		req->reply_err(ENOSYS);
+}
+
+static void do_getxattr(copper_fuse_req_t req, fuse_ino_t nodeid, const void* inarg) {
+	const struct fuse_getxattr_in* arg = (const struct fuse_getxattr_in*)inarg;
+
+	if (req->se->op.getxattr)
+		req->se->op.getxattr(req, nodeid, (const char*)(arg + 1), arg->size);
+	else
+		req->reply_err(ENOSYS);
+}
+
+static void do_listxattr(copper_fuse_req_t req, fuse_ino_t nodeid, const void* inarg) {
+	const struct fuse_getxattr_in* arg = (const struct fuse_getxattr_in*)inarg;
+
+	if (req->se->op.listxattr)
+		req->se->op.listxattr(req, nodeid, arg->size);
+	else
+		req->reply_err(ENOSYS);
+}
+
+static void do_removexattr(copper_fuse_req_t req, fuse_ino_t nodeid, const void* inarg) {
+	const char* name = (const char*)inarg;
+
+	if (req->se->op.removexattr)
+		req->se->op.removexattr(req, nodeid, name);
+	else
+		req->reply_err(ENOSYS);
+}
+
+static void do_opendir(copper_fuse_req_t req, fuse_ino_t nodeid, const void* inarg) {
+	const struct fuse_open_in* arg = (const struct fuse_open_in*)inarg;
+	struct fuse_file_info fi;
+
+	memset(&fi, 0, sizeof(fi));
+	fi.flags = arg->flags;
+
+	if (req->se->op.opendir)
+		req->se->op.opendir(req, nodeid, &fi);
+	else
+		req->reply_open(&fi);
+}
+
+static void do_readdir(copper_fuse_req_t req, fuse_ino_t nodeid, const void* inarg) {
+	const struct fuse_read_in* arg = (const struct fuse_read_in*)inarg;
+	struct fuse_file_info fi;
+
+	memset(&fi, 0, sizeof(fi));
+	fi.fh = arg->fh;
+
+	if (req->se->op.readdir)
+		req->se->op.readdir(req, nodeid, arg->size, arg->offset, &fi);
+	else
+		req->reply_err(ENOSYS);
+}
+
+static void do_readdirplus(copper_fuse_req_t req, fuse_ino_t nodeid, const void* inarg) {
+	const struct fuse_read_in* arg = (const struct fuse_read_in*)inarg;
+	struct fuse_file_info fi;
+
+	memset(&fi, 0, sizeof(fi));
+	fi.fh = arg->fh;
+
+	if (req->se->op.readdirplus)
+		req->se->op.readdirplus(req, nodeid, arg->size, arg->offset, &fi);
+	else
+		req->reply_err(ENOSYS);
+}
+
+static void do_releasedir(copper_fuse_req_t req, fuse_ino_t nodeid, const void* inarg) {
+	const struct fuse_release_in* arg = (const struct fuse_release_in*)inarg;
+	struct fuse_file_info fi;
+
+	memset(&fi, 0, sizeof(fi));
+	fi.flags = arg->flags;
+	fi.fh = arg->fh;
+
+	if (req->se->op.releasedir)
+		req->se->op.releasedir(req, nodeid, &fi);
+	else
+		req->reply_err(0);
+}
+
+static void do_fsyncdir(copper_fuse_req_t req, fuse_ino_t nodeid, const void* inarg) {
+	const struct fuse_fsync_in* arg = (const struct fuse_fsync_in*)inarg;
+	struct fuse_file_info fi;
+	int datasync = arg->fsync_flags & 1;
+
+	memset(&fi, 0, sizeof(fi));
+	fi.fh = arg->fh;
+
+	if (req->se->op.fsyncdir)
+		req->se->op.fsyncdir(req, nodeid, datasync, &fi);
+	else
+		req->reply_err(ENOSYS);
+}
+
+static void do_statfs(copper_fuse_req_t req, fuse_ino_t nodeid, const void* inarg) {
+	static_cast<void>(inarg);
+
+	if (req->se->op.statfs) {
+		req->se->op.statfs(req, nodeid);
+	} else {
+		struct statvfs buf;
+
+		memset(&buf, 0, sizeof(buf));
+		buf.f_namemax = 255;
+		buf.f_bsize = 512;
+		req->reply_statfs(&buf);
+	}
+}
+
+static void do_access(copper_fuse_req_t req, fuse_ino_t nodeid, const void* inarg) {
+	const struct fuse_access_in* arg = (const struct fuse_access_in*)inarg;
+
+	if (req->se->op.access)
+		req->se->op.access(req, nodeid, arg->mask);
+	else
+		req->reply_err(ENOSYS);
+}
+
+static void do_ioctl(copper_fuse_req_t req, fuse_ino_t nodeid, const void* inarg) {
+	const struct fuse_ioctl_in* arg = (const struct fuse_ioctl_in*)inarg;
+	unsigned int flags = arg->flags;
+	const void* in_buf = arg->in_size ? (const void*)(arg + 1) : nullptr;
+	struct fuse_file_info fi;
+
+	if ((flags & FUSE_IOCTL_DIR) && !(req->se->conn.want & FUSE_HAS_IOCTL_DIR)) {
+		req->reply_err(ENOTTY);
+		return;
+	}
+
+	memset(&fi, 0, sizeof(fi));
+	fi.fh = arg->fh;
+
+	if (req->se->op.ioctl)
+		req->se->op.ioctl(req, nodeid, arg->cmd, (void*)(uintptr_t)arg->arg, &fi, flags,
+			in_buf, arg->in_size, arg->out_size);
+	else
+		req->reply_err(ENOSYS);
+}
+
+static void do_poll(copper_fuse_req_t req, fuse_ino_t nodeid, const void* inarg) {
+	const struct fuse_poll_in* arg = (const struct fuse_poll_in*)inarg;
+	struct fuse_file_info fi;
+
+	memset(&fi, 0, sizeof(fi));
+	fi.fh = arg->fh;
+	fi.poll_events = arg->events;
+
+	if (req->se->op.poll) {
+		struct fuse_pollhandle* ph = nullptr;
+
+		if (arg->flags & FUSE_POLL_SCHEDULE_NOTIFY) {
+			ph = new (std::nothrow) fuse_pollhandle(req->se, arg->kh);
+			if (!ph) {
+				req->reply_err(ENOMEM);
+				return;
+			}
+		}
+
+		req->se->op.poll(req, nodeid, &fi, ph);
+	} else {
+		req->reply_err(ENOSYS);
+	}
+}
+
+static void convert_fuse_file_lock(const struct fuse_file_lock* fl, struct flock* flock) {
+	memset(flock, 0, sizeof(struct flock));
+	flock->l_type   = fl->type;
+	flock->l_whence = SEEK_SET;
+	flock->l_start  = fl->start;
+	if (fl->end == OFFSET_MAX)
+		flock->l_len = 0;
+	else
+		flock->l_len = fl->end - fl->start + 1;
+	flock->l_pid = fl->pid;
+}
+
+static void do_getlk(copper_fuse_req_t req, fuse_ino_t nodeid, const void* inarg) {
+	const struct fuse_lk_in* arg = (const struct fuse_lk_in*)inarg;
+	struct fuse_file_info fi;
+	struct flock flock;
+
+	memset(&fi, 0, sizeof(fi));
+	fi.fh = arg->fh;
+	fi.lock_owner = arg->owner;
+
+	convert_fuse_file_lock(&arg->lk, &flock);
+	if (req->se->op.getlk)
+		req->se->op.getlk(req, nodeid, &fi, &flock);
+	else
+		req->reply_err(ENOSYS);
+}
+
+static void do_setlk_common(copper_fuse_req_t req, fuse_ino_t nodeid, const void* inarg, int sleep) {
+	const struct fuse_lk_in* arg = (const struct fuse_lk_in*)inarg;
+	struct fuse_file_info fi;
+	struct flock flock;
+
+	memset(&fi, 0, sizeof(fi));
+	fi.fh = arg->fh;
+	fi.lock_owner = arg->owner;
+
+	if (arg->lk_flags & FUSE_LK_FLOCK) {
+		int op = 0;
+
+		switch (arg->lk.type) {
+		case F_RDLCK:
+			op = LOCK_SH;
+			break;
+		case F_WRLCK:
+			op = LOCK_EX;
+			break;
+		case F_UNLCK:
+			op = LOCK_UN;
+			break;
+		}
+		if (!sleep)
+			op |= LOCK_NB;
+
+		if (req->se->op.flock)
+			req->se->op.flock(req, nodeid, &fi, op);
+		else
+			req->reply_err(ENOSYS);
+	} else {
+		convert_fuse_file_lock(&arg->lk, &flock);
+		if (req->se->op.setlk)
+			req->se->op.setlk(req, nodeid, &fi, &flock, sleep);
+		else
+			req->reply_err(ENOSYS);
+	}
+}
+
+static void do_setlk(copper_fuse_req_t req, fuse_ino_t nodeid, const void* inarg) {
+	do_setlk_common(req, nodeid, inarg, 0);
+}
+
+static void do_setlkw(copper_fuse_req_t req, fuse_ino_t nodeid, const void* inarg) {
+	do_setlk_common(req, nodeid, inarg, 1);
+}
+
+static void do_init(copper_fuse_req_t req, fuse_ino_t nodeid, const void* inarg) {
+	const struct fuse_init_in* arg = (const struct fuse_init_in*)inarg;
+	struct fuse_init_out outarg;
+	copper_fuse_session* se = req->se;
+	size_t outargsize = sizeof(outarg);
+	static_cast<void>(nodeid);
+
+	memset(&outarg, 0, sizeof(outarg));
+	outarg.major = FUSE_KERNEL_VERSION;
+	outarg.minor = FUSE_KERNEL_MINOR_VERSION;
+
+	if (arg->major < 7) {
+		erron << "unsupported protocol version: " << arg->major << "." << arg->minor;
+		req->reply_err(EPROTO);
+		return;
+	}
+	if (arg->major > 7) {
+		/* Wait for a second INIT request with a 7.X version */
+		req->reply_buf((const char*)&outarg, sizeof(outarg));
+		return;
+	}
+
+	se->conn.proto_major = arg->major;
+	se->conn.proto_minor = arg->minor;
+	se->conn.capable = 0;
+	se->conn.want = 0;
+
+	if (arg->minor >= 6) {
+		uint64_t inflags = arg->flags;
+		if (inflags & FUSE_INIT_EXT)
+			inflags |= (uint64_t)arg->flags2 << 32;
+
+		se->conn.capable = inflags;
+		if (se->conn.max_readahead > arg->max_readahead)
+			se->conn.max_readahead = arg->max_readahead;
+	} else {
+		se->conn.max_readahead = 0;
+	}
+
+	/* Default settings for modern filesystems */
+	se->conn.want = se->conn.capable & (FUSE_ASYNC_READ | FUSE_ATOMIC_O_TRUNC |
+		FUSE_BIG_WRITES | FUSE_AUTO_INVAL_DATA | FUSE_ASYNC_DIO |
+		FUSE_PARALLEL_DIROPS | FUSE_HANDLE_KILLPRIV | FUSE_INIT_EXT);
+	if (se->op.getlk && se->op.setlk)
+		se->conn.want |= se->conn.capable & FUSE_POSIX_LOCKS;
+	if (se->op.flock)
+		se->conn.want |= se->conn.capable & FUSE_FLOCK_LOCKS;
+	if (se->op.readdirplus)
+		se->conn.want |= se->conn.capable & (FUSE_DO_READDIRPLUS | FUSE_READDIRPLUS_AUTO);
+
+	if (se->conn.max_write > se->bufsize - FUSE_BUFFER_HEADER_SIZE)
+		se->conn.max_write = se->bufsize - FUSE_BUFFER_HEADER_SIZE;
+
+	se->got_init = 1;
+	if (se->op.init)
+		se->op.init(se->userdata, &se->conn);
+
+	if (se->conn.want & ~se->conn.capable) {
+		erron << "requested capabilities not supported";
+		se->error = -EPROTO;
+		se->exit();
+		req->reply_err(EPROTO);
+		return;
+	}
+
+	if (se->conn.max_write < FUSE_MIN_READ_BUFFER - FUSE_BUFFER_HEADER_SIZE)
+		se->conn.max_write = FUSE_MIN_READ_BUFFER - FUSE_BUFFER_HEADER_SIZE;
+
+	se->cong.setup(&se->conn);
+	if (se->cong.adaptive) {
+		se->conn.max_background = se->cong.background();
+		se->conn.congestion_threshold = se->cong.threshold.load();
+	}
+
+	outarg.flags  = (uint32_t)se->conn.want;
+	outarg.flags2 = (uint32_t)(se->conn.want >> 32);
+	outarg.max_readahead = se->conn.max_readahead;
+	outarg.max_write = se->conn.max_write;
+	if (se->conn.capable & FUSE_MAX_PAGES) {
+		outarg.flags |= FUSE_MAX_PAGES;
+		outarg.max_pages = (se->conn.max_write - 1) / getpagesize() + 1;
+	}
+	if (se->conn.proto_minor >= 13) {
+		outarg.max_background = se->conn.max_background;
+		outarg.congestion_threshold = se->conn.congestion_threshold;
+	}
+	if (se->conn.proto_minor >= 23)
+		outarg.time_gran = se->conn.time_gran;
+
+	if (se->verbose) {
+		info << "INIT: " << outarg.major << "." << outarg.minor
+			<< " flags=0x" << std::hex << se->conn.want << std::dec
+			<< " max_write=" << outarg.max_write << " max_pages=" << outarg.max_pages;
+	}
+
+	if (arg->minor < 5)
+		outargsize = FUSE_COMPAT_INIT_OUT_SIZE;
+	else if (arg->minor < 23)
+		outargsize = FUSE_COMPAT_22_INIT_OUT_SIZE;
+
+	req->reply_buf((const char*)&outarg, outargsize);
+}
+
+static void do_destroy(copper_fuse_req_t req, fuse_ino_t nodeid, const void* inarg) {
+	copper_fuse_session* se = req->se;
+	static_cast<void>(nodeid);
+	static_cast<void>(inarg);
+
+	se->got_destroy = 1;
+	if (se->op.destroy)
+		se->op.destroy(se->userdata);
+
+	req->reply_err(0);
+}
+
+static void do_interrupt(copper_fuse_req_t req, fuse_ino_t nodeid, const void* inarg) {
+	const struct fuse_interrupt_in* arg = (const struct fuse_interrupt_in*)inarg;
+	copper_fuse_session* se = req->se;
+	static_cast<void>(nodeid);
+
+	if (se->verbose)
+		debug << "INTERRUPT: " << arg->unique;
+
+	/* An INTERRUPT gets no reply once it reached its request */
+	if (se->intrs.interrupt(arg->unique, req))
+		req->reply_none();
+}
+
+struct copper_fuse_ll_op {
+	uint32_t opcode;
+	void (*func)(copper_fuse_req_t, fuse_ino_t, const void*);
+	/* Minimal size of the fixed part of the request */
+	size_t insize;
+	const char* name;
+};
+
+static const struct copper_fuse_ll_op fuse_ll_ops[] = {
+	{ FUSE_LOOKUP,          do_lookup,          1,                                       "LOOKUP"          },
+	{ FUSE_FORGET,          do_forget,          sizeof(struct fuse_forget_in),           "FORGET"          },
+	{ FUSE_GETATTR,         do_getattr,         0,                                       "GETATTR"         },
+	{ FUSE_SETATTR,         do_setattr,         sizeof(struct fuse_setattr_in),          "SETATTR"         },
+	{ FUSE_READLINK,        do_readlink,        0,                                       "READLINK"        },
+	{ FUSE_SYMLINK,         do_symlink,         2,                                       "SYMLINK"         },
+	{ FUSE_MKNOD,           do_mknod,           FUSE_COMPAT_MKNOD_IN_SIZE + 1,           "MKNOD"           },
+	{ FUSE_MKDIR,           do_mkdir,           sizeof(struct fuse_mkdir_in) + 1,        "MKDIR"           },
+	{ FUSE_UNLINK,          do_unlink,          1,                                       "UNLINK"          },
+	{ FUSE_RMDIR,           do_rmdir,           1,                                       "RMDIR"           },
+	{ FUSE_RENAME,          do_rename,          sizeof(struct fuse_rename_in) + 2,       "RENAME"          },
+	{ FUSE_LINK,            do_link,            sizeof(struct fuse_link_in) + 1,         "LINK"            },
+	{ FUSE_OPEN,            do_open,            sizeof(struct fuse_open_in),             "OPEN"            },
+	{ FUSE_READ,            do_read,            offsetof(struct fuse_read_in, lock_owner),"READ"            },
+	{ FUSE_WRITE,           do_write,           FUSE_COMPAT_WRITE_IN_SIZE,               "WRITE"           },
+	{ FUSE_RELEASE,         do_release,         offsetof(struct fuse_release_in, lock_owner),"RELEASE"         },
+	{ FUSE_STATFS,          do_statfs,          0,                                       "STATFS"          },
+	{ FUSE_FSYNC,           do_fsync,           sizeof(struct fuse_fsync_in),            "FSYNC"           },
+	{ FUSE_FLUSH,           do_flush,           sizeof(struct fuse_flush_in),            "FLUSH"           },
+	{ FUSE_GETLK,           do_getlk,           sizeof(struct fuse_lk_in),               "GETLK"           },
+	{ FUSE_SETLK,           do_setlk,           sizeof(struct fuse_lk_in),               "SETLK"           },
+	{ FUSE_SETLKW,          do_setlkw,          sizeof(struct fuse_lk_in),               "SETLKW"          },
+	{ FUSE_SETXATTR,        do_setxattr,        FUSE_COMPAT_SETXATTR_IN_SIZE + 2,        "SETXATTR"        },
+	{ FUSE_GETXATTR,        do_getxattr,        sizeof(struct fuse_getxattr_in) + 1,     "GETXATTR"        },
+	{ FUSE_LISTXATTR,       do_listxattr,       sizeof(struct fuse_getxattr_in),         "LISTXATTR"       },
+	{ FUSE_REMOVEXATTR,     do_removexattr,     1,                                       "REMOVEXATTR"     },
+	{ FUSE_OPENDIR,         do_opendir,         sizeof(struct fuse_open_in),             "OPENDIR"         },
+	{ FUSE_READDIR,         do_readdir,         offsetof(struct fuse_read_in, lock_owner),"READDIR"         },
+	{ FUSE_RELEASEDIR,      do_releasedir,      offsetof(struct fuse_release_in, lock_owner),"RELEASEDIR"      },
+	{ FUSE_FSYNCDIR,        do_fsyncdir,        sizeof(struct fuse_fsync_in),            "FSYNCDIR"        },
+	{ FUSE_ACCESS,          do_access,          sizeof(struct fuse_access_in),           "ACCESS"          },
+	{ FUSE_INIT,            do_init,            sizeof(struct fuse_init_in) - 48,        "INIT"            },
+	{ FUSE_CREATE,          do_create,          sizeof(struct fuse_open_in) + 1,         "CREATE"          },
+	{ FUSE_INTERRUPT,       do_interrupt,       sizeof(struct fuse_interrupt_in),        "INTERRUPT"       },
+	{ FUSE_DESTROY,         do_destroy,         0,                                       "DESTROY"         },
+	{ FUSE_IOCTL,           do_ioctl,           sizeof(struct fuse_ioctl_in),            "IOCTL"           },
+	{ FUSE_POLL,            do_poll,            sizeof(struct fuse_poll_in),             "POLL"            },
+	{ FUSE_BATCH_FORGET,    do_batch_forget,    sizeof(struct fuse_batch_forget_in),     "BATCH_FORGET"    },
+	{ FUSE_FALLOCATE,       do_fallocate,       sizeof(struct fuse_fallocate_in),        "FALLOCATE"       },
+	{ FUSE_LSEEK,           do_lseek,           sizeof(struct fuse_lseek_in),            "LSEEK"           },
+	{ FUSE_COPY_FILE_RANGE, do_copy_file_range, sizeof(struct fuse_copy_file_range_in),  "COPY_FILE_RANGE" },
+	{ FUSE_READDIRPLUS,     do_readdirplus,     offsetof(struct fuse_read_in, lock_owner),"READDIRPLUS"     },
+	{ FUSE_RENAME2,         do_rename2,         sizeof(struct fuse_rename2_in) + 2,      "RENAME2"         },
+	{ CUSE_INIT,            copper_cuse_lowlevel_init, sizeof(struct cuse_init_in),      "CUSE_INIT"       },
+};
+
+/* Opcodes below this are looked up in a flat table */
+#define FUSE_LL_OPS_MAX 64
+
+static const struct copper_fuse_ll_op* fuse_ll_op(uint32_t opcode) {
+	static const std::vector<const struct copper_fuse_ll_op*> table = [] {
+		std::vector<const struct copper_fuse_ll_op*> t(FUSE_LL_OPS_MAX, nullptr);
+		for (const auto& op : fuse_ll_ops)
+			if (op.opcode < FUSE_LL_OPS_MAX)
+				t[op.opcode] = &op;
+		return t;
+	}();
+
+	if (opcode < FUSE_LL_OPS_MAX)
+		return table[opcode];
+	for (const auto& op : fuse_ll_ops)
+		if (op.opcode == opcode)
+			return &op;
+	return nullptr;
+}
+
+/** ---------------------------------------------------
+ * FOR COPPER FUSE SESSION
+ * ---------------------------------------------------*/
+
+copper_fuse_session::copper_fuse_session(const struct copper_fuse_lowlevel_ops* _op, void* _userdata)
+	: op(*_op), userdata(_userdata), fd(-1), verbose(0), got_init(0), got_destroy(0),
+	  exited(0), error(0), cuse_data(nullptr), mo(nullptr), notify_mmsg(1) {
+	bufsize = FUSE_DEFAULT_MAX_PAGES * getpagesize() + FUSE_BUFFER_HEADER_SIZE;
+
+	memset(&conn, 0, sizeof(conn));
+	conn.max_write = UINT_MAX;
+	conn.max_readahead = UINT_MAX;
+	conn.time_gran = 1;
+	sem_init(&exit_sem, 0, 0);
+}
+
+copper_fuse_session::~copper_fuse_session() {
+	if (got_init && !got_destroy && op.destroy)
+		op.destroy(userdata);
+	if (fd != -1)
+		close(fd);
+	delete cuse_data;
+	delete mo;
+	sem_destroy(&exit_sem);
+}
+
+int copper_fuse_session::mount(const char* mountpoint) {
+	/*
+	 * To allow FUSE daemons to run without privileges, the caller may open
+	 * /dev/fuse before launching the file system and pass on the file
+	 * descriptor by specifying /dev/fd/N as the mount point.
+	 */
+	int passed_fd = copper_fuse_mnt_parse_fd(mountpoint);
+	if (passed_fd != -1) {
+		if (fcntl(passed_fd, F_GETFD) == -1) {
+			erron << "invalid file descriptor /dev/fd/" << passed_fd;
+			return -1;
+		}
+		set_fd(passed_fd);
+		return 0;
+	}
+
+	if (!mo)
+		mo = new copper_fuse_mount_opts;
+	int mounted_fd = copper_fuse_kernel_mount(mountpoint, mo);
+	if (mounted_fd == -1)
+		return -1;
+	set_fd(mounted_fd);
+	this->mountpoint = mountpoint;
+	return 0;
+}
+
+void copper_fuse_session::unmount() {
+	if (mountpoint.empty())
+		return;
+
+	/* The descriptor is closed by copper_fuse_kernel_unmount() */
+	copper_fuse_kernel_unmount(mountpoint.c_str(), fd, mo);
+	fd = -1;
+	mountpoint.clear();
+}
+
+int copper_fuse_session::handoff(int sock, const std::string& state) {
+	if (fd == -1 || !exited.load(std::memory_order_acquire))
+		return -EINVAL;
+
+	copper_fuse_snapshot_writer w;
+	w.put<uint32_t>(got_init);
+	w.put<uint32_t>(conn.proto_major);
+	w.put<uint32_t>(conn.proto_minor);
+	w.put<uint32_t>(conn.max_write);
+	w.put<uint32_t>(conn.max_read);
+	w.put<uint32_t>(conn.max_readahead);
+	w.put<uint64_t>(conn.capable);
+	w.put<uint64_t>(conn.want);
+	w.put<uint32_t>(conn.max_background);
+	w.put<uint32_t>(conn.congestion_threshold);
+	w.put<uint32_t>(conn.time_gran);
+	w.put_str(mountpoint);
+	w.put_str(state);
+
+	int res = copper_fuse_handoff_send(sock, fd, w.buf);
+	if (res < 0)
+		return res;
+
+	/* Our copy of the descriptor goes with the session, the mount stays */
+	got_destroy = 1;
+	mountpoint.clear();
+	return 0;
+}
+
+int copper_fuse_session::takeover(int sock, std::string* state) {
+	int passed_fd;
+	std::string snapshot;
+
+	int res = copper_fuse_handoff_recv(sock, &passed_fd, &snapshot);
+	if (res < 0)
+		return res;
+
+	copper_fuse_snapshot_reader r(snapshot);
+	struct copper_fuse_conn_info c = conn;
+	uint32_t init;
+	std::string mnt;
+
+	r.get(&init);
+	r.get(&c.proto_major);
+	r.get(&c.proto_minor);
+	r.get(&c.max_write);
+	r.get(&c.max_read);
+	r.get(&c.max_readahead);
+	r.get(&c.capable);
+	r.get(&c.want);
+	r.get(&c.max_background);
+	r.get(&c.congestion_threshold);
+	r.get(&c.time_gran);
+	r.get_str(&mnt);
+	r.get_str(state);
+	if (!r.done()) {
+		close(passed_fd);
+		return -EPROTO;
+	}
+
+	set_fd(passed_fd);
+	mountpoint = std::move(mnt);
+	got_init = init;
+	if (got_init) {
+		/* The kernel was told at INIT, let ->init() look but not touch */
+		struct copper_fuse_conn_info seen = c;
+		if (op.init)
+			op.init(userdata, &seen);
+		conn = c;
+		/* Knobs of the library only, the kernel never saw them */
+		conn.max_background_min = seen.max_background_min;
+		conn.max_background_max = seen.max_background_max;
+		conn.target_latency_us = seen.target_latency_us;
+		conn.max_inflight_bytes = seen.max_inflight_bytes;
+		cong.setup(&conn);
+
+		/* The kernel may send writes as large as negotiated */
+		if (bufsize < conn.max_write + FUSE_BUFFER_HEADER_SIZE)
+			bufsize = conn.max_write + FUSE_BUFFER_HEADER_SIZE;
+	}
+	return 0;
+}
+
+void copper_fuse_session::set_fd(int _fd) {
+	fd = _fd;
+}
+
+/* What the kernel lets a filesystem ask for at most */
+static unsigned fuse_max_pages_limit() {
+	unsigned limit = FUSE_MAX_MAX_PAGES;
+	FILE* f = fopen("/proc/sys/fs/fuse/max_pages_limit", "r");
+
+	if (f) {
+		unsigned val;
+		if (fscanf(f, "%u", &val) == 1 && val)
+			limit = val;
+		fclose(f);
+	}
+	return limit;
+}
+
+int copper_fuse_session::set_max_pages(unsigned pages) {
+	if (got_init)
+		return -EBUSY;
+
+	pages = std::max(1u, std::min(pages, fuse_max_pages_limit()));
+	bufsize = (size_t)pages * getpagesize() + FUSE_BUFFER_HEADER_SIZE;
+	return pages;
+}
+
+void copper_fuse_session::exit() {
+	exited.store(1, std::memory_order_release);
+	sem_post(&exit_sem);
+}
+
+int copper_fuse_session::send_msg(struct iovec* iov, int count) {
+	if (verbose) {
+		const struct fuse_out_header* out = (const struct fuse_out_header*)iov[0].iov_base;
+		debug << "   unique: " << out->unique << ", error: " << out->error
+			<< " (" << strerror(-out->error) << "), outsize: " << out->len;
+	}
+
+	/* Most replies are coalesced into one segment, write() skips the iovec import */
+	ssize_t res = count == 1 ? write(fd, iov[0].iov_base, iov[0].iov_len) : writev(fd, iov, count);
+	if (res == -1) {
+		int err = errno;
+		/* ENOENT means the operation was interrupted */
+		if (!exited.load(std::memory_order_relaxed) && err != ENOENT)
+			erron << "writing device: " << strerror(err);
+		return -err;
+	}
+	return 0;
+}
+
+int copper_fuse_session::send_notify_batch(copper_fuse_notify_batch* batch) {
+	size_t count = batch->size();
+	size_t begin = 0;
+	int err = 0;
+
+	if (!got_init)
+		return -ENOTCONN;
+
+	std::vector<struct iovec> iov(count);
+	for (size_t i = 0; i < count; i++) {
+		iov[i].iov_base = &batch->buf[begin];
+		iov[i].iov_len  = batch->ends[i] - begin;
+		begin = batch->ends[i];
+	}
+
+	/* A socket standing in for the device takes the whole batch at once */
+	size_t sent = 0;
+	if (notify_mmsg.load(std::memory_order_relaxed) && count > 1) {
+		std::vector<struct mmsghdr> msgs(count);
+		memset(msgs.data(), 0, count * sizeof(msgs[0]));
+		for (size_t i = 0; i < count; i++) {
+			msgs[i].msg_hdr.msg_iov = &iov[i];
+			msgs[i].msg_hdr.msg_iovlen = 1;
+		}
+		while (sent < count) {
+			int res = sendmmsg(fd, &msgs[sent], count - sent, 0);
+			if (res >= 0) {
+				sent += res;
+			} else if (errno == ENOTSOCK) {
+				notify_mmsg.store(0, std::memory_order_relaxed);
+				break;
+			} else if (errno != EINTR) {
+				return -errno;
+			}
+		}
+	}
+
+	/* One message per write, a released file only fails its own */
+	for (size_t i = sent; i < count; i++) {
+		int res = send_msg(&iov[i], 1);
+		if (res < 0 && res != -ENOENT && !err)
+			err = res;
+	}
+	return err;
+}
+
+fuse_pollhandle::fuse_pollhandle(struct copper_fuse_session* _se, uint64_t _kh)
+	: kh(_kh), se(_se) {
+	se->polls.arm(kh);
+}
+
+fuse_pollhandle::~fuse_pollhandle() {
+	se->polls.release(kh);
+}
+
+int copper_fuse_session::send_notify_poll(uint64_t kh) {
+	struct fuse_notify_poll_wakeup_out outarg;
+	copper_fuse_reply_builder rb;
+	int count;
+
+	if (!got_init)
+		return -ENOTCONN;
+
+	outarg.kh = kh;
+	rb.add(&outarg, sizeof(outarg));
+	struct iovec* iov = rb.finish(0, FUSE_NOTIFY_POLL, &count);
+	int res = send_msg(iov, count);
+	/* The file was released since it was polled */
+	return res == -ENOENT ? 0 : res;
+}
+
+int copper_fuse_session::notify_poll(struct fuse_pollhandle* ph) {
+	/* Already woken and not polled again since */
+	if (!polls.disarm(ph->kh))
+		return 0;
+	return send_notify_poll(ph->kh);
+}
+
+int copper_fuse_session::notify_poll(struct fuse_pollhandle* const* phs, size_t count) {
+	std::vector<uint64_t> khs(count);
+
+	for (size_t i = 0; i < count; i++)
+		khs[i] = phs[i]->kh;
+	count = polls.disarm_batch(khs.data(), count);
+
+	copper_fuse_notify_batch batch;
+	for (size_t i = 0; i < count; i++) {
+		struct fuse_notify_poll_wakeup_out outarg;
+		outarg.kh = khs[i];
+		batch.add(FUSE_NOTIFY_POLL, &outarg, sizeof(outarg));
+	}
+	int res = send_notify_batch(&batch);
+	return res < 0 ? res : (int)count;
+}
+
+/* Admission budget of the loop worker running on this thread, if any */
+static thread_local std::shared_ptr<copper_fuse_budget> fuse_worker_budget;
+
+int copper_fuse_session::receive_buf(char* buf, size_t size) {
+	for (;;) {
+		ssize_t res = read(fd, buf, size);
+		if (res == -1) {
+			int err = errno;
+			/* Woken up by loop_mt(), nothing was read */
+			if (err == EINTR && exited.load(std::memory_order_acquire))
+				return 0;
+			/* ENOENT means the operation was interrupted, it's safe to restart */
+			if (err == EINTR || err == EAGAIN || err == ENOENT)
+				continue;
+			/* Errors occurring during normal operation: the filesystem was unmounted */
+			if (err == ENODEV) {
+				exit();
+				return 0;
+			}
+			erron << "reading device: " << strerror(err);
+			return -err;
+		}
+		if (res == 0) {
+			exit();
+			return 0;
+		}
+		if ((size_t)res < sizeof(struct fuse_in_header)) {
+			erron << "short read on fuse device";
+			return -EIO;
+		}
+		return res;
+	}
+}
+
+void copper_fuse_session::process_buf(const char* buf, size_t len) {
+	const struct fuse_in_header* in = (const struct fuse_in_header*)buf;
+	const void* inarg = buf + sizeof(struct fuse_in_header);
+
+	if (in->len != len) {
+		erron << "request length mismatch: " << in->len << " != " << len;
+		return;
+	}
+
+	copper_fuse_req* req = new (std::nothrow) copper_fuse_req(this, in);
+	if (!req) {
+		struct fuse_out_header out = { sizeof(out), -ENOMEM, in->unique };
+		struct iovec iov = { &out, sizeof(out) };
+		send_msg(&iov, 1);
+		return;
+	}
+
+	const struct copper_fuse_ll_op* op = fuse_ll_op(in->opcode);
+	if (verbose) {
+		debug << "unique: " << in->unique << ", opcode: " << (op ? op->name : "???")
+			<< " (" << in->opcode << "), nodeid: " << in->nodeid
+			<< ", insize: " << len << ", pid: " << in->pid;
+	}
+
+	/* FORGET gets no reply, an INTERRUPT is not interrupted */
+	if (in->opcode != FUSE_INTERRUPT && in->opcode != FUSE_FORGET &&
+		in->opcode != FUSE_BATCH_FORGET) {
+		bool matched;
+		copper_fuse_req* intr = intrs.add(req, &matched);
+		if (intr && matched)
+			intr->reply_none();
+		else if (intr)
+			intr->reply_err(EAGAIN);
+	}
+
+	bool is_init = in->opcode == FUSE_INIT || in->opcode == CUSE_INIT;
+	if (!got_init && !is_init) {
+		req->reply_err(EIO);
+	} else if (got_init && is_init) {
+		req->reply_err(EIO);
+	} else if (!op) {
+		req->reply_err(ENOSYS);
+	} else if (len - sizeof(struct fuse_in_header) < op->insize) {
+		erron << op->name << " request too short";
+		req->reply_err(EINVAL);
+	} else if (!fair.enabled.load(std::memory_order_relaxed) || !fair.submit(this, req, buf, len)) {
+		dispatch(req, in, inarg);
+	}
+}
+
+void copper_fuse_session::dispatch(copper_fuse_req* req, const struct fuse_in_header* in,
+	const void* inarg) {
+	if (in->opcode == FUSE_READ)
+		cong.start(req, ((const struct fuse_read_in*)inarg)->size, fuse_worker_budget);
+	else if (in->opcode == FUSE_WRITE)
+		cong.start(req, ((const struct fuse_write_in*)inarg)->size, fuse_worker_budget);
+	fuse_ll_op(in->opcode)->func(req, in->nodeid, inarg);
+}
+
+/* A receive buffer from the session's pool, returned when the worker ends */
+struct fuse_worker_buf {
+	copper_fuse_bufpool* pool;
+	copper_fuse_recv_buf buf;
+
+public:
+	fuse_worker_buf(copper_fuse_bufpool* _pool) : pool(_pool) {
+		buf.data = nullptr;
+	}
+	~fuse_worker_buf() {
+		release();
+	}
+
+	void release() {
+		if (buf.data)
+			pool->put(&buf);
+	}
+};
+
+int copper_fuse_session::loop() {
+	fuse_worker_buf buf(&bufs);
+	int res = bufs.get(bufsize, &buf.buf);
+	if (res < 0)
+		return res;
+
+	fuse_worker_budget = std::make_shared<copper_fuse_budget>();
+	while (!exited.load(std::memory_order_acquire)) {
+		if (!cong.admit(this, fuse_worker_budget.get()))
+			break;
+		res = receive_buf(buf.buf.data, buf.buf.size);
+		if (res <= 0)
+			break;
+		process_buf(buf.buf.data, res);
+		if (fair.backlog())
+			fair.run(this);
+	}
+
+	fuse_worker_budget.reset();
+	exit();
+	/* Requests held back are answered by this process, a successor never sees them */
+	fair.flush(this);
+	if (error)
+		return error;
+	return res < 0 ? res : 0;
+}
+
+/** ---------------------------------------------------
+ * FOR COPPER FUSE MULTI-THREADED LOOP
+ * ---------------------------------------------------*/
+
+/*
+ * Workers are added while all of them are busy and retire once more
+ * than max_idle_threads have been idle for FUSE_IDLE_RETIRE seconds, so
+ * that a burst doesn't start and end a thread per request.  A timer on
+ * the shared wheel measures it, armed by the first worker going idle
+ * over the limit and cancelled once one is busy again.
+ *
+ * At exit, workers blocked in read() are woken by FUSE_WAKE_SIGNAL: the
+ * read fails with EINTR, or returns a request already taken off the
+ * queue, which is then answered as usual.  pthread_cancel() may act
+ * just after read() returned and drop that request, it's only the last
+ * resort when the signal is ignored or restarts the read.
+ */
+#define FUSE_WAKE_SIGNAL	(SIGRTMIN + 1)
+#define FUSE_WAKE_TIMEOUT	std::chrono::seconds(1)
+#define FUSE_IDLE_RETIRE	1.0
+
+struct copper_fuse_mt_worker {
+	std::thread thread;
+	/* Blocked in or about to enter read(), where a signal is harmless */
+	bool reading;
+	bool stopped;
+};
+
+struct copper_fuse_mt {
+	copper_fuse_session* se;
+	std::mutex lock;
+	std::condition_variable done;
+	std::list<copper_fuse_mt_worker> workers;
+	unsigned numworker;
+	unsigned numavail;
+	unsigned max_idle;
+	unsigned max_threads;
+	int error;
+	/* Armed while too many are idle, `retire` once they were for long enough */
+	copper_fuse_timer idle;
+	bool idle_armed;
+	bool retire;
+};
+
+static std::mutex fuse_wake_lock;
+static unsigned fuse_wake_users;
+static int fuse_wake_installed;
+
+static void fuse_wake_sighandler(int sig) {
+	(void) sig;
+}
+
+/* A no-op handler without SA_RESTART, shared by all loops running */
+static void fuse_wake_signal_get() {
+	std::lock_guard<std::mutex> guard(fuse_wake_lock);
+	struct sigaction old_sa;
+
+	if (fuse_wake_users++ || sigaction(FUSE_WAKE_SIGNAL, nullptr, &old_sa) == -1 ||
+		old_sa.sa_handler != SIG_DFL)
+		return;
+
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = fuse_wake_sighandler;
+	sigemptyset(&sa.sa_mask);
+	if (sigaction(FUSE_WAKE_SIGNAL, &sa, nullptr) == 0)
+		fuse_wake_installed = 1;
+}
+
+static void fuse_wake_signal_put() {
+	std::lock_guard<std::mutex> guard(fuse_wake_lock);
+
+	if (--fuse_wake_users || !fuse_wake_installed)
+		return;
+
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = SIG_DFL;
+	sigaction(FUSE_WAKE_SIGNAL, &sa, nullptr);
+	fuse_wake_installed = 0;
+}
+
+static void fuse_mt_start_worker(copper_fuse_mt* mt);
+
+/* With mt->lock held, once no more than max_idle are idle */
+static void fuse_mt_idle_reset(copper_fuse_mt* mt) {
+	mt->retire = false;
+	if (mt->idle_armed) {
+		copper_fuse_timer_wheel::shared().cancel(&mt->idle);
+		mt->idle_armed = false;
+	}
+}
+
+static void fuse_mt_idle_expired(copper_fuse_mt* mt) {
+	std::lock_guard<std::mutex> guard(mt->lock);
+	mt->idle_armed = false;
+	if (mt->numavail > mt->max_idle)
+		mt->retire = true;
+}
+
+static void fuse_mt_worker(copper_fuse_mt* mt, std::list<copper_fuse_mt_worker>::iterator self) {
+	copper_fuse_session* se = mt->se;
+	fuse_worker_buf buf(&se->bufs);
+
+	if (se->bufs.get(se->bufsize, &buf.buf) < 0) {
+		std::lock_guard<std::mutex> guard(mt->lock);
+		mt->error = -ENOMEM;
+		self->stopped = true;
+		mt->done.notify_all();
+		se->exit();
+		return;
+	}
+
+	fuse_worker_budget = std::make_shared<copper_fuse_budget>();
+	while (!se->exited.load(std::memory_order_acquire)) {
+		int isforget = 0;
+
+		if (!se->cong.admit(se, fuse_worker_budget.get()))
+			break;
+
+		pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, nullptr);
+		int res = se->receive_buf(buf.buf.data, buf.buf.size);
+		pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, nullptr);
+		if (res <= 0) {
+			if (res < 0) {
+				std::lock_guard<std::mutex> guard(mt->lock);
+				mt->error = res;
+			}
+			se->exit();
+			break;
+		}
+
+		const struct fuse_in_header* in = (const struct fuse_in_header*)buf.buf.data;
+		if (in->opcode == FUSE_FORGET || in->opcode == FUSE_BATCH_FORGET)
+			isforget = 1;
+
+		{
+			std::lock_guard<std::mutex> guard(mt->lock);
+			self->reading = false;
+			if (!isforget)
+				mt->numavail--;
+			if (mt->numavail <= mt->max_idle)
+				fuse_mt_idle_reset(mt);
+			/* Once exited, loop_mt() may already be waiting for the last ones */
+			if (mt->numavail == 0 && mt->numworker < mt->max_threads &&
+				!se->exited.load(std::memory_order_acquire))
+				fuse_mt_start_worker(mt);
+		}
+
+		se->process_buf(buf.buf.data, res);
+		if (se->fair.backlog())
+			se->fair.run(se);
+
+		std::unique_lock<std::mutex> guard(mt->lock);
+		if (!isforget)
+			mt->numavail++;
+		if (mt->numavail > mt->max_idle && mt->numworker > 1) {
+			if (se->exited.load(std::memory_order_acquire))
+				break;
+			if (!mt->retire && mt->max_idle && !mt->idle_armed) {
+				/* Without a timer, retire at once */
+				if (copper_fuse_timer_wheel::shared().arm(&mt->idle, FUSE_IDLE_RETIRE) == 0)
+					mt->idle_armed = true;
+				else
+					mt->retire = true;
+			}
+			if (mt->retire || !mt->max_idle) {
+				/* Too many idle workers, this one retires, its buffer stays for the next */
+				buf.release();
+				mt->numworker--;
+				mt->numavail--;
+				if (mt->numavail <= mt->max_idle)
+					fuse_mt_idle_reset(mt);
+				self->thread.detach();
+				mt->workers.erase(self);
+				return;
+			}
+		}
+		self->reading = true;
+	}
+
+	std::lock_guard<std::mutex> guard(mt->lock);
+	self->stopped = true;
+	mt->done.notify_all();
+}
+
+static void fuse_mt_start_worker(copper_fuse_mt* mt) {
+	mt->workers.emplace_back();
+	auto self = std::prev(mt->workers.end());
+	self->reading = true;
+	self->stopped = false;
+	self->thread = std::thread(fuse_mt_worker, mt, self);
+	mt->numworker++;
+	mt->numavail++;
+}
+
+int copper_fuse_session::loop_mt(const struct copper_fuse_loop_config* config) {
+	copper_fuse_mt mt;
+	mt.se = this;
+	mt.numworker = 0;
+	mt.numavail = 0;
+	mt.max_idle = config ? config->max_idle_threads : UINT_MAX;
+	mt.max_threads = config && config->max_threads ? config->max_threads : FUSE_DEFAULT_MAX_THREADS;
+	mt.error = 0;
+	mt.idle.fire = [&mt] { fuse_mt_idle_expired(&mt); };
+	mt.idle_armed = false;
+	mt.retire = false;
+
+	fuse_wake_signal_get();
+	std::unique_lock<std::mutex> guard(mt.lock);
+	fuse_mt_start_worker(&mt);
+	guard.unlock();
+
+	while (!exited.load(std::memory_order_acquire))
+		sem_wait(&exit_sem);
+
+	/*
+	 * Holding the lock, a worker can't leave read() with a request
+	 * and clear `reading` between the check and the signal.
+	 */
+	guard.lock();
+	auto deadline = std::chrono::steady_clock::now() + FUSE_WAKE_TIMEOUT;
+	for (;;) {
+		bool running = false;
+		bool give_up = std::chrono::steady_clock::now() > deadline;
+
+		for (auto& worker : mt.workers) {
+			if (worker.stopped)
+				continue;
+			running = true;
+			if (worker.reading && give_up)
+				pthread_cancel(worker.thread.native_handle());
+			else if (worker.reading)
+				pthread_kill(worker.thread.native_handle(), FUSE_WAKE_SIGNAL);
+		}
+		/* The busy ones stop after their request, without reading again */
+		if (!running || give_up)
+			break;
+		mt.done.wait_for(guard, std::chrono::milliseconds(1));
+	}
+	std::list<copper_fuse_mt_worker> workers;
+	workers.swap(mt.workers);
+	guard.unlock();
+
+	for (auto& worker : workers)
+		worker.thread.join();
+	copper_fuse_timer_wheel::shared().cancel_sync(&mt.idle);
+	fuse_wake_signal_put();
+	fair.flush(this);
+
+	if (error)
+		return error;
+	return mt.error;
+}
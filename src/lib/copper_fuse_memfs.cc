@@ -0,0 +1,1404 @@
+/*
+  CopperFuse: C++ version Filesystem in Userspace
+  Copyright (C) 2023 Chen Miao <chenmiao.ku@gmail.com>
+
+  This program can be distributed under the terms of the GNU LGPLv2.
+  See the file COPYING.LIB.
+*/
+
+#include "copper_fuse_memfs.h"
+#include "copper_log.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <cstdint>
+#include <cstring>
+#include <ctime>
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#define MEMFS_ROOT_INO 1
+
+static constexpr const size_t MEMFS_CHUNK_BYTES =
+	COPPER_MEMFS_PAGE_SIZE << COPPER_MEMFS_MAX_ORDER;
+
+static struct timespec memfs_now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return ts;
+}
+
+/** ---------------------------------------------------
+ * FOR COPPER MEMFS ARENA
+ * ---------------------------------------------------*/
+
+copper_memfs_arena::copper_memfs_arena(size_t _max_bytes)
+	: max_bytes(_max_bytes), used_bytes(0) {}
+
+copper_memfs_arena::~copper_memfs_arena() {
+	for (void* chunk : chunks)
+		munmap(chunk, MEMFS_CHUNK_BYTES);
+}
+
+char* copper_memfs_arena::alloc(unsigned order) {
+	size_t len = COPPER_MEMFS_PAGE_SIZE << order;
+	char* run = nullptr;
+	unsigned o;
+
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		if (max_bytes && used_bytes.load(std::memory_order_relaxed) + len > max_bytes)
+			return nullptr;
+
+		for (o = order; o <= COPPER_MEMFS_MAX_ORDER; o++)
+			if (!free_runs[o].empty()) break;
+
+		if (o > COPPER_MEMFS_MAX_ORDER) {
+			/* Map twice the chunk size and trim it down to an aligned chunk */
+			char* map = (char*)mmap(nullptr, MEMFS_CHUNK_BYTES * 2, PROT_READ | PROT_WRITE,
+				MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+			if (map == MAP_FAILED) {
+				erron << "arena chunk mmap failed: " << strerror(errno);
+				return nullptr;
+			}
+			char* chunk = (char*)(((uintptr_t)map + MEMFS_CHUNK_BYTES - 1) & ~(MEMFS_CHUNK_BYTES - 1));
+			if (chunk != map)
+				munmap(map, chunk - map);
+			munmap(chunk + MEMFS_CHUNK_BYTES, map + MEMFS_CHUNK_BYTES - chunk);
+#ifdef MADV_HUGEPAGE
+			madvise(chunk, MEMFS_CHUNK_BYTES, MADV_HUGEPAGE);
+#endif
+			chunks.push_back(chunk);
+			free_runs[COPPER_MEMFS_MAX_ORDER].insert(chunk);
+			o = COPPER_MEMFS_MAX_ORDER;
+		}
+
+		auto it = free_runs[o].begin();
+		run = *it;
+		free_runs[o].erase(it);
+
+		/* Split the run, handing the upper halves back to the free lists */
+		while (o > order) {
+			o--;
+			free_runs[o].insert(run + (COPPER_MEMFS_PAGE_SIZE << o));
+		}
+		used_bytes.fetch_add(len, std::memory_order_relaxed);
+	}
+
+	memset(run, 0, len);
+	return run;
+}
+
+void copper_memfs_arena::free(char* run, unsigned order) {
+	std::lock_guard<std::mutex> guard(lock);
+
+	used_bytes.fetch_sub(COPPER_MEMFS_PAGE_SIZE << order, std::memory_order_relaxed);
+
+	char* chunk = (char*)((uintptr_t)run & ~(MEMFS_CHUNK_BYTES - 1));
+	while (order < COPPER_MEMFS_MAX_ORDER) {
+		char* buddy = chunk + ((run - chunk) ^ (COPPER_MEMFS_PAGE_SIZE << order));
+		if (!free_runs[order].erase(buddy))
+			break;
+		run = std::min(run, buddy);
+		order++;
+	}
+
+	/* A whole chunk is free again, let the kernel have its pages back */
+	if (order == COPPER_MEMFS_MAX_ORDER)
+		madvise(run, MEMFS_CHUNK_BYTES, MADV_DONTNEED);
+	free_runs[order].insert(run);
+}
+
+/** ---------------------------------------------------
+ * FOR COPPER MEMFS DIRECTORY
+ * ---------------------------------------------------*/
+
+static bool dir_lookup_ino(const copper_memfs_dir* dir, std::string_view name, uint64_t* ino) {
+	auto it = dir->index.find(name);
+	if (it == dir->index.end())
+		return false;
+	*ino = dir->entries[it->second].ino;
+	return true;
+}
+
+static void dir_insert(copper_memfs_dir* dir, std::string_view name, uint64_t ino) {
+	std::unique_ptr<std::string> owned(new std::string(name));
+	dir->index.emplace(*owned, (uint32_t)dir->entries.size());
+	dir->entries.push_back({ std::move(owned), ino });
+}
+
+static void dir_remove(copper_memfs_dir* dir, std::string_view name) {
+	auto it = dir->index.find(name);
+	if (it == dir->index.end())
+		return;
+
+	uint32_t slot = it->second;
+	dir->index.erase(it);
+	dir->entries[slot].name.reset();
+	dir->tombstones++;
+
+	if (dir->index.empty()) {
+		dir->entries.clear();
+		dir->tombstones = 0;
+	} else if (dir->tombstones > 64 && dir->tombstones > dir->entries.size() / 2) {
+		/* Compact the slot array, cookies of live entries shift down */
+		size_t n = 0;
+		for (size_t i = 0; i < dir->entries.size(); i++) {
+			if (!dir->entries[i].name) continue;
+			if (i != n)
+				dir->entries[n] = std::move(dir->entries[i]);
+			dir->index[*dir->entries[n].name] = (uint32_t)n;
+			n++;
+		}
+		dir->entries.resize(n);
+		dir->tombstones = 0;
+	}
+}
+
+static void dir_replace(copper_memfs_dir* dir, std::string_view name, uint64_t ino) {
+	dir->entries[dir->index.find(name)->second].ino = ino;
+}
+
+/** ---------------------------------------------------
+ * FOR COPPER MEMFS INODE TABLE
+ * ---------------------------------------------------*/
+
+copper_memfs::copper_memfs(size_t max_bytes, size_t _max_inodes)
+	: arena(max_bytes), next_ino(MEMFS_ROOT_INO), used_inodes(0) {
+	for (auto& chunk : chunks)
+		chunk.store(nullptr, std::memory_order_relaxed);
+
+	max_inodes = COPPER_MEMFS_CHUNK_INODES * COPPER_MEMFS_MAX_CHUNKS - 1;
+	if (_max_inodes && _max_inodes < max_inodes)
+		max_inodes = _max_inodes;
+
+	copper_memfs_inode* root = alloc_inode(S_IFDIR | 0755);
+	root->nlink = 2;
+	root->dir->parent = root->ino;
+}
+
+copper_memfs::~copper_memfs() {
+	for (auto& chunk : chunks) {
+		copper_memfs_inode* nodes = chunk.load(std::memory_order_relaxed);
+		if (!nodes) continue;
+		for (size_t i = 0; i < COPPER_MEMFS_CHUNK_INODES; i++)
+			if (nodes[i].live)
+				release_data(&nodes[i]);
+		delete[] nodes;
+	}
+}
+
+copper_memfs_inode* copper_memfs::inode(uint64_t ino) const {
+	if (ino / COPPER_MEMFS_CHUNK_INODES >= COPPER_MEMFS_MAX_CHUNKS)
+		return nullptr;
+	copper_memfs_inode* nodes =
+		chunks[ino / COPPER_MEMFS_CHUNK_INODES].load(std::memory_order_acquire);
+	return nodes ? &nodes[ino % COPPER_MEMFS_CHUNK_INODES] : nullptr;
+}
+
+copper_memfs_inode* copper_memfs::alloc_inode(mode_t mode) {
+	uint64_t ino;
+
+	{
+		std::lock_guard<std::mutex> guard(table_lock);
+		if (used_inodes.load(std::memory_order_relaxed) >= max_inodes)
+			return nullptr;
+
+		if (!free_inos.empty()) {
+			ino = free_inos.back();
+			free_inos.pop_back();
+		} else {
+			ino = next_ino++;
+			size_t idx = ino / COPPER_MEMFS_CHUNK_INODES;
+			if (!chunks[idx].load(std::memory_order_relaxed)) {
+				copper_memfs_inode* nodes = new (std::nothrow) copper_memfs_inode[COPPER_MEMFS_CHUNK_INODES];
+				if (!nodes) {
+					next_ino--;
+					return nullptr;
+				}
+				for (size_t i = 0; i < COPPER_MEMFS_CHUNK_INODES; i++) {
+					nodes[i].refs.store(0, std::memory_order_relaxed);
+					nodes[i].generation = 0;
+					nodes[i].live = false;
+				}
+				chunks[idx].store(nodes, std::memory_order_release);
+			}
+		}
+		used_inodes.fetch_add(1, std::memory_order_relaxed);
+	}
+
+	copper_memfs_inode* node = inode(ino);
+	std::unique_lock<std::shared_mutex> guard(node->lock);
+	struct timespec now = memfs_now();
+
+	node->opencount = 0;
+	node->generation++;
+	node->live  = true;
+	node->ino   = ino;
+	node->mode  = mode;
+	node->nlink = 1;
+	/* Owned by the caller, by us outside a request or for an unknown caller */
+	const struct copper_fuse_context* ctx = copper_fuse_get_context();
+	bool caller = ctx->fuse && ctx->pid;
+	node->uid   = caller ? ctx->uid : getuid();
+	node->gid   = caller ? ctx->gid : getgid();
+	node->rdev  = 0;
+	node->size  = 0;
+	node->atime = node->mtime = node->ctime = now;
+	memset(node->inline_data, 0, sizeof(node->inline_data));
+	node->extents.clear();
+	node->link.clear();
+	if (S_ISDIR(mode)) {
+		node->dir.reset(new copper_memfs_dir());
+		node->dir->tombstones = 0;
+	} else {
+		node->dir.reset();
+	}
+	return node;
+}
+
+/* Called with node->lock held exclusively */
+void copper_memfs::free_inode(copper_memfs_inode* node) {
+	release_data(node);
+	node->dir.reset();
+	node->link.clear();
+	node->link.shrink_to_fit();
+	node->live = false;
+
+	std::lock_guard<std::mutex> guard(table_lock);
+	free_inos.push_back(node->ino);
+	used_inodes.fetch_sub(1, std::memory_order_relaxed);
+}
+
+static bool memfs_reclaimable(const copper_memfs_inode* node) {
+	return node->live && !node->nlink && !node->opencount &&
+		!node->refs.load(std::memory_order_acquire);
+}
+
+void copper_memfs::put(copper_memfs_inode* node) {
+	if (node->refs.fetch_sub(1, std::memory_order_acq_rel) != 1)
+		return;
+
+	std::unique_lock<std::shared_mutex> guard(node->lock);
+	if (memfs_reclaimable(node))
+		free_inode(node);
+}
+
+/** ---------------------------------------------------
+ * FOR COPPER MEMFS PATH RESOLUTION
+ * ---------------------------------------------------*/
+
+int copper_memfs::resolve(std::string_view path, copper_memfs_inode** nodep) {
+	copper_memfs_inode* node = inode(MEMFS_ROOT_INO);
+	node->refs.fetch_add(1, std::memory_order_relaxed);
+
+	size_t pos = 0;
+	while (pos < path.size()) {
+		if (path[pos] == '/') {
+			pos++;
+			continue;
+		}
+		size_t end = path.find('/', pos);
+		if (end == std::string_view::npos) end = path.size();
+		std::string_view name = path.substr(pos, end - pos);
+		pos = end;
+
+		copper_memfs_inode* child = nullptr;
+		{
+			std::shared_lock<std::shared_mutex> guard(node->lock);
+			if (!node->dir) {
+				guard.unlock();
+				put(node);
+				return -ENOTDIR;
+			}
+			uint64_t ino;
+			if (dir_lookup_ino(node->dir.get(), name, &ino)) {
+				/* An entry always names a live inode, a missing one is corruption */
+				child = inode(ino);
+				if (!child) {
+					guard.unlock();
+					put(node);
+					return -EIO;
+				}
+				child->refs.fetch_add(1, std::memory_order_relaxed);
+			}
+		}
+		put(node);
+		if (!child)
+			return -ENOENT;
+		node = child;
+	}
+
+	*nodep = node;
+	return 0;
+}
+
+int copper_memfs::resolve_parent(std::string_view path, copper_memfs_inode** parentp,
+	std::string_view* name) {
+	while (path.size() > 1 && path.back() == '/')
+		path.remove_suffix(1);
+
+	size_t slash = path.rfind('/');
+	if (slash == std::string_view::npos)
+		return -EINVAL;
+
+	*name = path.substr(slash + 1);
+	if (name->empty())
+		return -EBUSY;
+	if (name->size() > NAME_MAX)
+		return -ENAMETOOLONG;
+
+	copper_memfs_inode* parent;
+	int res = resolve(path.substr(0, slash), &parent);
+	if (res != 0)
+		return res;
+	if (!S_ISDIR(parent->mode)) {
+		put(parent);
+		return -ENOTDIR;
+	}
+	*parentp = parent;
+	return 0;
+}
+
+int copper_memfs::resolve_fi(const char* path, struct fuse_file_info* fi,
+	copper_memfs_inode** nodep) {
+	if (fi && fi->fh) {
+		copper_memfs_inode* node = inode(fi->fh);
+		if (!node)
+			return -EBADF;
+		node->refs.fetch_add(1, std::memory_order_relaxed);
+		*nodep = node;
+		return 0;
+	}
+	if (!path)
+		return -EBADF;
+	return resolve(path, nodep);
+}
+
+void copper_memfs::fill_stat(const copper_memfs_inode* node, struct stat* stbuf) const {
+	size_t allocated = 0;
+	for (const auto& ext : node->extents)
+		allocated += ext.len;
+
+	memset(stbuf, 0, sizeof(struct stat));
+	stbuf->st_ino     = node->ino;
+	stbuf->st_mode    = node->mode;
+	stbuf->st_nlink   = node->nlink;
+	stbuf->st_uid     = node->uid;
+	stbuf->st_gid     = node->gid;
+	stbuf->st_rdev    = node->rdev;
+	stbuf->st_size    = node->size;
+	stbuf->st_blksize = COPPER_MEMFS_PAGE_SIZE;
+	stbuf->st_blocks  = allocated / 512;
+	stbuf->st_atim    = node->atime;
+	stbuf->st_mtim    = node->mtime;
+	stbuf->st_ctim    = node->ctime;
+}
+
+/** ---------------------------------------------------
+ * FOR COPPER MEMFS FILE DATA
+ * ---------------------------------------------------*/
+
+static unsigned memfs_order_for(size_t pages) {
+	unsigned order = 0;
+	while (order < COPPER_MEMFS_MAX_ORDER && ((size_t)1 << order) < pages)
+		order++;
+	return order;
+}
+
+/* Index of the first extent that ends after `off` */
+static size_t memfs_extent_at(const std::vector<copper_memfs_extent>& extents, off_t off) {
+	auto it = std::upper_bound(extents.begin(), extents.end(), off,
+		[](off_t o, const copper_memfs_extent& ext) { return o < ext.off + (off_t)ext.len; });
+	return it - extents.begin();
+}
+
+void copper_memfs::release_data(copper_memfs_inode* node) {
+	for (const auto& ext : node->extents)
+		arena.free(ext.data, ext.order);
+	node->extents.clear();
+	node->extents.shrink_to_fit();
+	memset(node->inline_data, 0, sizeof(node->inline_data));
+}
+
+/**
+ * Make sure [off, end) is backed by extents, allocating runs for holes.
+ * Appending files get runs that grow with the file so that large files
+ * end up in few, large extents.
+ */
+int copper_memfs::materialize(copper_memfs_inode* node, off_t off, off_t end) {
+	auto& extents = node->extents;
+	off_t pos = off & ~(off_t)(COPPER_MEMFS_PAGE_SIZE - 1);
+	size_t i = memfs_extent_at(extents, pos);
+
+	if (extents.empty() && node->size > 0) {
+		/* The data still lives inline, move it to the first page */
+		char* data = arena.alloc(0);
+		if (!data)
+			return -ENOSPC;
+		memcpy(data, node->inline_data, std::min<size_t>(node->size, COPPER_MEMFS_INLINE_MAX));
+		memset(node->inline_data, 0, sizeof(node->inline_data));
+		extents.push_back({ 0, COPPER_MEMFS_PAGE_SIZE, data, 0 });
+		i = memfs_extent_at(extents, pos);
+	}
+
+	while (pos < end) {
+		if (i < extents.size() && extents[i].off <= pos) {
+			pos = extents[i].off + extents[i].len;
+			i++;
+			continue;
+		}
+
+		off_t gap_end = i < extents.size() ? extents[i].off : INT64_MAX;
+		size_t need = (std::min(end, gap_end) - pos + COPPER_MEMFS_PAGE_SIZE - 1) /
+			COPPER_MEMFS_PAGE_SIZE;
+		unsigned order = std::max(memfs_order_for(need),
+			memfs_order_for(((size_t)node->size / COPPER_MEMFS_PAGE_SIZE) >> 2));
+		while (order && pos + (off_t)(COPPER_MEMFS_PAGE_SIZE << order) > gap_end)
+			order--;
+
+		char* data = arena.alloc(order);
+		if (!data)
+			return -ENOSPC;
+		extents.insert(extents.begin() + i,
+			{ pos, COPPER_MEMFS_PAGE_SIZE << order, data, order });
+		pos += COPPER_MEMFS_PAGE_SIZE << order;
+		i++;
+	}
+	return 0;
+}
+
+ssize_t copper_memfs::read_data(copper_memfs_inode* node, char* buf, size_t size, off_t off) {
+	if (off >= node->size)
+		return 0;
+	size = std::min<size_t>(size, node->size - off);
+	off_t end = off + size;
+
+	if (node->extents.empty()) {
+		size_t inl = off < (off_t)COPPER_MEMFS_INLINE_MAX ?
+			std::min<size_t>(size, COPPER_MEMFS_INLINE_MAX - off) : 0;
+		memcpy(buf, node->inline_data + off, inl);
+		memset(buf + inl, 0, size - inl);
+		return size;
+	}
+
+	off_t pos = off;
+	for (size_t i = memfs_extent_at(node->extents, off); pos < end; i++) {
+		off_t next = end;
+		if (i < node->extents.size())
+			next = std::min(end, node->extents[i].off);
+		if (pos < next) {
+			/* hole */
+			memset(buf + (pos - off), 0, next - pos);
+			pos = next;
+		}
+		if (pos >= end || i >= node->extents.size())
+			break;
+
+		const copper_memfs_extent& ext = node->extents[i];
+		size_t n = std::min<off_t>(end, ext.off + ext.len) - pos;
+		memcpy(buf + (pos - off), ext.data + (pos - ext.off), n);
+		pos += n;
+	}
+	return size;
+}
+
+ssize_t copper_memfs::write_data(copper_memfs_inode* node, const char* buf, size_t size, off_t off) {
+	off_t end = off + size;
+
+	if (size == 0)
+		return 0;
+	if (node->extents.empty() && end <= (off_t)COPPER_MEMFS_INLINE_MAX) {
+		memcpy(node->inline_data + off, buf, size);
+	} else {
+		int res = materialize(node, off, end);
+		if (res != 0)
+			return res;
+
+		off_t pos = off;
+		for (size_t i = memfs_extent_at(node->extents, off); pos < end; i++) {
+			const copper_memfs_extent& ext = node->extents[i];
+			size_t n = std::min<off_t>(end, ext.off + ext.len) - pos;
+			memcpy(ext.data + (pos - ext.off), buf + (pos - off), n);
+			pos += n;
+		}
+	}
+
+	if (end > node->size)
+		node->size = end;
+	return size;
+}
+
+int copper_memfs::resize_data(copper_memfs_inode* node, off_t size) {
+	auto& extents = node->extents;
+
+	if (size >= node->size) {
+		/* Bytes past EOF are always zero, growing only creates a hole */
+		node->size = size;
+		return 0;
+	}
+
+	if (extents.empty()) {
+		if (size < (off_t)COPPER_MEMFS_INLINE_MAX)
+			memset(node->inline_data + size, 0, COPPER_MEMFS_INLINE_MAX - size);
+	} else if (size <= (off_t)COPPER_MEMFS_INLINE_MAX) {
+		/* Small enough to go back inline */
+		char head[COPPER_MEMFS_INLINE_MAX] = { 0 };
+		if (extents[0].off == 0)
+			memcpy(head, extents[0].data, size);
+		release_data(node);
+		memcpy(node->inline_data, head, size);
+	} else {
+		size_t i = memfs_extent_at(extents, size);
+		if (i < extents.size() && extents[i].off < size) {
+			copper_memfs_extent& ext = extents[i];
+			memset(ext.data + (size - ext.off), 0, ext.len - (size - ext.off));
+			i++;
+		}
+		for (size_t j = i; j < extents.size(); j++)
+			arena.free(extents[j].data, extents[j].order);
+		extents.erase(extents.begin() + i, extents.end());
+	}
+
+	node->size = size;
+	return 0;
+}
+
+/**
+ * Turn [off, end) into a hole.  Runs only partly inside the range are
+ * split into their buddy halves until the pieces inside can be given
+ * back to the arena; single pages that stay are zeroed instead.
+ */
+void copper_memfs::punch_data(copper_memfs_inode* node, off_t off, off_t end) {
+	auto& extents = node->extents;
+
+	end = std::min(end, (off_t)node->size);
+	if (off >= end)
+		return;
+
+	if (extents.empty()) {
+		if (off < (off_t)COPPER_MEMFS_INLINE_MAX)
+			memset(node->inline_data + off, 0,
+				std::min<off_t>(end, COPPER_MEMFS_INLINE_MAX) - off);
+		return;
+	}
+
+	size_t i = memfs_extent_at(extents, off);
+	while (i < extents.size() && extents[i].off < end) {
+		copper_memfs_extent& ext = extents[i];
+		off_t ext_end = ext.off + ext.len;
+
+		if (off <= ext.off && ext_end <= end) {
+			arena.free(ext.data, ext.order);
+			extents.erase(extents.begin() + i);
+		} else if (ext.order > 0) {
+			copper_memfs_extent upper = { ext.off + (off_t)ext.len / 2, ext.len / 2,
+				ext.data + ext.len / 2, ext.order - 1 };
+			ext.len /= 2;
+			ext.order--;
+			extents.insert(extents.begin() + i + 1, upper);
+			/* Look at the lower half again, unless it lies before the hole */
+			if (extents[i].off + (off_t)extents[i].len <= off)
+				i++;
+		} else {
+			off_t from = std::max(off, ext.off);
+			off_t to = std::min(end, ext_end);
+			memset(ext.data + (from - ext.off), 0, to - from);
+			i++;
+		}
+	}
+}
+
+/** ---------------------------------------------------
+ * FOR COPPER MEMFS OPERATIONS
+ * ---------------------------------------------------*/
+
+copper_fuse_operations copper_memfs::operations() {
+#define MEMFS_OP(name) \
+	op.name = [this](auto... args) { return this->name(args...); }
+
+	copper_fuse_operations op;
+	MEMFS_OP(getattr);
+	MEMFS_OP(readlink);
+	MEMFS_OP(mknod);
+	MEMFS_OP(mkdir);
+	MEMFS_OP(unlink);
+	MEMFS_OP(rmdir);
+	MEMFS_OP(symlink);
+	MEMFS_OP(rename);
+	MEMFS_OP(link);
+	MEMFS_OP(chmod);
+	MEMFS_OP(chown);
+	MEMFS_OP(truncate);
+	MEMFS_OP(open);
+	MEMFS_OP(create);
+	MEMFS_OP(read);
+	MEMFS_OP(write);
+	MEMFS_OP(statfs);
+	MEMFS_OP(release);
+	MEMFS_OP(opendir);
+	MEMFS_OP(readdir);
+	MEMFS_OP(releasedir);
+	MEMFS_OP(utimens);
+	MEMFS_OP(fallocate);
+	MEMFS_OP(lseek);
+	op.init = [this](copper_fuse_conn_info* conn, copper_fuse_config* cfg) -> void* {
+		static_cast<void>(conn);
+		cfg->use_ino = 1;
+		cfg->nullpath_ok = 1;
+		return this;
+	};
+	return op;
+
+#undef MEMFS_OP
+}
+
+int copper_memfs::getattr(const char* path, struct stat* stbuf, struct fuse_file_info* fi) {
+	copper_memfs_inode* node;
+	int res = resolve_fi(path, fi, &node);
+	if (res != 0)
+		return res;
+
+	{
+		std::shared_lock<std::shared_mutex> guard(node->lock);
+		fill_stat(node, stbuf);
+	}
+	put(node);
+	return 0;
+}
+
+int copper_memfs::readlink(const char* path, char* buf, size_t size) {
+	copper_memfs_inode* node;
+	int res = resolve(path, &node);
+	if (res != 0)
+		return res;
+
+	{
+		std::shared_lock<std::shared_mutex> guard(node->lock);
+		if (!S_ISLNK(node->mode)) {
+			res = -EINVAL;
+		} else if (size) {
+			size_t n = std::min(size - 1, node->link.size());
+			memcpy(buf, node->link.data(), n);
+			buf[n] = '\0';
+		}
+	}
+	put(node);
+	return res;
+}
+
+int copper_memfs::make_node(const char* path, mode_t mode, dev_t rdev,
+	const char* link, copper_memfs_inode** nodep) {
+	copper_memfs_inode* parent;
+	std::string_view name;
+	int res = resolve_parent(path, &parent, &name);
+	if (res != 0)
+		return res;
+
+	{
+		std::unique_lock<std::shared_mutex> guard(parent->lock);
+		uint64_t ino;
+		if (!parent->nlink) {
+			res = -ENOENT;
+		} else if (dir_lookup_ino(parent->dir.get(), name, &ino)) {
+			res = -EEXIST;
+		} else {
+			copper_memfs_inode* node = alloc_inode(mode);
+			if (!node) {
+				res = -ENOSPC;
+			} else {
+				node->rdev = rdev;
+				if (link)
+					node->link = link;
+				if (node->dir) {
+					node->nlink = 2;
+					node->dir->parent = parent->ino;
+					parent->nlink++;
+				}
+				if (nodep) {
+					node->refs.fetch_add(1, std::memory_order_relaxed);
+					*nodep = node;
+				}
+				dir_insert(parent->dir.get(), name, node->ino);
+				parent->mtime = parent->ctime = node->ctime;
+			}
+		}
+	}
+	put(parent);
+	return res;
+}
+
+int copper_memfs::mknod(const char* path, mode_t mode, dev_t rdev) {
+	return make_node(path, mode, rdev, nullptr, nullptr);
+}
+
+int copper_memfs::mkdir(const char* path, mode_t mode) {
+	return make_node(path, S_IFDIR | (mode & 07777), 0, nullptr, nullptr);
+}
+
+int copper_memfs::symlink(const char* from, const char* to) {
+	if (strlen(from) >= PATH_MAX)
+		return -ENAMETOOLONG;
+
+	copper_memfs_inode* node;
+	int res = make_node(to, S_IFLNK | 0777, 0, from, &node);
+	if (res != 0)
+		return res;
+	{
+		std::unique_lock<std::shared_mutex> guard(node->lock);
+		node->size = strlen(from);
+	}
+	put(node);
+	return 0;
+}
+
+int copper_memfs::remove_node(const char* path, bool dir) {
+	copper_memfs_inode* parent;
+	copper_memfs_inode* node = nullptr;
+	std::string_view name;
+	int res = resolve_parent(path, &parent, &name);
+	if (res != 0)
+		return res;
+
+	{
+		std::unique_lock<std::shared_mutex> guard(parent->lock);
+		uint64_t ino;
+		if (!dir_lookup_ino(parent->dir.get(), name, &ino)) {
+			res = -ENOENT;
+		} else if (!(node = inode(ino))) {
+			res = -EIO;
+		} else {
+			node->refs.fetch_add(1, std::memory_order_relaxed);
+
+			std::unique_lock<std::shared_mutex> child_guard(node->lock);
+			struct timespec now = memfs_now();
+			if (dir && !node->dir) {
+				res = -ENOTDIR;
+			} else if (dir && !node->dir->index.empty()) {
+				res = -ENOTEMPTY;
+			} else if (!dir && node->dir) {
+				res = -EISDIR;
+			} else {
+				if (dir) {
+					node->nlink = 0;
+					parent->nlink--;
+				} else {
+					node->nlink--;
+				}
+				node->ctime = now;
+				dir_remove(parent->dir.get(), name);
+				parent->mtime = parent->ctime = now;
+			}
+		}
+	}
+	if (node)
+		put(node);
+	put(parent);
+	return res;
+}
+
+int copper_memfs::unlink(const char* path) {
+	return remove_node(path, false);
+}
+
+int copper_memfs::rmdir(const char* path) {
+	return remove_node(path, true);
+}
+
+/* Lock two inodes exclusively, lower inode number first */
+static void memfs_lock_pair(copper_memfs_inode* a, copper_memfs_inode* b) {
+	if (a == b) {
+		a->lock.lock();
+	} else if (a->ino < b->ino) {
+		a->lock.lock();
+		b->lock.lock();
+	} else {
+		b->lock.lock();
+		a->lock.lock();
+	}
+}
+
+/*
+ * Lock two inodes exclusively.  Every other operation locks a parent
+ * before its child, so of two related directories the ancestor goes
+ * first; inode numbers are reused and only order unrelated inodes.
+ * Called with rename_lock held, which keeps the parent pointers still
+ */
+void copper_memfs::lock_pair(copper_memfs_inode* a, copper_memfs_inode* b) {
+	if (a != b && a->dir && b->dir) {
+		if (is_below(b, a->ino)) {
+			a->lock.lock();
+			b->lock.lock();
+			return;
+		}
+		if (is_below(a, b->ino)) {
+			b->lock.lock();
+			a->lock.lock();
+			return;
+		}
+	}
+	memfs_lock_pair(a, b);
+}
+
+static void memfs_unlock_pair(copper_memfs_inode* a, copper_memfs_inode* b) {
+	a->lock.unlock();
+	if (a != b)
+		b->lock.unlock();
+}
+
+int copper_memfs::rename(const char* from, const char* to, unsigned int flags) {
+	if (flags & ~(RENAME_NOREPLACE | RENAME_EXCHANGE))
+		return -EINVAL;
+	if ((flags & RENAME_NOREPLACE) && (flags & RENAME_EXCHANGE))
+		return -EINVAL;
+
+	copper_memfs_inode *fp, *tp;
+	copper_memfs_inode *src = nullptr, *dst = nullptr;
+	std::string_view fname, tname;
+	int res = resolve_parent(from, &fp, &fname);
+	if (res != 0)
+		return res;
+	res = resolve_parent(to, &tp, &tname);
+	if (res != 0) {
+		put(fp);
+		return res;
+	}
+
+	/* Parent pointers of directories only change under rename_lock */
+	std::unique_lock<std::mutex> rename_guard(rename_lock, std::defer_lock);
+	if (fp != tp) {
+		rename_guard.lock();
+		lock_pair(fp, tp);
+	} else {
+		fp->lock.lock();
+	}
+	uint64_t ino;
+	if (!fp->nlink || !tp->nlink || !dir_lookup_ino(fp->dir.get(), fname, &ino)) {
+		res = -ENOENT;
+		goto out_unlock;
+	}
+	src = inode(ino);
+	if (!src) {
+		res = -EIO;
+		goto out_unlock;
+	}
+	src->refs.fetch_add(1, std::memory_order_relaxed);
+	if (dir_lookup_ino(tp->dir.get(), tname, &ino)) {
+		dst = inode(ino);
+		if (!dst) {
+			res = -EIO;
+			goto out_unlock;
+		}
+		dst->refs.fetch_add(1, std::memory_order_relaxed);
+	}
+
+	if (src == dst)
+		goto out_unlock;
+	if (!dst && (flags & RENAME_EXCHANGE)) {
+		res = -ENOENT;
+		goto out_unlock;
+	}
+	if (dst && (flags & RENAME_NOREPLACE)) {
+		res = -EEXIST;
+		goto out_unlock;
+	}
+	if (src == tp || dst == fp) {
+		/* Moving a directory into itself, or over one of its ancestors */
+		res = (flags & RENAME_EXCHANGE) || src == tp ? -EINVAL : -ENOTEMPTY;
+		goto out_unlock;
+	}
+	if (fp != tp) {
+		if (S_ISDIR(src->mode) && is_below(tp, src->ino)) {
+			res = -EINVAL;
+			goto out_unlock;
+		}
+		if (dst && S_ISDIR(dst->mode) && is_below(fp, dst->ino)) {
+			/* dst is an ancestor of src, it can't be empty */
+			res = (flags & RENAME_EXCHANGE) ? -EINVAL : -ENOTEMPTY;
+			goto out_unlock;
+		}
+	}
+
+	/* Entries of one directory are siblings, neither is below the other */
+	if (rename_guard.owns_lock())
+		lock_pair(src, dst ? dst : src);
+	else
+		memfs_lock_pair(src, dst ? dst : src);
+	{
+		struct timespec now = memfs_now();
+		bool src_dir = S_ISDIR(src->mode);
+		bool dst_dir = dst && S_ISDIR(dst->mode);
+
+		if (flags & RENAME_EXCHANGE) {
+			dir_replace(fp->dir.get(), fname, dst->ino);
+			dir_replace(tp->dir.get(), tname, src->ino);
+			if (src_dir) src->dir->parent = tp->ino;
+			if (dst_dir) dst->dir->parent = fp->ino;
+			if (src_dir != dst_dir) {
+				fp->nlink += src_dir ? -1 : 1;
+				tp->nlink += src_dir ? 1 : -1;
+			}
+			dst->ctime = now;
+		} else {
+			if (dst) {
+				if (src_dir && !dst_dir)
+					res = -ENOTDIR;
+				else if (!src_dir && dst_dir)
+					res = -EISDIR;
+				else if (dst_dir && !dst->dir->index.empty())
+					res = -ENOTEMPTY;
+			}
+			if (res == 0) {
+				if (dst) {
+					if (dst_dir) {
+						dst->nlink = 0;
+						tp->nlink--;
+					} else {
+						dst->nlink--;
+					}
+					dst->ctime = now;
+					dir_replace(tp->dir.get(), tname, src->ino);
+				} else {
+					dir_insert(tp->dir.get(), tname, src->ino);
+				}
+				dir_remove(fp->dir.get(), fname);
+				if (src_dir) {
+					src->dir->parent = tp->ino;
+					fp->nlink--;
+					tp->nlink++;
+				}
+			}
+		}
+		if (res == 0) {
+			src->ctime = now;
+			fp->mtime = fp->ctime = now;
+			tp->mtime = tp->ctime = now;
+		}
+	}
+	memfs_unlock_pair(src, dst ? dst : src);
+
+out_unlock:
+	memfs_unlock_pair(fp, tp);
+	if (rename_guard.owns_lock())
+		rename_guard.unlock();
+	if (dst)
+		put(dst);
+	if (src)
+		put(src);
+	put(tp);
+	put(fp);
+	return res;
+}
+
+/* Is `node` the directory `ino` or below it?  Called with rename_lock held */
+bool copper_memfs::is_below(const copper_memfs_inode* node, uint64_t ino) const {
+	for (;;) {
+		if (node->ino == ino)
+			return true;
+		if (node->ino == MEMFS_ROOT_INO)
+			return false;
+		node = inode(node->dir->parent);
+		/* Reached a directory removed meanwhile, the chain ends there */
+		if (!node || !node->dir)
+			return false;
+	}
+}
+
+int copper_memfs::link(const char* from, const char* to) {
+	copper_memfs_inode* node;
+	copper_memfs_inode* parent;
+	std::string_view name;
+	int res = resolve(from, &node);
+	if (res != 0)
+		return res;
+	if (S_ISDIR(node->mode)) {
+		put(node);
+		return -EPERM;
+	}
+	res = resolve_parent(to, &parent, &name);
+	if (res != 0) {
+		put(node);
+		return res;
+	}
+
+	{
+		std::unique_lock<std::shared_mutex> guard(parent->lock);
+		uint64_t ino;
+		if (!parent->nlink) {
+			res = -ENOENT;
+		} else if (dir_lookup_ino(parent->dir.get(), name, &ino)) {
+			res = -EEXIST;
+		} else {
+			std::unique_lock<std::shared_mutex> child_guard(node->lock);
+			if (!node->nlink) {
+				res = -ENOENT;
+			} else {
+				struct timespec now = memfs_now();
+				node->nlink++;
+				node->ctime = now;
+				dir_insert(parent->dir.get(), name, node->ino);
+				parent->mtime = parent->ctime = now;
+			}
+		}
+	}
+	put(parent);
+	put(node);
+	return res;
+}
+
+int copper_memfs::chmod(const char* path, mode_t mode, struct fuse_file_info* fi) {
+	copper_memfs_inode* node;
+	int res = resolve_fi(path, fi, &node);
+	if (res != 0)
+		return res;
+
+	{
+		std::unique_lock<std::shared_mutex> guard(node->lock);
+		node->mode  = (node->mode & S_IFMT) | (mode & 07777);
+		node->ctime = memfs_now();
+	}
+	put(node);
+	return 0;
+}
+
+int copper_memfs::chown(const char* path, uid_t uid, gid_t gid, struct fuse_file_info* fi) {
+	copper_memfs_inode* node;
+	int res = resolve_fi(path, fi, &node);
+	if (res != 0)
+		return res;
+
+	{
+		std::unique_lock<std::shared_mutex> guard(node->lock);
+		if (uid != (uid_t)-1) node->uid = uid;
+		if (gid != (gid_t)-1) node->gid = gid;
+		node->ctime = memfs_now();
+	}
+	put(node);
+	return 0;
+}
+
+int copper_memfs::truncate(const char* path, off_t size, struct fuse_file_info* fi) {
+	copper_memfs_inode* node;
+	int res = resolve_fi(path, fi, &node);
+	if (res != 0)
+		return res;
+
+	{
+		std::unique_lock<std::shared_mutex> guard(node->lock);
+		if (node->dir)
+			res = -EISDIR;
+		else if (!S_ISREG(node->mode))
+			res = -EINVAL;
+		else if (size < 0)
+			res = -EINVAL;
+		else
+			res = resize_data(node, size);
+		if (res == 0)
+			node->mtime = node->ctime = memfs_now();
+	}
+	put(node);
+	return res;
+}
+
+int copper_memfs::open(const char* path, struct fuse_file_info* fi) {
+	copper_memfs_inode* node;
+	int res = resolve(path, &node);
+	if (res != 0)
+		return res;
+
+	{
+		std::unique_lock<std::shared_mutex> guard(node->lock);
+		if (node->dir && (fi->flags & O_ACCMODE) != O_RDONLY) {
+			res = -EISDIR;
+		} else {
+			if ((fi->flags & O_TRUNC) && S_ISREG(node->mode) && node->size) {
+				resize_data(node, 0);
+				node->mtime = node->ctime = memfs_now();
+			}
+			node->opencount++;
+			fi->fh = node->ino;
+		}
+	}
+	put(node);
+	return res;
+}
+
+int copper_memfs::create(const char* path, mode_t mode, struct fuse_file_info* fi) {
+	copper_memfs_inode* node;
+	int res = make_node(path, S_IFREG | (mode & 07777), 0, nullptr, &node);
+	if (res == -EEXIST && !(fi->flags & O_EXCL))
+		return open(path, fi);
+	if (res != 0)
+		return res;
+
+	{
+		std::unique_lock<std::shared_mutex> guard(node->lock);
+		node->opencount++;
+		fi->fh = node->ino;
+	}
+	put(node);
+	return 0;
+}
+
+int copper_memfs::read(const char* path, char* buf, size_t size, off_t off, struct fuse_file_info* fi) {
+	copper_memfs_inode* node;
+	int res = resolve_fi(path, fi, &node);
+	if (res != 0)
+		return res;
+
+	{
+		std::shared_lock<std::shared_mutex> guard(node->lock);
+		if (node->dir)
+			res = -EISDIR;
+		else
+			res = read_data(node, buf, std::min<size_t>(size, INT_MAX), off);
+	}
+	put(node);
+	return res;
+}
+
+int copper_memfs::write(const char* path, const char* buf, size_t size, off_t off, struct fuse_file_info* fi) {
+	copper_memfs_inode* node;
+	int res = resolve_fi(path, fi, &node);
+	if (res != 0)
+		return res;
+
+	{
+		std::unique_lock<std::shared_mutex> guard(node->lock);
+		if (node->dir) {
+			res = -EISDIR;
+		} else {
+			res = write_data(node, buf, std::min<size_t>(size, INT_MAX), off);
+			if (res > 0)
+				node->mtime = node->ctime = memfs_now();
+		}
+	}
+	put(node);
+	return res;
+}
+
+int copper_memfs::statfs(const char* path, struct statvfs* stbuf) {
+	static_cast<void>(path);
+
+	size_t total = arena.max_bytes;
+	if (!total)
+		total = (size_t)sysconf(_SC_PHYS_PAGES) * sysconf(_SC_PAGESIZE) / 2;
+	size_t used = arena.used_bytes.load(std::memory_order_relaxed);
+	size_t inodes = used_inodes.load(std::memory_order_relaxed);
+
+	memset(stbuf, 0, sizeof(struct statvfs));
+	stbuf->f_bsize   = COPPER_MEMFS_PAGE_SIZE;
+	stbuf->f_frsize  = COPPER_MEMFS_PAGE_SIZE;
+	stbuf->f_blocks  = total / COPPER_MEMFS_PAGE_SIZE;
+	stbuf->f_bfree   = used < total ? (total - used) / COPPER_MEMFS_PAGE_SIZE : 0;
+	stbuf->f_bavail  = stbuf->f_bfree;
+	stbuf->f_files   = max_inodes;
+	stbuf->f_ffree   = max_inodes - inodes;
+	stbuf->f_favail  = stbuf->f_ffree;
+	stbuf->f_namemax = NAME_MAX;
+	return 0;
+}
+
+int copper_memfs::release(const char* path, struct fuse_file_info* fi) {
+	static_cast<void>(path);
+
+	copper_memfs_inode* node = inode(fi->fh);
+	if (!node)
+		return -EBADF;
+
+	std::unique_lock<std::shared_mutex> guard(node->lock);
+	node->opencount--;
+	if (memfs_reclaimable(node))
+		free_inode(node);
+	return 0;
+}
+
+int copper_memfs::opendir(const char* path, struct fuse_file_info* fi) {
+	copper_memfs_inode* node;
+	int res = resolve(path, &node);
+	if (res != 0)
+		return res;
+
+	{
+		std::unique_lock<std::shared_mutex> guard(node->lock);
+		if (!node->dir) {
+			res = -ENOTDIR;
+		} else {
+			node->opencount++;
+			fi->fh = node->ino;
+		}
+	}
+	put(node);
+	return res;
+}
+
+/*
+ * Cookies: 1 and 2 follow "." and "..", entry slot i is followed by
+ * cookie i + 3.  Slots are stable until the directory is compacted.
+ */
+int copper_memfs::readdir(const char* path, void* buf, fuse_fill_dir_t filler, off_t off,
+	struct fuse_file_info* fi, enum fuse_readdir_flags flags) {
+	copper_memfs_inode* node;
+	int res = resolve_fi(path, fi, &node);
+	if (res != 0)
+		return res;
+
+	std::shared_lock<std::shared_mutex> guard(node->lock);
+	if (!node->dir) {
+		guard.unlock();
+		put(node);
+		return -ENOTDIR;
+	}
+
+	bool plus = flags & FUSE_READDIR_PLUS;
+	auto fill_flags = plus ? FUSE_FILL_DIR_PLUS : (enum fuse_fill_dir_flags)0;
+	struct stat st;
+
+	if (off < 1) {
+		fill_stat(node, &st);
+		if (filler(buf, ".", &st, 1, fill_flags))
+			goto out;
+	}
+	if (off < 2) {
+		memset(&st, 0, sizeof(st));
+		st.st_ino  = node->dir->parent;
+		st.st_mode = S_IFDIR;
+		if (filler(buf, "..", &st, 2, (enum fuse_fill_dir_flags)0))
+			goto out;
+	}
+
+	for (size_t i = off < 3 ? 0 : off - 2; i < node->dir->entries.size(); i++) {
+		const copper_memfs_dirent& ent = node->dir->entries[i];
+		if (!ent.name) continue;
+
+		copper_memfs_inode* child = inode(ent.ino);
+		if (plus) {
+			std::shared_lock<std::shared_mutex> child_guard(child->lock);
+			fill_stat(child, &st);
+		} else {
+			memset(&st, 0, sizeof(st));
+			st.st_ino  = ent.ino;
+			st.st_mode = child->mode & S_IFMT;
+		}
+		if (filler(buf, ent.name->c_str(), &st, i + 3, fill_flags))
+			break;
+	}
+
+out:
+	guard.unlock();
+	put(node);
+	return 0;
+}
+
+int copper_memfs::releasedir(const char* path, struct fuse_file_info* fi) {
+	return release(path, fi);
+}
+
+int copper_memfs::utimens(const char* path, const struct timespec tv[2], struct fuse_file_info* fi) {
+	copper_memfs_inode* node;
+	int res = resolve_fi(path, fi, &node);
+	if (res != 0)
+		return res;
+
+	{
+		std::unique_lock<std::shared_mutex> guard(node->lock);
+		struct timespec now = memfs_now();
+		if (!tv) {
+			node->atime = node->mtime = now;
+		} else {
+			if (tv[0].tv_nsec != UTIME_OMIT)
+				node->atime = tv[0].tv_nsec == UTIME_NOW ? now : tv[0];
+			if (tv[1].tv_nsec != UTIME_OMIT)
+				node->mtime = tv[1].tv_nsec == UTIME_NOW ? now : tv[1];
+		}
+		node->ctime = now;
+	}
+	put(node);
+	return 0;
+}
+
+int copper_memfs::fallocate(const char* path, int mode, off_t off, off_t len, struct fuse_file_info* fi) {
+	if (off < 0 || len <= 0)
+		return -EINVAL;
+	if (mode & ~(FALLOC_FL_KEEP_SIZE | FALLOC_FL_PUNCH_HOLE | FALLOC_FL_ZERO_RANGE))
+		return -EOPNOTSUPP;
+	if ((mode & FALLOC_FL_PUNCH_HOLE) && !(mode & FALLOC_FL_KEEP_SIZE))
+		return -EOPNOTSUPP;
+	if ((mode & FALLOC_FL_PUNCH_HOLE) && (mode & FALLOC_FL_ZERO_RANGE))
+		return -EOPNOTSUPP;
+	if (len > INT64_MAX - off)
+		return -EFBIG;
+
+	copper_memfs_inode* node;
+	int res = resolve_fi(path, fi, &node);
+	if (res != 0)
+		return res;
+
+	{
+		std::unique_lock<std::shared_mutex> guard(node->lock);
+		off_t end = off + len;
+
+		if (node->dir) {
+			res = -EISDIR;
+		} else if (!S_ISREG(node->mode)) {
+			res = -ENODEV;
+		} else {
+			if (mode & (FALLOC_FL_PUNCH_HOLE | FALLOC_FL_ZERO_RANGE))
+				punch_data(node, off, end);
+			/* Zeroed ranges come back allocated, punched ones stay holes */
+			if (!(mode & FALLOC_FL_PUNCH_HOLE) &&
+			    (end > (off_t)COPPER_MEMFS_INLINE_MAX || !node->extents.empty()))
+				res = materialize(node, off, end);
+			if (res == 0 && !(mode & FALLOC_FL_KEEP_SIZE) && end > node->size)
+				node->size = end;
+			if (res == 0 && mode)
+				node->mtime = node->ctime = memfs_now();
+		}
+	}
+	put(node);
+	return res;
+}
+
+off_t copper_memfs::lseek(const char* path, off_t off, int whence, struct fuse_file_info* fi) {
+	copper_memfs_inode* node;
+	int res = resolve_fi(path, fi, &node);
+	if (res != 0)
+		return res;
+
+	off_t pos = -EINVAL;
+	{
+		std::shared_lock<std::shared_mutex> guard(node->lock);
+		const auto& extents = node->extents;
+
+		if (whence != SEEK_DATA && whence != SEEK_HOLE) {
+			pos = -EINVAL;
+		} else if (off < 0 || off >= node->size) {
+			pos = -ENXIO;
+		} else if (extents.empty()) {
+			/* The inline bytes are data unless all zero, the rest is a hole */
+			off_t inl = std::min<off_t>(node->size, COPPER_MEMFS_INLINE_MAX);
+			bool data = std::any_of(node->inline_data, node->inline_data + inl,
+				[](char c) { return c != 0; });
+			if (whence == SEEK_DATA)
+				pos = data && off < inl ? off : -ENXIO;
+			else
+				pos = data && off < inl ? inl : off;
+		} else if (whence == SEEK_DATA) {
+			size_t i = memfs_extent_at(extents, off);
+			pos = i < extents.size() ? std::max(off, extents[i].off) : node->size;
+			if (pos >= node->size)
+				pos = -ENXIO;
+		} else {
+			pos = off;
+			for (size_t i = memfs_extent_at(extents, off);
+			     i < extents.size() && extents[i].off <= pos; i++)
+				pos = extents[i].off + extents[i].len;
+			pos = std::min(pos, (off_t)node->size);
+		}
+	}
+	put(node);
+	return pos;
+}
@@ -1,6 +1,9 @@
 #include "copper_fuse_mnt_util.h"
+#include <cerrno>
 #include <cstdio>
 #include <cstring>
+#include <sys/socket.h>
+#include <unistd.h>
 
 int copper_fuse_mnt_parse_fd(const char *mountpoint) {
 	 int fd = -1;
@@ -12,4 +15,65 @@ int copper_fuse_mnt_parse_fd(const char *mountpoint) {
 	}
 
 	return -1;
-}
\ No newline at end of file
+}
+
+int copper_fuse_mnt_send_fd(int sock, const void* buf, size_t size, int fd) {
+	union {
+		struct cmsghdr align;
+		char buf[CMSG_SPACE(sizeof(int))];
+	} control;
+	struct iovec iov = { (void*)buf, size };
+	struct msghdr msg;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	if (fd != -1) {
+		memset(&control, 0, sizeof(control));
+		msg.msg_control = control.buf;
+		msg.msg_controllen = sizeof(control.buf);
+
+		struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type  = SCM_RIGHTS;
+		cmsg->cmsg_len   = CMSG_LEN(sizeof(int));
+		memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+	}
+
+	ssize_t res;
+	do {
+		res = sendmsg(sock, &msg, MSG_NOSIGNAL);
+	} while (res == -1 && errno == EINTR);
+	if (res == -1)
+		return -errno;
+	return (size_t)res == size ? 0 : -EIO;
+}
+
+ssize_t copper_fuse_mnt_recv_fd(int sock, void* buf, size_t size, int* fd) {
+	union {
+		struct cmsghdr align;
+		char buf[CMSG_SPACE(sizeof(int))];
+	} control;
+	struct iovec iov = { buf, size };
+	struct msghdr msg;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.buf;
+	msg.msg_controllen = sizeof(control.buf);
+
+	ssize_t res;
+	do {
+		res = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+	} while (res == -1 && errno == EINTR);
+	*fd = -1;
+	if (res == -1)
+		return -errno;
+
+	for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+		if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+			memcpy(fd, CMSG_DATA(cmsg), sizeof(int));
+	}
+	return res;
+}
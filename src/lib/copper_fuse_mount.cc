@@ -0,0 +1,796 @@
+#include "copper_fuse_mount.h"
+#include "copper_fuse_lowlevel.h"
+#include "copper_fuse_mnt_util.h"
+#include "copper_fuse_opt.h"
+#include "copper_log.h"
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <mutex>
+#include <poll.h>
+#include <string_view>
+#include <sys/eventfd.h>
+#include <sys/mount.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <vector>
+
+#define FUSERMOUNT_PROG		"fusermount3"
+#define FUSE_COMMFD_ENV		"_FUSE_COMMFD"
+
+enum {
+	KEY_KERN_FLAG,
+	KEY_KERN_OPT,
+	KEY_FUSERMOUNT_OPT,
+};
+
+#define FUSE_MOUNT_OPT(t, p)	\
+		{ t, offsetof(copper_fuse_mount_opts, p), 1 }
+
+static const struct copper_fuse_opt copper_fuse_mount_opts_table[] = {
+	FUSE_MOUNT_OPT("allow_other",       allow_other),
+	FUSE_MOUNT_OPT("fsname=%s",         fsname),
+	FUSE_MOUNT_OPT("subtype=%s",        subtype),
+	FUSE_MOUNT_OPT("mount_helper=%s",   mount_helper),
+	COPPER_FUSE_OPT_KEY("allow_other",         KEY_KERN_OPT),
+	COPPER_FUSE_OPT_KEY("default_permissions", KEY_KERN_OPT),
+	COPPER_FUSE_OPT_KEY("max_read=",           KEY_KERN_OPT),
+	COPPER_FUSE_OPT_KEY("blksize=",            KEY_KERN_OPT),
+	COPPER_FUSE_OPT_KEY("fsname=",             KEY_FUSERMOUNT_OPT),
+	COPPER_FUSE_OPT_KEY("subtype=",            KEY_FUSERMOUNT_OPT),
+	COPPER_FUSE_OPT_KEY("blkdev",              KEY_FUSERMOUNT_OPT),
+	COPPER_FUSE_OPT_KEY("rw",                  KEY_KERN_FLAG),
+	COPPER_FUSE_OPT_KEY("ro",                  KEY_KERN_FLAG),
+	COPPER_FUSE_OPT_KEY("suid",                KEY_KERN_FLAG),
+	COPPER_FUSE_OPT_KEY("nosuid",              KEY_KERN_FLAG),
+	COPPER_FUSE_OPT_KEY("dev",                 KEY_KERN_FLAG),
+	COPPER_FUSE_OPT_KEY("nodev",               KEY_KERN_FLAG),
+	COPPER_FUSE_OPT_KEY("exec",                KEY_KERN_FLAG),
+	COPPER_FUSE_OPT_KEY("noexec",              KEY_KERN_FLAG),
+	COPPER_FUSE_OPT_KEY("async",               KEY_KERN_FLAG),
+	COPPER_FUSE_OPT_KEY("sync",                KEY_KERN_FLAG),
+	COPPER_FUSE_OPT_KEY("dirsync",             KEY_KERN_FLAG),
+	COPPER_FUSE_OPT_KEY("atime",               KEY_KERN_FLAG),
+	COPPER_FUSE_OPT_KEY("noatime",             KEY_KERN_FLAG),
+	COPPER_FUSE_OPT_KEY("diratime",            KEY_KERN_FLAG),
+	COPPER_FUSE_OPT_KEY("nodiratime",          KEY_KERN_FLAG),
+	COPPER_FUSE_OPT_END
+};
+
+struct mount_flags {
+	const char* opt;
+	unsigned long flag;
+	int on;
+};
+
+static const struct mount_flags mount_flags[] = {
+	{ "rw",         MS_RDONLY,      0 },
+	{ "ro",         MS_RDONLY,      1 },
+	{ "suid",       MS_NOSUID,      0 },
+	{ "nosuid",     MS_NOSUID,      1 },
+	{ "dev",        MS_NODEV,       0 },
+	{ "nodev",      MS_NODEV,       1 },
+	{ "exec",       MS_NOEXEC,      0 },
+	{ "noexec",     MS_NOEXEC,      1 },
+	{ "async",      MS_SYNCHRONOUS, 0 },
+	{ "sync",       MS_SYNCHRONOUS, 1 },
+	{ "dirsync",    MS_DIRSYNC,     1 },
+	{ "atime",      MS_NOATIME,     0 },
+	{ "noatime",    MS_NOATIME,     1 },
+	{ "diratime",   MS_NODIRATIME,  0 },
+	{ "nodiratime", MS_NODIRATIME,  1 },
+	{ nullptr,      0,              0 }
+};
+
+/* Flags an unprivileged user may ask the mount helper for */
+static const int user_mount_flags = MS_RDONLY | MS_NOSUID | MS_NODEV | MS_NOEXEC |
+	MS_SYNCHRONOUS | MS_DIRSYNC | MS_NOATIME | MS_NODIRATIME;
+
+static void set_mount_flag(const char* s, int* flags) {
+	for (const struct mount_flags* mf = mount_flags; mf->opt; mf++) {
+		if (strcmp(mf->opt, s) == 0) {
+			if (mf->on)
+				*flags |= mf->flag;
+			else
+				*flags &= ~mf->flag;
+			return;
+		}
+	}
+}
+
+static int fuse_mount_opt_proc(void* data, const char* arg, int key, struct copper_fuse_args* outargs) {
+	static_cast<void>(outargs);
+	copper_fuse_mount_opts* mo = static_cast<copper_fuse_mount_opts*>(data);
+
+	switch (key) {
+	case KEY_KERN_FLAG:
+		set_mount_flag(arg, &mo->flags);
+		return 0;
+	case KEY_KERN_OPT:
+		return add_opt_common(&mo->kernel_opts, arg, 0);
+	case KEY_FUSERMOUNT_OPT:
+		return add_opt_common(&mo->fusermount_opts, arg, 1);
+	}
+
+	/* Pass through unknown options */
+	return 1;
+}
+
+/** ---------------------------------------------------
+ * FOR COPPER FUSE MOUNT OPTS
+ * ---------------------------------------------------*/
+
+copper_fuse_mount_opts::copper_fuse_mount_opts()
+	: allow_other(0), flags(MS_NOSUID | MS_NODEV), fsname(nullptr), subtype(nullptr),
+	  mount_helper(nullptr), kernel_opts(nullptr), fusermount_opts(nullptr) {}
+
+copper_fuse_mount_opts::~copper_fuse_mount_opts() {
+	free(fsname);
+	free(subtype);
+	free(mount_helper);
+	free(kernel_opts);
+	free(fusermount_opts);
+}
+
+struct copper_fuse_mount_opts* copper_fuse_parse_mount_opts(struct copper_fuse_args* args) {
+	copper_fuse_mount_opts* mo = new copper_fuse_mount_opts;
+
+	if (args && args->parse_opt(mo, copper_fuse_mount_opts_table, fuse_mount_opt_proc) == -1) {
+		delete mo;
+		return nullptr;
+	}
+	return mo;
+}
+
+/** ---------------------------------------------------
+ * FOR COPPER FUSE KERNEL MOUNT
+ * ---------------------------------------------------*/
+
+int copper_fuse_mount_sys(const struct copper_fuse_mount_req* req, uid_t uid, gid_t gid) {
+	struct stat st;
+	if (stat(req->mountpoint.c_str(), &st) == -1)
+		return -errno;
+
+	int fd = open("/dev/fuse", O_RDWR | O_CLOEXEC);
+	if (fd == -1)
+		return -errno;
+
+	char tmp[128];
+	char* opts = nullptr;
+	snprintf(tmp, sizeof(tmp), "fd=%i,rootmode=%o,user_id=%u,group_id=%u",
+		fd, st.st_mode & S_IFMT, uid, gid);
+	if (add_opt_common(&opts, tmp, 0) == -1 ||
+		(!req->kernel_opts.empty() && add_opt_common(&opts, req->kernel_opts.c_str(), 0) == -1)) {
+		free(opts);
+		close(fd);
+		return -ENOMEM;
+	}
+
+	std::string type = req->subtype.empty() ? "fuse" : "fuse." + req->subtype;
+	const std::string& source = !req->fsname.empty() ? req->fsname :
+		!req->subtype.empty() ? req->subtype : std::string("/dev/fuse");
+
+	int res = ::mount(source.c_str(), req->mountpoint.c_str(), type.c_str(), req->flags, opts);
+	int err = errno;
+	free(opts);
+	if (res == -1) {
+		close(fd);
+		return -err;
+	}
+	return fd;
+}
+
+static int fuse_mount_fusermount(const char* mountpoint, const struct copper_fuse_mount_opts* mo) {
+	char* opts = nullptr;
+	int res = 0;
+
+	if (!(mo->flags & MS_RDONLY))
+		res = add_opt_common(&opts, "rw", 0);
+	for (const struct mount_flags* mf = mount_flags; res == 0 && mf->opt; mf++) {
+		if (mf->on && (mo->flags & mf->flag))
+			res = add_opt_common(&opts, mf->opt, 0);
+	}
+	if (res == 0 && mo->kernel_opts)
+		res = add_opt_common(&opts, mo->kernel_opts, 0);
+	if (res == 0 && mo->fusermount_opts)
+		res = add_opt_common(&opts, mo->fusermount_opts, 0);
+	if (res == -1) {
+		free(opts);
+		return -1;
+	}
+
+	int fds[2];
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == -1) {
+		erron << "socketpair: " << strerror(errno);
+		free(opts);
+		return -1;
+	}
+
+	pid_t pid = fork();
+	if (pid == -1) {
+		erron << "fork: " << strerror(errno);
+		close(fds[0]);
+		close(fds[1]);
+		free(opts);
+		return -1;
+	}
+	if (pid == 0) {
+		char env[16];
+		const char* argv[] = { FUSERMOUNT_PROG, "-o", opts, "--", mountpoint, nullptr };
+
+		close(fds[1]);
+		fcntl(fds[0], F_SETFD, 0);
+		snprintf(env, sizeof(env), "%i", fds[0]);
+		setenv(FUSE_COMMFD_ENV, env, 1);
+		execvp(FUSERMOUNT_PROG, (char**)argv);
+		_exit(1);
+	}
+
+	close(fds[0]);
+	free(opts);
+
+	char c;
+	int fd;
+	ssize_t n = copper_fuse_mnt_recv_fd(fds[1], &c, 1, &fd);
+	close(fds[1]);
+	waitpid(pid, nullptr, 0);
+	if (n <= 0 || fd == -1) {
+		if (fd != -1)
+			close(fd);
+		erron << "mounting with " FUSERMOUNT_PROG " failed";
+		return -1;
+	}
+	return fd;
+}
+
+static void fuse_unmount_fusermount(const char* mountpoint) {
+	pid_t pid = fork();
+	if (pid == -1) {
+		erron << "fork: " << strerror(errno);
+		return;
+	}
+	if (pid == 0) {
+		const char* argv[] = { FUSERMOUNT_PROG, "-u", "-q", "-z", "--", mountpoint, nullptr };
+
+		execvp(FUSERMOUNT_PROG, (char**)argv);
+		_exit(1);
+	}
+	waitpid(pid, nullptr, 0);
+}
+
+static const char* mount_helper_path(const struct copper_fuse_mount_opts* mo) {
+	if (mo->mount_helper)
+		return mo->mount_helper;
+	return getenv(COPPER_FUSE_MOUNT_HELPER_ENV);
+}
+
+int copper_fuse_kernel_mount(const char* mountpoint, const struct copper_fuse_mount_opts* mo) {
+	struct copper_fuse_mount_req req;
+	req.mountpoint  = mountpoint;
+	req.kernel_opts = mo->kernel_opts ? mo->kernel_opts : "";
+	req.fsname      = mo->fsname ? mo->fsname : "";
+	req.subtype     = mo->subtype ? mo->subtype : "";
+	req.flags       = mo->flags;
+
+	const char* helper = mount_helper_path(mo);
+	int res;
+
+	/* Unprivileged with a helper around, don't bother trying mount(2) */
+	if (geteuid() == 0 || !helper) {
+		res = copper_fuse_mount_sys(&req, getuid(), getgid());
+		if (res >= 0)
+			return res;
+		if (res != -EPERM || geteuid() == 0) {
+			if (res == -ENOENT || res == -ENODEV)
+				erron << "mounting `" << mountpoint << "`: " << strerror(-res)
+					<< ", is the fuse module loaded?";
+			else
+				erron << "mounting `" << mountpoint << "`: " << strerror(-res);
+			return -1;
+		}
+	}
+
+	if (helper) {
+		res = copper_fuse_helper_mount(helper, &req);
+		if (res < 0) {
+			erron << "mount helper `" << helper << "` failed to mount `" << mountpoint
+				<< "`: " << strerror(-res);
+			return -1;
+		}
+		return res;
+	}
+	return fuse_mount_fusermount(mountpoint, mo);
+}
+
+void copper_fuse_kernel_unmount(const char* mountpoint, int fd, const struct copper_fuse_mount_opts* mo) {
+	if (fd != -1) {
+		struct pollfd pfd = { fd, 0, 0 };
+		int res = poll(&pfd, 1, 0);
+
+		/*
+		 * Close the descriptor first, a synchronous unmount would
+		 * otherwise recurse into the filesystem and deadlock
+		 */
+		close(fd);
+
+		/* Already unmounted, the connection was aborted */
+		if (res == 1 && (pfd.revents & POLLERR))
+			return;
+	}
+
+	if (geteuid() == 0) {
+		if (umount2(mountpoint, MNT_DETACH) == -1)
+			erron << "unmounting `" << mountpoint << "`: " << strerror(errno);
+		return;
+	}
+
+	const char* helper = mount_helper_path(mo);
+	if (helper) {
+		int res = copper_fuse_helper_unmount(helper, mountpoint);
+		if (res < 0)
+			erron << "mount helper `" << helper << "` failed to unmount `" << mountpoint
+				<< "`: " << strerror(-res);
+		return;
+	}
+	fuse_unmount_fusermount(mountpoint);
+}
+
+/** ---------------------------------------------------
+ * FOR COPPER FUSE MOUNT HELPER CLIENT
+ * ---------------------------------------------------*/
+
+/*
+ * The connection to the mount helper, kept open for the later mounts
+ * of the process
+ */
+static std::mutex helper_lock;
+static int helper_sock = -1;
+static std::string helper_sock_path;
+
+static int fill_sockaddr(const char* path, struct sockaddr_un* addr) {
+	if (strlen(path) >= sizeof(addr->sun_path))
+		return -ENAMETOOLONG;
+
+	memset(addr, 0, sizeof(*addr));
+	addr->sun_family = AF_UNIX;
+	strcpy(addr->sun_path, path);
+	return 0;
+}
+
+static int helper_connect(const char* path) {
+	struct sockaddr_un addr;
+	int res = fill_sockaddr(path, &addr);
+	if (res < 0)
+		return res;
+
+	int sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (sock == -1)
+		return -errno;
+	if (connect(sock, (struct sockaddr*)&addr, sizeof(addr)) == -1) {
+		res = -errno;
+		close(sock);
+		return res;
+	}
+	return sock;
+}
+
+/*
+ * One round trip with the helper
+ *
+ * A kept connection may have outlived its helper, in which case the
+ * request is sent once more over a new connection.
+ */
+static int helper_call(const char* path, const std::string& msg, int* fd) {
+	std::lock_guard<std::mutex> guard(helper_lock);
+
+	*fd = -1;
+	for (;;) {
+		int fresh = 0;
+		if (helper_sock == -1 || helper_sock_path != path) {
+			if (helper_sock != -1)
+				close(helper_sock);
+			helper_sock = helper_connect(path);
+			if (helper_sock < 0) {
+				int res = helper_sock;
+				helper_sock = -1;
+				return res;
+			}
+			helper_sock_path = path;
+			fresh = 1;
+		}
+
+		int res = copper_fuse_mnt_send_fd(helper_sock, msg.data(), msg.size(), -1);
+		if (res == 0) {
+			struct copper_fuse_helper_reply reply;
+			ssize_t n = copper_fuse_mnt_recv_fd(helper_sock, &reply, sizeof(reply), fd);
+			if (n == sizeof(reply)) {
+				if (reply.error && *fd != -1) {
+					close(*fd);
+					*fd = -1;
+				}
+				return reply.error;
+			}
+			if (*fd != -1) {
+				close(*fd);
+				*fd = -1;
+			}
+			res = n < 0 ? n : -ECONNRESET;
+		}
+
+		close(helper_sock);
+		helper_sock = -1;
+		if (fresh)
+			return res;
+	}
+}
+
+static std::string helper_msg(uint32_t op, uint32_t flags, const std::string* strs, int count) {
+	struct copper_fuse_helper_msg hdr = { op, flags, 0 };
+	std::string msg(sizeof(hdr), '\0');
+
+	for (int i = 0; i < count; i++)
+		msg.append(strs[i].c_str(), strs[i].size() + 1);
+	hdr.len = msg.size() - sizeof(hdr);
+	memcpy(&msg[0], &hdr, sizeof(hdr));
+	return msg;
+}
+
+int copper_fuse_helper_mount(const char* sock_path, const struct copper_fuse_mount_req* req) {
+	const std::string strs[] = { req->mountpoint, req->kernel_opts, req->fsname, req->subtype };
+	std::string msg = helper_msg(COPPER_FUSE_HELPER_MOUNT, req->flags, strs, 4);
+	if (msg.size() > COPPER_FUSE_HELPER_MSG_MAX)
+		return -ENAMETOOLONG;
+
+	int fd;
+	int res = helper_call(sock_path, msg, &fd);
+	if (res < 0)
+		return res;
+	return fd != -1 ? fd : -EIO;
+}
+
+int copper_fuse_helper_unmount(const char* sock_path, const char* mountpoint) {
+	const std::string strs[] = { mountpoint };
+	std::string msg = helper_msg(COPPER_FUSE_HELPER_UNMOUNT, 0, strs, 1);
+	if (msg.size() > COPPER_FUSE_HELPER_MSG_MAX)
+		return -ENAMETOOLONG;
+
+	int fd;
+	return helper_call(sock_path, msg, &fd);
+}
+
+/** ---------------------------------------------------
+ * FOR COPPER FUSE MOUNT HELPER
+ * ---------------------------------------------------*/
+
+copper_fuse_mount_helper::copper_fuse_mount_helper()
+	: listen_fd(-1), event_fd(eventfd(0, EFD_CLOEXEC)), exited(0), user_allow_other(0) {}
+
+copper_fuse_mount_helper::~copper_fuse_mount_helper() {
+	if (listen_fd != -1)
+		close(listen_fd);
+	if (event_fd != -1)
+		close(event_fd);
+}
+
+int copper_fuse_mount_helper::listen(const char* sock_path) {
+	struct sockaddr_un addr;
+	int res = fill_sockaddr(sock_path, &addr);
+	if (res < 0)
+		return res;
+
+	/* Don't take over the socket of a running helper */
+	struct stat st;
+	if (lstat(sock_path, &st) == 0) {
+		if (!S_ISSOCK(st.st_mode))
+			return -EEXIST;
+		int sock = helper_connect(sock_path);
+		if (sock >= 0) {
+			close(sock);
+			return -EADDRINUSE;
+		}
+		unlink(sock_path);
+	}
+
+	int sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (sock == -1)
+		return -errno;
+	if (bind(sock, (struct sockaddr*)&addr, sizeof(addr)) == -1 ||
+		chmod(sock_path, 0666) == -1 || ::listen(sock, SOMAXCONN) == -1) {
+		res = -errno;
+		close(sock);
+		return res;
+	}
+
+	if (listen_fd != -1)
+		close(listen_fd);
+	listen_fd = sock;
+	return 0;
+}
+
+void copper_fuse_mount_helper::exit() {
+	uint64_t one = 1;
+
+	exited.store(1, std::memory_order_release);
+	if (write(event_fd, &one, sizeof(one)) == -1)
+		warn << "waking the mount helper: " << strerror(errno);
+}
+
+int copper_fuse_mount_helper::serve() {
+	if (listen_fd == -1 || event_fd == -1)
+		return -EBADF;
+
+	std::vector<struct pollfd> fds;
+	fds.push_back({ event_fd, POLLIN, 0 });
+	fds.push_back({ listen_fd, POLLIN, 0 });
+
+	int err = 0;
+	while (!exited.load(std::memory_order_acquire)) {
+		if (poll(fds.data(), fds.size(), -1) == -1) {
+			if (errno == EINTR)
+				continue;
+			err = -errno;
+			break;
+		}
+
+		/* The sockets accepted here are only polled next round */
+		size_t polled = fds.size();
+		if (fds[1].revents & POLLIN) {
+			int sock = accept4(listen_fd, nullptr, nullptr, SOCK_CLOEXEC);
+			if (sock != -1)
+				fds.push_back({ sock, POLLIN, 0 });
+			else if (errno != EINTR && errno != EAGAIN && errno != ECONNABORTED)
+				warn << "accept: " << strerror(errno);
+		}
+
+		for (size_t i = 2; i < polled;) {
+			if (fds[i].revents && !handle(fds[i].fd)) {
+				close(fds[i].fd);
+				fds[i] = fds[polled - 1];
+				fds[polled - 1] = fds.back();
+				fds.pop_back();
+				polled--;
+				continue;
+			}
+			i++;
+		}
+	}
+
+	for (size_t i = 2; i < fds.size(); i++)
+		close(fds[i].fd);
+	return err;
+}
+
+static int parse_strings(const char* body, size_t len, std::string* strs, int count) {
+	for (int i = 0; i < count; i++) {
+		const char* end = static_cast<const char*>(memchr(body, '\0', len));
+		if (!end)
+			return -EINVAL;
+		strs[i].assign(body, end - body);
+		len -= end - body + 1;
+		body = end + 1;
+	}
+	return len ? -EINVAL : 0;
+}
+
+int copper_fuse_mount_helper::handle(int sock) {
+	char buf[COPPER_FUSE_HELPER_MSG_MAX];
+	int passed;
+
+	ssize_t n = copper_fuse_mnt_recv_fd(sock, buf, sizeof(buf), &passed);
+	if (n <= 0)
+		return 0;
+	if (passed != -1)
+		close(passed);
+
+	struct ucred cred;
+	socklen_t credlen = sizeof(cred);
+	if (getsockopt(sock, SOL_SOCKET, SO_PEERCRED, &cred, &credlen) == -1)
+		return 0;
+
+	struct copper_fuse_helper_msg hdr;
+	struct copper_fuse_mount_req req;
+	std::string strs[4];
+	int res = -EINVAL;
+	int fd = -1;
+
+	if ((size_t)n < sizeof(hdr))
+		return 0;
+	memcpy(&hdr, buf, sizeof(hdr));
+	if (hdr.len != n - sizeof(hdr))
+		return 0;
+
+	const char* body = buf + sizeof(hdr);
+	switch (hdr.op) {
+	case COPPER_FUSE_HELPER_MOUNT:
+		res = parse_strings(body, hdr.len, strs, 4);
+		if (res == 0 && strs[0][0] != '/')
+			res = -EINVAL;
+		if (res == 0) {
+			req.mountpoint  = std::move(strs[0]);
+			req.kernel_opts = std::move(strs[1]);
+			req.fsname      = std::move(strs[2]);
+			req.subtype     = std::move(strs[3]);
+			req.flags       = hdr.flags;
+			res = fd = do_mount(&cred, &req);
+			if (fd < 0)
+				fd = -1;
+		}
+		break;
+	case COPPER_FUSE_HELPER_UNMOUNT:
+		res = parse_strings(body, hdr.len, strs, 1);
+		if (res == 0)
+			res = do_unmount(&cred, strs[0].c_str());
+		break;
+	}
+
+	struct copper_fuse_helper_reply reply = { res < 0 ? res : 0 };
+	int sent = copper_fuse_mnt_send_fd(sock, &reply, sizeof(reply), fd);
+	if (fd != -1) {
+		close(fd);
+		/* Nobody is left to serve the mount */
+		if (sent < 0)
+			do_unmount(&cred, req.mountpoint.c_str());
+	}
+	return sent == 0;
+}
+
+/* Kernel options an unprivileged user may pass */
+static int check_user_opts(const std::string& opts, int user_allow_other) {
+	size_t pos = 0;
+
+	while (pos < opts.size()) {
+		size_t end = opts.find(',', pos);
+		if (end == std::string::npos)
+			end = opts.size();
+
+		std::string_view opt(opts.data() + pos, end - pos);
+		if (opt == "allow_other") {
+			if (!user_allow_other)
+				return -EPERM;
+		} else if (opt != "default_permissions" && opt.substr(0, 9) != "max_read=") {
+			return -EPERM;
+		}
+		pos = end + 1;
+	}
+	return 0;
+}
+
+int copper_fuse_mount_helper::do_mount(const struct ucred* cred, const struct copper_fuse_mount_req* req) {
+	if (mounter)
+		return mounter(cred, req);
+
+	if (cred->uid == 0) {
+		return copper_fuse_mount_sys(req, cred->uid, cred->gid);
+	}
+
+	int res = check_user_opts(req->kernel_opts, user_allow_other);
+	if (res < 0)
+		return res;
+
+	/*
+	 * Check the mountpoint through a descriptor and mount on that very
+	 * descriptor, it can't be swapped for a symlink in between
+	 */
+	int dirfd = open(req->mountpoint.c_str(), O_PATH | O_NOFOLLOW | O_CLOEXEC);
+	if (dirfd == -1)
+		return -errno;
+
+	struct stat st;
+	if (fstat(dirfd, &st) == -1) {
+		res = -errno;
+	} else if (!S_ISDIR(st.st_mode) && !S_ISREG(st.st_mode)) {
+		res = -ENOTDIR;
+	} else if (st.st_uid != cred->uid) {
+		res = -EPERM;
+	} else {
+		struct copper_fuse_mount_req checked = *req;
+		checked.mountpoint = "/proc/self/fd/" + std::to_string(dirfd);
+		checked.flags = (req->flags & user_mount_flags) | MS_NOSUID | MS_NODEV;
+		res = copper_fuse_mount_sys(&checked, cred->uid, cred->gid);
+	}
+	close(dirfd);
+	return res;
+}
+
+/* The id of the mount `fd` is on, from /proc/self/fdinfo */
+static int fd_mount_id(int fd) {
+	std::string path = "/proc/self/fdinfo/" + std::to_string(fd);
+	FILE* fp = fopen(path.c_str(), "re");
+	if (!fp)
+		return -errno;
+
+	char line[256];
+	int id = -ENOENT;
+	while (fgets(line, sizeof(line), fp))
+		if (sscanf(line, "mnt_id: %d", &id) == 1)
+			break;
+	fclose(fp);
+	return id;
+}
+
+/*
+ * Whether mount `id` is a fuse mount of `uid`, by its type and user_id
+ * in /proc/self/mountinfo as fusermount checks it.  Root may unmount
+ * any fuse mount.
+ */
+static int check_fuse_mount(int id, uid_t uid) {
+	FILE* fp = fopen("/proc/self/mountinfo", "re");
+	if (!fp)
+		return -errno;
+
+	std::string user_id = "user_id=" + std::to_string(uid);
+	char* line = nullptr;
+	size_t size = 0;
+	int res = -EINVAL;
+	while (getline(&line, &size, fp) != -1) {
+		int mnt_id;
+		if (sscanf(line, "%d", &mnt_id) != 1 || mnt_id != id)
+			continue;
+
+		/* Past the optional fields: type, source, super options */
+		char* sep = strstr(line, " - ");
+		char type[64], source[4096], opts[4096];
+		if (!sep || sscanf(sep + 3, "%63s %4095s %4095s", type, source, opts) != 3)
+			break;
+		std::string_view t(type);
+		if (t != "fuse" && t != "fuseblk" && t.substr(0, 5) != "fuse." && t.substr(0, 8) != "fuseblk.")
+			break;
+		if (uid != 0) {
+			res = -EPERM;
+			std::string_view o(opts);
+			size_t pos = 0;
+			while (pos <= o.size()) {
+				size_t end = o.find(',', pos);
+				if (end == std::string_view::npos)
+					end = o.size();
+				if (o.substr(pos, end - pos) == user_id) {
+					res = 0;
+					break;
+				}
+				pos = end + 1;
+			}
+		} else {
+			res = 0;
+		}
+		break;
+	}
+	free(line);
+	fclose(fp);
+	return res;
+}
+
+int copper_fuse_mount_helper::do_unmount(const struct ucred* cred, const char* mountpoint) {
+	if (unmounter)
+		return unmounter(cred, mountpoint);
+
+	/*
+	 * Resolve the mountpoint once, check the mount it leads to and
+	 * unmount that very mount through the descriptor
+	 */
+	int dirfd = open(mountpoint, O_PATH | O_NOFOLLOW | O_CLOEXEC);
+	if (dirfd == -1)
+		return -errno;
+
+	struct stat st;
+	int res = 0;
+	if (fstat(dirfd, &st) == -1)
+		res = -errno;
+	else if (!S_ISDIR(st.st_mode) && !S_ISREG(st.st_mode))
+		res = -EINVAL;
+	int id = res ? res : fd_mount_id(dirfd);
+	if (id < 0)
+		res = id;
+	else
+		res = check_fuse_mount(id, cred->uid);
+	if (!res) {
+		std::string path = "/proc/self/fd/" + std::to_string(dirfd);
+		if (umount2(path.c_str(), MNT_DETACH) == -1)
+			res = -errno;
+	}
+	close(dirfd);
+	return res;
+}
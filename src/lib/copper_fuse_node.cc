@@ -0,0 +1,567 @@
+/*
+  CopperFuse: C++ version Filesystem in Userspace
+  Copyright (C) 2023 Chen Miao <chenmiao.ku@gmail.com>
+
+  This program can be distributed under the terms of the GNU LGPLv2.
+  See the file COPYING.LIB.
+*/
+
+#include "copper_fuse_node.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <thread>
+#include <vector>
+
+/** ---------------------------------------------------
+ * FOR COPPER FUSE NODE TABLE
+ * ---------------------------------------------------*/
+
+copper_fuse_node_table::copper_fuse_node_table(copper_fuse_atom_table* _atoms)
+	: atoms(_atoms), remember(0), timers(&copper_fuse_timer_wheel::shared()), ctr(0),
+		generation(0), renames_started(0), renames_finished(0) {
+	std::shared_ptr<copper_fuse_node> root(new copper_fuse_node);
+	root->nodeid     = FUSE_ROOT_ID;
+	root->generation = 0;
+	root->nlookup    = 1;
+	root->open_count = 0;
+	root->children   = 0;
+	root->hidden     = false;
+	id_shard_of(FUSE_ROOT_ID).nodes.emplace(FUSE_ROOT_ID, std::move(root));
+}
+
+copper_fuse_node_table::~copper_fuse_node_table() {
+	disarm_all();
+}
+
+copper_fuse_node_table::id_shard& copper_fuse_node_table::id_shard_of(fuse_ino_t nodeid) {
+	return ids[(nodeid * 0x9e3779b97f4a7c15ULL) >> 58];
+}
+
+copper_fuse_node_table::name_shard& copper_fuse_node_table::name_shard_of(
+	const copper_fuse_name_key& key) {
+	return names[copper_fuse_name_hash()(key) % COPPER_FUSE_NODE_SHARDS];
+}
+
+std::mutex& copper_fuse_node_table::dir_lock(fuse_ino_t nodeid) {
+	return dir_locks[(nodeid * 0x9e3779b97f4a7c15ULL) >> 56];
+}
+
+void copper_fuse_node_table::lock_dirs(fuse_ino_t a, fuse_ino_t b) {
+	std::mutex* la = &dir_lock(a);
+	std::mutex* lb = &dir_lock(b);
+
+	if (la == lb) {
+		la->lock();
+	} else if (la < lb) {
+		la->lock();
+		lb->lock();
+	} else {
+		lb->lock();
+		la->lock();
+	}
+}
+
+void copper_fuse_node_table::unlock_dirs(fuse_ino_t a, fuse_ino_t b) {
+	std::mutex* la = &dir_lock(a);
+	std::mutex* lb = &dir_lock(b);
+
+	la->unlock();
+	if (la != lb)
+		lb->unlock();
+}
+
+std::shared_ptr<copper_fuse_node> copper_fuse_node_table::get(fuse_ino_t nodeid) {
+	id_shard& s = id_shard_of(nodeid);
+	std::lock_guard<std::mutex> guard(s.lock);
+	auto it = s.nodes.find(nodeid);
+	return it == s.nodes.end() ? nullptr : it->second;
+}
+
+void copper_fuse_node_table::insert_id(std::shared_ptr<copper_fuse_node> node) {
+	for (;;) {
+		uint64_t id = ++ctr;
+		if (!id)
+			generation++;
+		if (id == FUSE_UNKNOWN_INO || id == FUSE_ROOT_ID)
+			continue;
+
+		node->nodeid     = id;
+		node->generation = generation.load();
+		node->timer.fire = [this, id] { drop(get(id)); };
+		id_shard& s = id_shard_of(id);
+		std::lock_guard<std::mutex> guard(s.lock);
+		if (s.nodes.emplace(id, node).second)
+			return;
+	}
+}
+
+std::shared_ptr<copper_fuse_node> copper_fuse_node_table::find(fuse_ino_t parent,
+	const char* name) {
+	/* Hashed and interned before taking any lock */
+	copper_fuse_atom_ref atom = atoms->intern(name);
+	if (!atom)
+		return nullptr;
+
+	copper_fuse_name_key key = { parent, atom.get() };
+	name_shard& ns = name_shard_of(key);
+	{
+		std::lock_guard<std::mutex> guard(ns.lock);
+		auto it = ns.nodes.find(key);
+		if (it != ns.nodes.end()) {
+			it->second->nlookup++;
+			return it->second;
+		}
+	}
+
+	std::shared_ptr<copper_fuse_node> dir = get(parent);
+	if (!dir)
+		return nullptr;
+
+	std::shared_ptr<copper_fuse_node> node(new (std::nothrow) copper_fuse_node);
+	std::shared_ptr<copper_fuse_node_link> link(new (std::nothrow) copper_fuse_node_link);
+	if (!node || !link)
+		return nullptr;
+
+	std::lock_guard<std::mutex> dir_guard(dir_lock(parent));
+	{
+		/* Created by another lookup meanwhile */
+		std::lock_guard<std::mutex> guard(ns.lock);
+		auto it = ns.nodes.find(key);
+		if (it != ns.nodes.end()) {
+			it->second->nlookup++;
+			return it->second;
+		}
+	}
+
+	node->nlookup    = 1;
+	node->open_count = 0;
+	node->children   = 0;
+	node->hidden     = false;
+	link->parent     = dir;
+	link->name       = std::move(atom);
+	std::atomic_store(&node->link, std::shared_ptr<const copper_fuse_node_link>(std::move(link)));
+	/* Known by id before by name, a request may follow the reply at once */
+	insert_id(node);
+	{
+		std::lock_guard<std::mutex> guard(ns.lock);
+		ns.nodes.emplace(key, node);
+	}
+	dir->children++;
+	return node;
+}
+
+std::shared_ptr<copper_fuse_node> copper_fuse_node_table::child(fuse_ino_t parent,
+	const char* name) {
+	copper_fuse_atom_ref atom = atoms->intern(name);
+	if (!atom)
+		return nullptr;
+
+	copper_fuse_name_key key = { parent, atom.get() };
+	name_shard& ns = name_shard_of(key);
+	std::lock_guard<std::mutex> guard(ns.lock);
+	auto it = ns.nodes.find(key);
+	return it == ns.nodes.end() ? nullptr : it->second;
+}
+
+fuse_ino_t copper_fuse_node_table::lookup_nodeid(fuse_ino_t parent, const char* name) {
+	std::shared_ptr<copper_fuse_node> node = child(parent, name);
+	return node ? node->nodeid : FUSE_UNKNOWN_INO;
+}
+
+void copper_fuse_node_table::forget(fuse_ino_t nodeid, uint64_t nlookup) {
+	if (nodeid == FUSE_ROOT_ID)
+		return;
+
+	std::shared_ptr<copper_fuse_node> node = get(nodeid);
+	if (node) {
+		uint64_t n = node->nlookup.load();
+		while (!node->nlookup.compare_exchange_weak(n, n - std::min(nlookup, n)));
+		if (n <= nlookup) {
+			if (remember > 0)
+				arm(std::move(node));
+			else if (remember == 0)
+				drop(std::move(node));
+		}
+	}
+}
+
+int copper_fuse_node_table::get_path(fuse_ino_t nodeid, const char* name, std::string* path) {
+	/* Kept per thread, no allocation once a deep enough path was seen */
+	static thread_local std::vector<std::shared_ptr<const copper_fuse_node_link>> chain;
+	size_t name_len = name ? copper_fuse_path_len(name) : 0;
+	size_t len;
+
+	std::shared_ptr<copper_fuse_node> node = get(nodeid);
+	if (!node)
+		return -ENOENT;
+
+	for (unsigned attempt = 0;; attempt++) {
+		/* Out of retries, the last walk runs with renames held off */
+		std::unique_lock<std::shared_mutex> guard;
+		if (attempt == COPPER_FUSE_PATH_RETRIES)
+			guard = std::unique_lock<std::shared_mutex>(rename_lock);
+		uint64_t finished = renames_finished.load();
+
+		chain.clear();
+		len = name ? 1 + name_len : 0;
+		for (const copper_fuse_node* n = node.get(); n->nodeid != FUSE_ROOT_ID;) {
+			std::shared_ptr<const copper_fuse_node_link> link = std::atomic_load(&n->link);
+			if (!link) {
+				chain.clear();
+				return -ENOENT;
+			}
+			n = link->parent.get();
+			len += 1 + link->name.size();
+			chain.push_back(std::move(link));
+		}
+
+		/* No rename ran while the links were followed */
+		if (renames_started.load() == finished || guard.owns_lock())
+			break;
+		std::this_thread::yield();
+	}
+
+	/* Sized once, then every component copied in place */
+	path->clear();
+	path->reserve(len);
+	for (auto it = chain.rbegin(); it != chain.rend(); ++it)
+		copper_fuse_path_join(path, (*it)->name.c_str(), (*it)->name.size());
+	if (name)
+		copper_fuse_path_join(path, name, name_len);
+	if (path->empty())
+		path->push_back('/');
+	chain.clear();
+	return 0;
+}
+
+void copper_fuse_node_table::unhash_locked(copper_fuse_node* node,
+	const copper_fuse_node_link* link) {
+	copper_fuse_name_key key = { link->parent->nodeid, link->name.get() };
+	name_shard& ns = name_shard_of(key);
+	{
+		std::lock_guard<std::mutex> guard(ns.lock);
+		auto it = ns.nodes.find(key);
+		if (it != ns.nodes.end() && it->second.get() == node)
+			ns.nodes.erase(it);
+	}
+	std::atomic_store(&node->link, std::shared_ptr<const copper_fuse_node_link>());
+	link->parent->children--;
+}
+
+bool copper_fuse_node_table::unused(copper_fuse_node* node) {
+	return !node->nlookup.load() && !timers->pending(&node->timer);
+}
+
+void copper_fuse_node_table::drop(std::shared_ptr<copper_fuse_node> node) {
+	while (node && node->nodeid != FUSE_ROOT_ID) {
+		std::shared_ptr<const copper_fuse_node_link> link = std::atomic_load(&node->link);
+		fuse_ino_t dir = link ? link->parent->nodeid : node->nodeid;
+
+		lock_dirs(dir, node->nodeid);
+		/* Moved meanwhile, the stripe held may no longer be its parent's */
+		if (std::atomic_load(&node->link) != link) {
+			unlock_dirs(dir, node->nodeid);
+			continue;
+		}
+
+		bool keep = node->children || remember < 0;
+		bool last = false;
+		if (!keep && link) {
+			/* A lookup of the name counts under the lock of its shard */
+			copper_fuse_name_key key = { dir, link->name.get() };
+			name_shard& ns = name_shard_of(key);
+			std::lock_guard<std::mutex> guard(ns.lock);
+			keep = !unused(node.get());
+			if (!keep) {
+				ns.nodes.erase(key);
+				std::atomic_store(&node->link, std::shared_ptr<const copper_fuse_node_link>());
+				last = --link->parent->children == 0;
+			}
+		} else if (!keep) {
+			keep = !unused(node.get());
+		}
+		if (keep) {
+			unlock_dirs(dir, node->nodeid);
+			return;
+		}
+
+		{
+			id_shard& s = id_shard_of(node->nodeid);
+			std::lock_guard<std::mutex> guard(s.lock);
+			auto it = s.nodes.find(node->nodeid);
+			if (it != s.nodes.end() && it->second == node)
+				s.nodes.erase(it);
+		}
+		unlock_dirs(dir, node->nodeid);
+
+		if (forgotten)
+			forgotten(node->nodeid);
+		/* A directory stays while any of its children is known to the kernel */
+		node = last ? link->parent : nullptr;
+	}
+}
+
+int copper_fuse_node_table::rename(fuse_ino_t olddir, const char* oldname, fuse_ino_t newdir,
+	const char* newname, bool exchange) {
+	copper_fuse_atom_ref oldatom = atoms->intern(oldname);
+	copper_fuse_atom_ref newatom = atoms->intern(newname);
+	std::shared_ptr<copper_fuse_node> from = get(olddir);
+	std::shared_ptr<copper_fuse_node> to = get(newdir);
+	if (!oldatom || !newatom)
+		return -ENOMEM;
+	/* The kernel holds both, a node already gone has no name to move */
+	if (!from || !to)
+		return 0;
+
+	std::shared_ptr<copper_fuse_node_link> there(new (std::nothrow) copper_fuse_node_link);
+	std::shared_ptr<copper_fuse_node_link> back(new (std::nothrow) copper_fuse_node_link);
+	if (!there || !back)
+		return -ENOMEM;
+	there->parent = to;
+	there->name   = newatom;
+	back->parent  = from;
+	back->name    = oldatom;
+
+	copper_fuse_name_key oldkey = { olddir, oldatom.get() };
+	copper_fuse_name_key newkey = { newdir, newatom.get() };
+	name_shard& oldns = name_shard_of(oldkey);
+	name_shard& newns = name_shard_of(newkey);
+	std::shared_ptr<copper_fuse_node> node, target;
+
+	std::shared_lock<std::shared_mutex> rename_guard(rename_lock);
+	lock_dirs(olddir, newdir);
+	renames_started++;
+	{
+		std::lock_guard<std::mutex> guard(oldns.lock);
+		auto it = oldns.nodes.find(oldkey);
+		if (it != oldns.nodes.end()) {
+			node = std::move(it->second);
+			oldns.nodes.erase(it);
+		}
+	}
+	{
+		std::lock_guard<std::mutex> guard(newns.lock);
+		auto it = newns.nodes.find(newkey);
+		if (it != newns.nodes.end()) {
+			target = std::move(it->second);
+			newns.nodes.erase(it);
+		}
+		if (node)
+			newns.nodes.emplace(newkey, node);
+	}
+	if (node) {
+		std::atomic_store(&node->link, std::shared_ptr<const copper_fuse_node_link>(there));
+		from->children--;
+		to->children++;
+	}
+	if (target && exchange) {
+		{
+			std::lock_guard<std::mutex> guard(oldns.lock);
+			oldns.nodes.emplace(oldkey, target);
+		}
+		std::atomic_store(&target->link, std::shared_ptr<const copper_fuse_node_link>(back));
+		from->children++;
+		to->children--;
+	} else if (target) {
+		std::atomic_store(&target->link, std::shared_ptr<const copper_fuse_node_link>());
+		to->children--;
+	}
+	renames_finished++;
+	unlock_dirs(olddir, newdir);
+	rename_guard.unlock();
+
+	if (target && !exchange)
+		drop(std::move(target));
+	drop(std::move(from));
+	drop(std::move(to));
+	return 0;
+}
+
+void copper_fuse_node_table::remove(fuse_ino_t dir, const char* name) {
+	copper_fuse_atom_ref atom = atoms->intern(name);
+	if (!atom)
+		return;
+
+	copper_fuse_name_key key = { dir, atom.get() };
+	name_shard& ns = name_shard_of(key);
+	std::shared_ptr<copper_fuse_node> node;
+	std::shared_ptr<const copper_fuse_node_link> link;
+	{
+		std::lock_guard<std::mutex> dir_guard(dir_lock(dir));
+		{
+			std::lock_guard<std::mutex> guard(ns.lock);
+			auto it = ns.nodes.find(key);
+			if (it == ns.nodes.end())
+				return;
+			node = it->second;
+		}
+		link = std::atomic_load(&node->link);
+		unhash_locked(node.get(), link.get());
+	}
+	drop(std::move(node));
+	drop(link->parent);
+}
+
+void copper_fuse_node_table::unhash(fuse_ino_t nodeid) {
+	std::shared_ptr<copper_fuse_node> node = get(nodeid);
+	std::shared_ptr<const copper_fuse_node_link> link;
+
+	while (node && (link = std::atomic_load(&node->link))) {
+		std::lock_guard<std::mutex> dir_guard(dir_lock(link->parent->nodeid));
+		if (std::atomic_load(&node->link) == link) {
+			unhash_locked(node.get(), link.get());
+			break;
+		}
+	}
+	if (link) {
+		drop(std::move(node));
+		drop(link->parent);
+	}
+}
+
+void copper_fuse_node_table::opened(fuse_ino_t nodeid) {
+	std::shared_ptr<copper_fuse_node> node = get(nodeid);
+	if (node)
+		node->open_count++;
+}
+
+bool copper_fuse_node_table::closed(fuse_ino_t nodeid) {
+	std::shared_ptr<copper_fuse_node> node = get(nodeid);
+	if (!node)
+		return false;
+
+	unsigned n = node->open_count.load();
+	while (n && !node->open_count.compare_exchange_weak(n, n - 1));
+	return n == 1 && node->hidden.load();
+}
+
+void copper_fuse_node_table::arm(std::shared_ptr<copper_fuse_node> node) {
+	bool armed;
+	{
+		/* drop() holds it too, a node it took out is never armed */
+		std::lock_guard<std::mutex> guard(dir_lock(node->nodeid));
+		if (get(node->nodeid) != node)
+			return;
+		armed = timers->arm(&node->timer, remember) == 0;
+	}
+	/* Without a timer thread it can't be remembered */
+	if (!armed)
+		drop(std::move(node));
+}
+
+void copper_fuse_node_table::disarm_all() {
+	std::vector<std::shared_ptr<copper_fuse_node>> all;
+	for (id_shard& s : ids) {
+		std::lock_guard<std::mutex> guard(s.lock);
+		for (auto& it : s.nodes)
+			all.push_back(it.second);
+	}
+	/* Without a lock held, a firing timer takes them */
+	for (std::shared_ptr<copper_fuse_node>& node : all)
+		timers->cancel_sync(&node->timer);
+}
+
+size_t copper_fuse_node_table::size() {
+	size_t n = 0;
+	for (id_shard& s : ids) {
+		std::lock_guard<std::mutex> guard(s.lock);
+		n += s.nodes.size();
+	}
+	return n;
+}
+
+void copper_fuse_node_table::save(copper_fuse_snapshot_writer* w) {
+	w->put<uint64_t>(ctr.load());
+	w->put<uint64_t>(generation.load());
+	w->put<uint64_t>(size());
+	for (id_shard& s : ids) {
+		std::lock_guard<std::mutex> guard(s.lock);
+		for (auto& it : s.nodes) {
+			const copper_fuse_node* node = it.second.get();
+			std::shared_ptr<const copper_fuse_node_link> link = std::atomic_load(&node->link);
+			w->put<uint64_t>(node->nodeid);
+			w->put<uint64_t>(node->generation);
+			w->put<uint64_t>(node->nlookup.load());
+			w->put<uint32_t>(node->open_count.load());
+			w->put<uint8_t>(node->hidden.load());
+			w->put<uint64_t>(link ? link->parent->nodeid : 0);
+			w->put_str(link ? std::string(link->name.view()) : std::string());
+		}
+	}
+}
+
+int copper_fuse_node_table::restore(copper_fuse_snapshot_reader* r) {
+	struct parent_of {
+		std::shared_ptr<copper_fuse_node> node;
+		fuse_ino_t parent;
+		copper_fuse_atom_ref name;
+	};
+	std::vector<parent_of> parents;
+	uint64_t count = 0, value = 0;
+
+	disarm_all();
+	for (id_shard& s : ids)
+		s.nodes.clear();
+	for (name_shard& s : names)
+		s.nodes.clear();
+
+	r->get(&value);
+	ctr = value;
+	r->get(&value);
+	generation = value;
+	r->get(&count);
+	for (uint64_t i = 0; i < count && !r->failed; i++) {
+		std::shared_ptr<copper_fuse_node> node(new copper_fuse_node);
+		uint64_t nlookup = 0, parent = 0;
+		uint32_t open_count = 0;
+		uint8_t hidden = 0;
+		std::string name;
+
+		r->get(&node->nodeid);
+		r->get(&node->generation);
+		r->get(&nlookup);
+		r->get(&open_count);
+		r->get(&hidden);
+		r->get(&parent);
+		r->get_str(&name);
+		node->nlookup    = nlookup;
+		node->open_count = open_count;
+		node->children   = 0;
+		node->hidden     = hidden != 0;
+		node->timer.fire = [this, id = node->nodeid] { drop(get(id)); };
+		if (parent) {
+			copper_fuse_atom_ref atom = atoms->intern(name.data(), name.size());
+			if (!atom)
+				return -ENOMEM;
+			parents.push_back({ node, parent, std::move(atom) });
+		}
+		id_shard_of(node->nodeid).nodes[node->nodeid] = node;
+	}
+	if (r->failed || !get(FUSE_ROOT_ID))
+		return -EPROTO;
+
+	/* Parents may come after their children, link once all are known */
+	for (parent_of& p : parents) {
+		std::shared_ptr<copper_fuse_node_link> link(new copper_fuse_node_link);
+		link->parent = get(p.parent);
+		if (!link->parent)
+			return -EPROTO;
+		link->name = std::move(p.name);
+		link->parent->children++;
+		name_shard_of({ p.parent, link->name.get() }).nodes.emplace(
+			copper_fuse_name_key{ p.parent, link->name.get() }, p.node);
+		std::atomic_store(&p.node->link, std::shared_ptr<const copper_fuse_node_link>(std::move(link)));
+	}
+	/* Those the old process remembered are kept as long again */
+	if (remember > 0) {
+		std::vector<std::shared_ptr<copper_fuse_node>> forgotten_nodes;
+		for (id_shard& s : ids)
+			for (auto& it : s.nodes)
+				if (!it.second->nlookup && it.first != FUSE_ROOT_ID)
+					forgotten_nodes.push_back(it.second);
+		for (std::shared_ptr<copper_fuse_node>& node : forgotten_nodes)
+			arm(std::move(node));
+	}
+	return 0;
+}
@@ -10,14 +10,22 @@
 #include <string>
 #include <variant>
 
-#define PATH_MAX 64
-
 #define FUSE_HELPER_OPT(t, p)	\
 		{ t, offsetof(copper_fuse_cmdline_opts, p), 1 }
 
 static const struct copper_fuse_opt copper_fuse_helper_opts[] = {
 	FUSE_HELPER_OPT("-h", show_help),
 	FUSE_HELPER_OPT("--help", show_help),
+	FUSE_HELPER_OPT("-d", foreground),
+	FUSE_HELPER_OPT("debug", foreground),
+	COPPER_FUSE_OPT_KEY("-d", COPPER_FUSE_OPT::KEY_KEEP),
+	COPPER_FUSE_OPT_KEY("debug", COPPER_FUSE_OPT::KEY_KEEP),
+	FUSE_HELPER_OPT("-f", foreground),
+	FUSE_HELPER_OPT("-s", singlethread),
+	FUSE_HELPER_OPT("clone_fd", clone_fd),
+	FUSE_HELPER_OPT("max_idle_threads=%u", max_idle_threads),
+	FUSE_HELPER_OPT("max_threads=%u", max_threads),
+	COPPER_FUSE_OPT_END
 };
 
 /** ---------------------------------------------------
@@ -42,7 +50,7 @@ static int match_template(const char* t, const char* arg, unsigned* sepp) {
 	sep = sep ? sep : strchr(t, ' ');
 
 	/* Here is the type of the judgment form `--xxx=%s` */
-	if (sep && (!sep[1] || sep[2] == '%')) {
+	if (sep && (!sep[1] || sep[1] == '%')) {
 		int t_len = sep - t;
 		if (sep[0] == '=') t_len++;
 		if (arg_len >= t_len && strncmp(arg, t, t_len) == 0) {
@@ -96,12 +104,14 @@ static int copper_fuse_helper_opt_proc(void* data, const char* arg, int key, cop
 				return opts->add_opt(arg);
 			}
 
-			char mountpoint[PATH_MAX] = "";
-			if (realpath(arg, mountpoint) == nullptr) {
+			char* mountpoint = realpath(arg, nullptr);
+			if (mountpoint == nullptr) {
 				erron << "bad mount point `" << arg << "`: " << strerror(errno);
 				return -1;
 			}
-			return opts->add_opt(arg);
+			int res = opts->add_opt(mountpoint);
+			free(mountpoint);
+			return res;
 		} else {
 			erron << "invalid argument `" << arg << "`";
 			return -1;
@@ -0,0 +1,890 @@
+/*
+  CopperFuse: C++ version Filesystem in Userspace
+  Copyright (C) 2023 Chen Miao <chenmiao.ku@gmail.com>
+
+  This program can be distributed under the terms of the GNU LGPLv2.
+  See the file COPYING.LIB.
+*/
+
+#include "copper_fuse_passthrough.h"
+#include "copper_log.h"
+
+#include <atomic>
+#include <cerrno>
+#include <climits>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <unistd.h>
+#ifdef HAVE_SETXATTR
+#include <sys/xattr.h>
+#endif
+
+/* Flags that make two descriptors of one inode behave differently */
+#define PASSTHROUGH_FD_MODE_MASK \
+	(O_ACCMODE | O_APPEND | O_DIRECT | O_SYNC | O_DSYNC | O_NOATIME | O_NONBLOCK)
+
+static std::atomic<unsigned> passthrough_idle_fds { 0 };
+
+static struct timespec passthrough_now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts;
+}
+
+static double passthrough_age(const struct timespec& since) {
+	struct timespec now = passthrough_now();
+	return (now.tv_sec - since.tv_sec) + (now.tv_nsec - since.tv_nsec) / 1e9;
+}
+
+static copper_passthrough_handle* passthrough_handle(const struct fuse_file_info* fi) {
+	return reinterpret_cast<copper_passthrough_handle*>(fi->fh);
+}
+
+/** ---------------------------------------------------
+ * FOR COPPER PASSTHROUGH INODE
+ * ---------------------------------------------------*/
+
+copper_passthrough_inode::copper_passthrough_inode(int _fd, dev_t _dev, ino_t _ino)
+	: fd(_fd), dev(_dev), ino(_ino), nchildren(0) {}
+
+copper_passthrough_inode::~copper_passthrough_inode() {
+	for (const auto& sfd : fds) {
+		if (!sfd.users)
+			passthrough_idle_fds.fetch_sub(1, std::memory_order_relaxed);
+		close(sfd.fd);
+	}
+	close(fd);
+}
+
+/** ---------------------------------------------------
+ * FOR COPPER PASSTHROUGH DENTRY CACHE
+ * ---------------------------------------------------*/
+
+copper_passthrough_dentry::copper_passthrough_dentry(copper_passthrough* _fs,
+	const std::shared_ptr<copper_passthrough_inode>& dir, std::string _name,
+	std::shared_ptr<copper_passthrough_inode> _node)
+	: fs(_fs), name(std::move(_name)), node(std::move(_node)), validated(passthrough_now()) {
+	std::lock_guard<std::mutex> guard(fs->lru_lock);
+	lru = fs->lru.insert(fs->lru.begin(), { dir, this });
+}
+
+copper_passthrough_dentry::~copper_passthrough_dentry() {
+	std::lock_guard<std::mutex> guard(fs->lru_lock);
+	fs->lru.erase(lru);
+}
+
+copper_passthrough::copper_passthrough()
+	: dentry_timeout(1.0), max_dentries(COPPER_PASSTHROUGH_MAX_DENTRIES) {}
+
+copper_passthrough::~copper_passthrough() {
+	root.reset();
+}
+
+int copper_passthrough::init(const char* source, double timeout) {
+	struct stat st;
+	int fd = ::open(source, O_PATH | O_DIRECTORY | O_CLOEXEC);
+	if (fd == -1) {
+		erron << "cannot open source `" << source << "`: " << strerror(errno);
+		return -errno;
+	}
+	if (fstat(fd, &st) == -1) {
+		int err = errno;
+		close(fd);
+		return -err;
+	}
+
+	dentry_timeout = timeout;
+	root = std::make_shared<copper_passthrough_inode>(fd, st.st_dev, st.st_ino);
+	std::lock_guard<std::mutex> guard(inodes_lock);
+	inodes[{ st.st_dev, st.st_ino }] = root;
+	return 0;
+}
+
+int copper_passthrough::lookup(const std::shared_ptr<copper_passthrough_inode>& dir, std::string_view name,
+	std::shared_ptr<copper_passthrough_inode>* nodep) {
+	std::string cname(name);
+	struct stat st;
+	bool cached = false;
+
+	{
+		std::shared_lock<std::shared_mutex> guard(dir->lock);
+		auto it = dir->children.find(name);
+		if (it != dir->children.end()) {
+			if (passthrough_age(it->second->validated) < dentry_timeout) {
+				*nodep = it->second->node;
+				return 0;
+			}
+			cached = true;
+		}
+	}
+
+	if (cached) {
+		/* Old entry, check that the name still refers to the same inode */
+		if (fstatat(dir->fd, cname.c_str(), &st, AT_SYMLINK_NOFOLLOW) == -1) {
+			int err = errno;
+			forget(dir, name);
+			return -err;
+		}
+		std::unique_lock<std::shared_mutex> guard(dir->lock);
+		auto it = dir->children.find(name);
+		if (it != dir->children.end() &&
+			it->second->node->dev == st.st_dev && it->second->node->ino == st.st_ino) {
+			copper_passthrough_dentry* dentry = it->second.get();
+			dentry->validated = passthrough_now();
+			{
+				std::lock_guard<std::mutex> lru_guard(lru_lock);
+				lru.splice(lru.begin(), lru, dentry->lru);
+			}
+			*nodep = dentry->node;
+			return 0;
+		}
+	}
+
+	int fd = openat(dir->fd, cname.c_str(), O_PATH | O_NOFOLLOW | O_CLOEXEC);
+	if (fd == -1) {
+		int err = errno;
+		forget(dir, name);
+		return -err;
+	}
+	if (fstat(fd, &st) == -1) {
+		int err = errno;
+		close(fd);
+		return -err;
+	}
+
+	std::shared_ptr<copper_passthrough_inode> node;
+	{
+		std::lock_guard<std::mutex> guard(inodes_lock);
+		auto& slot = inodes[{ st.st_dev, st.st_ino }];
+		node = slot.lock();
+		if (!node) {
+			node = std::make_shared<copper_passthrough_inode>(fd, st.st_dev, st.st_ino);
+			slot = node;
+			fd = -1;
+		}
+	}
+	if (fd != -1)
+		close(fd);
+
+	std::unique_ptr<copper_passthrough_dentry> dentry, old;
+	{
+		std::unique_lock<std::shared_mutex> guard(dir->lock);
+		dentry.reset(new copper_passthrough_dentry(this, dir, std::move(cname), node));
+		auto it = dir->children.find(name);
+		if (it != dir->children.end()) {
+			old = std::move(it->second);
+			dir->children.erase(it);
+		}
+		std::string_view key = dentry->name;
+		dir->children.emplace(key, std::move(dentry));
+		dir->nchildren.store(dir->children.size(), std::memory_order_relaxed);
+	}
+	old.reset();
+
+	*nodep = std::move(node);
+	shrink();
+	return 0;
+}
+
+bool copper_passthrough::forget(const std::shared_ptr<copper_passthrough_inode>& dir, std::string_view name) {
+	std::unique_ptr<copper_passthrough_dentry> dentry;
+	{
+		std::unique_lock<std::shared_mutex> guard(dir->lock);
+		auto it = dir->children.find(name);
+		if (it == dir->children.end())
+			return false;
+		dentry = std::move(it->second);
+		dir->children.erase(it);
+		dir->nchildren.store(dir->children.size(), std::memory_order_relaxed);
+	}
+
+	/* The last reference may go away here, drop the table slot with it */
+	std::pair<dev_t, ino_t> key { dentry->node->dev, dentry->node->ino };
+	dentry.reset();
+	std::lock_guard<std::mutex> guard(inodes_lock);
+	auto it = inodes.find(key);
+	if (it != inodes.end() && it->second.expired())
+		inodes.erase(it);
+	return true;
+}
+
+void copper_passthrough::shrink() {
+	for (;;) {
+		std::shared_ptr<copper_passthrough_inode> dir;
+		std::string name;
+		{
+			std::lock_guard<std::mutex> guard(lru_lock);
+			if (lru.size() <= max_dentries)
+				return;
+			/*
+			 * A directory with dentries below it is in use as long as
+			 * they are, it waits at the front until they are gone
+			 */
+			size_t skipped = 0;
+			while (skipped < lru.size() &&
+				lru.back().dentry->node->nchildren.load(std::memory_order_relaxed)) {
+				lru.splice(lru.begin(), lru, std::prev(lru.end()));
+				skipped++;
+			}
+			dir = lru.back().dir.lock();
+			/* A directory going away takes its dentries along */
+			if (!dir)
+				return;
+			name = lru.back().dentry->name;
+		}
+		/* Dropped by someone else meanwhile, they made the room */
+		if (!forget(dir, name))
+			return;
+	}
+}
+
+int copper_passthrough::resolve(const char* path, std::shared_ptr<copper_passthrough_inode>* nodep) {
+	std::shared_ptr<copper_passthrough_inode> node = root;
+	std::string_view rest(path);
+
+	while (!rest.empty()) {
+		if (rest[0] == '/') {
+			rest.remove_prefix(1);
+			continue;
+		}
+		size_t end = rest.find('/');
+		std::string_view name = rest.substr(0, end);
+		rest.remove_prefix(end == std::string_view::npos ? rest.size() : end);
+
+		std::shared_ptr<copper_passthrough_inode> child;
+		int res = lookup(node, name, &child);
+		if (res != 0)
+			return res;
+		node = std::move(child);
+	}
+
+	*nodep = std::move(node);
+	return 0;
+}
+
+int copper_passthrough::resolve_parent(const char* path,
+	std::shared_ptr<copper_passthrough_inode>* parentp, const char** name) {
+	const char* slash = strrchr(path, '/');
+	if (!slash)
+		return -EINVAL;
+
+	if (!slash[1]) {
+		*parentp = root;
+		*name = ".";
+		return 0;
+	}
+	*name = slash + 1;
+	if (strlen(*name) > NAME_MAX)
+		return -ENAMETOOLONG;
+	return resolve(std::string(path, slash - path).c_str(), parentp);
+}
+
+/** ---------------------------------------------------
+ * FOR COPPER PASSTHROUGH DESCRIPTORS
+ * ---------------------------------------------------*/
+
+int copper_passthrough::open_fd(const std::shared_ptr<copper_passthrough_inode>& node, int flags, int fd,
+	struct fuse_file_info* fi) {
+	int mode = flags & PASSTHROUGH_FD_MODE_MASK;
+
+	{
+		std::lock_guard<std::mutex> guard(node->fds_lock);
+		if (fd == -1) {
+			for (auto& sfd : node->fds) {
+				if (sfd.mode != mode) continue;
+				if (!sfd.users++)
+					passthrough_idle_fds.fetch_sub(1, std::memory_order_relaxed);
+				fd = sfd.fd;
+				break;
+			}
+		} else {
+			node->fds.push_back({ fd, mode, 1 });
+		}
+	}
+
+	if (fd == -1) {
+		/* Reopen the inode itself, the name may have moved on since lookup */
+		char procname[64];
+		snprintf(procname, sizeof(procname), "/proc/self/fd/%d", node->fd);
+		fd = ::open(procname, (flags & ~(O_CREAT | O_EXCL | O_NOCTTY | O_TRUNC)) | O_CLOEXEC);
+		if (fd == -1)
+			return -errno;
+
+		std::lock_guard<std::mutex> guard(node->fds_lock);
+		node->fds.push_back({ fd, mode, 1 });
+	}
+
+	fi->fh = reinterpret_cast<uint64_t>(new copper_passthrough_handle { node, fd, mode, nullptr, nullptr, 0 });
+	if ((flags & O_TRUNC) && ftruncate(fd, 0) == -1) {
+		int err = errno;
+		release(nullptr, fi);
+		return -err;
+	}
+	return 0;
+}
+
+int copper_passthrough::path_fd(const char* path, struct fuse_file_info* fi, int flags, bool* temporary) {
+	*temporary = false;
+	if (fi && fi->fh)
+		return passthrough_handle(fi)->fd;
+	if (!path)
+		return -EBADF;
+
+	std::shared_ptr<copper_passthrough_inode> parent;
+	const char* name;
+	int res = resolve_parent(path, &parent, &name);
+	if (res != 0)
+		return res;
+
+	int fd = openat(parent->fd, name, flags | O_CLOEXEC);
+	if (fd == -1)
+		return -errno;
+	*temporary = true;
+	return fd;
+}
+
+/** ---------------------------------------------------
+ * FOR COPPER PASSTHROUGH OPERATIONS
+ * ---------------------------------------------------*/
+
+copper_fuse_operations copper_passthrough::operations() {
+#define PASSTHROUGH_OP(name) \
+	op.name = [this](auto... args) { return this->name(args...); }
+
+	copper_fuse_operations op;
+	PASSTHROUGH_OP(getattr);
+	PASSTHROUGH_OP(readlink);
+	PASSTHROUGH_OP(mknod);
+	PASSTHROUGH_OP(mkdir);
+	PASSTHROUGH_OP(unlink);
+	PASSTHROUGH_OP(rmdir);
+	PASSTHROUGH_OP(symlink);
+	PASSTHROUGH_OP(rename);
+	PASSTHROUGH_OP(link);
+	PASSTHROUGH_OP(chmod);
+	PASSTHROUGH_OP(chown);
+	PASSTHROUGH_OP(truncate);
+	PASSTHROUGH_OP(open);
+	PASSTHROUGH_OP(create);
+	PASSTHROUGH_OP(read);
+	PASSTHROUGH_OP(write);
+	PASSTHROUGH_OP(statfs);
+	PASSTHROUGH_OP(flush);
+	PASSTHROUGH_OP(release);
+	PASSTHROUGH_OP(fsync);
+#ifdef HAVE_SETXATTR
+	PASSTHROUGH_OP(setxattr);
+	PASSTHROUGH_OP(getxattr);
+	PASSTHROUGH_OP(listxattr);
+	PASSTHROUGH_OP(removexattr);
+#endif
+	PASSTHROUGH_OP(opendir);
+	PASSTHROUGH_OP(readdir);
+	PASSTHROUGH_OP(releasedir);
+	PASSTHROUGH_OP(access);
+	PASSTHROUGH_OP(utimens);
+	PASSTHROUGH_OP(fallocate);
+	PASSTHROUGH_OP(copy_file_range);
+	PASSTHROUGH_OP(lseek);
+	PASSTHROUGH_OP(backing_fd);
+	op.init = [this](copper_fuse_conn_info* conn, copper_fuse_config* cfg) -> void* {
+		static_cast<void>(conn);
+		cfg->use_ino = 1;
+		cfg->nullpath_ok = 1;
+		/* The source may change behind our back, don't trust cached data */
+		cfg->entry_timeout = 0;
+		cfg->attr_timeout = 0;
+		cfg->negative_timeout = 0;
+		return this;
+	};
+	return op;
+
+#undef PASSTHROUGH_OP
+}
+
+int copper_passthrough::getattr(const char* path, struct stat* stbuf, struct fuse_file_info* fi) {
+	if (fi && fi->fh)
+		return fstat(passthrough_handle(fi)->fd, stbuf) == -1 ? -errno : 0;
+
+	std::shared_ptr<copper_passthrough_inode> parent;
+	const char* name;
+	int res = resolve_parent(path, &parent, &name);
+	if (res != 0)
+		return res;
+	return fstatat(parent->fd, name, stbuf, AT_SYMLINK_NOFOLLOW) == -1 ? -errno : 0;
+}
+
+int copper_passthrough::readlink(const char* path, char* buf, size_t size) {
+	std::shared_ptr<copper_passthrough_inode> parent;
+	const char* name;
+	/* No room for the terminating NUL, as readlink(2) with a zero size */
+	if (size == 0)
+		return -EINVAL;
+	int res = resolve_parent(path, &parent, &name);
+	if (res != 0)
+		return res;
+
+	ssize_t n = readlinkat(parent->fd, name, buf, size - 1);
+	if (n == -1)
+		return -errno;
+	buf[n] = '\0';
+	return 0;
+}
+
+int copper_passthrough::mknod(const char* path, mode_t mode, dev_t rdev) {
+	std::shared_ptr<copper_passthrough_inode> parent;
+	const char* name;
+	int res = resolve_parent(path, &parent, &name);
+	if (res != 0)
+		return res;
+
+	if (S_ISFIFO(mode))
+		res = mkfifoat(parent->fd, name, mode);
+	else
+		res = mknodat(parent->fd, name, mode, rdev);
+	return res == -1 ? -errno : 0;
+}
+
+int copper_passthrough::mkdir(const char* path, mode_t mode) {
+	std::shared_ptr<copper_passthrough_inode> parent;
+	const char* name;
+	int res = resolve_parent(path, &parent, &name);
+	if (res != 0)
+		return res;
+	return mkdirat(parent->fd, name, mode) == -1 ? -errno : 0;
+}
+
+int copper_passthrough::unlink(const char* path) {
+	std::shared_ptr<copper_passthrough_inode> parent;
+	const char* name;
+	int res = resolve_parent(path, &parent, &name);
+	if (res != 0)
+		return res;
+
+	res = unlinkat(parent->fd, name, 0) == -1 ? -errno : 0;
+	forget(parent, name);
+	return res;
+}
+
+int copper_passthrough::rmdir(const char* path) {
+	std::shared_ptr<copper_passthrough_inode> parent;
+	const char* name;
+	int res = resolve_parent(path, &parent, &name);
+	if (res != 0)
+		return res;
+
+	res = unlinkat(parent->fd, name, AT_REMOVEDIR) == -1 ? -errno : 0;
+	forget(parent, name);
+	return res;
+}
+
+int copper_passthrough::symlink(const char* from, const char* to) {
+	std::shared_ptr<copper_passthrough_inode> parent;
+	const char* name;
+	int res = resolve_parent(to, &parent, &name);
+	if (res != 0)
+		return res;
+	return symlinkat(from, parent->fd, name) == -1 ? -errno : 0;
+}
+
+int copper_passthrough::rename(const char* from, const char* to, unsigned int flags) {
+	std::shared_ptr<copper_passthrough_inode> fparent, tparent;
+	const char *fname, *tname;
+	int res = resolve_parent(from, &fparent, &fname);
+	if (res != 0)
+		return res;
+	res = resolve_parent(to, &tparent, &tname);
+	if (res != 0)
+		return res;
+
+	if (flags)
+		res = renameat2(fparent->fd, fname, tparent->fd, tname, flags);
+	else
+		res = renameat(fparent->fd, fname, tparent->fd, tname);
+	res = res == -1 ? -errno : 0;
+
+	/* Children of a moved directory stay valid, they hang off its inode */
+	forget(fparent, fname);
+	forget(tparent, tname);
+	return res;
+}
+
+int copper_passthrough::link(const char* from, const char* to) {
+	std::shared_ptr<copper_passthrough_inode> fparent, tparent;
+	const char *fname, *tname;
+	int res = resolve_parent(from, &fparent, &fname);
+	if (res != 0)
+		return res;
+	res = resolve_parent(to, &tparent, &tname);
+	if (res != 0)
+		return res;
+	return linkat(fparent->fd, fname, tparent->fd, tname, 0) == -1 ? -errno : 0;
+}
+
+int copper_passthrough::chmod(const char* path, mode_t mode, struct fuse_file_info* fi) {
+	if (fi && fi->fh)
+		return fchmod(passthrough_handle(fi)->fd, mode) == -1 ? -errno : 0;
+
+	std::shared_ptr<copper_passthrough_inode> parent;
+	const char* name;
+	int res = resolve_parent(path, &parent, &name);
+	if (res != 0)
+		return res;
+	return fchmodat(parent->fd, name, mode, 0) == -1 ? -errno : 0;
+}
+
+int copper_passthrough::chown(const char* path, uid_t uid, gid_t gid, struct fuse_file_info* fi) {
+	if (fi && fi->fh)
+		return fchown(passthrough_handle(fi)->fd, uid, gid) == -1 ? -errno : 0;
+
+	std::shared_ptr<copper_passthrough_inode> parent;
+	const char* name;
+	int res = resolve_parent(path, &parent, &name);
+	if (res != 0)
+		return res;
+	return fchownat(parent->fd, name, uid, gid, AT_SYMLINK_NOFOLLOW) == -1 ? -errno : 0;
+}
+
+int copper_passthrough::truncate(const char* path, off_t size, struct fuse_file_info* fi) {
+	bool temporary;
+	int fd = path_fd(path, fi, O_WRONLY, &temporary);
+	if (fd < 0)
+		return fd;
+
+	int res = ftruncate(fd, size) == -1 ? -errno : 0;
+	if (temporary)
+		close(fd);
+	return res;
+}
+
+int copper_passthrough::open(const char* path, struct fuse_file_info* fi) {
+	std::shared_ptr<copper_passthrough_inode> node;
+	int res = resolve(path, &node);
+	if (res != 0)
+		return res;
+	return open_fd(node, fi->flags, -1, fi);
+}
+
+int copper_passthrough::create(const char* path, mode_t mode, struct fuse_file_info* fi) {
+	std::shared_ptr<copper_passthrough_inode> parent, node;
+	const char* name;
+	int res = resolve_parent(path, &parent, &name);
+	if (res != 0)
+		return res;
+
+	int fd = openat(parent->fd, name, (fi->flags | O_CREAT | O_CLOEXEC) & ~O_TRUNC, mode);
+	if (fd == -1)
+		return -errno;
+
+	res = lookup(parent, name, &node);
+	if (res != 0) {
+		close(fd);
+		return res;
+	}
+	return open_fd(node, fi->flags & ~(O_CREAT | O_EXCL), fd, fi);
+}
+
+int copper_passthrough::read(const char* path, char* buf, size_t size, off_t off, struct fuse_file_info* fi) {
+	bool temporary;
+	int fd = path_fd(path, fi, O_RDONLY, &temporary);
+	if (fd < 0)
+		return fd;
+
+	ssize_t res = pread(fd, buf, size, off);
+	if (res == -1)
+		res = -errno;
+	if (temporary)
+		close(fd);
+	return res;
+}
+
+int copper_passthrough::write(const char* path, const char* buf, size_t size, off_t off, struct fuse_file_info* fi) {
+	bool temporary;
+	int fd = path_fd(path, fi, O_WRONLY, &temporary);
+	if (fd < 0)
+		return fd;
+
+	ssize_t res = pwrite(fd, buf, size, off);
+	if (res == -1)
+		res = -errno;
+	if (temporary)
+		close(fd);
+	return res;
+}
+
+int copper_passthrough::statfs(const char* path, struct statvfs* stbuf) {
+	static_cast<void>(path);
+	return fstatvfs(root->fd, stbuf) == -1 ? -errno : 0;
+}
+
+int copper_passthrough::flush(const char* path, struct fuse_file_info* fi) {
+	static_cast<void>(path);
+
+	/* The descriptor may be shared, flush a duplicate instead */
+	int fd = dup(passthrough_handle(fi)->fd);
+	if (fd == -1)
+		return -errno;
+	return close(fd) == -1 ? -errno : 0;
+}
+
+int copper_passthrough::release(const char* path, struct fuse_file_info* fi) {
+	static_cast<void>(path);
+	copper_passthrough_handle* handle = passthrough_handle(fi);
+	copper_passthrough_inode* node = handle->node.get();
+
+	{
+		std::lock_guard<std::mutex> guard(node->fds_lock);
+		for (auto it = node->fds.begin(); it != node->fds.end(); ++it) {
+			if (it->fd != handle->fd || --it->users)
+				continue;
+			/* Keep the descriptor for the next open unless too many are idle */
+			if (passthrough_idle_fds.fetch_add(1, std::memory_order_relaxed) >=
+				COPPER_PASSTHROUGH_MAX_IDLE_FDS) {
+				passthrough_idle_fds.fetch_sub(1, std::memory_order_relaxed);
+				close(it->fd);
+				node->fds.erase(it);
+			}
+			break;
+		}
+	}
+	delete handle;
+	fi->fh = 0;
+	return 0;
+}
+
+int copper_passthrough::fsync(const char* path, int datasync, struct fuse_file_info* fi) {
+	bool temporary;
+	int fd = path_fd(path, fi, O_RDONLY, &temporary);
+	if (fd < 0)
+		return fd;
+
+	int res;
+#ifdef HAVE_FDATASYNC
+	if (datasync)
+		res = fdatasync(fd);
+	else
+#endif
+		res = ::fsync(fd);
+	res = res == -1 ? -errno : 0;
+	if (temporary)
+		close(fd);
+	return res;
+}
+
+#ifdef HAVE_SETXATTR
+/*
+ * There are no *at() variants of the xattr calls, go through the magic
+ * link of the parent's O_PATH descriptor instead of the full path.
+ */
+static std::string passthrough_proc_path(int dirfd, const char* name) {
+	char procname[64];
+	snprintf(procname, sizeof(procname), "/proc/self/fd/%d/", dirfd);
+	return std::string(procname) + name;
+}
+
+int copper_passthrough::setxattr(const char* path, const char* name, const char* value, size_t size, int flags) {
+	std::shared_ptr<copper_passthrough_inode> parent;
+	const char* base;
+	int res = resolve_parent(path, &parent, &base);
+	if (res != 0)
+		return res;
+	std::string proc = passthrough_proc_path(parent->fd, base);
+	return lsetxattr(proc.c_str(), name, value, size, flags) == -1 ? -errno : 0;
+}
+
+int copper_passthrough::getxattr(const char* path, const char* name, char* value, size_t size) {
+	std::shared_ptr<copper_passthrough_inode> parent;
+	const char* base;
+	int res = resolve_parent(path, &parent, &base);
+	if (res != 0)
+		return res;
+	std::string proc = passthrough_proc_path(parent->fd, base);
+	ssize_t n = lgetxattr(proc.c_str(), name, value, size);
+	return n == -1 ? -errno : n;
+}
+
+int copper_passthrough::listxattr(const char* path, char* list, size_t size) {
+	std::shared_ptr<copper_passthrough_inode> parent;
+	const char* base;
+	int res = resolve_parent(path, &parent, &base);
+	if (res != 0)
+		return res;
+	std::string proc = passthrough_proc_path(parent->fd, base);
+	ssize_t n = llistxattr(proc.c_str(), list, size);
+	return n == -1 ? -errno : n;
+}
+
+int copper_passthrough::removexattr(const char* path, const char* name) {
+	std::shared_ptr<copper_passthrough_inode> parent;
+	const char* base;
+	int res = resolve_parent(path, &parent, &base);
+	if (res != 0)
+		return res;
+	std::string proc = passthrough_proc_path(parent->fd, base);
+	return lremovexattr(proc.c_str(), name) == -1 ? -errno : 0;
+}
+#endif
+
+int copper_passthrough::opendir(const char* path, struct fuse_file_info* fi) {
+	std::shared_ptr<copper_passthrough_inode> node;
+	int res = resolve(path, &node);
+	if (res != 0)
+		return res;
+
+	int fd = openat(node->fd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd == -1)
+		return -errno;
+	DIR* dp = fdopendir(fd);
+	if (!dp) {
+		res = -errno;
+		close(fd);
+		return res;
+	}
+
+	fi->fh = reinterpret_cast<uint64_t>(new copper_passthrough_handle { node, fd, O_RDONLY, dp, nullptr, 0 });
+	return 0;
+}
+
+int copper_passthrough::readdir(const char* path, void* buf, fuse_fill_dir_t filler, off_t off,
+	struct fuse_file_info* fi, enum fuse_readdir_flags flags) {
+	static_cast<void>(path);
+	copper_passthrough_handle* d = passthrough_handle(fi);
+	bool plus = flags & FUSE_READDIR_PLUS;
+
+	if (off != d->offset) {
+		seekdir(d->dp, off);
+		d->entry = nullptr;
+		d->offset = off;
+	}
+
+	for (;;) {
+		if (!d->entry) {
+			errno = 0;
+			d->entry = ::readdir(d->dp);
+			if (!d->entry) {
+				if (errno)
+					return -errno;
+				break;
+			}
+		}
+
+		struct stat st;
+		enum fuse_fill_dir_flags fill_flags = (enum fuse_fill_dir_flags)0;
+		if (plus && fstatat(dirfd(d->dp), d->entry->d_name, &st, AT_SYMLINK_NOFOLLOW) != -1) {
+			fill_flags = FUSE_FILL_DIR_PLUS;
+		} else {
+			memset(&st, 0, sizeof(st));
+			st.st_ino  = d->entry->d_ino;
+			st.st_mode = d->entry->d_type << 12;
+		}
+
+		off_t nextoff = telldir(d->dp);
+		if (filler(buf, d->entry->d_name, &st, nextoff, fill_flags))
+			break;
+		d->entry = nullptr;
+		d->offset = nextoff;
+	}
+	return 0;
+}
+
+int copper_passthrough::releasedir(const char* path, struct fuse_file_info* fi) {
+	static_cast<void>(path);
+	copper_passthrough_handle* d = passthrough_handle(fi);
+	closedir(d->dp);
+	delete d;
+	fi->fh = 0;
+	return 0;
+}
+
+int copper_passthrough::access(const char* path, int mask) {
+	std::shared_ptr<copper_passthrough_inode> parent;
+	const char* name;
+	int res = resolve_parent(path, &parent, &name);
+	if (res != 0)
+		return res;
+	return faccessat(parent->fd, name, mask, 0) == -1 ? -errno : 0;
+}
+
+int copper_passthrough::utimens(const char* path, const struct timespec tv[2], struct fuse_file_info* fi) {
+	if (fi && fi->fh)
+		return futimens(passthrough_handle(fi)->fd, tv) == -1 ? -errno : 0;
+
+	std::shared_ptr<copper_passthrough_inode> parent;
+	const char* name;
+	int res = resolve_parent(path, &parent, &name);
+	if (res != 0)
+		return res;
+	return utimensat(parent->fd, name, tv, AT_SYMLINK_NOFOLLOW) == -1 ? -errno : 0;
+}
+
+int copper_passthrough::fallocate(const char* path, int mode, off_t off, off_t len, struct fuse_file_info* fi) {
+	bool temporary;
+	int fd = path_fd(path, fi, O_WRONLY, &temporary);
+	if (fd < 0)
+		return fd;
+
+	int res;
+#if defined(HAVE_FALLOCATE)
+	res = ::fallocate(fd, mode, off, len) == -1 ? -errno : 0;
+#elif defined(HAVE_POSIX_FALLOCATE)
+	res = mode ? -EOPNOTSUPP : -posix_fallocate(fd, off, len);
+#else
+	res = -EOPNOTSUPP;
+#endif
+	if (temporary)
+		close(fd);
+	return res;
+}
+
+ssize_t copper_passthrough::copy_file_range(const char* path_in, struct fuse_file_info* fi_in, off_t off_in,
+	const char* path_out, struct fuse_file_info* fi_out, off_t off_out, size_t len, int flags) {
+#ifdef HAVE_COPY_FILE_RANGE
+	bool tmp_in, tmp_out;
+	int fd_in = path_fd(path_in, fi_in, O_RDONLY, &tmp_in);
+	if (fd_in < 0)
+		return fd_in;
+	int fd_out = path_fd(path_out, fi_out, O_WRONLY, &tmp_out);
+	if (fd_out < 0) {
+		if (tmp_in)
+			close(fd_in);
+		return fd_out;
+	}
+
+	ssize_t res = ::copy_file_range(fd_in, &off_in, fd_out, &off_out, len, flags);
+	if (res == -1)
+		res = -errno;
+	if (tmp_in)
+		close(fd_in);
+	if (tmp_out)
+		close(fd_out);
+	return res;
+#else
+	return -EOPNOTSUPP;
+#endif
+}
+
+off_t copper_passthrough::lseek(const char* path, off_t off, int whence, struct fuse_file_info* fi) {
+	bool temporary;
+	int fd = path_fd(path, fi, O_RDONLY, &temporary);
+	if (fd < 0)
+		return fd;
+
+	/* Handles read with pread(), so moving a shared file position is harmless */
+	off_t res = ::lseek(fd, off, whence);
+	if (res == -1)
+		res = -errno;
+	if (temporary)
+		close(fd);
+	return res;
+}
+
+int copper_passthrough::backing_fd(const char* path, struct fuse_file_info* fi) {
+	static_cast<void>(path);
+	if (!fi || !fi->fh)
+		return -EBADF;
+
+	return passthrough_handle(fi)->fd;
+}
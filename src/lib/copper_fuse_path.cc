@@ -0,0 +1,566 @@
+/*
+  CopperFuse: C++ version Filesystem in Userspace
+  Copyright (C) 2023 Chen Miao <chenmiao.ku@gmail.com>
+
+  This program can be distributed under the terms of the GNU LGPLv2.
+  See the file COPYING.LIB.
+*/
+
+#include "copper_fuse_path.h"
+
+#include <algorithm>
+#include <array>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+/** ---------------------------------------------------
+ * FOR COPPER FUSE PATH KERNELS
+ * ---------------------------------------------------*/
+
+/* Reads the rest of the aligned block holding the end of the string */
+#define PATH_OVERREAD __attribute__((no_sanitize_address, no_sanitize_thread))
+
+typedef uint64_t __attribute__((may_alias)) path_word;
+
+static inline uint64_t load64(const char* p) {
+	uint64_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+/* A set high bit in each byte of `v` that is zero, and only in those */
+static inline uint64_t zero_bytes(uint64_t v) {
+	const uint64_t low7 = 0x7f7f7f7f7f7f7f7fULL;
+	return ~(((v & low7) + low7) | v | low7);
+}
+
+/* Index of the first byte in memory order with a bit set in `mask` */
+static inline unsigned first_byte(uint64_t mask) {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	return __builtin_ctzll(mask) / 8;
+#else
+	return __builtin_clzll(mask) / 8;
+#endif
+}
+
+/*
+ * Difference of the first unequal bytes in `n` < 16, 0 if there are none
+ *
+ * The two words of 8 or 4 bytes may overlap: if the first ones are
+ * equal, the first difference is in the rest, which the last ones cover.
+ */
+static inline int cmp_tail(const char* a, const char* b, size_t n) {
+	size_t i;
+
+	if (n >= 8) {
+		uint64_t x = load64(a) ^ load64(b);
+		i = 0;
+		if (!x) {
+			x = load64(a + n - 8) ^ load64(b + n - 8);
+			i = n - 8;
+		}
+		if (!x)
+			return 0;
+		i += first_byte(x);
+	} else if (n >= 4) {
+		uint32_t x, y, u, v;
+		memcpy(&x, a, 4);
+		memcpy(&y, b, 4);
+		memcpy(&u, a + n - 4, 4);
+		memcpy(&v, b + n - 4, 4);
+		if (x == y && u == v)
+			return 0;
+		for (i = x != y ? 0 : n - 4; a[i] == b[i]; i++)
+			;
+	} else {
+		for (i = 0; i < n && a[i] == b[i]; i++)
+			;
+		if (i == n)
+			return 0;
+	}
+	return (unsigned char)a[i] - (unsigned char)b[i];
+}
+
+/* Difference of the first unequal bytes in `n`, 0 if there are none */
+static inline int cmp_words(const char* a, const char* b, size_t n) {
+	size_t i = 0;
+
+	for (; i + 16 <= n; i += 8) {
+		uint64_t x = load64(a + i) ^ load64(b + i);
+		if (x) {
+			i += first_byte(x);
+			return (unsigned char)a[i] - (unsigned char)b[i];
+		}
+	}
+	return cmp_tail(a + i, b + i, n - i);
+}
+
+static inline int cmp_lengths(size_t alen, size_t blen) {
+	return alen < blen ? -1 : alen > blen;
+}
+
+/* Avalanche the crc and the length into 64 bits */
+static inline uint64_t hash_finish(uint32_t crc, size_t len) {
+	uint64_t h = ((uint64_t)len << 32) ^ crc;
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+	return h;
+}
+
+/* CRC-32C, the polynomial of the SSE4.2 crc32 instruction */
+static constexpr std::array<uint32_t, 256> crc32c_table = [] {
+	std::array<uint32_t, 256> t{};
+	for (uint32_t i = 0; i < 256; i++) {
+		uint32_t c = i;
+		for (int k = 0; k < 8; k++)
+			c = c & 1 ? (c >> 1) ^ 0x82f63b78 : c >> 1;
+		t[i] = c;
+	}
+	return t;
+}();
+
+PATH_OVERREAD
+static size_t len_scalar(const char* s) {
+	const char* p = s;
+
+	for (; (uintptr_t)p & 7; p++)
+		if (!*p)
+			return p - s;
+	for (;; p += 8) {
+		uint64_t mask = zero_bytes(*(const path_word*)p);
+		if (mask)
+			return p - s + first_byte(mask);
+	}
+}
+
+static uint64_t hash_scalar(const char* s, size_t len) {
+	uint32_t crc = ~0u;
+
+	for (size_t i = 0; i < len; i++)
+		crc = crc32c_table[(crc ^ (unsigned char)s[i]) & 0xff] ^ (crc >> 8);
+	return hash_finish(crc, len);
+}
+
+static const char* sep_scalar(const char* s, size_t len) {
+	const uint64_t slashes = 0x2f2f2f2f2f2f2f2fULL;
+	size_t i = 0;
+
+	for (; i + 8 <= len; i += 8) {
+		uint64_t mask = zero_bytes(load64(s + i) ^ slashes);
+		if (mask)
+			return s + i + first_byte(mask);
+	}
+	for (; i < len; i++)
+		if (s[i] == '/')
+			return s + i;
+	return nullptr;
+}
+
+static int cmp_scalar(const char* a, size_t alen, const char* b, size_t blen) {
+	int res = cmp_words(a, b, std::min(alen, blen));
+	return res ? res : cmp_lengths(alen, blen);
+}
+
+static const copper_fuse_path_kernels kernels_scalar = {
+	"scalar", len_scalar, hash_scalar, sep_scalar, cmp_scalar,
+};
+
+#if defined(__x86_64__)
+
+__attribute__((target("sse4.2")))
+static uint64_t hash_sse42(const char* s, size_t len) {
+	uint64_t crc = ~0u;
+	size_t i = 0;
+
+	for (; i + 8 <= len; i += 8)
+		crc = _mm_crc32_u64(crc, load64(s + i));
+	if (i + 4 <= len) {
+		uint32_t v;
+		memcpy(&v, s + i, 4);
+		crc = _mm_crc32_u32(crc, v);
+		i += 4;
+	}
+	if (i + 2 <= len) {
+		uint16_t v;
+		memcpy(&v, s + i, 2);
+		crc = _mm_crc32_u16(crc, v);
+		i += 2;
+	}
+	if (i < len)
+		crc = _mm_crc32_u8(crc, (unsigned char)s[i]);
+	return hash_finish(crc, len);
+}
+
+PATH_OVERREAD
+static size_t len_sse2(const char* s) {
+	const __m128i zero = _mm_setzero_si128();
+	uintptr_t mis = (uintptr_t)s & 15;
+	const char* p = s - mis;
+	unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_load_si128((const __m128i*)p), zero)) >> mis;
+
+	if (mask)
+		return __builtin_ctz(mask);
+	for (;;) {
+		p += 16;
+		mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_load_si128((const __m128i*)p), zero));
+		if (mask)
+			return p - s + __builtin_ctz(mask);
+	}
+}
+
+PATH_OVERREAD
+static const char* sep_sse2(const char* s, size_t len) {
+	const __m128i slash = _mm_set1_epi8('/');
+	const char* end = s + len;
+	uintptr_t mis = (uintptr_t)s & 15;
+	const char* p = s - mis;
+
+	if (!len)
+		return nullptr;
+	unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_load_si128((const __m128i*)p), slash)) &
+		(0xffffu << mis);
+	for (;;) {
+		if (mask) {
+			const char* res = p + __builtin_ctz(mask);
+			return res < end ? res : nullptr;
+		}
+		p += 16;
+		if (p >= end)
+			return nullptr;
+		mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_load_si128((const __m128i*)p), slash));
+	}
+}
+
+/* Whether `width` bytes at `p` stay within its page */
+static inline bool page_safe(const char* p, size_t width) {
+	return ((uintptr_t)p & 4095) <= 4096 - width;
+}
+
+/* Difference of the first unequal bytes of the blocks at `a` and `b`, 0 if none */
+PATH_OVERREAD
+static inline int cmp_block16(const char* a, const char* b, unsigned valid) {
+	__m128i x = _mm_loadu_si128((const __m128i*)a);
+	__m128i y = _mm_loadu_si128((const __m128i*)b);
+	unsigned diff = (_mm_movemask_epi8(_mm_cmpeq_epi8(x, y)) ^ 0xffff) & valid;
+
+	if (!diff)
+		return 0;
+	unsigned i = __builtin_ctz(diff);
+	return (unsigned char)a[i] - (unsigned char)b[i];
+}
+
+/*
+ * Below a block, one load masked to `n` bytes unless that crosses a
+ * page; above, blocks and a last one overlapping the one before
+ */
+PATH_OVERREAD
+static inline int cmp_prefix_sse2(const char* a, const char* b, size_t n) {
+	if (n < 16) {
+		if (page_safe(a, 16) && page_safe(b, 16))
+			return cmp_block16(a, b, (1u << n) - 1);
+		return cmp_tail(a, b, n);
+	}
+	for (size_t i = 0; i + 16 < n; i += 16) {
+		int res = cmp_block16(a + i, b + i, 0xffff);
+		if (res)
+			return res;
+	}
+	return cmp_block16(a + n - 16, b + n - 16, 0xffff);
+}
+
+static int cmp_sse2(const char* a, size_t alen, const char* b, size_t blen) {
+	int res = cmp_prefix_sse2(a, b, std::min(alen, blen));
+	return res ? res : cmp_lengths(alen, blen);
+}
+
+static const copper_fuse_path_kernels kernels_sse42 = {
+	"sse4.2", len_sse2, hash_sse42, sep_sse2, cmp_sse2,
+};
+
+__attribute__((target("avx2"))) PATH_OVERREAD
+static size_t len_avx2(const char* s) {
+	const __m256i zero = _mm256_setzero_si256();
+	uintptr_t mis = (uintptr_t)s & 31;
+	const char* p = s - mis;
+	unsigned mask = (unsigned)_mm256_movemask_epi8(
+		_mm256_cmpeq_epi8(_mm256_load_si256((const __m256i*)p), zero)) >> mis;
+
+	if (mask)
+		return __builtin_ctz(mask);
+	for (;;) {
+		p += 32;
+		mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_load_si256((const __m256i*)p), zero));
+		if (mask)
+			return p - s + __builtin_ctz(mask);
+	}
+}
+
+__attribute__((target("avx2"))) PATH_OVERREAD
+static const char* sep_avx2(const char* s, size_t len) {
+	const __m256i slash = _mm256_set1_epi8('/');
+	const char* end = s + len;
+	uintptr_t mis = (uintptr_t)s & 31;
+	const char* p = s - mis;
+
+	if (!len)
+		return nullptr;
+	unsigned mask = (unsigned)_mm256_movemask_epi8(
+		_mm256_cmpeq_epi8(_mm256_load_si256((const __m256i*)p), slash)) & (0xffffffffu << mis);
+	for (;;) {
+		if (mask) {
+			const char* res = p + __builtin_ctz(mask);
+			return res < end ? res : nullptr;
+		}
+		p += 32;
+		if (p >= end)
+			return nullptr;
+		mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_load_si256((const __m256i*)p), slash));
+	}
+}
+
+__attribute__((target("avx2")))
+static inline int cmp_block32(const char* a, const char* b) {
+	__m256i x = _mm256_loadu_si256((const __m256i*)a);
+	__m256i y = _mm256_loadu_si256((const __m256i*)b);
+	unsigned diff = ~(unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(x, y));
+
+	if (!diff)
+		return 0;
+	unsigned i = __builtin_ctz(diff);
+	return (unsigned char)a[i] - (unsigned char)b[i];
+}
+
+__attribute__((target("avx2")))
+static int cmp_avx2(const char* a, size_t alen, const char* b, size_t blen) {
+	size_t n = std::min(alen, blen);
+	int res;
+
+	/* Most names are shorter than a block, those are compared as by SSE2 */
+	if (n <= 32) {
+		res = n < 32 ? cmp_prefix_sse2(a, b, n) : cmp_block32(a, b);
+	} else {
+		res = 0;
+		for (size_t i = 0; !res && i + 32 < n; i += 32)
+			res = cmp_block32(a + i, b + i);
+		if (!res)
+			res = cmp_block32(a + n - 32, b + n - 32);
+	}
+	return res ? res : cmp_lengths(alen, blen);
+}
+
+static const copper_fuse_path_kernels kernels_avx2 = {
+	"avx2", len_avx2, hash_sse42, sep_avx2, cmp_avx2,
+};
+
+#endif
+
+static const copper_fuse_path_kernels* select_kernels() {
+#if defined(__x86_64__)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("sse4.2"))
+		return &kernels_avx2;
+	if (__builtin_cpu_supports("sse4.2"))
+		return &kernels_sse42;
+#endif
+	return &kernels_scalar;
+}
+
+static const copper_fuse_path_kernels* resolve() {
+	const copper_fuse_path_kernels* k = select_kernels();
+	copper_fuse_path_active.store(k, std::memory_order_relaxed);
+	return k;
+}
+
+static size_t len_resolve(const char* s) {
+	return resolve()->len(s);
+}
+
+static uint64_t hash_resolve(const char* s, size_t len) {
+	return resolve()->hash(s, len);
+}
+
+static const char* sep_resolve(const char* s, size_t len) {
+	return resolve()->sep(s, len);
+}
+
+static int cmp_resolve(const char* a, size_t alen, const char* b, size_t blen) {
+	return resolve()->cmp(a, alen, b, blen);
+}
+
+static const copper_fuse_path_kernels kernels_resolve = {
+	"unresolved", len_resolve, hash_resolve, sep_resolve, cmp_resolve,
+};
+
+/* Constant initialized, usable from other static constructors */
+std::atomic<const copper_fuse_path_kernels*> copper_fuse_path_active(&kernels_resolve);
+
+const copper_fuse_path_kernels* copper_fuse_path_ops(const char* isa) {
+	if (!strcmp(isa, "scalar"))
+		return &kernels_scalar;
+#if defined(__x86_64__)
+	__builtin_cpu_init();
+	if (!strcmp(isa, "sse4.2") && __builtin_cpu_supports("sse4.2"))
+		return &kernels_sse42;
+	if (!strcmp(isa, "avx2") && __builtin_cpu_supports("avx2") && __builtin_cpu_supports("sse4.2"))
+		return &kernels_avx2;
+#endif
+	return nullptr;
+}
+
+size_t copper_fuse_path_join(std::string* path, const char* name, size_t len) {
+	size_t off = path->size();
+
+	path->resize(off + 1 + len);
+	char* dst = &(*path)[off];
+	dst[0] = '/';
+	memcpy(dst + 1, name, len);
+	return off + 1 + len;
+}
+
+/** ---------------------------------------------------
+ * FOR COPPER FUSE ATOM TABLE
+ * ---------------------------------------------------*/
+
+copper_fuse_atom_ref::copper_fuse_atom_ref(const copper_fuse_atom_ref& other)
+	: table(other.table), atom(other.atom) {
+	if (atom)
+		copper_fuse_atom_table::get(atom);
+}
+
+copper_fuse_atom_ref::copper_fuse_atom_ref(copper_fuse_atom_ref&& other) noexcept
+	: table(other.table), atom(other.atom) {
+	other.table = nullptr;
+	other.atom  = nullptr;
+}
+
+copper_fuse_atom_ref::~copper_fuse_atom_ref() {
+	if (atom)
+		table->put(atom);
+}
+
+copper_fuse_atom_ref& copper_fuse_atom_ref::operator= (copper_fuse_atom_ref other) noexcept {
+	std::swap(table, other.table);
+	std::swap(atom, other.atom);
+	return *this;
+}
+
+copper_fuse_atom_table::~copper_fuse_atom_table() {
+	for (shard& s : shards) {
+		for (slot& sl : s.slots) {
+			if (!sl.atom)
+				continue;
+			sl.atom->~copper_fuse_atom();
+			free(sl.atom);
+		}
+	}
+}
+
+bool copper_fuse_atom_table::grow(shard& s) {
+	std::vector<slot> old;
+	size_t size = s.slots.empty() ? 16 : s.slots.size() * 2;
+
+	try {
+		old.assign(size, slot{ 0, nullptr });
+	} catch (const std::bad_alloc&) {
+		return false;
+	}
+	old.swap(s.slots);
+	for (const slot& sl : old) {
+		if (!sl.atom)
+			continue;
+		size_t i = sl.hash & (size - 1);
+		while (s.slots[i].atom)
+			i = (i + 1) & (size - 1);
+		s.slots[i] = sl;
+	}
+	return true;
+}
+
+copper_fuse_atom_ref copper_fuse_atom_table::intern(const char* name, size_t len) {
+	const copper_fuse_path_kernels* k = copper_fuse_path_ops();
+	uint64_t hash = k->hash(name, len);
+	shard& s = shard_of(hash);
+
+	std::lock_guard<std::mutex> guard(s.lock);
+	size_t mask = s.slots.size() - 1;
+	if (!s.slots.empty()) {
+		for (size_t i = hash & mask; s.slots[i].atom; i = (i + 1) & mask) {
+			copper_fuse_atom* atom = s.slots[i].atom;
+			if (s.slots[i].hash == hash && !k->cmp(atom->name, atom->len, name, len)) {
+				atom->refs.fetch_add(1, std::memory_order_relaxed);
+				return { this, atom };
+			}
+		}
+	}
+
+	/* Kept at most 3/4 full, probes stay short */
+	if ((s.used + 1) * 4 > s.slots.size() * 3) {
+		if (!grow(s))
+			return {};
+		mask = s.slots.size() - 1;
+	}
+	void* mem = malloc(sizeof(copper_fuse_atom) + len + 1);
+	if (!mem)
+		return {};
+	copper_fuse_atom* atom = new (mem) copper_fuse_atom;
+	atom->hash = hash;
+	atom->refs.store(1, std::memory_order_relaxed);
+	atom->len  = len;
+	memcpy(atom->name, name, len);
+	atom->name[len] = '\0';
+
+	size_t i = hash & mask;
+	while (s.slots[i].atom)
+		i = (i + 1) & mask;
+	s.slots[i] = { hash, atom };
+	s.used++;
+	count.fetch_add(1, std::memory_order_relaxed);
+	return { this, atom };
+}
+
+void copper_fuse_atom_table::get(copper_fuse_atom* atom) {
+	atom->refs.fetch_add(1, std::memory_order_relaxed);
+}
+
+void copper_fuse_atom_table::put(copper_fuse_atom* atom) {
+	unsigned refs = atom->refs.load(std::memory_order_relaxed);
+
+	/* Not the last reference, no need for the lock */
+	while (refs > 1)
+		if (atom->refs.compare_exchange_weak(refs, refs - 1, std::memory_order_release,
+				std::memory_order_relaxed))
+			return;
+
+	shard& s = shard_of(atom->hash);
+	{
+		std::lock_guard<std::mutex> guard(s.lock);
+		if (atom->refs.fetch_sub(1, std::memory_order_acq_rel) != 1)
+			return;
+
+		size_t mask = s.slots.size() - 1;
+		size_t i = atom->hash & mask;
+		while (s.slots[i].atom != atom)
+			i = (i + 1) & mask;
+		/* Move back the entries of the run whose home is not after the hole */
+		for (size_t j = (i + 1) & mask; s.slots[j].atom; j = (j + 1) & mask) {
+			size_t home = s.slots[j].hash & mask;
+			if (((j - home) & mask) >= ((j - i) & mask)) {
+				s.slots[i] = s.slots[j];
+				i = j;
+			}
+		}
+		s.slots[i] = { 0, nullptr };
+		s.used--;
+	}
+	count.fetch_sub(1, std::memory_order_relaxed);
+	atom->~copper_fuse_atom();
+	free(atom);
+}
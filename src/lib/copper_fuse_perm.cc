@@ -0,0 +1,206 @@
+/*
+  CopperFuse: C++ version Filesystem in Userspace
+  Copyright (C) 2023 Chen Miao <chenmiao.ku@gmail.com>
+
+  This program can be distributed under the terms of the GNU LGPLv2.
+  See the file COPYING.LIB.
+*/
+
+#include "copper_fuse_perm.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <endian.h>
+#include <unistd.h>
+
+/* Version of the ACL attribute format */
+#define ACL_XATTR_VERSION 0x0002
+
+static int64_t perm_now() {
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/** ---------------------------------------------------
+ * FOR COPPER FUSE ACL
+ * ---------------------------------------------------*/
+
+int copper_fuse_acl::parse(const void* value, size_t size) {
+	const unsigned char* p = (const unsigned char*)value;
+	uint32_t version;
+
+	if (size < sizeof(version) || (size - sizeof(version)) % 8)
+		return -EINVAL;
+	memcpy(&version, p, sizeof(version));
+	if (le32toh(version) != ACL_XATTR_VERSION)
+		return -EINVAL;
+
+	entries.clear();
+	entries.reserve((size - sizeof(version)) / 8);
+	for (size_t off = sizeof(version); off < size; off += 8) {
+		uint16_t tag, perm;
+		uint32_t id;
+		memcpy(&tag, p + off, sizeof(tag));
+		memcpy(&perm, p + off + 2, sizeof(perm));
+		memcpy(&id, p + off + 4, sizeof(id));
+		entries.push_back({ le16toh(tag), (uint16_t)(le16toh(perm) & 7), le32toh(id) });
+	}
+	return 0;
+}
+
+/** ---------------------------------------------------
+ * FOR COPPER FUSE PERMISSION CHECK
+ * ---------------------------------------------------*/
+
+bool copper_fuse_cred::in_group(gid_t group) {
+	if (group == gid)
+		return true;
+
+	if (ngroups < 0) {
+		int n = cache ? cache->get(pid, uid, gid, COPPER_FUSE_CRED_GROUPS, small) : -ENOSYS;
+		if (n > COPPER_FUSE_CRED_GROUPS) {
+			big.resize(n);
+			n = std::min(n, cache->get(pid, uid, gid, n, big.data()));
+		}
+		ngroups = std::max(n, 0);
+	}
+	const gid_t* groups = ngroups > COPPER_FUSE_CRED_GROUPS ? big.data() : small;
+	return std::find(groups, groups + ngroups, group) != groups + ngroups;
+}
+
+static bool perm_grants(unsigned perm, int mask) {
+	return (perm & mask) == (unsigned)mask;
+}
+
+int copper_fuse_perm_check(mode_t mode, uid_t owner, gid_t group, const copper_fuse_acl* acl,
+	copper_fuse_cred* cred, int mask) {
+	mask &= R_OK | W_OK | X_OK;
+
+	if (cred->uid == 0) {
+		if (!(mask & X_OK) || S_ISDIR(mode) || (mode & 0111))
+			return 0;
+		return -EACCES;
+	}
+
+	/* The minimal ACL the mode stands for, or the real one */
+	copper_fuse_acl_entry minimal = { COPPER_FUSE_ACL_GROUP_OBJ, (uint16_t)((mode >> 3) & 7), group };
+	const copper_fuse_acl_entry* begin = &minimal;
+	const copper_fuse_acl_entry* end = &minimal + 1;
+	unsigned user_obj = (mode >> 6) & 7;
+	unsigned other = mode & 7;
+	unsigned limit = 7;
+	if (acl && !acl->entries.empty()) {
+		begin = acl->entries.data();
+		end = begin + acl->entries.size();
+		for (const copper_fuse_acl_entry* e = begin; e != end; e++) {
+			if (e->tag == COPPER_FUSE_ACL_USER_OBJ)
+				user_obj = e->perm;
+			else if (e->tag == COPPER_FUSE_ACL_OTHER)
+				other = e->perm;
+			else if (e->tag == COPPER_FUSE_ACL_MASK)
+				limit = e->perm;
+		}
+	}
+
+	if (cred->uid == owner)
+		return perm_grants(user_obj, mask) ? 0 : -EACCES;
+	for (const copper_fuse_acl_entry* e = begin; e != end; e++)
+		if (e->tag == COPPER_FUSE_ACL_USER && e->id == cred->uid)
+			return perm_grants(e->perm & limit, mask) ? 0 : -EACCES;
+
+	/* Membership only matters when the group class and others disagree */
+	bool all = true, any = false;
+	for (const copper_fuse_acl_entry* e = begin; e != end; e++) {
+		if (e->tag != COPPER_FUSE_ACL_GROUP_OBJ && e->tag != COPPER_FUSE_ACL_GROUP)
+			continue;
+		if (perm_grants(e->perm & limit, mask))
+			any = true;
+		else
+			all = false;
+	}
+	bool other_ok = perm_grants(other, mask);
+	if (all && other_ok)
+		return 0;
+	if (!any && !other_ok)
+		return -EACCES;
+
+	/* Any matching group that grants will do, the primary one is free to test */
+	bool matched = false;
+	for (int pass = 0; pass < 2; pass++) {
+		for (const copper_fuse_acl_entry* e = begin; e != end; e++) {
+			if (e->tag != COPPER_FUSE_ACL_GROUP_OBJ && e->tag != COPPER_FUSE_ACL_GROUP)
+				continue;
+			gid_t id = e->tag == COPPER_FUSE_ACL_GROUP_OBJ ? group : e->id;
+			if (pass == 0 ? id != cred->gid : id == cred->gid || !cred->in_group(id))
+				continue;
+			matched = true;
+			if (perm_grants(e->perm & limit, mask))
+				return 0;
+		}
+	}
+	if (matched)
+		return -EACCES;
+	return other_ok ? 0 : -EACCES;
+}
+
+/** ---------------------------------------------------
+ * FOR COPPER FUSE PERMISSION CACHE
+ * ---------------------------------------------------*/
+
+copper_fuse_perm_cache::copper_fuse_perm_cache(double _timeout) : timeout(_timeout) {
+	for (shard& s : shards)
+		s.version = 0;
+}
+
+bool copper_fuse_perm_cache::lookup(fuse_ino_t ino, copper_fuse_perm_node* node,
+	uint64_t* version) {
+	shard& s = shard_of(ino);
+	std::lock_guard<std::mutex> guard(s.lock);
+
+	*version = s.version;
+	auto it = s.nodes.find(ino);
+	if (it == s.nodes.end() || it->second.expires <= perm_now())
+		return false;
+	*node = it->second;
+	return true;
+}
+
+void copper_fuse_perm_cache::update(fuse_ino_t ino, const struct stat* stbuf) {
+	shard& s = shard_of(ino);
+	int64_t expires = perm_now() + (int64_t)(timeout * 1e9);
+	std::lock_guard<std::mutex> guard(s.lock);
+
+	copper_fuse_perm_node& node = s.nodes[ino];
+	if (node.acl_known && (node.mode != stbuf->st_mode || node.uid != stbuf->st_uid ||
+	    node.gid != stbuf->st_gid)) {
+		node.acl_known = false;
+		node.acl.reset();
+		s.version++;
+	}
+	node.mode    = stbuf->st_mode;
+	node.uid     = stbuf->st_uid;
+	node.gid     = stbuf->st_gid;
+	node.expires = expires;
+}
+
+void copper_fuse_perm_cache::set_acl(fuse_ino_t ino, uint64_t version,
+	std::shared_ptr<const copper_fuse_acl> acl) {
+	shard& s = shard_of(ino);
+	std::lock_guard<std::mutex> guard(s.lock);
+
+	auto it = s.nodes.find(ino);
+	if (it == s.nodes.end() || s.version != version)
+		return;
+	it->second.acl_known = true;
+	it->second.acl = std::move(acl);
+}
+
+void copper_fuse_perm_cache::invalidate(fuse_ino_t ino) {
+	shard& s = shard_of(ino);
+	std::lock_guard<std::mutex> guard(s.lock);
+
+	s.nodes.erase(ino);
+	s.version++;
+}
@@ -0,0 +1,82 @@
+/*
+  CopperFuse: C++ version Filesystem in Userspace
+  Copyright (C) 2023 Chen Miao <chenmiao.ku@gmail.com>
+
+  This program can be distributed under the terms of the GNU LGPLv2.
+  See the file COPYING.LIB.
+*/
+
+#include "copper_fuse_poll.h"
+
+#include <algorithm>
+
+static unsigned poll_shard_index(uint64_t kh) {
+	return (kh * 0x9e3779b97f4a7c15ULL) >> 58;
+}
+
+copper_fuse_poll_registry::shard& copper_fuse_poll_registry::shard_of(uint64_t kh) {
+	return shards[poll_shard_index(kh)];
+}
+
+void copper_fuse_poll_registry::arm(uint64_t kh) {
+	shard& s = shard_of(kh);
+	std::lock_guard<std::mutex> guard(s.lock);
+
+	waiter& w = s.waiters[kh];
+	w.handles++;
+	w.armed = true;
+}
+
+void copper_fuse_poll_registry::release(uint64_t kh) {
+	shard& s = shard_of(kh);
+	std::lock_guard<std::mutex> guard(s.lock);
+
+	auto it = s.waiters.find(kh);
+	if (it != s.waiters.end() && --it->second.handles == 0)
+		s.waiters.erase(it);
+}
+
+bool copper_fuse_poll_registry::disarm(uint64_t kh) {
+	shard& s = shard_of(kh);
+	std::lock_guard<std::mutex> guard(s.lock);
+
+	auto it = s.waiters.find(kh);
+	if (it == s.waiters.end() || !it->second.armed)
+		return false;
+	it->second.armed = false;
+	return true;
+}
+
+size_t copper_fuse_poll_registry::disarm_batch(uint64_t* khs, size_t count) {
+	/* Group by shard, so every lock is taken once, and drop duplicates */
+	std::sort(khs, khs + count, [](uint64_t a, uint64_t b) {
+		unsigned sa = poll_shard_index(a), sb = poll_shard_index(b);
+		return sa != sb ? sa < sb : a < b;
+	});
+	count = std::unique(khs, khs + count) - khs;
+
+	size_t armed = 0;
+	for (size_t i = 0; i < count; ) {
+		unsigned index = poll_shard_index(khs[i]);
+		shard& s = shards[index];
+		std::lock_guard<std::mutex> guard(s.lock);
+
+		for (; i < count && poll_shard_index(khs[i]) == index; i++) {
+			auto it = s.waiters.find(khs[i]);
+			if (it == s.waiters.end() || !it->second.armed)
+				continue;
+			it->second.armed = false;
+			khs[armed++] = khs[i];
+		}
+	}
+	return armed;
+}
+
+size_t copper_fuse_poll_registry::size() {
+	size_t n = 0;
+	for (auto& s : shards) {
+		std::lock_guard<std::mutex> guard(s.lock);
+		n += s.waiters.size();
+	}
+	return n;
+}
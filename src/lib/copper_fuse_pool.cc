@@ -0,0 +1,49 @@
+/*
+  CopperFuse: C++ version Filesystem in Userspace
+  Copyright (C) 2023 Chen Miao <chenmiao.ku@gmail.com>
+
+  This program can be distributed under the terms of the GNU LGPLv2.
+  See the file COPYING.LIB.
+*/
+
+#include "copper_fuse_pool.h"
+
+copper_fuse_pool::copper_fuse_pool(size_t _max_threads)
+	: max_threads(_max_threads ? _max_threads : 1), idle(0), stopping(false) {}
+
+copper_fuse_pool::~copper_fuse_pool() {
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		stopping = true;
+	}
+	cond.notify_all();
+	for (auto& thread : threads)
+		thread.join();
+}
+
+void copper_fuse_pool::submit(std::function<void()> work) {
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		queue.push_back(std::move(work));
+		if (queue.size() > idle && threads.size() < max_threads)
+			threads.emplace_back(&copper_fuse_pool::worker, this);
+	}
+	cond.notify_one();
+}
+
+void copper_fuse_pool::worker() {
+	std::unique_lock<std::mutex> guard(lock);
+	for (;;) {
+		idle++;
+		cond.wait(guard, [this] { return stopping || !queue.empty(); });
+		idle--;
+		if (queue.empty())
+			return;
+
+		std::function<void()> work = std::move(queue.front());
+		queue.pop_front();
+		guard.unlock();
+		work();
+		guard.lock();
+	}
+}
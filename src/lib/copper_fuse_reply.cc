@@ -0,0 +1,113 @@
+/*
+  CopperFuse: C++ version Filesystem in Userspace
+  Copyright (C) 2023 Chen Miao <chenmiao.ku@gmail.com>
+
+  This program can be distributed under the terms of the GNU LGPLv2.
+  See the file COPYING.LIB.
+*/
+
+#include "copper_fuse_reply.h"
+
+#include <algorithm>
+#include <cstring>
+
+copper_fuse_reply_builder::copper_fuse_reply_builder()
+	: iov(local), capacity(COPPER_FUSE_REPLY_IOVS) {
+	clear();
+}
+
+void copper_fuse_reply_builder::reserve(int pieces) {
+	if (count + pieces <= capacity)
+		return;
+
+	capacity = std::max(count + pieces, capacity * 2);
+	if (iov == local)
+		spill.assign(local, local + count);
+	spill.resize(capacity);
+	iov = spill.data();
+}
+
+void copper_fuse_reply_builder::add(const void* data, size_t size) {
+	if (!size)
+		return;
+	len += size;
+
+	if (size <= COPPER_FUSE_REPLY_COALESCE && staged + size <= sizeof(stage)) {
+		char* dst = stage + staged;
+		struct iovec* last = &iov[count - 1];
+
+		memcpy(dst, data, size);
+		staged += size;
+		/* Right behind the last segment: it grows, starting with the header */
+		if ((char*)last->iov_base + last->iov_len == dst) {
+			last->iov_len += size;
+			return;
+		}
+		reserve(1);
+		iov[count].iov_base = dst;
+		iov[count].iov_len  = size;
+		count++;
+		return;
+	}
+
+	reserve(1);
+	iov[count].iov_base = (void*)data;
+	iov[count].iov_len  = size;
+	count++;
+}
+
+void copper_fuse_reply_builder::add_iov(const struct iovec* segs, int n) {
+	int large = 0;
+
+	/* Only pieces too large to copy are sure to need a segment */
+	for (int i = 0; i < n; i++)
+		large += segs[i].iov_len > COPPER_FUSE_REPLY_COALESCE;
+	reserve(large);
+	for (int i = 0; i < n; i++)
+		add(segs[i].iov_base, segs[i].iov_len);
+}
+
+size_t copper_fuse_reply_builder::size() const {
+	return len;
+}
+
+struct iovec* copper_fuse_reply_builder::finish(uint64_t unique, int32_t error, int* n) {
+	struct fuse_out_header* out = (struct fuse_out_header*)stage;
+
+	out->unique = unique;
+	out->error  = error;
+	out->len    = sizeof(*out) + len;
+	*n = count;
+	return iov;
+}
+
+void copper_fuse_reply_builder::clear() {
+	staged = sizeof(struct fuse_out_header);
+	len = 0;
+	count = 1;
+	iov[0].iov_base = stage;
+	iov[0].iov_len  = sizeof(struct fuse_out_header);
+}
+
+void copper_fuse_notify_batch::add(int code, const void* arg, size_t size) {
+	struct fuse_out_header out;
+	size_t off = buf.size();
+
+	out.unique = 0;
+	out.error  = code;
+	out.len    = sizeof(out) + size;
+	buf.resize(off + out.len);
+	memcpy(&buf[off], &out, sizeof(out));
+	if (size)
+		memcpy(&buf[off + sizeof(out)], arg, size);
+	ends.push_back(buf.size());
+}
+
+size_t copper_fuse_notify_batch::size() const {
+	return ends.size();
+}
+
+void copper_fuse_notify_batch::clear() {
+	buf.clear();
+	ends.clear();
+}
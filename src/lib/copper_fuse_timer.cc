@@ -0,0 +1,293 @@
+/*
+  CopperFuse: C++ version Filesystem in Userspace
+  Copyright (C) 2023 Chen Miao <chenmiao.ku@gmail.com>
+
+  This program can be distributed under the terms of the GNU LGPLv2.
+  See the file COPYING.LIB.
+*/
+
+#include "copper_fuse_timer.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <cmath>
+#include <system_error>
+
+#define TIMER_BITS	8
+#define TIMER_MASK	(COPPER_FUSE_TIMER_SLOTS - 1)
+#define TIMER_WORDS	(COPPER_FUSE_TIMER_SLOTS / 64)
+/* The list of timers due, after every level's slots */
+#define TIMER_DUE	(COPPER_FUSE_TIMER_LEVELS * COPPER_FUSE_TIMER_SLOTS)
+/* The longest delay the wheel holds, longer ones are cut to it */
+#define TIMER_MAX	(((int64_t)1 << (TIMER_BITS * COPPER_FUSE_TIMER_LEVELS)) - 1)
+
+/* The first slot set at or after `from`, up to the end of the level, -1 if none */
+static int timer_next_slot(const uint64_t* bits, unsigned from) {
+	for (unsigned w = from / 64; w < TIMER_WORDS; w++) {
+		uint64_t word = bits[w];
+		if (w == from / 64)
+			word &= ~0ULL << (from % 64);
+		if (word)
+			return w * 64 + __builtin_ctzll(word);
+	}
+	return -1;
+}
+
+/* The first slot set at or after `from`, going round to `from` - 1, -1 if none */
+static int timer_next_slot_wrap(const uint64_t* bits, unsigned from) {
+	int slot = timer_next_slot(bits, from);
+	if (slot < 0 && from)
+		slot = timer_next_slot(bits, 0);
+	return slot;
+}
+
+/** ---------------------------------------------------
+ * FOR COPPER FUSE TIMER
+ * ---------------------------------------------------*/
+
+copper_fuse_timer::copper_fuse_timer()
+	: prev(nullptr), next(nullptr), expires(0), slot(-1) {}
+
+copper_fuse_timer::copper_fuse_timer(std::function<void()> _fire)
+	: fire(std::move(_fire)), prev(nullptr), next(nullptr), expires(0), slot(-1) {}
+
+/** ---------------------------------------------------
+ * FOR COPPER FUSE TIMER WHEEL
+ * ---------------------------------------------------*/
+
+copper_fuse_timer_wheel::copper_fuse_timer_wheel()
+	: stopping(false), base(std::chrono::steady_clock::now()), cur(1), wake(LLONG_MAX),
+	  armed(0), running(nullptr) {
+	for (copper_fuse_timer*& slot : slots)
+		slot = nullptr;
+	for (auto& level : occupied)
+		for (uint64_t& word : level)
+			word = 0;
+}
+
+copper_fuse_timer_wheel::~copper_fuse_timer_wheel() {
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		stopping = true;
+	}
+	cond.notify_all();
+	if (thread.joinable())
+		thread.join();
+}
+
+copper_fuse_timer_wheel& copper_fuse_timer_wheel::shared() {
+	static copper_fuse_timer_wheel wheel;
+	return wheel;
+}
+
+/* Tick 1 starts at `base`, so that `cur` - 1 is never negative */
+int64_t copper_fuse_timer_wheel::now_tick() {
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::steady_clock::now() - base).count() / COPPER_FUSE_TIMER_TICK_NS + 1;
+}
+
+void copper_fuse_timer_wheel::link(copper_fuse_timer* timer, int slot) {
+	copper_fuse_timer*& head = slots[slot];
+
+	timer->slot = slot;
+	timer->prev = nullptr;
+	timer->next = head;
+	if (head)
+		head->prev = timer;
+	head = timer;
+	if (slot != TIMER_DUE) {
+		unsigned idx = slot % COPPER_FUSE_TIMER_SLOTS;
+		occupied[slot / COPPER_FUSE_TIMER_SLOTS][idx / 64] |= 1ULL << (idx % 64);
+	}
+}
+
+void copper_fuse_timer_wheel::unlink(copper_fuse_timer* timer) {
+	int slot = timer->slot;
+
+	if (timer->prev)
+		timer->prev->next = timer->next;
+	else
+		slots[slot] = timer->next;
+	if (timer->next)
+		timer->next->prev = timer->prev;
+	if (!slots[slot] && slot != TIMER_DUE) {
+		unsigned idx = slot % COPPER_FUSE_TIMER_SLOTS;
+		occupied[slot / COPPER_FUSE_TIMER_SLOTS][idx / 64] &= ~(1ULL << (idx % 64));
+	}
+	timer->prev = timer->next = nullptr;
+	timer->slot = -1;
+}
+
+void copper_fuse_timer_wheel::place(copper_fuse_timer* timer) {
+	timer->expires = std::min(std::max(timer->expires, cur), cur + TIMER_MAX);
+
+	int64_t delta = timer->expires - cur;
+	unsigned level = 0;
+	while (level + 1 < COPPER_FUSE_TIMER_LEVELS && delta >> (TIMER_BITS * (level + 1)))
+		level++;
+	link(timer, level * COPPER_FUSE_TIMER_SLOTS +
+		((timer->expires >> (TIMER_BITS * level)) & TIMER_MASK));
+}
+
+void copper_fuse_timer_wheel::cascade(unsigned level) {
+	unsigned idx = (cur >> (TIMER_BITS * level)) & TIMER_MASK;
+	copper_fuse_timer* timer = slots[level * COPPER_FUSE_TIMER_SLOTS + idx];
+
+	slots[level * COPPER_FUSE_TIMER_SLOTS + idx] = nullptr;
+	occupied[level][idx / 64] &= ~(1ULL << (idx % 64));
+	while (timer) {
+		copper_fuse_timer* next = timer->next;
+		place(timer);
+		timer = next;
+	}
+}
+
+void copper_fuse_timer_wheel::advance(int64_t to) {
+	while (cur <= to) {
+		unsigned idx = cur & TIMER_MASK;
+
+		/* A turn of the first level is over, bring the next turn down */
+		if (!idx) {
+			for (unsigned level = 1; level < COPPER_FUSE_TIMER_LEVELS; level++) {
+				cascade(level);
+				if ((cur >> (TIMER_BITS * level)) & TIMER_MASK)
+					break;
+			}
+		}
+
+		int next = timer_next_slot(occupied[0], idx);
+		if (next < 0) {
+			/* Nothing left in this turn */
+			cur = std::min((cur | TIMER_MASK) + 1, to + 1);
+			continue;
+		}
+		int64_t tick = (cur & ~(int64_t)TIMER_MASK) + next;
+		if (tick > to) {
+			cur = to + 1;
+			break;
+		}
+
+		cur = tick;
+		copper_fuse_timer* timer = slots[next];
+		slots[next] = nullptr;
+		occupied[0][next / 64] &= ~(1ULL << (next % 64));
+		while (timer) {
+			copper_fuse_timer* later = timer->next;
+			link(timer, TIMER_DUE);
+			timer = later;
+		}
+		cur++;
+	}
+}
+
+int64_t copper_fuse_timer_wheel::next_tick() {
+	int64_t best = LLONG_MAX;
+
+	for (unsigned level = 0; level < COPPER_FUSE_TIMER_LEVELS; level++) {
+		/* The slot the last tick expired or cascaded, anything on it is a turn away */
+		int64_t last = (cur - 1) >> (TIMER_BITS * level);
+		unsigned idx = last & TIMER_MASK;
+		int next = timer_next_slot_wrap(occupied[level], (idx + 1) & TIMER_MASK);
+		if (next < 0)
+			continue;
+
+		unsigned dist = (next - idx) & TIMER_MASK;
+		best = std::min(best, (last + (dist ? dist : COPPER_FUSE_TIMER_SLOTS)) <<
+			(TIMER_BITS * level));
+	}
+	return best;
+}
+
+int copper_fuse_timer_wheel::arm(copper_fuse_timer* timer, double seconds) {
+	std::lock_guard<std::mutex> guard(lock);
+
+	if (!thread.joinable()) {
+		try {
+			thread = std::thread(&copper_fuse_timer_wheel::run, this);
+		} catch (const std::system_error&) {
+			return -ENOMEM;
+		}
+	}
+
+	if (timer->slot >= 0)
+		unlink(timer);
+	else
+		armed++;
+	/* A tick expires as it starts, the one after this one's end is the first late enough */
+	double ticks = std::ceil(seconds * 1e9 / COPPER_FUSE_TIMER_TICK_NS);
+	timer->expires = now_tick() + 1 + (ticks < 0 ? 0 : ticks > TIMER_MAX ? TIMER_MAX : (int64_t)ticks);
+	place(timer);
+
+	if (timer->expires < wake) {
+		wake = timer->expires;
+		cond.notify_one();
+	}
+	return 0;
+}
+
+bool copper_fuse_timer_wheel::cancel(copper_fuse_timer* timer) {
+	std::lock_guard<std::mutex> guard(lock);
+
+	if (timer->slot < 0)
+		return false;
+	unlink(timer);
+	armed--;
+	return true;
+}
+
+bool copper_fuse_timer_wheel::cancel_sync(copper_fuse_timer* timer) {
+	std::unique_lock<std::mutex> guard(lock);
+	bool was_armed = timer->slot >= 0;
+
+	if (was_armed) {
+		unlink(timer);
+		armed--;
+	}
+	if (std::this_thread::get_id() != thread.get_id())
+		done.wait(guard, [this, timer] { return running != timer; });
+	return was_armed;
+}
+
+bool copper_fuse_timer_wheel::pending(copper_fuse_timer* timer) {
+	std::lock_guard<std::mutex> guard(lock);
+	return timer->slot >= 0;
+}
+
+size_t copper_fuse_timer_wheel::size() {
+	std::lock_guard<std::mutex> guard(lock);
+	return armed;
+}
+
+void copper_fuse_timer_wheel::run() {
+	std::unique_lock<std::mutex> guard(lock);
+
+	while (!stopping) {
+		advance(now_tick());
+
+		while (copper_fuse_timer* timer = slots[TIMER_DUE]) {
+			unlink(timer);
+			armed--;
+			/* The callback may free its timer */
+			std::function<void()> fire = timer->fire;
+			running = timer;
+			guard.unlock();
+
+			fire();
+			fire = nullptr;
+
+			guard.lock();
+			running = nullptr;
+			done.notify_all();
+			if (stopping)
+				return;
+		}
+
+		wake = armed ? next_tick() : LLONG_MAX;
+		if (wake == LLONG_MAX)
+			cond.wait(guard);
+		else
+			cond.wait_until(guard, base + std::chrono::nanoseconds((wake - 1) *
+				COPPER_FUSE_TIMER_TICK_NS));
+	}
+}
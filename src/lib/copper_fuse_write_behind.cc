@@ -0,0 +1,228 @@
+/*
+  CopperFuse: C++ version Filesystem in Userspace
+  Copyright (C) 2023 Chen Miao <chenmiao.ku@gmail.com>
+
+  This program can be distributed under the terms of the GNU LGPLv2.
+  See the file COPYING.LIB.
+*/
+
+#include "copper_fuse_write_behind.h"
+
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <fcntl.h>
+#include <new>
+#include <vector>
+
+static int64_t wb_now() {
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/* Hand `size` bytes to ->write(), which may take them in pieces */
+static int wb_write_all(const copper_fuse_write_behind::write_fn& write_out, fuse_ino_t ino,
+	const char* buf, size_t size, off_t off, struct fuse_file_info* fi) {
+	size_t done = 0;
+
+	while (done < size) {
+		int res = write_out(ino, buf + done, size - done, off + done, fi);
+		if (res < 0)
+			return res;
+		if (res == 0)
+			return -EIO;
+		done += res;
+	}
+	return 0;
+}
+
+/** ---------------------------------------------------
+ * FOR COPPER FUSE WRITE BEHIND
+ * ---------------------------------------------------*/
+
+copper_fuse_write_behind::copper_fuse_write_behind(write_fn _write_out, size_t _max_bytes,
+	double _max_age)
+	: write_out(std::move(_write_out)), max_bytes(_max_bytes),
+	  max_age_ns((int64_t)(_max_age * 1e9)), timers(&copper_fuse_timer_wheel::shared()),
+	  pool(COPPER_FUSE_WRITE_BEHIND_THREADS) {}
+
+copper_fuse_write_behind::~copper_fuse_write_behind() {
+	std::vector<std::shared_ptr<handle>> found;
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		for (auto& it : handles)
+			found.push_back(it.second);
+	}
+	/* Without a lock held, a firing timer takes them */
+	for (auto& h : found)
+		timers->cancel_sync(&h->timer);
+}
+
+std::shared_ptr<copper_fuse_write_behind::handle> copper_fuse_write_behind::find(fuse_ino_t ino,
+	uint64_t fh) {
+	std::lock_guard<std::mutex> guard(lock);
+
+	auto it = handles.find({ ino, fh });
+	return it == handles.end() ? nullptr : it->second;
+}
+
+int copper_fuse_write_behind::write_extent(fuse_ino_t ino, handle* h) {
+	int err = wb_write_all(write_out, ino, h->data.data(), h->data.size(), h->off, &h->fi);
+	/* Failed or not, the data is gone, as a page after a writeback error */
+	h->data.clear();
+	h->since = 0;
+	/* Its callback may be waiting for `h->lock`, it finds nothing to write */
+	timers->cancel(&h->timer);
+	return err;
+}
+
+int copper_fuse_write_behind::write(fuse_ino_t ino, struct fuse_file_info* fi, const char* buf,
+	size_t size, off_t off) {
+	std::shared_ptr<handle> h;
+	int err;
+
+	if (fi->flags & (O_SYNC | O_DSYNC)) {
+		err = flush(ino, fi);
+		if (!err)
+			err = wb_write_all(write_out, ino, buf, size, off, fi);
+		return err ? err : (int)size;
+	}
+
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		std::shared_ptr<handle>& slot = handles[{ ino, fi->fh }];
+		if (!slot) {
+			slot = std::make_shared<handle>();
+			slot->fi    = *fi;
+			slot->off   = 0;
+			slot->since = 0;
+			slot->error = 0;
+			slot->timer.fire = [this, ino, fh = fi->fh] {
+				pool.submit([this, ino, fh] { expire(ino, fh); });
+			};
+		}
+		h = slot;
+	}
+
+	std::lock_guard<std::mutex> guard(h->lock);
+	if (h->error) {
+		err = h->error;
+		h->error = 0;
+		return err;
+	}
+	/* Not part of the extent, which goes first */
+	if (!h->data.empty() && (off < h->off || off > h->off + (off_t)h->data.size())) {
+		err = write_extent(ino, h.get());
+		if (err)
+			return err;
+	}
+	if (h->data.empty()) {
+		/* Nothing to gain from holding a write this large */
+		if (size >= max_bytes) {
+			err = wb_write_all(write_out, ino, buf, size, off, fi);
+			return err ? err : (int)size;
+		}
+		h->off = off;
+		h->since = wb_now();
+		/* Without a timer thread it goes at the next flush or when full */
+		if (max_age_ns > 0)
+			timers->arm(&h->timer, max_age_ns / 1e9);
+	}
+
+	size_t pos = off - h->off;
+	try {
+		if (h->data.capacity() < max_bytes)
+			h->data.reserve(max_bytes);
+		if (pos + size > h->data.size())
+			h->data.resize(pos + size);
+	} catch (const std::bad_alloc&) {
+		err = write_extent(ino, h.get());
+		if (!err)
+			err = wb_write_all(write_out, ino, buf, size, off, fi);
+		return err ? err : (int)size;
+	}
+	memcpy(&h->data[pos], buf, size);
+
+	if (h->data.size() >= max_bytes) {
+		err = write_extent(ino, h.get());
+		if (err)
+			return err;
+	}
+	return size;
+}
+
+int copper_fuse_write_behind::flush(fuse_ino_t ino, const struct fuse_file_info* fi) {
+	std::shared_ptr<handle> h = find(ino, fi->fh);
+	if (!h)
+		return 0;
+
+	std::lock_guard<std::mutex> guard(h->lock);
+	int err = h->data.empty() ? 0 : write_extent(ino, h.get());
+	if (!err)
+		err = h->error;
+	h->error = 0;
+	return err;
+}
+
+void copper_fuse_write_behind::flush_ino(fuse_ino_t ino) {
+	std::vector<std::shared_ptr<handle>> found;
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		for (auto it = handles.lower_bound({ ino, 0 }); it != handles.end() && it->first.first == ino; ++it)
+			found.push_back(it->second);
+	}
+
+	for (auto& h : found) {
+		std::lock_guard<std::mutex> guard(h->lock);
+		if (!h->data.empty()) {
+			int err = write_extent(ino, h.get());
+			if (err)
+				h->error = err;
+		}
+	}
+}
+
+int copper_fuse_write_behind::release(fuse_ino_t ino, const struct fuse_file_info* fi) {
+	int err = flush(ino, fi);
+
+	std::lock_guard<std::mutex> guard(lock);
+	auto it = handles.find({ ino, fi->fh });
+	if (it != handles.end()) {
+		/* A firing timer finds the handle gone, or holds it */
+		timers->cancel(&it->second->timer);
+		handles.erase(it);
+	}
+	return err;
+}
+
+void copper_fuse_write_behind::flush_all() {
+	std::vector<std::pair<fuse_ino_t, std::shared_ptr<handle>>> found;
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		for (auto& it : handles)
+			found.push_back({ it.first.first, it.second });
+	}
+
+	for (auto& it : found) {
+		std::lock_guard<std::mutex> guard(it.second->lock);
+		if (!it.second->data.empty()) {
+			int err = write_extent(it.first, it.second.get());
+			if (err)
+				it.second->error = err;
+		}
+	}
+}
+
+void copper_fuse_write_behind::expire(fuse_ino_t ino, uint64_t fh) {
+	std::shared_ptr<handle> h = find(ino, fh);
+	if (!h)
+		return;
+
+	std::lock_guard<std::mutex> guard(h->lock);
+	/* Written out and started over since it was armed */
+	if (h->data.empty() || wb_now() - h->since < max_age_ns)
+		return;
+	int err = write_extent(ino, h.get());
+	if (err)
+		h->error = err;
+}
@@ -0,0 +1,138 @@
+/*
+  CopperFuse: C++ version Filesystem in Userspace
+  Copyright (C) 2023 Chen Miao <chenmiao.ku@gmail.com>
+
+  This program can be distributed under the terms of the GNU LGPLv2.
+  See the file COPYING.LIB.
+*/
+
+#include "copper_fuse_xattr_cache.h"
+
+#include <cerrno>
+
+/* Bookkeeping charged per cached entry on top of name and value */
+#define XATTR_ENTRY_OVERHEAD 64
+
+static struct timespec xattr_now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts;
+}
+
+static double xattr_age(const struct timespec& since) {
+	struct timespec now = xattr_now();
+	return (now.tv_sec - since.tv_sec) + (now.tv_nsec - since.tv_nsec) / 1e9;
+}
+
+static size_t xattr_charge(const std::string& name, const copper_fuse_xattr_entry& entry) {
+	return name.size() + entry.value.size() + XATTR_ENTRY_OVERHEAD;
+}
+
+copper_fuse_xattr_cache::copper_fuse_xattr_cache(double _timeout, size_t _max_bytes)
+	: timeout(_timeout), max_bytes(_max_bytes) {
+	for (auto& s : shards) {
+		s.bytes = 0;
+		s.version = 0;
+	}
+}
+
+copper_fuse_xattr_cache::shard& copper_fuse_xattr_cache::shard_of(fuse_ino_t ino) {
+	return shards[(ino * 0x9e3779b97f4a7c15ULL) >> 58];
+}
+
+bool copper_fuse_xattr_cache::lookup(fuse_ino_t ino, const char* name, int* err,
+	std::string* value, uint64_t* version) {
+	shard& s = shard_of(ino);
+	std::lock_guard<std::mutex> guard(s.lock);
+
+	*version = s.version;
+	auto it = s.nodes.find(ino);
+	if (it == s.nodes.end())
+		return false;
+
+	const copper_fuse_xattr_entry* entry = nullptr;
+	if (!name) {
+		if (it->second.has_list)
+			entry = &it->second.list;
+	} else {
+		auto e = it->second.names.find(name);
+		if (e != it->second.names.end())
+			entry = &e->second;
+	}
+	if (!entry || xattr_age(entry->stamp) >= timeout)
+		return false;
+
+	*err = entry->err;
+	*value = entry->value;
+	return true;
+}
+
+void copper_fuse_xattr_cache::store(fuse_ino_t ino, const char* name, uint64_t version,
+	int err, const std::string& value) {
+	/* Only hits and misses are stable answers, anything else is retried */
+	if (timeout <= 0 || (err && err != ENODATA))
+		return;
+
+	shard& s = shard_of(ino);
+	std::lock_guard<std::mutex> guard(s.lock);
+	if (s.version != version)
+		return;
+
+	/* Over budget: start this shard over rather than track recency */
+	if (s.bytes > max_bytes / COPPER_FUSE_XATTR_SHARDS) {
+		s.nodes.clear();
+		s.bytes = 0;
+	}
+
+	copper_fuse_xattr_node& node = s.nodes[ino];
+	copper_fuse_xattr_entry fresh = { err, value, xattr_now() };
+	if (!name) {
+		if (node.has_list)
+			s.bytes -= xattr_charge(std::string(), node.list);
+		node.has_list = true;
+		node.list = std::move(fresh);
+		s.bytes += xattr_charge(std::string(), node.list);
+	} else {
+		auto res = node.names.emplace(name, copper_fuse_xattr_entry());
+		if (!res.second)
+			s.bytes -= xattr_charge(res.first->first, res.first->second);
+		res.first->second = std::move(fresh);
+		s.bytes += xattr_charge(res.first->first, res.first->second);
+	}
+}
+
+void copper_fuse_xattr_cache::invalidate(fuse_ino_t ino, const char* name) {
+	shard& s = shard_of(ino);
+	std::lock_guard<std::mutex> guard(s.lock);
+
+	s.version++;
+	auto it = s.nodes.find(ino);
+	if (it == s.nodes.end())
+		return;
+
+	copper_fuse_xattr_node& node = it->second;
+	if (name) {
+		auto e = node.names.find(name);
+		if (e != node.names.end()) {
+			s.bytes -= xattr_charge(e->first, e->second);
+			node.names.erase(e);
+		}
+		if (node.has_list) {
+			s.bytes -= xattr_charge(std::string(), node.list);
+			node.has_list = false;
+			node.list.value.clear();
+		}
+		if (!node.names.empty())
+			return;
+	}
+
+	for (const auto& e : node.names)
+		s.bytes -= xattr_charge(e.first, e.second);
+	if (node.has_list)
+		s.bytes -= xattr_charge(std::string(), node.list);
+	s.nodes.erase(it);
+}
+
+void copper_fuse_xattr_cache::forget(fuse_ino_t ino) {
+	invalidate(ino, nullptr);
+}
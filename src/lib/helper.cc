@@ -1,23 +1,82 @@
 #include "copper_fuse.h"
 #include "copper_fuse_opt.h"
 #include "copper_fuse_common.h"
+#include "copper_fuse_i.h"
 #include "copper_fuse_lowlevel.h"
+#include "copper_fuse_mount.h"
+#include "copper_log.h"
 
 #include <cstddef>
+#include <cstdio>
+#include <cstdlib>
 #include <cstring>
 #include <limits>
 #include <thread>
 
-int copper_fuse_main_real(int argc, char* argv[], 
+static void copper_fuse_cmdline_help() {
+	printf("    -h   --help            print help\n"
+	       "    -d   -o debug          enable debug output (implies -f)\n"
+	       "    -f                     foreground operation\n"
+	       "    -s                     disable multi-threaded operation\n"
+	       "    -o clone_fd            use separate fuse device fd for each thread\n"
+	       "                           (may improve performance)\n"
+	       "    -o max_idle_threads    the maximum number of idle worker threads\n"
+	       "                           allowed (default: unlimited)\n"
+	       "    -o max_threads         the maximum number of worker threads\n"
+	       "                           (default: number of cpus)\n"
+	       "    -o xattr_timeout=T     cache extended attributes for T seconds\n"
+	       "                           (default: 1.0)\n"
+	       "    -o copy_chunk_size=N   piece size of library performed\n"
+	       "                           copy_file_range (default: 1 MiB)\n"
+	       "    -o copy_threads=N      threads per library performed\n"
+	       "                           copy_file_range (default: 4)\n"
+	       "    -o allow_other         allow access by all users\n"
+	       "    -o fsname=NAME         set filesystem name\n"
+	       "    -o subtype=NAME        set filesystem type\n"
+	       "    -o mount_helper=PATH   mount through the helper listening on\n"
+	       "                           PATH (default: $" COPPER_FUSE_MOUNT_HELPER_ENV ")\n");
+}
+
+int copper_fuse_main_real(int argc, char* argv[],
 	const struct copper_fuse_operations* op, size_t op_size, void* user_data) {
 	copper_fuse_args args(argc, argv);
-	copper_fuse* fuse;
 	copper_fuse_cmdline_opts opts;
-	copper_fuse_loop_config* loop_config = nullptr;
+	copper_fuse_loop_config loop_config;
+	static_cast<void>(op_size);
 
 	int ret = 0;
-	if (args.parse_cmdline(&opts) != 0) {
-		// TODO
+	if (args.parse_cmdline(&opts) != 0)
+		return 1;
+
+	if (opts.show_help) {
+		if (args.argv[0][0] != '\0')
+			printf("usage: %s [options] <mountpoint>\n\n", args.argv[0]);
+		printf("FUSE options:\n");
+		copper_fuse_cmdline_help();
+		free(opts.mountpoint);
+		return 0;
+	}
+
+	if (!opts.mountpoint) {
+		erron << "no mountpoint specified";
+		return 2;
 	}
-	return {};
-}
\ No newline at end of file
+
+	copper_fuse fuse(op, user_data);
+	if (fuse.init(&args) == -1) {
+		ret = 3;
+	} else if (fuse.mount(opts.mountpoint) != 0) {
+		ret = 4;
+	} else if (opts.singlethread) {
+		ret = fuse.loop() ? 7 : 0;
+	} else {
+		loop_config.clone_fd = opts.clone_fd;
+		loop_config.max_idle_threads = opts.max_idle_threads;
+		loop_config.max_threads = opts.max_threads;
+		ret = fuse.loop_mt(&loop_config) ? 7 : 0;
+	}
+	fuse.unmount();
+
+	free(opts.mountpoint);
+	return ret;
+}